@@ -0,0 +1,233 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "blockmap.hh"
+#include "buffer.hh"
+
+namespace WADmake {
+
+// Vanilla node builders leave a little room around the edges of the map.
+static const int32_t blockMargin = 8;
+
+// Block lists end with this, so it can't be used as a linedef number.
+static const uint16_t listEnd = 0xFFFF;
+
+// Find every block a line touches, one column of blocks at a time.  The
+// coordinates are relative to the origin of the blocks, and must not be
+// negative.
+void WalkBlocks(double x1, double y1, double x2, double y2, int32_t columns,
+                std::vector<uint32_t>& blocks) {
+	if (x1 > x2) {
+		std::swap(x1, x2);
+		std::swap(y1, y2);
+	}
+
+	int32_t column1 = static_cast<int32_t>(x1) / blockSize;
+	int32_t column2 = static_cast<int32_t>(x2) / blockSize;
+	for (int32_t column = column1;column <= column2;column++) {
+		// Clip the line to the column to find the rows it crosses.
+		double ya = y1, yb = y2;
+		if (x1 != x2) {
+			double left = std::max<double>(x1, column * blockSize);
+			double right = std::min<double>(x2, (column + 1) * blockSize);
+			double slope = (y2 - y1) / (x2 - x1);
+			ya = y1 + slope * (left - x1);
+			yb = y1 + slope * (right - x1);
+		}
+
+		int32_t row1 = static_cast<int32_t>(std::min(ya, yb)) / blockSize;
+		int32_t row2 = static_cast<int32_t>(std::max(ya, yb)) / blockSize;
+		for (int32_t row = row1;row <= row2;row++) {
+			blocks.push_back(row * columns + column);
+		}
+	}
+}
+
+// Build a BLOCKMAP lump covering the given bounds.  eachline is called
+// with a visitor that takes the number and endpoints of a linedef, and
+// must visit the linedefs in order.
+template <class F>
+static std::string BuildLump(int32_t minx, int32_t miny, int32_t maxx, int32_t maxy,
+                             F eachline, bool compress) {
+	int32_t originx = minx - blockMargin;
+	int32_t originy = miny - blockMargin;
+	int32_t columns = (maxx - originx) / blockSize + 1;
+	int32_t rows = (maxy - originy) / blockSize + 1;
+	size_t numblocks = static_cast<size_t>(columns) * rows;
+
+	// Walk every linedef, noting which blocks it lands in.
+	std::vector<uint32_t> blocks;
+	std::vector<uint16_t> lines;
+	eachline([&](uint16_t line, int32_t x1, int32_t y1, int32_t x2, int32_t y2) {
+		WalkBlocks(x1 - originx, y1 - originy, x2 - originx, y2 - originy, columns, blocks);
+		lines.resize(blocks.size(), line);
+	});
+
+	// Counting sort the linedefs into per-block lists.  Linedefs were
+	// walked in order, so each list stays in order too.
+	std::vector<size_t> starts(numblocks + 1, 0);
+	for (uint32_t block : blocks) {
+		starts[block + 1] += 1;
+	}
+	for (size_t i = 0;i < numblocks;i++) {
+		starts[i + 1] += starts[i];
+	}
+	std::vector<uint16_t> sorted(blocks.size());
+	std::vector<size_t> next(starts.begin(), starts.end() - 1);
+	for (size_t i = 0;i < blocks.size();i++) {
+		sorted[next[blocks[i]]++] = lines[i];
+	}
+
+	BinaryWriter writer;
+	writer.write<int16_t>(originx);
+	writer.write<int16_t>(originy);
+	writer.write<int16_t>(columns);
+	writer.write<int16_t>(rows);
+	size_t offsets = writer.size();
+	writer.record(numblocks * 2);
+
+	// Each list starts with a 0 and ends with listEnd.  Identical lists are
+	// only written once when compressing.
+	std::unordered_map<std::string, uint16_t> written;
+	for (size_t block = 0;block < numblocks;block++) {
+		BinaryWriter list;
+		list.write<uint16_t>(0);
+		for (size_t i = starts[block];i < starts[block + 1];i++) {
+			list.write<uint16_t>(sorted[i]);
+		}
+		list.write<uint16_t>(listEnd);
+		std::string key = list.release();
+
+		if (compress) {
+			auto it = written.find(key);
+			if (it != written.end()) {
+				writer.writeAt<uint16_t>(offsets + block * 2, it->second);
+				continue;
+			}
+		}
+
+		size_t offset = writer.size() / 2;
+		if (offset > UINT16_MAX) {
+			throw std::runtime_error("Blockmap is too large");
+		}
+		writer.writeAt<uint16_t>(offsets + block * 2, offset);
+		writer.writeString(key);
+		if (compress) {
+			written.insert(std::make_pair(std::move(key), static_cast<uint16_t>(offset)));
+		}
+	}
+
+	return writer.release();
+}
+
+BlockmapBuilder::BlockmapBuilder() : compress(true) { }
+
+// Replace the map's BLOCKMAP.  The map is compacted first, so linedef IDs
+// match the linedefs that will be written.
+void BlockmapBuilder::build(DoomMap& map) {
+	map.compact();
+
+	if (map.getLinedefs().size() >= listEnd) {
+		throw std::runtime_error("Too many linedefs for a blockmap");
+	}
+
+	// The blockmap covers every vertex in the map.
+	bool first = true;
+	int32_t minx = 0, miny = 0, maxx = 0, maxy = 0;
+	map.getVertexes().each([&](Vertex& vertex) {
+		if (first) {
+			minx = maxx = vertex.x;
+			miny = maxy = vertex.y;
+			first = false;
+		}
+		minx = std::min<int32_t>(minx, vertex.x);
+		miny = std::min<int32_t>(miny, vertex.y);
+		maxx = std::max<int32_t>(maxx, vertex.x);
+		maxy = std::max<int32_t>(maxy, vertex.y);
+	});
+
+	map.setBlockmap(BuildLump(minx, miny, maxx, maxy, [&](std::function<void(uint16_t, int32_t, int32_t, int32_t, int32_t)> visit) {
+		map.getLinedefs().each([&](DoomLinedef& linedef) {
+			auto startvertex = linedef.startvertex.lock();
+			auto endvertex = linedef.endvertex.lock();
+			if (!startvertex || !endvertex) {
+				throw std::runtime_error("Linedef is missing a vertex");
+			}
+			visit(static_cast<uint16_t>(linedef.id), startvertex->x, startvertex->y, endvertex->x, endvertex->y);
+		});
+	}, this->compress));
+}
+
+// Build a BLOCKMAP lump for a DenseMap.  Linedefs are numbered the way
+// DenseMap::writeLinedefs will write them, skipping tombstones.
+std::string BlockmapBuilder::build(const DenseMap& map) const {
+	const DenseVertexes& vertexes = map.vertexes;
+	const DenseLinedefs& linedefs = map.linedefs;
+	if (linedefs.size() >= listEnd) {
+		throw std::runtime_error("Too many linedefs for a blockmap");
+	}
+
+	// The blockmap covers every vertex in the map.
+	bool first = true;
+	int32_t minx = 0, miny = 0, maxx = 0, maxy = 0;
+	for (DenseIndex i = 0;i < vertexes.slots();i++) {
+		if (!vertexes.contains(i)) {
+			continue;
+		}
+		if (first) {
+			minx = maxx = vertexes.x[i];
+			miny = maxy = vertexes.y[i];
+			first = false;
+		}
+		minx = std::min<int32_t>(minx, vertexes.x[i]);
+		miny = std::min<int32_t>(miny, vertexes.y[i]);
+		maxx = std::max<int32_t>(maxx, vertexes.x[i]);
+		maxy = std::max<int32_t>(maxy, vertexes.y[i]);
+	}
+
+	return BuildLump(minx, miny, maxx, maxy, [&](std::function<void(uint16_t, int32_t, int32_t, int32_t, int32_t)> visit) {
+		uint16_t line = 0;
+		for (DenseIndex i = 0;i < linedefs.slots();i++) {
+			if (!linedefs.contains(i)) {
+				continue;
+			}
+			DenseIndex start = linedefs.startvertex[i];
+			DenseIndex end = linedefs.endvertex[i];
+			if (!vertexes.contains(start) || !vertexes.contains(end)) {
+				throw std::runtime_error("Linedef is missing a vertex");
+			}
+			visit(line++, vertexes.x[start], vertexes.y[start], vertexes.x[end], vertexes.y[end]);
+		}
+	}, this->compress);
+}
+
+// Set whether blocks with identical lists share one copy of the list.
+void BlockmapBuilder::setCompress(bool compress) {
+	this->compress = compress;
+}
+
+}
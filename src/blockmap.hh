@@ -0,0 +1,54 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BLOCKMAP_HH
+#define BLOCKMAP_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "densemap.hh"
+#include "map.hh"
+
+namespace WADmake {
+
+const int32_t blockSize = 128;
+
+void WalkBlocks(double x1, double y1, double x2, double y2, int32_t columns,
+                std::vector<uint32_t>& blocks);
+
+// Builds a vanilla BLOCKMAP lump for a DoomMap or a DenseMap.
+//
+// Every linedef is walked across the 128x128 blocks it touches, and the
+// block lists are then gathered with a counting sort, so the whole build
+// is linear in the number of linedefs and blocks.  Blocks with identical
+// lists can share a single copy of the list, which keeps large maps
+// under the 64K word limit of the format.
+class BlockmapBuilder {
+	bool compress;
+public:
+	BlockmapBuilder();
+	void build(DoomMap& map);
+	std::string build(const DenseMap& map) const;
+	void setCompress(bool compress);
+};
+
+}
+
+#endif
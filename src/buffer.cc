@@ -16,27 +16,165 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <vector>
 
+#include "buffer.hh"
+
 namespace WADmake {
 
+MemoryBuffer::MemoryBuffer(const char* data, size_t len) {
+	char* begin = const_cast<char*>(data);
+	this->setg(begin, begin, begin + len);
+}
+
+MemoryBuffer::pos_type MemoryBuffer::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+	if (!(which & std::ios_base::in)) {
+		return pos_type(off_type(-1));
+	}
+
+	off_type base;
+	if (dir == std::ios_base::beg) {
+		base = 0;
+	} else if (dir == std::ios_base::cur) {
+		base = this->gptr() - this->eback();
+	} else {
+		base = this->egptr() - this->eback();
+	}
+
+	off_type pos = base + off;
+	if (pos < 0 || pos > this->egptr() - this->eback()) {
+		return pos_type(off_type(-1));
+	}
+	this->setg(this->eback(), this->eback() + pos, this->egptr());
+	return pos_type(pos);
+}
+
+MemoryBuffer::pos_type MemoryBuffer::seekpos(pos_type pos, std::ios_base::openmode which) {
+	return this->seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+MemoryStream::MemoryStream(const char* data, size_t len) : std::istream(nullptr), buf(data, len) {
+	this->rdbuf(&this->buf);
+}
+
+// Get a string out of a fixed-width buffer, which ends at the first NULL
+// byte if there is one.
+std::string LoadCString(const char* data, size_t len) {
+	return std::string(data, std::find(data, data + len, '\0'));
+}
+
+// Put a string into a fixed-width buffer.  Like WriteCString, there is
+// no NULL byte if the string fills the buffer, and anything longer is cut
+// off.
+void StoreCString(char* data, const std::string& str, size_t len) {
+	size_t reallen = std::min(str.size(), len);
+	std::memcpy(data, str.data(), reallen);
+	std::memset(data + reallen, 0, len - reallen);
+}
+
+BinaryReader::BinaryReader(const char* data, size_t len) : data(data), len(len), pos(0) { }
+
+bool BinaryReader::eof() const {
+	return this->pos >= this->len;
+}
+
+size_t BinaryReader::remaining() const {
+	return this->len - this->pos;
+}
+
+size_t BinaryReader::size() const {
+	return this->len;
+}
+
+size_t BinaryReader::tell() const {
+	return this->pos;
+}
+
+void BinaryReader::seek(size_t pos) {
+	if (pos > this->len) {
+		throw std::out_of_range("Seek is outside of buffer");
+	}
+	this->pos = pos;
+}
+
+// Check that the next len bytes are there, and move past them.
+const char* BinaryReader::record(size_t len) {
+	if (len > this->len - this->pos) {
+		std::stringstream err;
+		err << "Couldn't read " << len << " bytes from buffer";
+		throw std::runtime_error(err.str());
+	}
+	const char* result = this->data + this->pos;
+	this->pos += len;
+	return result;
+}
+
+std::string BinaryReader::readString(size_t len) {
+	const char* data = this->record(len);
+	return std::string(data, len);
+}
+
+std::string BinaryReader::readCString(size_t len) {
+	return LoadCString(this->record(len), len);
+}
+
+const char* BinaryWriter::data() const {
+	return this->buffer.data();
+}
+
+size_t BinaryWriter::size() const {
+	return this->buffer.size();
+}
+
+void BinaryWriter::reserve(size_t len) {
+	this->buffer.reserve(len);
+}
+
+// Hand over everything written so far, leaving the writer empty.
+std::string BinaryWriter::release() {
+	std::string result;
+	result.swap(this->buffer);
+	return result;
+}
+
+// Add len bytes to the end of the buffer and return a pointer to them.
+char* BinaryWriter::record(size_t len) {
+	size_t pos = this->buffer.size();
+	this->buffer.resize(pos + len);
+	return &this->buffer[0] + pos;
+}
+
+void BinaryWriter::writeData(const char* data, size_t len) {
+	this->buffer.append(data, len);
+}
+
+void BinaryWriter::writeString(const std::string& str) {
+	this->buffer.append(str);
+}
+
+void BinaryWriter::writeCString(const std::string& str, size_t len) {
+	StoreCString(this->record(len), str, len);
+}
+
 std::string ReadString(std::istream& buffer, size_t len) {
 	if (len == 0) {
 		return std::string();
 	}
 
-	std::vector<char> result(len);
-	if (!buffer.read(result.data(), len)) {
+	std::string result(len, '\0');
+	if (!buffer.read(&result[0], len)) {
 		std::stringstream err;
 		err << "Couldn't read " << len << " bytes from stream";
 		throw std::runtime_error(err.str());
 	}
 
-	return std::string(result.begin(), result.end());
+	return result;
 }
 
 void WriteString(std::ostream& buffer, const std::string& str) {
@@ -56,25 +194,20 @@ std::string ReadCString(std::istream& buffer, size_t len) {
 		return std::string();
 	}
 
-	std::vector<char> result(len);
-	if (!buffer.read(result.data(), len)) {
+	char result[256];
+	std::string big;
+	char* dest = result;
+	if (len > sizeof(result)) {
+		big.resize(len);
+		dest = &big[0];
+	}
+	if (!buffer.read(dest, len)) {
 		std::stringstream err;
 		err << "Couldn't read " << len << " bytes from stream";
 		throw std::runtime_error(err.str());
 	}
 
-	// Find a NULL byte, and truncate the string if we find it.
-	for (auto it = result.begin();it != result.end();++it) {
-		if (*it == '\0') {
-			if (it == result.begin()) {
-				return std::string();
-			} else {
-				return std::string(result.begin(), it);
-			}
-		}
-	}
-
-	return std::string(result.begin(), result.end());
+	return LoadCString(dest, len);
 }
 
 // DANGER: This function will not write the trailing NULL byte if there
@@ -20,11 +20,104 @@
 #define BUFFER_HH
 
 #include <cstdint>
+#include <istream>
+#include <stdexcept>
+#include <streambuf>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 namespace WADmake {
 
+// A read-only stream buffer over memory that belongs to somebody else.
+// This lets stream-based readers parse lump data without copying it.
+class MemoryBuffer : public std::streambuf {
+public:
+	MemoryBuffer(const char* data, size_t len);
+protected:
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+};
+
+class MemoryStream : public std::istream {
+	MemoryBuffer buf;
+public:
+	MemoryStream(const char* data, size_t len);
+};
+
+// Load a little-endian integer of any width from memory.  This compiles
+// down to a single load on little-endian machines.
+template <typename T>
+inline T LoadLE(const char* data) {
+	typedef typename std::make_unsigned<T>::type U;
+	const uint8_t* raw = reinterpret_cast<const uint8_t*>(data);
+	U result = 0;
+	for (size_t i = 0;i < sizeof(T);i++) {
+		result |= static_cast<U>(static_cast<U>(raw[i]) << (8 * i));
+	}
+	return static_cast<T>(result);
+}
+
+// Store a little-endian integer of any width to memory.
+template <typename T>
+inline void StoreLE(char* data, T value) {
+	typedef typename std::make_unsigned<T>::type U;
+	U raw = static_cast<U>(value);
+	for (size_t i = 0;i < sizeof(T);i++) {
+		data[i] = static_cast<char>((raw >> (8 * i)) & 0xFF);
+	}
+}
+
+std::string LoadCString(const char* data, size_t len);
+void StoreCString(char* data, const std::string& str, size_t len);
+
+// A cursor over memory that belongs to somebody else, for reading binary
+// structures.  Reads are bounds checked, and record() checks a whole
+// fixed-size record at once so its fields can be loaded with LoadLE.
+class BinaryReader {
+	const char* data;
+	size_t len;
+	size_t pos;
+public:
+	BinaryReader(const char* data, size_t len);
+	bool eof() const;
+	size_t remaining() const;
+	size_t size() const;
+	size_t tell() const;
+	void seek(size_t pos);
+	const char* record(size_t len);
+	std::string readString(size_t len);
+	std::string readCString(size_t len);
+	template <typename T> T read() {
+		return LoadLE<T>(this->record(sizeof(T)));
+	}
+};
+
+// A growable buffer for writing binary structures.  record() makes room
+// for a whole fixed-size record at once, and the pointer it returns is
+// good until the next write.
+class BinaryWriter {
+	std::string buffer;
+public:
+	const char* data() const;
+	size_t size() const;
+	void reserve(size_t len);
+	std::string release();
+	char* record(size_t len);
+	void writeData(const char* data, size_t len);
+	void writeString(const std::string& str);
+	void writeCString(const std::string& str, size_t len);
+	template <typename T> void write(T value) {
+		StoreLE<T>(this->record(sizeof(T)), value);
+	}
+	template <typename T> void writeAt(size_t pos, T value) {
+		if (pos > this->buffer.size() || sizeof(T) > this->buffer.size() - pos) {
+			throw std::out_of_range("Write is outside of buffer");
+		}
+		StoreLE<T>(&this->buffer[pos], value);
+	}
+};
+
 std::string ReadString(std::istream& buffer, size_t len);
 void WriteString(std::ostream& buffer, const std::string& str);
 std::string ReadCString(std::istream& buffer, size_t len);
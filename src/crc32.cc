@@ -0,0 +1,264 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "crc32.hh"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CRC32_CLMUL
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CRC32_CLMUL_TARGET
+#else
+#include <cpuid.h>
+#define CRC32_CLMUL_TARGET __attribute__((target("pclmul,sse4.1")))
+#endif
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+namespace WADmake {
+
+// Reversed CRC-32 polynomial
+static const uint32_t polynomial = 0xEDB88320;
+
+// Lookup tables for processing eight bytes at a time.  table[0] is the
+// usual byte-at-a-time table, and each following table advances the CRC
+// by one more byte of zeroes.
+struct CRC32Tables {
+	uint32_t table[8][256];
+	CRC32Tables() {
+		for (uint32_t i = 0;i < 256;i++) {
+			uint32_t crc = i;
+			for (int j = 0;j < 8;j++) {
+				crc = crc & 1 ? (crc >> 1) ^ polynomial : crc >> 1;
+			}
+			this->table[0][i] = crc;
+		}
+		for (uint32_t i = 0;i < 256;i++) {
+			for (int k = 1;k < 8;k++) {
+				uint32_t prev = this->table[k - 1][i];
+				this->table[k][i] = (prev >> 8) ^ this->table[0][prev & 0xFF];
+			}
+		}
+	}
+};
+
+static const CRC32Tables& GetTables() {
+	static const CRC32Tables tables;
+	return tables;
+}
+
+// Slice-by-8 on a CRC that has already been inverted.
+static uint32_t SliceBy8(uint32_t crc, const unsigned char* p, size_t len) {
+	const auto& t = GetTables().table;
+	while (len >= 8) {
+		uint32_t one = crc ^ (static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+		                      static_cast<uint32_t>(p[2]) << 16 | static_cast<uint32_t>(p[3]) << 24);
+		uint32_t two = static_cast<uint32_t>(p[4]) | static_cast<uint32_t>(p[5]) << 8 |
+		               static_cast<uint32_t>(p[6]) << 16 | static_cast<uint32_t>(p[7]) << 24;
+		crc = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^
+		      t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24] ^
+		      t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^
+		      t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF];
+		p += 1;
+		len -= 1;
+	}
+	return crc;
+}
+
+#ifdef CRC32_CLMUL
+
+// Folding constants for the CRC-32 polynomial, from Intel's "Fast CRC
+// Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+// Fold 64 bytes at a time with carry-less multiplication, then reduce
+// down to 32 bits.  Takes an inverted CRC, and len must be at least 64
+// and a multiple of 16.
+CRC32_CLMUL_TARGET
+static uint32_t FoldCLMUL(uint32_t crc, const unsigned char* p, size_t len) {
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x5 = _mm_load_si128(reinterpret_cast<const __m128i*>(k1k2));
+	x0 = _mm_cvtsi32_si128(static_cast<int>(crc));
+	x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x00));
+	x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x10));
+	x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x20));
+	x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x30));
+	x1 = _mm_xor_si128(x1, x0);
+	p += 64;
+	len -= 64;
+
+	// Fold four blocks of 16 bytes at a time
+	while (len >= 64) {
+		x6 = _mm_clmulepi64_si128(x1, x5, 0x00);
+		x7 = _mm_clmulepi64_si128(x2, x5, 0x00);
+		x8 = _mm_clmulepi64_si128(x3, x5, 0x00);
+		x0 = _mm_clmulepi64_si128(x4, x5, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x5, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x5, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x5, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x5, 0x11);
+		y5 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x00));
+		y6 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x10));
+		y7 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x20));
+		y8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x6), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x7), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x8), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x0), y8);
+		p += 64;
+		len -= 64;
+	}
+
+	// Fold the four blocks into one
+	x5 = _mm_load_si128(reinterpret_cast<const __m128i*>(k3k4));
+	x0 = _mm_clmulepi64_si128(x1, x5, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x5, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x0);
+	x0 = _mm_clmulepi64_si128(x1, x5, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x5, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x0);
+	x0 = _mm_clmulepi64_si128(x1, x5, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x5, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x0);
+
+	// Fold any remaining blocks of 16 bytes
+	while (len >= 16) {
+		x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		x0 = _mm_clmulepi64_si128(x1, x5, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x5, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x0);
+		p += 16;
+		len -= 16;
+	}
+
+	// Fold 128 bits down to 64 bits
+	x2 = _mm_clmulepi64_si128(x1, x5, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x5 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x5, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduction down to 32 bits
+	x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(poly));
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+}
+
+// Check if the processor has carry-less multiplication, along with
+// SSE4.1 for extracting the result.
+static bool HasCLMUL() {
+	unsigned int ecx;
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	ecx = static_cast<unsigned int>(info[2]);
+#else
+	unsigned int eax, ebx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		return false;
+	}
+#endif
+	return (ecx & (1 << 1)) && (ecx & (1 << 19));
+}
+
+#endif
+
+uint32_t CRC32Portable(uint32_t crc, const char* data, size_t len) {
+	return ~SliceBy8(~crc, reinterpret_cast<const unsigned char*>(data), len);
+}
+
+uint32_t CRC32(uint32_t crc, const char* data, size_t len) {
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+	crc = ~crc;
+#ifdef CRC32_CLMUL
+	static const bool clmul = HasCLMUL();
+	if (clmul && len >= 64) {
+		size_t chunk = len & ~static_cast<size_t>(15);
+		crc = FoldCLMUL(crc, p, chunk);
+		p += chunk;
+		len -= chunk;
+	}
+#endif
+	return ~SliceBy8(crc, p, len);
+}
+
+// Multiply two polynomials modulo the CRC-32 polynomial, with the bits
+// reversed the same way the CRC is.
+static uint32_t MultModP(uint32_t a, uint32_t b) {
+	uint32_t m = static_cast<uint32_t>(1) << 31;
+	uint32_t p = 0;
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0) {
+				break;
+			}
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ polynomial : b >> 1;
+	}
+	return p;
+}
+
+uint32_t CRC32Combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+	// x^(2^n) mod p for each n, starting from x^1.
+	struct Powers {
+		uint32_t power[64];
+		Powers() {
+			uint32_t p = static_cast<uint32_t>(1) << 30;
+			for (int n = 0;n < 64;n++) {
+				this->power[n] = p;
+				p = MultModP(p, p);
+			}
+		}
+	};
+	static const Powers powers;
+
+	// Appending len2 bytes multiplies the first CRC by x^(8 * len2).
+	uint32_t x = static_cast<uint32_t>(1) << 31;
+	int k = 3;
+	while (len2 > 0) {
+		if (len2 & 1) {
+			x = MultModP(powers.power[k & 63], x);
+		}
+		len2 >>= 1;
+		k += 1;
+	}
+	return MultModP(x, crc1) ^ crc2;
+}
+
+}
@@ -0,0 +1,40 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRC32_HH
+#define CRC32_HH
+
+#include <cstddef>
+#include <cstdint>
+
+namespace WADmake {
+
+// CRC-32 as used by ZIP, with the same conventions as zlib's crc32():
+// start with a CRC of 0 and pass the previous result to continue.
+uint32_t CRC32(uint32_t crc, const char* data, size_t len);
+
+// Given the CRC-32 of two blocks of data and the length of the second
+// block, get the CRC-32 of both blocks one after the other.
+uint32_t CRC32Combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+// CRC-32 using only the portable table-driven code, for testing.
+uint32_t CRC32Portable(uint32_t crc, const char* data, size_t len);
+
+}
+
+#endif
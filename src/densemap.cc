@@ -0,0 +1,344 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <stdexcept>
+
+#include "densemap.hh"
+#include "map.hh"
+
+namespace WADmake {
+
+DenseName ToDenseName(const std::string& name) {
+	DenseName result;
+	StoreCString(result.data(), name, result.size());
+	return result;
+}
+
+std::string FromDenseName(const DenseName& name) {
+	return LoadCString(name.data(), name.size());
+}
+
+static DenseName LoadDenseName(const char* data) {
+	DenseName result;
+	std::memcpy(result.data(), data, result.size());
+	return result;
+}
+
+// Renumber a reference for writing, skipping over tombstones.  0xFFFF
+// reads back as no reference at all, so the last usable index is 0xFFFE.
+static uint16_t StoreIndex(const std::vector<DenseIndex>& remap, DenseIndex index, const char* what) {
+	if (index >= remap.size() || remap[index] == NoIndex) {
+		throw std::runtime_error(std::string("Reference to missing ") + what);
+	}
+	if (remap[index] >= UINT16_MAX) {
+		throw std::runtime_error(std::string("Too many ") + what + "s for the Doom map format");
+	}
+	return static_cast<uint16_t>(remap[index]);
+}
+
+DenseTable::DenseTable() : count(0), gen(0) { }
+
+DenseIndex DenseTable::allocate() {
+	if (this->tombstones.size() >= NoIndex) {
+		throw std::runtime_error("Too many elements in table");
+	}
+	this->tombstones.push_back(false);
+	this->count += 1;
+	return static_cast<DenseIndex>(this->tombstones.size() - 1);
+}
+
+void DenseTable::check(DenseIndex index) const {
+	if (!this->contains(index)) {
+		throw std::out_of_range("No element at index " + std::to_string(index));
+	}
+}
+
+bool DenseTable::contains(DenseIndex index) const {
+	return index < this->tombstones.size() && !this->tombstones[index];
+}
+
+// The element's fields are left where they are, only its slot is marked
+// as dead.
+void DenseTable::erase(DenseIndex index) {
+	this->check(index);
+	this->tombstones[index] = true;
+	this->count -= 1;
+	this->gen += 1;
+}
+
+uint32_t DenseTable::generation() const {
+	return this->gen;
+}
+
+// Returns the index each slot ends up at once tombstones are dropped, or
+// NoIndex for the tombstones themselves.
+std::vector<DenseIndex> DenseTable::remap() const {
+	std::vector<DenseIndex> result(this->tombstones.size());
+	DenseIndex next = 0;
+	for (size_t i = 0;i < this->tombstones.size();i++) {
+		result[i] = this->tombstones[i] ? NoIndex : next++;
+	}
+	return result;
+}
+
+size_t DenseTable::size() const {
+	return this->count;
+}
+
+size_t DenseTable::slots() const {
+	return this->tombstones.size();
+}
+
+DenseIndex DenseVertexes::push_back(int16_t x, int16_t y) {
+	DenseIndex index = this->allocate();
+	this->x.push_back(x);
+	this->y.push_back(y);
+	return index;
+}
+
+DenseIndex DenseSectors::push_back(int16_t floor, int16_t ceiling, const DenseName& floortex,
+                                   const DenseName& ceilingtex, int16_t light, int16_t special, int16_t tag) {
+	DenseIndex index = this->allocate();
+	this->floor.push_back(floor);
+	this->ceiling.push_back(ceiling);
+	this->floortex.push_back(floortex);
+	this->ceilingtex.push_back(ceilingtex);
+	this->light.push_back(light);
+	this->special.push_back(special);
+	this->tag.push_back(tag);
+	return index;
+}
+
+DenseIndex DenseSidedefs::push_back(int16_t xoffset, int16_t yoffset, const DenseName& uppertex,
+                                    const DenseName& middletex, const DenseName& lowertex, DenseIndex sector) {
+	DenseIndex index = this->allocate();
+	this->xoffset.push_back(xoffset);
+	this->yoffset.push_back(yoffset);
+	this->uppertex.push_back(uppertex);
+	this->middletex.push_back(middletex);
+	this->lowertex.push_back(lowertex);
+	this->sector.push_back(sector);
+	return index;
+}
+
+DenseIndex DenseLinedefs::push_back(DenseIndex startvertex, DenseIndex endvertex, uint16_t flags,
+                                    int16_t special, int16_t tag, DenseIndex frontsidedef, DenseIndex backsidedef) {
+	DenseIndex index = this->allocate();
+	this->startvertex.push_back(startvertex);
+	this->endvertex.push_back(endvertex);
+	this->flags.push_back(flags);
+	this->special.push_back(special);
+	this->tag.push_back(tag);
+	this->frontsidedef.push_back(frontsidedef);
+	this->backsidedef.push_back(backsidedef);
+	return index;
+}
+
+DenseIndex DenseThings::push_back(int16_t x, int16_t y, uint16_t angle, uint16_t type, uint16_t flags) {
+	DenseIndex index = this->allocate();
+	this->x.push_back(x);
+	this->y.push_back(y);
+	this->angle.push_back(angle);
+	this->type.push_back(type);
+	this->flags.push_back(flags);
+	return index;
+}
+
+BinaryReader& DenseMap::readVertexes(BinaryReader& buffer) {
+	size_t count = RecordCount(buffer, Vertex::size);
+	const char* records = buffer.record(count * Vertex::size);
+	for (size_t i = 0;i < count;i++) {
+		const char* record = records + i * Vertex::size;
+		this->vertexes.push_back(LoadLE<int16_t>(record), LoadLE<int16_t>(record + 2));
+	}
+
+	return buffer;
+}
+
+BinaryReader& DenseMap::readSectors(BinaryReader& buffer) {
+	size_t count = RecordCount(buffer, Sector::size);
+	const char* records = buffer.record(count * Sector::size);
+	for (size_t i = 0;i < count;i++) {
+		const char* record = records + i * Sector::size;
+		this->sectors.push_back(LoadLE<int16_t>(record), LoadLE<int16_t>(record + 2),
+		                        LoadDenseName(record + 4), LoadDenseName(record + 12),
+		                        LoadLE<int16_t>(record + 20), LoadLE<int16_t>(record + 22),
+		                        LoadLE<int16_t>(record + 24));
+	}
+
+	return buffer;
+}
+
+BinaryReader& DenseMap::readSidedefs(BinaryReader& buffer) {
+	size_t count = RecordCount(buffer, Sidedef::size);
+	const char* records = buffer.record(count * Sidedef::size);
+	for (size_t i = 0;i < count;i++) {
+		const char* record = records + i * Sidedef::size;
+		DenseIndex sector = LoadLE<uint16_t>(record + 28);
+		this->sectors.check(sector);
+		this->sidedefs.push_back(LoadLE<int16_t>(record), LoadLE<int16_t>(record + 2),
+		                         LoadDenseName(record + 4), LoadDenseName(record + 12),
+		                         LoadDenseName(record + 20), sector);
+	}
+
+	return buffer;
+}
+
+BinaryReader& DenseMap::readLinedefs(BinaryReader& buffer) {
+	size_t count = RecordCount(buffer, DoomLinedef::size);
+	const char* records = buffer.record(count * DoomLinedef::size);
+	for (size_t i = 0;i < count;i++) {
+		const char* record = records + i * DoomLinedef::size;
+
+		DenseIndex startvertex = LoadLE<uint16_t>(record);
+		this->vertexes.check(startvertex);
+		DenseIndex endvertex = LoadLE<uint16_t>(record + 2);
+		this->vertexes.check(endvertex);
+
+		// 0xFFFF means there is no sidedef on that side.
+		DenseIndex frontsidedef = LoadLE<uint16_t>(record + 10);
+		if (frontsidedef == UINT16_MAX) {
+			frontsidedef = NoIndex;
+		} else {
+			this->sidedefs.check(frontsidedef);
+		}
+		DenseIndex backsidedef = LoadLE<uint16_t>(record + 12);
+		if (backsidedef == UINT16_MAX) {
+			backsidedef = NoIndex;
+		} else {
+			this->sidedefs.check(backsidedef);
+		}
+
+		this->linedefs.push_back(startvertex, endvertex, LoadLE<uint16_t>(record + 4),
+		                         LoadLE<int16_t>(record + 6), LoadLE<int16_t>(record + 8),
+		                         frontsidedef, backsidedef);
+	}
+
+	return buffer;
+}
+
+BinaryReader& DenseMap::readThings(BinaryReader& buffer) {
+	size_t count = RecordCount(buffer, DoomThing::size);
+	const char* records = buffer.record(count * DoomThing::size);
+	for (size_t i = 0;i < count;i++) {
+		const char* record = records + i * DoomThing::size;
+		this->things.push_back(LoadLE<int16_t>(record), LoadLE<int16_t>(record + 2),
+		                       LoadLE<uint16_t>(record + 4), LoadLE<uint16_t>(record + 6),
+		                       LoadLE<uint16_t>(record + 8));
+	}
+
+	return buffer;
+}
+
+BinaryWriter& DenseMap::writeVertexes(BinaryWriter& buffer) const {
+	char* record = buffer.record(this->vertexes.size() * Vertex::size);
+	for (DenseIndex i = 0;i < this->vertexes.slots();i++) {
+		if (!this->vertexes.contains(i)) {
+			continue;
+		}
+		StoreLE<int16_t>(record, this->vertexes.x[i]);
+		StoreLE<int16_t>(record + 2, this->vertexes.y[i]);
+		record += Vertex::size;
+	}
+
+	return buffer;
+}
+
+BinaryWriter& DenseMap::writeSectors(BinaryWriter& buffer) const {
+	char* record = buffer.record(this->sectors.size() * Sector::size);
+	for (DenseIndex i = 0;i < this->sectors.slots();i++) {
+		if (!this->sectors.contains(i)) {
+			continue;
+		}
+		StoreLE<int16_t>(record, this->sectors.floor[i]);
+		StoreLE<int16_t>(record + 2, this->sectors.ceiling[i]);
+		std::memcpy(record + 4, this->sectors.floortex[i].data(), 8);
+		std::memcpy(record + 12, this->sectors.ceilingtex[i].data(), 8);
+		StoreLE<int16_t>(record + 20, this->sectors.light[i]);
+		StoreLE<int16_t>(record + 22, this->sectors.special[i]);
+		StoreLE<int16_t>(record + 24, this->sectors.tag[i]);
+		record += Sector::size;
+	}
+
+	return buffer;
+}
+
+BinaryWriter& DenseMap::writeSidedefs(BinaryWriter& buffer) const {
+	std::vector<DenseIndex> sectors = this->sectors.remap();
+
+	char* record = buffer.record(this->sidedefs.size() * Sidedef::size);
+	for (DenseIndex i = 0;i < this->sidedefs.slots();i++) {
+		if (!this->sidedefs.contains(i)) {
+			continue;
+		}
+		StoreLE<int16_t>(record, this->sidedefs.xoffset[i]);
+		StoreLE<int16_t>(record + 2, this->sidedefs.yoffset[i]);
+		std::memcpy(record + 4, this->sidedefs.uppertex[i].data(), 8);
+		std::memcpy(record + 12, this->sidedefs.middletex[i].data(), 8);
+		std::memcpy(record + 20, this->sidedefs.lowertex[i].data(), 8);
+		StoreLE<uint16_t>(record + 28, StoreIndex(sectors, this->sidedefs.sector[i], "sector"));
+		record += Sidedef::size;
+	}
+
+	return buffer;
+}
+
+BinaryWriter& DenseMap::writeLinedefs(BinaryWriter& buffer) const {
+	std::vector<DenseIndex> vertexes = this->vertexes.remap();
+	std::vector<DenseIndex> sidedefs = this->sidedefs.remap();
+
+	char* record = buffer.record(this->linedefs.size() * DoomLinedef::size);
+	for (DenseIndex i = 0;i < this->linedefs.slots();i++) {
+		if (!this->linedefs.contains(i)) {
+			continue;
+		}
+		StoreLE<uint16_t>(record, StoreIndex(vertexes, this->linedefs.startvertex[i], "vertex"));
+		StoreLE<uint16_t>(record + 2, StoreIndex(vertexes, this->linedefs.endvertex[i], "vertex"));
+		StoreLE<uint16_t>(record + 4, this->linedefs.flags[i]);
+		StoreLE<int16_t>(record + 6, this->linedefs.special[i]);
+		StoreLE<int16_t>(record + 8, this->linedefs.tag[i]);
+
+		DenseIndex frontsidedef = this->linedefs.frontsidedef[i];
+		StoreLE<uint16_t>(record + 10, frontsidedef == NoIndex ? UINT16_MAX : StoreIndex(sidedefs, frontsidedef, "sidedef"));
+		DenseIndex backsidedef = this->linedefs.backsidedef[i];
+		StoreLE<uint16_t>(record + 12, backsidedef == NoIndex ? UINT16_MAX : StoreIndex(sidedefs, backsidedef, "sidedef"));
+		record += DoomLinedef::size;
+	}
+
+	return buffer;
+}
+
+BinaryWriter& DenseMap::writeThings(BinaryWriter& buffer) const {
+	char* record = buffer.record(this->things.size() * DoomThing::size);
+	for (DenseIndex i = 0;i < this->things.slots();i++) {
+		if (!this->things.contains(i)) {
+			continue;
+		}
+		StoreLE<int16_t>(record, this->things.x[i]);
+		StoreLE<int16_t>(record + 2, this->things.y[i]);
+		StoreLE<uint16_t>(record + 4, this->things.angle[i]);
+		StoreLE<uint16_t>(record + 6, this->things.type[i]);
+		StoreLE<uint16_t>(record + 8, this->things.flags[i]);
+		record += DoomThing::size;
+	}
+
+	return buffer;
+}
+
+}
@@ -0,0 +1,153 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// DenseMap is a compact alternative to DoomMap for passes that walk over
+// the geometry of large maps.
+//
+// Every table keeps its fields in parallel arrays, and elements refer to
+// one another by 32-bit index instead of by pointer.  An element's index
+// is its ID, and it never changes: erasing an element only leaves a
+// tombstone in its slot, and bumps the generation of the table so anything
+// caching indexes can tell that it needs to look again.  Tombstones are
+// skipped when the map is written back out, and references are renumbered
+// to match.
+//
+// Unlike DoomMap, indexes in the lumps are read as unsigned, so a map with
+// more than 32767 of anything keeps its references.  Only 0xFFFF means
+// that there is no reference.
+
+#ifndef DENSEMAP_HH
+#define DENSEMAP_HH
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "buffer.hh"
+
+namespace WADmake {
+
+typedef uint32_t DenseIndex;
+
+// Stands in for a missing reference, such as a one-sided linedef's back
+// sidedef.
+const DenseIndex NoIndex = UINT32_MAX;
+
+// Texture and flat names are kept exactly as they sit in the lump.
+typedef std::array<char, 8> DenseName;
+
+DenseName ToDenseName(const std::string& name);
+std::string FromDenseName(const DenseName& name);
+
+// Slot bookkeeping shared by every table in a DenseMap.
+class DenseTable {
+	std::vector<bool> tombstones;
+	size_t count;
+	uint32_t gen;
+protected:
+	DenseIndex allocate();
+public:
+	DenseTable();
+	void check(DenseIndex index) const;
+	bool contains(DenseIndex index) const;
+	void erase(DenseIndex index);
+	uint32_t generation() const;
+	std::vector<DenseIndex> remap() const;
+	size_t size() const;
+	size_t slots() const;
+};
+
+class DenseVertexes : public DenseTable {
+public:
+	std::vector<int16_t> x;
+	std::vector<int16_t> y;
+	DenseIndex push_back(int16_t x, int16_t y);
+};
+
+class DenseSectors : public DenseTable {
+public:
+	std::vector<int16_t> floor;
+	std::vector<int16_t> ceiling;
+	std::vector<DenseName> floortex;
+	std::vector<DenseName> ceilingtex;
+	std::vector<int16_t> light;
+	std::vector<int16_t> special;
+	std::vector<int16_t> tag;
+	DenseIndex push_back(int16_t floor, int16_t ceiling, const DenseName& floortex,
+	                     const DenseName& ceilingtex, int16_t light, int16_t special, int16_t tag);
+};
+
+class DenseSidedefs : public DenseTable {
+public:
+	std::vector<int16_t> xoffset;
+	std::vector<int16_t> yoffset;
+	std::vector<DenseName> uppertex;
+	std::vector<DenseName> middletex;
+	std::vector<DenseName> lowertex;
+	std::vector<DenseIndex> sector;
+	DenseIndex push_back(int16_t xoffset, int16_t yoffset, const DenseName& uppertex,
+	                     const DenseName& middletex, const DenseName& lowertex, DenseIndex sector);
+};
+
+class DenseLinedefs : public DenseTable {
+public:
+	std::vector<DenseIndex> startvertex;
+	std::vector<DenseIndex> endvertex;
+	std::vector<uint16_t> flags;
+	std::vector<int16_t> special;
+	std::vector<int16_t> tag;
+	std::vector<DenseIndex> frontsidedef;
+	std::vector<DenseIndex> backsidedef;
+	DenseIndex push_back(DenseIndex startvertex, DenseIndex endvertex, uint16_t flags,
+	                     int16_t special, int16_t tag, DenseIndex frontsidedef, DenseIndex backsidedef);
+};
+
+class DenseThings : public DenseTable {
+public:
+	std::vector<int16_t> x;
+	std::vector<int16_t> y;
+	std::vector<uint16_t> angle;
+	std::vector<uint16_t> type;
+	std::vector<uint16_t> flags;
+	DenseIndex push_back(int16_t x, int16_t y, uint16_t angle, uint16_t type, uint16_t flags);
+};
+
+class DenseMap {
+public:
+	DenseVertexes vertexes;
+	DenseSectors sectors;
+	DenseSidedefs sidedefs;
+	DenseLinedefs linedefs;
+	DenseThings things;
+	// Lumps must be read in this order, so references can be checked.
+	BinaryReader& readVertexes(BinaryReader& buffer);
+	BinaryReader& readSectors(BinaryReader& buffer);
+	BinaryReader& readSidedefs(BinaryReader& buffer);
+	BinaryReader& readLinedefs(BinaryReader& buffer);
+	BinaryReader& readThings(BinaryReader& buffer);
+	BinaryWriter& writeVertexes(BinaryWriter& buffer) const;
+	BinaryWriter& writeSectors(BinaryWriter& buffer) const;
+	BinaryWriter& writeSidedefs(BinaryWriter& buffer) const;
+	BinaryWriter& writeLinedefs(BinaryWriter& buffer) const;
+	BinaryWriter& writeThings(BinaryWriter& buffer) const;
+};
+
+}
+
+#endif
@@ -17,70 +17,352 @@
  */
 
 #include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_set>
 
 #include "directory.hh"
+#include "file.hh"
 
 namespace WADmake {
 
-const std::string Lump::getName() const {
+LumpData::LumpData() : ptr(nullptr), len(0), writable(false) { }
+
+LumpData::LumpData(std::string&& str) : ptr(nullptr), len(str.size()), writable(true) {
+	auto owned = std::make_shared<std::string>(std::move(str));
+	this->ptr = owned->data();
+	this->owner = owned;
+}
+
+LumpData::LumpData(const std::shared_ptr<const MappedFile>& mapping, size_t offset, size_t length) :
+	owner(mapping), ptr(nullptr), len(length), writable(false) {
+	if (offset > mapping->size() || length > mapping->size() - offset) {
+		throw std::out_of_range("Lump data is outside of mapped file");
+	}
+	this->ptr = mapping->getData() + offset;
+}
+
+bool LumpData::operator==(const LumpData& other) const {
+	if (this->len != other.len) {
+		return false;
+	}
+	return this->ptr == other.ptr || this->len == 0 ||
+	       std::memcmp(this->ptr, other.ptr, this->len) == 0;
+}
+
+bool LumpData::operator!=(const LumpData& other) const {
+	return !(*this == other);
+}
+
+const char* LumpData::data() const {
+	return this->ptr;
+}
+
+bool LumpData::empty() const {
+	return this->len == 0;
+}
+
+size_t LumpData::size() const {
+	return this->len;
+}
+
+// Return a view of part of this data that shares the same storage.
+LumpData LumpData::slice(size_t offset, size_t length) const {
+	if (offset > this->len || length > this->len - offset) {
+		throw std::out_of_range("Slice is outside of lump data");
+	}
+	LumpData result(*this);
+	result.ptr += offset;
+	result.len = length;
+	result.writable = false;
+	return result;
+}
+
+std::string LumpData::str() const {
+	if (this->len == 0) {
+		return std::string();
+	}
+	return std::string(this->ptr, this->len);
+}
+
+// True if nothing else shares this storage.
+bool LumpData::unique() const {
+	return this->owner.use_count() == 1;
+}
+
+// Get a pointer to the data that can be modified in place.  Only a string
+// we own outright can be written to, so anything else is copied first.
+char* LumpData::mutableData() {
+	if (!this->writable || !this->unique()) {
+		*this = LumpData(this->str());
+	}
+	return const_cast<char*>(this->ptr);
+}
+
+Lump::Lump() : loaded(true) { }
+
+const std::string& Lump::getName() const {
 	return this->name;
 }
 
-const std::string Lump::getData() const {
+// Lumps that come from a LumpSource are only loaded the first time
+// somebody asks for their data.
+const LumpData& Lump::getData() const {
+	if (!this->loaded) {
+		this->data = this->source->load();
+		this->loaded = true;
+	}
 	return this->data;
 }
 
+size_t Lump::getSize() const {
+	if (!this->loaded) {
+		return this->source->size();
+	}
+	return this->data.size();
+}
+
+// The source this lump's data was loaded from, or nullptr if the data
+// has been set directly.
+const std::shared_ptr<const LumpSource>& Lump::getSource() const {
+	return this->source;
+}
+
+// Get a pointer to lump data that can be modified in place.  If the data
+// is shared with anybody else, it is copied first.
+char* Lump::mutableData() {
+	this->getData();
+	this->source.reset();
+	return this->data.mutableData();
+}
+
 void Lump::setName(std::string&& name) {
 	this->name = std::move(name);
 }
 
 void Lump::setData(std::string&& data) {
-	this->data = std::move(data);
+	this->setData(LumpData(std::move(data)));
 }
 
 void Lump::setData(std::vector<char>&& data) {
-	this->data = std::string(std::begin(data), std::end(data));
+	this->setData(LumpData(std::string(std::begin(data), std::end(data))));
+}
+
+void Lump::setData(const LumpData& data) {
+	this->source.reset();
+	this->data = data;
+	this->loaded = true;
+}
+
+// Set a source to load lump data from once it's needed.
+void Lump::setSource(const std::shared_ptr<const LumpSource>& source) {
+	this->source = source;
+	this->data = LumpData();
+	this->loaded = false;
 }
 
-size_t Directory::size() {
+// Find the position of the map lump with the given name.
+std::tuple<bool, size_t> MapLocation::find(const std::string& name) const {
+	auto it = this->lumps.find(name);
+	if (it == this->lumps.end()) {
+		return std::make_tuple(false, 0);
+	}
+	return std::make_tuple(true, it->second);
+}
+
+// Names of lumps that can follow a map header.  GL nodes are recognized
+// by their GL_ prefix instead.
+static const std::unordered_set<std::string> mapLumpNames = {
+	"THINGS", "LINEDEFS", "SIDEDEFS", "VERTEXES", "SEGS", "SSECTORS",
+	"NODES", "SECTORS", "REJECT", "BLOCKMAP", "BEHAVIOR", "SCRIPTS",
+	"TEXTMAP", "ZNODES", "DIALOGUE", "ENDMAP"
+};
+
+static bool IsMapLump(const std::string& name) {
+	return name.compare(0, 3, "GL_") == 0 || mapLumpNames.count(name) != 0;
+}
+
+Directory::Directory() : mapsvalid(false) { }
+
+// Find every map in the directory in a single pass.  Any lump that isn't
+// itself a map lump and is followed by one is taken to be a map header,
+// and the map lumps that follow it, in whatever order, belong to that map.
+// Between a TEXTMAP and its ENDMAP, every lump belongs to the map.
+void Directory::locateMaps() const {
+	this->maplocations.clear();
+	this->mapnames.clear();
+
+	size_t i = 0;
+	while (i < this->index.size()) {
+		const std::string& name = this->index[i].getName();
+		if (IsMapLump(name) || i + 1 >= this->index.size() ||
+		    !IsMapLump(this->index[i + 1].getName())) {
+			i += 1;
+			continue;
+		}
+
+		MapLocation location;
+		location.name = name;
+		location.header = i;
+		bool udmf = false;
+		for (i += 1;i < this->index.size();i++) {
+			const std::string& lumpname = this->index[i].getName();
+			if (!udmf && !IsMapLump(lumpname)) {
+				break;
+			}
+			location.lumps.insert(std::make_pair(lumpname, i));
+			if (lumpname == "TEXTMAP") {
+				udmf = true;
+			} else if (lumpname == "ENDMAP") {
+				i += 1;
+				break;
+			}
+		}
+
+		// Only the first map with a given name can be found by name.
+		this->mapnames.insert(std::make_pair(location.name, this->maplocations.size()));
+		this->maplocations.push_back(std::move(location));
+	}
+
+	this->mapsvalid = true;
+}
+
+// Note that a lump with the given name lives at the given position.
+void Directory::addName(const std::string& name, size_t pos) {
+	std::vector<size_t>& positions = this->names[name];
+	positions.insert(std::lower_bound(positions.begin(), positions.end(), pos), pos);
+}
+
+// Forget that a lump with the given name lives at the given position.
+void Directory::removeName(const std::string& name, size_t pos) {
+	auto it = this->names.find(name);
+	if (it == this->names.end()) {
+		return;
+	}
+
+	std::vector<size_t>& positions = it->second;
+	auto posit = std::lower_bound(positions.begin(), positions.end(), pos);
+	if (posit != positions.end() && *posit == pos) {
+		positions.erase(posit);
+	}
+	if (positions.empty()) {
+		this->names.erase(it);
+	}
+}
+
+// Move every indexed position at or after pos up by one if we're
+// inserting a lump, or down by one if we've just erased one.
+void Directory::shiftNames(size_t pos, bool insert) {
+	for (auto& name : this->names) {
+		std::vector<size_t>& positions = name.second;
+		auto it = std::lower_bound(positions.begin(), positions.end(), pos);
+		for (;it != positions.end();++it) {
+			if (insert) {
+				*it += 1;
+			} else {
+				*it -= 1;
+			}
+		}
+	}
+}
+
+size_t Directory::size() const {
 	return this->index.size();
 }
 
-Lump& Directory::at(size_t n) {
+const Lump& Directory::at(size_t n) const {
 	return this->index.at(n);
 }
 
-std::vector<Lump>::const_iterator Directory::begin() {
+std::vector<Lump>::const_iterator Directory::begin() const {
 	return this->index.begin();
 }
 
-std::vector<Lump>::const_iterator Directory::end() {
+std::vector<Lump>::const_iterator Directory::end() const {
 	return this->index.end();
 }
 
 void Directory::erase_at(size_t index) {
-	std::vector<Lump>::iterator it = this->index.begin();
-	this->index.erase(it + index);
+	const Lump& lump = this->index.at(index);
+	this->removeName(lump.getName(), index);
+	this->index.erase(this->index.begin() + index);
+	this->shiftNames(index, false);
+	this->mapsvalid = false;
 }
 
-std::tuple<bool, size_t> Directory::find_index(const std::string& name, size_t start) {
-	std::vector<Lump>::iterator result = std::find_if(this->index.begin() + start, this->index.end(), [name](Lump lump) {
-		return name == lump.getName();
-	});
-	if (result == this->index.end()) {
+// Find the first lump with the given name at or after the start position.
+std::tuple<bool, size_t> Directory::find_index(const std::string& name, size_t start) const {
+	auto it = this->names.find(name);
+	if (it == this->names.end()) {
+		return std::make_tuple(false, 0);
+	}
+
+	const std::vector<size_t>& positions = it->second;
+	auto posit = std::lower_bound(positions.begin(), positions.end(), start);
+	if (posit == positions.end()) {
 		return std::make_tuple(false, 0);
 	} else {
-		return std::make_tuple(true, result - this->index.begin());
+		return std::make_tuple(true, *posit);
 	}
 }
 
+// Find the map with the given name, returning its position in maps().
+std::tuple<bool, size_t> Directory::find_map(const std::string& name) const {
+	this->maps();
+	auto it = this->mapnames.find(name);
+	if (it == this->mapnames.end()) {
+		return std::make_tuple(false, 0);
+	}
+	return std::make_tuple(true, it->second);
+}
+
+// Find the map whose header is at the given lump position, returning its
+// position in maps().
+std::tuple<bool, size_t> Directory::find_map_at(size_t header) const {
+	const std::vector<MapLocation>& locations = this->maps();
+	auto it = std::lower_bound(locations.begin(), locations.end(), header,
+		[](const MapLocation& location, size_t header) {
+			return location.header < header;
+		});
+	if (it == locations.end() || it->header != header) {
+		return std::make_tuple(false, 0);
+	}
+	return std::make_tuple(true, it - locations.begin());
+}
+
 void Directory::insert_at(size_t index, Lump&& lump) {
-	std::vector<Lump>::iterator it = this->index.begin();
-	this->index.insert(it + index, std::move(lump));
+	if (index > this->index.size()) {
+		throw std::out_of_range("Directory index out of range");
+	}
+	this->shiftNames(index, true);
+	this->addName(lump.getName(), index);
+	this->index.insert(this->index.begin() + index, std::move(lump));
+	this->mapsvalid = false;
+}
+
+// Every map in the directory, in the order their headers appear.
+const std::vector<MapLocation>& Directory::maps() const {
+	if (!this->mapsvalid) {
+		this->locateMaps();
+	}
+	return this->maplocations;
 }
 
 void Directory::push_back(Lump&& lump) {
+	this->addName(lump.getName(), this->index.size());
 	this->index.push_back(std::move(lump));
+	this->mapsvalid = false;
+}
+
+// Replace the lump at the given position.
+void Directory::set_at(size_t index, Lump&& lump) {
+	Lump& current = this->index.at(index);
+	if (current.getName() != lump.getName()) {
+		this->removeName(current.getName(), index);
+		this->addName(lump.getName(), index);
+		this->mapsvalid = false;
+	}
+	current = std::move(lump);
 }
 
 }
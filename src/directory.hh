@@ -19,34 +19,105 @@
 #ifndef DIRECTORY_HH
 #define DIRECTORY_HH
 
+#include <memory>
 #include <string>
 #include <tuple>
+#include <unordered_map>
 #include <vector>
 
 namespace WADmake {
 
+class MappedFile;
+
+// An immutable, reference-counted run of bytes.  Copies of LumpData share
+// the same storage, which is either a string we own or a region of a
+// mapped file, so passing lump data around never copies the bytes.
+class LumpData {
+	std::shared_ptr<const void> owner;
+	const char* ptr;
+	size_t len;
+	bool writable;
+public:
+	LumpData();
+	LumpData(std::string&& str);
+	LumpData(const std::shared_ptr<const MappedFile>& mapping, size_t offset, size_t length);
+	bool operator==(const LumpData& other) const;
+	bool operator!=(const LumpData& other) const;
+	const char* data() const;
+	bool empty() const;
+	size_t size() const;
+	LumpData slice(size_t offset, size_t length) const;
+	std::string str() const;
+	bool unique() const;
+	char* mutableData();
+};
+
+// Something that can produce lump data on demand, such as an entry in a
+// ZIP file that hasn't been inflated yet.
+class LumpSource {
+public:
+	virtual ~LumpSource() { }
+	virtual LumpData load() const = 0;
+	virtual size_t size() const = 0;
+};
+
 class Lump {
 	std::string name;
-	std::string data;
+	mutable LumpData data;
+	mutable bool loaded;
+	std::shared_ptr<const LumpSource> source;
 public:
-	const std::string getName() const;
-	const std::string getData() const;
+	Lump();
+	const std::string& getName() const;
+	const LumpData& getData() const;
+	size_t getSize() const;
+	const std::shared_ptr<const LumpSource>& getSource() const;
+	char* mutableData();
 	void setName(std::string&& name);
-	void setData(std::string&& name);
+	void setData(std::string&& data);
 	void setData(std::vector<char>&& data);
+	void setData(const LumpData& data);
+	void setSource(const std::shared_ptr<const LumpSource>& source);
+};
+
+// Where the lumps that make up a single map live in a Directory.
+struct MapLocation {
+	std::string name;
+	size_t header;
+	std::unordered_map<std::string, size_t> lumps;
+	std::tuple<bool, size_t> find(const std::string& name) const;
 };
 
+// An ordered list of lumps.  Alongside the lumps themselves, Directory
+// keeps every lump position sorted by name, so finding a lump by name
+// doesn't need to look at every lump in the directory.
+//
+// The maps in the directory are found the first time somebody asks for
+// them and remembered until the directory changes.
 class Directory {
 	std::vector<Lump> index;
+	std::unordered_map<std::string, std::vector<size_t>> names;
+	mutable std::vector<MapLocation> maplocations;
+	mutable std::unordered_map<std::string, size_t> mapnames;
+	mutable bool mapsvalid;
+	void addName(const std::string& name, size_t pos);
+	void removeName(const std::string& name, size_t pos);
+	void shiftNames(size_t pos, bool insert);
+	void locateMaps() const;
 public:
-	Lump& at(size_t n);
-	std::vector<Lump>::const_iterator begin();
-	std::vector<Lump>::const_iterator end();
+	Directory();
+	const Lump& at(size_t n) const;
+	std::vector<Lump>::const_iterator begin() const;
+	std::vector<Lump>::const_iterator end() const;
 	void erase_at(size_t index);
-	std::tuple<bool, size_t> find_index(const std::string& name, size_t start);
+	std::tuple<bool, size_t> find_index(const std::string& name, size_t start) const;
+	std::tuple<bool, size_t> find_map(const std::string& name) const;
+	std::tuple<bool, size_t> find_map_at(size_t header) const;
 	void insert_at(size_t index, Lump&& lump);
+	const std::vector<MapLocation>& maps() const;
 	void push_back(Lump&& lump);
-	size_t size();
+	void set_at(size_t index, Lump&& lump);
+	size_t size() const;
 };
 
 }
@@ -0,0 +1,351 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include "file.hh"
+
+namespace WADmake {
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& filename) :
+	data(nullptr), length(0), file(INVALID_HANDLE_VALUE), mapping(NULL) {
+	// Sharing delete access lets OutputFile rename a new file over this one.
+	this->file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+	                         NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (this->file == INVALID_HANDLE_VALUE) {
+		throw std::runtime_error("Couldn't open " + filename);
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(this->file, &size)) {
+		CloseHandle(this->file);
+		throw std::runtime_error("Couldn't get size of " + filename);
+	}
+	this->length = static_cast<size_t>(size.QuadPart);
+
+	// Empty files can't be mapped, but there's nothing to read anyway.
+	if (this->length == 0) {
+		return;
+	}
+
+	this->mapping = CreateFileMappingA(this->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (this->mapping == NULL) {
+		CloseHandle(this->file);
+		throw std::runtime_error("Couldn't map " + filename);
+	}
+
+	this->data = static_cast<const char*>(MapViewOfFile(this->mapping, FILE_MAP_READ, 0, 0, 0));
+	if (this->data == nullptr) {
+		CloseHandle(this->mapping);
+		CloseHandle(this->file);
+		throw std::runtime_error("Couldn't map " + filename);
+	}
+}
+
+MappedFile::~MappedFile() {
+	if (this->data != nullptr) {
+		UnmapViewOfFile(this->data);
+	}
+	if (this->mapping != NULL) {
+		CloseHandle(this->mapping);
+	}
+	CloseHandle(this->file);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& filename) :
+	data(nullptr), length(0), fd(-1) {
+	this->fd = ::open(filename.c_str(), O_RDONLY);
+	if (this->fd == -1) {
+		throw std::runtime_error("Couldn't open " + filename);
+	}
+
+	struct stat st;
+	if (fstat(this->fd, &st) == -1) {
+		::close(this->fd);
+		throw std::runtime_error("Couldn't get size of " + filename);
+	}
+	this->length = static_cast<size_t>(st.st_size);
+
+	// Empty files can't be mapped, but there's nothing to read anyway.
+	if (this->length == 0) {
+		return;
+	}
+
+	void* addr = mmap(NULL, this->length, PROT_READ, MAP_PRIVATE, this->fd, 0);
+	if (addr == MAP_FAILED) {
+		::close(this->fd);
+		throw std::runtime_error("Couldn't map " + filename);
+	}
+	this->data = static_cast<const char*>(addr);
+}
+
+MappedFile::~MappedFile() {
+	if (this->data != nullptr) {
+		munmap(const_cast<char*>(this->data), this->length);
+	}
+	::close(this->fd);
+}
+
+#endif
+
+const char* MappedFile::getData() const {
+	return this->data;
+}
+
+size_t MappedFile::size() const {
+	return this->length;
+}
+
+// Writes smaller than this are gathered up before being written out.
+const size_t OutputFile::batchSize = 1 << 20;
+
+#ifdef _WIN32
+
+OutputFile::OutputFile(const std::string& filename) :
+	fd(-1), position(0), filename(filename) {
+	// GetTempFileName creates an empty file under a name nobody else is
+	// using, in the same directory so it can be moved into place.
+	size_t slash = filename.find_last_of("/\\:");
+	std::string dir = slash == std::string::npos ? "." : filename.substr(0, slash + 1);
+	char tempname[MAX_PATH];
+	if (GetTempFileNameA(dir.c_str(), "wad", 0, tempname) == 0) {
+		throw std::runtime_error("Couldn't open " + filename + " for writing");
+	}
+	this->tempname = tempname;
+
+	this->fd = _open(this->tempname.c_str(), _O_WRONLY | _O_TRUNC | _O_BINARY);
+	if (this->fd == -1) {
+		_unlink(this->tempname.c_str());
+		throw std::runtime_error("Couldn't open " + filename + " for writing");
+	}
+	this->pending.reserve(OutputFile::batchSize);
+}
+
+// Write out any pending data followed by the passed buffer.
+void OutputFile::flush(const char* data, size_t len) {
+	const char* bufs[2] = { this->pending.data(), data };
+	size_t lens[2] = { this->pending.size(), len };
+	for (size_t i = 0;i < 2;i++) {
+		while (lens[i] > 0) {
+			unsigned int chunk = lens[i] > INT_MAX ? INT_MAX : static_cast<unsigned int>(lens[i]);
+			int written = _write(this->fd, bufs[i], chunk);
+			if (written <= 0) {
+				throw std::runtime_error("Couldn't write to file");
+			}
+			bufs[i] += written;
+			lens[i] -= written;
+		}
+	}
+	this->pending.clear();
+}
+
+void OutputFile::writeAt(uint64_t offset, const char* data, size_t len) {
+	this->flush(nullptr, 0);
+	if (_lseeki64(this->fd, offset, SEEK_SET) == -1) {
+		throw std::runtime_error("Couldn't seek in file");
+	}
+	this->flush(data, len);
+	if (_lseeki64(this->fd, this->position, SEEK_SET) == -1) {
+		throw std::runtime_error("Couldn't seek in file");
+	}
+}
+
+void OutputFile::close() {
+	if (this->fd == -1) {
+		return;
+	}
+	this->flush(nullptr, 0);
+	int fd = this->fd;
+	this->fd = -1;
+	if (_close(fd) == -1) {
+		_unlink(this->tempname.c_str());
+		throw std::runtime_error("Couldn't close file");
+	}
+	if (!MoveFileExA(this->tempname.c_str(), this->filename.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		_unlink(this->tempname.c_str());
+		throw std::runtime_error("Couldn't replace " + this->filename);
+	}
+}
+
+// A file that was never closed is thrown away.
+OutputFile::~OutputFile() {
+	if (this->fd != -1) {
+		_close(this->fd);
+		_unlink(this->tempname.c_str());
+	}
+}
+
+#else
+
+OutputFile::OutputFile(const std::string& filename) :
+	fd(-1), position(0), filename(filename), tempname(filename + ".XXXXXX") {
+	// mkstemp picks a name nobody else is using, so neither an unrelated
+	// file nor another save of the same file gets clobbered.
+	this->fd = ::mkstemp(&this->tempname[0]);
+	if (this->fd == -1) {
+		throw std::runtime_error("Couldn't open " + filename + " for writing");
+	}
+
+	// The temporary file is only readable by its owner, so give it the
+	// permissions of the file it will replace, or of a new file.
+	struct stat st;
+	mode_t mode;
+	if (::stat(filename.c_str(), &st) == 0) {
+		mode = st.st_mode & 07777;
+	} else {
+		// The umask can only be read by setting it, so put it right back.
+		mode_t mask = ::umask(0);
+		::umask(mask);
+		mode = 0666 & ~mask;
+	}
+	if (::fchmod(this->fd, mode) == -1) {
+		::close(this->fd);
+		::unlink(this->tempname.c_str());
+		throw std::runtime_error("Couldn't open " + filename + " for writing");
+	}
+	this->pending.reserve(OutputFile::batchSize);
+}
+
+// Write out any pending data followed by the passed buffer, using a
+// single system call if possible.
+void OutputFile::flush(const char* data, size_t len) {
+	struct iovec iov[2];
+	iov[0].iov_base = this->pending.data();
+	iov[0].iov_len = this->pending.size();
+	iov[1].iov_base = const_cast<char*>(data);
+	iov[1].iov_len = len;
+
+	struct iovec* cur = iov;
+	int count = 2;
+	while (count > 0) {
+		if (cur->iov_len == 0) {
+			cur += 1;
+			count -= 1;
+			continue;
+		}
+
+		ssize_t written = ::writev(this->fd, cur, count);
+		if (written == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::runtime_error(std::string("Couldn't write to file: ") + std::strerror(errno));
+		}
+
+		// Skip past whatever made it to disk.
+		size_t done = static_cast<size_t>(written);
+		while (count > 0 && done >= cur->iov_len) {
+			done -= cur->iov_len;
+			cur += 1;
+			count -= 1;
+		}
+		if (count > 0) {
+			cur->iov_base = static_cast<char*>(cur->iov_base) + done;
+			cur->iov_len -= done;
+		}
+	}
+	this->pending.clear();
+}
+
+void OutputFile::writeAt(uint64_t offset, const char* data, size_t len) {
+	// Anything already pending might overlap, so get it out of the way.
+	this->flush(nullptr, 0);
+	while (len > 0) {
+		ssize_t written = ::pwrite(this->fd, data, len, static_cast<off_t>(offset));
+		if (written == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::runtime_error(std::string("Couldn't write to file: ") + std::strerror(errno));
+		}
+		data += written;
+		len -= written;
+		offset += written;
+	}
+}
+
+void OutputFile::close() {
+	if (this->fd == -1) {
+		return;
+	}
+	this->flush(nullptr, 0);
+	int fd = this->fd;
+	this->fd = -1;
+	if (::close(fd) == -1) {
+		std::string error = std::strerror(errno);
+		::unlink(this->tempname.c_str());
+		throw std::runtime_error("Couldn't close file: " + error);
+	}
+	if (::rename(this->tempname.c_str(), this->filename.c_str()) == -1) {
+		std::string error = std::strerror(errno);
+		::unlink(this->tempname.c_str());
+		throw std::runtime_error("Couldn't replace " + this->filename + ": " + error);
+	}
+}
+
+// A file that was never closed is thrown away.
+OutputFile::~OutputFile() {
+	if (this->fd != -1) {
+		::close(this->fd);
+		::unlink(this->tempname.c_str());
+	}
+}
+
+#endif
+
+uint64_t OutputFile::tell() const {
+	return this->position;
+}
+
+// Small writes are gathered into the pending buffer, while large writes
+// go straight to the file along with whatever was pending.
+void OutputFile::write(const char* data, size_t len) {
+	if (this->fd == -1) {
+		throw std::runtime_error("Couldn't write to closed file");
+	}
+	if (this->pending.size() + len <= OutputFile::batchSize) {
+		this->pending.insert(this->pending.end(), data, data + len);
+	} else {
+		this->flush(data, len);
+	}
+	this->position += len;
+}
+
+}
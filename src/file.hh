@@ -0,0 +1,80 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FILE_HH
+#define FILE_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace WADmake {
+
+// A read-only view of an entire file on disk.  The file is mapped into
+// memory, so pages are only read from disk when something actually
+// touches them.
+class MappedFile {
+	const char* data;
+	size_t length;
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#else
+	int fd;
+#endif
+public:
+	MappedFile(const std::string& filename);
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile();
+	const char* getData() const;
+	size_t size() const;
+};
+
+// A file on disk opened for writing.  Small writes are gathered up and
+// handed to the operating system in large batches, and data can be
+// patched at an earlier position without disturbing the write position.
+//
+// Data goes to a uniquely named temporary file next to the real one, which
+// only takes the real file's place once it is closed, with the real file's
+// permissions.  That way a file can be saved over one that lumps are still
+// mapped from.  On Windows that relies on MappedFile sharing delete access,
+// and if the rename still fails the original is left alone.
+class OutputFile {
+	static const size_t batchSize;
+	int fd;
+	uint64_t position;
+	std::vector<char> pending;
+	std::string filename;
+	std::string tempname;
+	void flush(const char* data, size_t len);
+public:
+	OutputFile(const std::string& filename);
+	OutputFile(const OutputFile&) = delete;
+	OutputFile& operator=(const OutputFile&) = delete;
+	~OutputFile();
+	void close();
+	uint64_t tell() const;
+	void write(const char* data, size_t len);
+	void writeAt(uint64_t offset, const char* data, size_t len);
+};
+
+}
+
+#endif
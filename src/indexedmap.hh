@@ -22,7 +22,7 @@
 // at first blush - indexes are mapped to elements in a sequence.  Unlike a
 // vector, however, removing elements from the middle does not modify the
 // indexes of the elements that follow the removed element...unless you
-// explicitly call reindex, at which point the entire container is reindexed
+// explicitly call compact, at which point the entire container is reindexed
 // from 0.
 //
 // For my own uses, I need to know what the index of an element is just by
@@ -34,42 +34,62 @@
 #define INDEXEDMAP_HH
 
 #include <limits>
-#include <list>
+#include <memory>
+#include <stdexcept>
 #include <unordered_map>
+#include <vector>
 
 namespace WADmake {
 
 template <class T>
 class IndexedMap {
 protected:
-	std::list<std::shared_ptr<T>> elements;
+	std::vector<std::shared_ptr<T>> elements;
 	size_t nextid;
-	std::unordered_map<size_t, std::weak_ptr<T>> elementids;
+	size_t erased;
+	std::unordered_map<size_t, size_t> elementids;
 public:
-	typedef typename std::unordered_map<size_t, std::weak_ptr<T>>::iterator iterator;
+	typedef T value_type;
+
+	// The ID an element is given once it has been erased, and the new ID
+	// that erased elements map to in a remap table.
+	static const size_t npos = std::numeric_limits<size_t>::max();
 	IndexedMap();
 	T& operator[](size_t pos);
 	T& at(size_t pos);
-	iterator begin();
-	iterator end();
-	iterator find(size_t index);
+	bool contains(size_t pos) const;
+	template <class F> void each(F func);
 	std::shared_ptr<T> lock(size_t pos);
+	size_t size() const;
+	void append(std::vector<T>&& block);
 	void push_back(T&& element);
+	void erase(size_t pos);
+	void erase(const std::vector<size_t>& positions);
+	std::vector<size_t> compact();
 	void reindex();
 };
 
 template <class T>
-IndexedMap<T>::IndexedMap() : nextid(0) { }
+const size_t IndexedMap<T>::npos;
+
+template <class T>
+IndexedMap<T>::IndexedMap() : nextid(0), erased(0) { }
 
 template <class T>
 T& IndexedMap<T>::operator[](size_t pos) {
-	auto ptr = this->elementids[pos].lock();
-	if (ptr) {
-		return *ptr;
+	auto it = this->elementids.find(pos);
+	if (it != this->elementids.end()) {
+		return *this->elements[it->second];
 	} else {
+		if (pos == npos) {
+			throw std::out_of_range("Element ID is out of range");
+		}
 		auto newptr = std::make_shared<T>();
 		newptr->id = pos;
-		this->elementids[pos] = newptr;
+		if (pos >= this->nextid) {
+			this->nextid = pos + 1;
+		}
+		this->elementids[pos] = this->elements.size();
 		this->elements.push_back(newptr);
 		return *newptr;
 	}
@@ -77,56 +97,122 @@ T& IndexedMap<T>::operator[](size_t pos) {
 
 template <class T>
 T& IndexedMap<T>::at(size_t pos) {
-	auto ptr = this->elementids.at(pos).lock();
-	if (ptr) {
-		return *ptr;
-	} else {
-		throw std::runtime_error("Couldn't lock element");
-	}
+	return *this->elements[this->elementids.at(pos)];
 }
 
 template <class T>
-typename IndexedMap<T>::iterator IndexedMap<T>::begin() {
-	return this->elementids.begin();
+bool IndexedMap<T>::contains(size_t pos) const {
+	return this->elementids.find(pos) != this->elementids.end();
 }
 
+// Call func with every element that hasn't been erased, in order.
 template <class T>
-typename IndexedMap<T>::iterator IndexedMap<T>::end() {
-	return this->elementids.end();
+template <class F>
+void IndexedMap<T>::each(F func) {
+	for (auto& eleptr : this->elements) {
+		if (eleptr) {
+			func(*eleptr);
+		}
+	}
 }
 
 template <class T>
-typename IndexedMap<T>::iterator IndexedMap<T>::find(size_t index) {
-	return this->elementids.find(index);
+std::shared_ptr<T> IndexedMap<T>::lock(size_t pos) {
+	return this->elements[this->elementids.at(pos)];
 }
 
 template <class T>
-std::shared_ptr<T> IndexedMap<T>::lock(size_t pos) {
-	return this->elementids.at(pos).lock();
+size_t IndexedMap<T>::size() const {
+	return this->elements.size() - this->erased;
+}
+
+// Push a whole block of elements at once.  The elements stay together in
+// one allocation that is shared by all of them, instead of each element
+// getting an allocation of its own.
+template <class T>
+void IndexedMap<T>::append(std::vector<T>&& block) {
+	if (block.size() > std::numeric_limits<size_t>::max() - 1 - this->nextid) {
+		throw std::runtime_error("Too many Element IDs");
+	}
+
+	auto shared = std::make_shared<std::vector<T>>(std::move(block));
+	this->elements.reserve(this->elements.size() + shared->size());
+	this->elementids.reserve(this->elementids.size() + shared->size());
+	for (auto& element : *shared) {
+		element.id = this->nextid;
+		this->elementids[this->nextid] = this->elements.size();
+		this->elements.push_back(std::shared_ptr<T>(shared, &element));
+		this->nextid += 1;
+	}
 }
 
 template <class T>
 void IndexedMap<T>::push_back(T&& element) {
-	if (this->nextid == std::numeric_limits<size_t>::max()) {
+	if (this->nextid == npos - 1) {
 		throw std::runtime_error("Too many Element IDs");
 	}
 
 	element.id = this->nextid;
-	auto eleptr = std::make_shared<T>(std::move(element));
-	this->elementids[this->nextid] = eleptr;
-	this->elements.push_back(std::move(eleptr));
+	this->elementids[this->nextid] = this->elements.size();
+	this->elements.push_back(std::make_shared<T>(std::move(element)));
 	this->nextid += 1;
 }
 
+// Erasing leaves the IDs of every other element alone, and leaves a hole
+// behind until the next compact.  The element's ID is set to npos, so
+// anything still referring to it can tell that it's gone.
 template <class T>
-void IndexedMap<T>::reindex() {
+void IndexedMap<T>::erase(size_t pos) {
+	auto it = this->elementids.find(pos);
+	if (it == this->elementids.end()) {
+		throw std::out_of_range("Couldn't find element to erase");
+	}
+
+	auto& eleptr = this->elements[it->second];
+	eleptr->id = npos;
+	eleptr.reset();
+	this->elementids.erase(it);
+	this->erased += 1;
+}
+
+template <class T>
+void IndexedMap<T>::erase(const std::vector<size_t>& positions) {
+	for (size_t pos : positions) {
+		this->erase(pos);
+	}
+}
+
+// Close up the holes left by erased elements and renumber everything from
+// 0 in order.  Returns a table mapping every old ID to its new ID, with
+// erased or unused IDs mapping to npos.
+template <class T>
+std::vector<size_t> IndexedMap<T>::compact() {
+	std::vector<size_t> remap(this->nextid, npos);
+	size_t live = 0;
+	for (auto& eleptr : this->elements) {
+		if (eleptr) {
+			remap[eleptr->id] = live;
+			eleptr->id = live;
+			this->elements[live] = std::move(eleptr);
+			live += 1;
+		}
+	}
+	this->elements.resize(live);
+
 	this->elementids.clear();
-	this->nextid = 1;
-	for (auto eleptr : this->elements) {
-		eleptr->id = this->nextid;
-		this->elementids[this->nextid] = eleptr;
-		this->nextid += 1;
+	this->elementids.reserve(live);
+	for (size_t i = 0;i < live;i++) {
+		this->elementids[i] = i;
 	}
+	this->nextid = live;
+	this->erased = 0;
+
+	return remap;
+}
+
+template <class T>
+void IndexedMap<T>::reindex() {
+	this->compact();
 }
 
 }
@@ -21,6 +21,7 @@
 #include <lua.h>
 #include <lauxlib.h>
 
+#include "buffer.hh"
 #include "lua.hh"
 #include "lualumps.hh"
 #include "wad.hh"
@@ -40,23 +41,8 @@ static int wad_createLumps(lua_State* L) {
 	return 1;
 }
 
-// Read WAD file data and return the WAD type and lumps
-static int wad_unpackwad(lua_State* L) {
-	// Read WAD file data into stringstream.
-	size_t len;
-	const char* buffer = luaL_checklstring(L, 1, &len);
-	std::string buffer_string(buffer, len);
-	std::stringstream buffer_stream;
-	buffer_stream << buffer_string;
-
-	// Stream the data into Wad class to get our WAD type and lumps.
-	Wad wad;
-	try {
-		buffer_stream >> wad;
-	} catch (const std::runtime_error& e) {
-		return luaL_error(L, e.what());
-	}
-
+// Push the lumps of a WAD, followed by its type.
+static int pushwad(lua_State* L, Wad& wad) {
 	// Lump data
 	auto ptr = static_cast<std::shared_ptr<Directory>*>(lua_newuserdata(L, sizeof(std::shared_ptr<Directory>)));
 	new(ptr) std::shared_ptr<Directory>(wad.getLumps());
@@ -74,14 +60,64 @@ static int wad_unpackwad(lua_State* L) {
 	return 2;
 }
 
+// Open a WAD file on disk and return the lumps and WAD type.  Lump data
+// is read straight from the file once it's needed.
+static int wad_openwad(lua_State* L) {
+	std::string filename = Lua::checkstring(L, 1);
+
+	Wad wad;
+	try {
+		wad.open(filename);
+	} catch (const std::exception& e) {
+		return luaL_error(L, e.what());
+	}
+
+	return pushwad(L, wad);
+}
+
+// Open a ZIP file on disk and return the lumps contained therein.  Files
+// are inflated straight from the ZIP once they're needed.
+static int wad_openzip(lua_State* L) {
+	std::string filename = Lua::checkstring(L, 1);
+
+	Zip zip;
+	try {
+		zip.open(filename);
+	} catch (const std::exception& e) {
+		return luaL_error(L, e.what());
+	}
+
+	auto ptr = static_cast<std::shared_ptr<Directory>*>(lua_newuserdata(L, sizeof(std::shared_ptr<Directory>)));
+	new(ptr) std::shared_ptr<Directory>(zip.getLumps());
+	luaL_setmetatable(L, WADmake::META_LUMPS);
+
+	return 1;
+}
+
+// Read WAD file data and return the WAD type and lumps
+static int wad_unpackwad(lua_State* L) {
+	// Read WAD file data straight out of the Lua string.
+	size_t len;
+	const char* buffer = luaL_checklstring(L, 1, &len);
+	MemoryStream buffer_stream(buffer, len);
+
+	// Stream the data into Wad class to get our WAD type and lumps.
+	Wad wad;
+	try {
+		buffer_stream >> wad;
+	} catch (const std::exception& e) {
+		return luaL_error(L, e.what());
+	}
+
+	return pushwad(L, wad);
+}
+
 // Read Zip file data and return lumps contained therin
 static int wad_unpackzip(lua_State* L) {
-	// Read Zip file data into stringstream.
+	// Read Zip file data straight out of the Lua string.
 	size_t len;
 	const char* buffer = luaL_checklstring(L, 1, &len);
-	std::string buffer_string(buffer, len);
-	std::stringstream buffer_stream;
-	buffer_stream << buffer_string;
+	MemoryStream buffer_stream(buffer, len);
 
 	// Stream the data into Zip class to get our lumps.
 	Zip zip;
@@ -152,11 +188,11 @@ static int ulumps_get(lua_State* L) {
 		return 1;
 	}
 
-	Lump lump = ptr->at(index - 1);
-	const std::string name = lump.getName();
-	const std::string data = lump.getData();
+	const Lump& lump = ptr->at(index - 1);
+	const std::string& name = lump.getName();
+	const LumpData& data = lump.getData();
 
-	lua_pushstring(L, name.c_str());
+	lua_pushlstring(L, name.data(), name.size());
 	lua_pushlstring(L, data.data(), data.size());
 
 	return 2;
@@ -190,6 +226,21 @@ static int ulumps_insert(lua_State* L) {
 	return 0;
 }
 
+// List the names of every map in the Lumps, in order.
+static int ulumps_maps(lua_State* L) {
+	auto ptr = *static_cast<std::shared_ptr<Directory>*>(luaL_checkudata(L, 1, WADmake::META_LUMPS));
+
+	const std::vector<MapLocation>& locations = ptr->maps();
+	lua_createtable(L, locations.size(), 0);
+	for (size_t i = 0;i < locations.size();i++) {
+		const std::string& name = locations[i].name;
+		lua_pushlstring(L, name.data(), name.size());
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	return 1;
+}
+
 // Remove a lump from a particular position
 static int ulumps_remove(lua_State* L) {
 	auto ptr = *static_cast<std::shared_ptr<Directory>*>(luaL_checkudata(L, 1, WADmake::META_LUMPS));
@@ -226,7 +277,7 @@ static int ulumps_set(lua_State* L) {
 
 	if (nametype == LUA_TNIL || datatype == LUA_TNONE) {
 		// If one of the parameters is missing, we need the original
-		Lump lump = std::move(ptr->at(index - 1));
+		Lump lump = ptr->at(index - 1);
 
 		if (nametype == LUA_TSTRING) {
 			lump.setName(Lua::tostring(L, 3));
@@ -235,14 +286,14 @@ static int ulumps_set(lua_State* L) {
 			lump.setData(Lua::tolstring(L, 4));
 		}
 
-		ptr->at(index - 1) = std::move(lump);
+		ptr->set_at(index - 1, std::move(lump));
 	} else {
 		// Both parameters, so a brand new lump.
 		Lump lump;
 		lump.setName(Lua::tostring(L, 3));
 		lump.setData(Lua::tolstring(L, 4));
 
-		ptr->at(index - 1) = std::move(lump);
+		ptr->set_at(index - 1, std::move(lump));
 	}
 
 	return 0;
@@ -274,10 +325,19 @@ static int ulumps_packzip(lua_State* L) {
 	Zip zip;
 	zip.setLumps(ptr);
 
+	// Optional number of threads to compress with
+	if (lua_type(L, 2) != LUA_TNONE && lua_type(L, 2) != LUA_TNIL) {
+		lua_Integer workers = luaL_checkinteger(L, 2);
+		if (workers < 0) {
+			luaL_argerror(L, 2, "must not be negative");
+		}
+		zip.setWorkers(static_cast<size_t>(workers));
+	}
+
 	std::stringstream output;
 	try {
 		output << zip;
-	} catch (const std::runtime_error& e) {
+	} catch (const std::exception& e) {
 		return luaL_error(L, e.what());
 	}
 
@@ -286,6 +346,49 @@ static int ulumps_packzip(lua_State* L) {
 	return 1;
 }
 
+// Write a WAD file straight to disk
+static int ulumps_writewad(lua_State* L) {
+	auto ptr = *static_cast<std::shared_ptr<Directory>*>(luaL_checkudata(L, 1, WADmake::META_LUMPS));
+	std::string filename = Lua::checkstring(L, 2);
+
+	Wad wad(Wad::Type::PWAD);
+	wad.setLumps(ptr);
+
+	try {
+		wad.save(filename);
+	} catch (const std::runtime_error& e) {
+		return luaL_error(L, e.what());
+	}
+
+	return 0;
+}
+
+// Write a ZIP file straight to disk
+static int ulumps_writezip(lua_State* L) {
+	auto ptr = *static_cast<std::shared_ptr<Directory>*>(luaL_checkudata(L, 1, WADmake::META_LUMPS));
+	std::string filename = Lua::checkstring(L, 2);
+
+	Zip zip;
+	zip.setLumps(ptr);
+
+	// Optional number of threads to compress with
+	if (lua_type(L, 3) != LUA_TNONE && lua_type(L, 3) != LUA_TNIL) {
+		lua_Integer workers = luaL_checkinteger(L, 3);
+		if (workers < 0) {
+			luaL_argerror(L, 3, "must not be negative");
+		}
+		zip.setWorkers(static_cast<size_t>(workers));
+	}
+
+	try {
+		zip.save(filename);
+	} catch (const std::exception& e) {
+		return luaL_error(L, e.what());
+	}
+
+	return 0;
+}
+
 // Garbage-collect Lumps
 static int ulumps_gc(lua_State* L) {
 	auto ptr = static_cast<std::shared_ptr<Directory>*>(luaL_checkudata(L, 1, WADmake::META_LUMPS));
@@ -317,10 +420,13 @@ static const luaL_Reg ulumps_functions[] = {
 	{"find", ulumps_find},
 	{"get", ulumps_get},
 	{"insert", ulumps_insert},
+	{"maps", ulumps_maps},
 	{"remove", ulumps_remove},
 	{"set", ulumps_set},
 	{"packwad", ulumps_packwad},
 	{"packzip", ulumps_packzip},
+	{"writewad", ulumps_writewad},
+	{"writezip", ulumps_writezip},
 	{"__gc", ulumps_gc},
 	{"__len", ulumps_len},
 	{"__tostring", ulumps_tostring},
@@ -330,6 +436,8 @@ static const luaL_Reg ulumps_functions[] = {
 // Functions that go in the top-level wad package
 static const luaL_Reg wad_functions[] = {
 	{ "createLumps", wad_createLumps },
+	{ "openwad", wad_openwad },
+	{ "openzip", wad_openzip },
 	{ "unpackwad", wad_unpackwad },
 	{ "unpackzip", wad_unpackzip },
 	{ NULL, NULL }
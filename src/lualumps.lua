@@ -29,37 +29,16 @@ function Lumps.move(source, istart, iend, ito, dest)
 	end
 end
 
-function Lumps:writewad(filename)
-	local file = io.open(filename, 'wb')
-	local data = self:packwad()
-	file:write(data)
-	file:close()
-end
-
-function Lumps:writezip(filename)
-	local file = io.open(filename, 'wb')
-	local data = self:packzip()
-	file:write(data)
-	file:close()
-end
-
 -- Additional functions for `wad` module
 local mod = {}
 
+-- Older names for openwad and openzip
 function mod.readwad(filename)
-	local file = io.open(filename, 'rb')
-	local data = file:read('a')
-	local lumps, type = wad.unpackwad(data)
-	file:close()
-	return lumps, type
+	return wad.openwad(filename)
 end
 
 function mod.readzip(filename)
-	local file = io.open(filename, 'rb')
-	local data = file:read('a')
-	local lumps = wad.unpackzip(data)
-	file:close()
-	return lumps
+	return wad.openzip(filename)
 end
 
 return mod, Lumps
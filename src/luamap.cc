@@ -16,20 +16,54 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <sstream>
+#include <cstring>
 
 #include <lua.h>
 #include <lauxlib.h>
 
+#include "blockmap.hh"
+#include "buffer.hh"
+#include "densemap.hh"
 #include "directory.hh"
 #include "lua.hh"
 #include "lualumps.hh"
 #include "luamap.hh"
 #include "map.hh"
+#include "nodebuilder.hh"
+#include "optimizer.hh"
+#include "reject.hh"
+#include "spatialindex.hh"
+#include "udmf.hh"
 
 namespace WADmake {
 
 const char META_DOOMMAP[] = "DoomMap";
+const char META_HEXENMAP[] = "HexenMap";
+const char META_SPATIALINDEX[] = "SpatialIndex";
+
+// Maps of each format get their own userdata, though most of their methods
+// are shared.
+template <class M> struct MapMetatable;
+
+template <> struct MapMetatable<DoomMap> {
+	static const char* name() { return WADmake::META_DOOMMAP; }
+};
+
+template <> struct MapMetatable<HexenMap> {
+	static const char* name() { return WADmake::META_HEXENMAP; }
+};
+
+template <class M>
+static std::shared_ptr<M> checkmap(lua_State* L, int arg) {
+	return *static_cast<std::shared_ptr<M>*>(luaL_checkudata(L, arg, MapMetatable<M>::name()));
+}
+
+template <class M>
+static void pushmap(lua_State* L, std::shared_ptr<M>&& map) {
+	auto ptr = static_cast<std::shared_ptr<M>*>(lua_newuserdata(L, sizeof(std::shared_ptr<M>)));
+	new(ptr) std::shared_ptr<M>(std::move(map));
+	luaL_setmetatable(L, MapMetatable<M>::name());
+}
 
 static int wad_createDoomMap(lua_State* L) {
 	auto ptr = static_cast<std::shared_ptr<DoomMap>*>(lua_newuserdata(L, sizeof(std::shared_ptr<DoomMap>)));
@@ -38,62 +72,265 @@ static int wad_createDoomMap(lua_State* L) {
 	return 1;
 }
 
-// Given Lumps and an index (optional), unpack map data into a map userdata.
+static int wad_createHexenMap(lua_State* L) {
+	pushmap(L, std::shared_ptr<HexenMap>(new HexenMap()));
+	return 1;
+}
+
+// Data of the named lump of a map.  Missing lumps that can be rebuilt
+// come back empty.
+static LumpData maplumpdata(const Directory& lumps, const MapLocation& location, const char* name, bool required) {
+	bool success;
+	size_t index;
+	std::tie(success, index) = location.find(name);
+	if (!success) {
+		if (required) {
+			throw std::runtime_error(std::string("Map ") + location.name + " has no " + name);
+		}
+		return LumpData();
+	}
+	return lumps.at(index).getData();
+}
+
+// Hand the binary lumps of a map over to it, wherever they are found.  The
+// lumps are only decoded once the map needs them.
+template <class M>
+static void unpackmaplumps(const Directory& lumps, const MapLocation& location, M& map) {
+	map.setThingsLump(maplumpdata(lumps, location, "THINGS", true));
+	map.setLinedefsLump(maplumpdata(lumps, location, "LINEDEFS", true));
+	map.setSidedefsLump(maplumpdata(lumps, location, "SIDEDEFS", true));
+	map.setVertexesLump(maplumpdata(lumps, location, "VERTEXES", true));
+	map.setSegs(maplumpdata(lumps, location, "SEGS", false).str());
+	map.setSsectors(maplumpdata(lumps, location, "SSECTORS", false).str());
+	map.setNodes(maplumpdata(lumps, location, "NODES", false).str());
+	map.setSectorsLump(maplumpdata(lumps, location, "SECTORS", true));
+	map.setReject(maplumpdata(lumps, location, "REJECT", false).str());
+	map.setBlockmap(maplumpdata(lumps, location, "BLOCKMAP", false).str());
+}
+
+// Find the map picked out by the given argument, which is either the name
+// of the map or the index of its header.  Without the argument, the first
+// map in the lumps is used.
+static const MapLocation& checkmaplocation(lua_State* L, int arg, const Directory& lumps) {
+	const std::vector<MapLocation>& locations = lumps.maps();
+	bool success = !locations.empty();
+	size_t position = 0;
+	if (lua_type(L, arg) == LUA_TSTRING) {
+		std::tie(success, position) = lumps.find_map(lua_tostring(L, arg));
+		if (!success) {
+			luaL_error(L, "Map %s not found", lua_tostring(L, arg));
+		}
+	} else if (lua_type(L, arg) != LUA_TNONE && lua_type(L, arg) != LUA_TNIL) {
+		lua_Integer index = luaL_checkinteger(L, arg);
+		if (index >= 1) {
+			std::tie(success, position) = lumps.find_map_at(index - 1);
+		} else {
+			success = false;
+		}
+		if (!success) {
+			luaL_error(L, "No map at index %d", static_cast<int>(index));
+		}
+	} else if (!success) {
+		luaL_error(L, "Lumps contain no maps");
+	}
+	return locations[position];
+}
+
+// Given Lumps and a map name or index (optional), unpack map data into a map
+// userdata.  Hexen maps are told apart by their BEHAVIOR lump.
 static int wad_unpackmap(lua_State* L) {
 	auto lumps = *static_cast<std::shared_ptr<Directory>*>(luaL_checkudata(L, 1, WADmake::META_LUMPS));
+	const MapLocation& location = checkmaplocation(L, 2, *lumps);
+
+	bool hexen;
+	size_t behavior;
+	std::tie(hexen, behavior) = location.find("BEHAVIOR");
+	std::shared_ptr<DoomMap> doommap;
+	std::shared_ptr<HexenMap> hexenmap;
+	try {
+		if (hexen) {
+			hexenmap.reset(new HexenMap());
+			unpackmaplumps(*lumps, location, *hexenmap);
+			hexenmap->setBehavior(lumps->at(behavior).getData().str());
+		} else {
+			doommap.reset(new DoomMap());
+			unpackmaplumps(*lumps, location, *doommap);
+		}
+	} catch (const std::runtime_error& e) {
+		return luaL_error(L, e.what());
+	}
+
+	if (hexen) {
+		pushmap(L, std::move(hexenmap));
+	} else {
+		pushmap(L, std::move(doommap));
+	}
+	return 1;
+}
+
+// Given Lumps and a map name or index (optional), build a BLOCKMAP lump
+// straight from the map's lumps without unpacking them into a map.
+// Identical block lists are shared unless the third parameter is false.
+static int wad_buildblockmap(lua_State* L) {
+	auto lumps = *static_cast<std::shared_ptr<Directory>*>(luaL_checkudata(L, 1, WADmake::META_LUMPS));
+	const MapLocation& location = checkmaplocation(L, 2, *lumps);
+	if (std::get<0>(location.find("BEHAVIOR"))) {
+		return luaL_error(L, "Map %s is not a Doom map", location.name.c_str());
+	}
 
-	size_t index = 1;
-	if (lua_isinteger(L, 2)) {
-		index = lua_tointeger(L, 2);
+	BlockmapBuilder builder;
+	if (lua_type(L, 3) != LUA_TNONE && lua_type(L, 3) != LUA_TNIL) {
+		builder.setCompress(lua_toboolean(L, 3) != 0);
 	}
 
-	DoomThings things;
-	DoomLinedefs linedefs;
-	Sidedefs sidedefs;
-	Vertexes vertexes;
-	Sectors sectors;
-	std::string segs, ssectors, nodes, reject, blockmap;
+	std::string blockmap;
 	try {
-		std::stringstream vertexesbuffer(lumps->at(index + 3).getData());
-		vertexes.read(vertexesbuffer);
-		std::stringstream sectorsbuffer(lumps->at(index + 7).getData());
-		sectors.read(sectorsbuffer);
-		std::stringstream sidedefsbuffer(lumps->at(index + 2).getData());
-		sidedefs.read(sidedefsbuffer, sectors);
-		std::stringstream linedefsbuffer(lumps->at(index + 1).getData());
-		linedefs.read(linedefsbuffer, vertexes, sidedefs);
-		std::stringstream thingsbuffer(lumps->at(index).getData());
-		things.read(thingsbuffer);
-		std::stringstream segsbuffer(lumps->at(index + 4).getData());
-		segs = segsbuffer.str();
-		std::stringstream ssectorsbuffer(lumps->at(index + 5).getData());
-		ssectors = segsbuffer.str();
-		std::stringstream nodesbuffer(lumps->at(index + 6).getData());
-		nodes = segsbuffer.str();
-		std::stringstream rejectbuffer(lumps->at(index + 8).getData());
-		reject = segsbuffer.str();
-		std::stringstream blockmapbuffer(lumps->at(index + 9).getData());
-		blockmap = segsbuffer.str();
+		// Lumps are read in the order DenseMap needs to check references.
+		DenseMap map;
+		const char* names[] = { "VERTEXES", "SECTORS", "SIDEDEFS", "LINEDEFS" };
+		BinaryReader& (DenseMap::*readers[])(BinaryReader&) = {
+			&DenseMap::readVertexes, &DenseMap::readSectors,
+			&DenseMap::readSidedefs, &DenseMap::readLinedefs
+		};
+		for (size_t i = 0;i < 4;i++) {
+			LumpData data = maplumpdata(*lumps, location, names[i], true);
+			BinaryReader reader(data.data(), data.size());
+			(map.*readers[i])(reader);
+		}
+		blockmap = builder.build(map);
+	} catch (const std::exception& e) {
+		return luaL_error(L, e.what());
+	}
+
+	lua_pushlstring(L, blockmap.data(), blockmap.size());
+	return 1;
+}
+
+// Given Lumps and a map name or index (optional), unpack a UDMF map's
+// TEXTMAP into a map userdata.
+static int wad_unpackudmf(lua_State* L) {
+	auto lumps = *static_cast<std::shared_ptr<Directory>*>(luaL_checkudata(L, 1, WADmake::META_LUMPS));
+	const MapLocation& location = checkmaplocation(L, 2, *lumps);
+
+	std::shared_ptr<DoomMap> map(new DoomMap());
+	try {
+		LumpData data = maplumpdata(*lumps, location, "TEXTMAP", true);
+		ReadTextmap(data.data(), data.size(), *map);
 	} catch (const std::runtime_error& e) {
-		lua_pushstring(L, e.what());
-		throw e;
+		return luaL_error(L, e.what());
 	}
 
-	auto ptr = static_cast<std::shared_ptr<DoomMap>*>(lua_newuserdata(L, sizeof(std::shared_ptr<DoomMap>)));
-	new(ptr) std::shared_ptr<DoomMap>(new DoomMap());
-	luaL_setmetatable(L, WADmake::META_DOOMMAP);
+	pushmap(L, std::move(map));
+	return 1;
+}
+
+// Rebuild the map's blockmap.  Identical block lists are shared unless the
+// optional parameter is false.
+static int udoommap_buildblockmap(lua_State* L) {
+	auto ptr = *static_cast<std::shared_ptr<DoomMap>*>(luaL_checkudata(L, 1, WADmake::META_DOOMMAP));
+
+	BlockmapBuilder builder;
+	if (lua_type(L, 2) != LUA_TNONE && lua_type(L, 2) != LUA_TNIL) {
+		builder.setCompress(lua_toboolean(L, 2) != 0);
+	}
+
+	try {
+		builder.build(*ptr);
+	} catch (const std::runtime_error& e) {
+		return luaL_error(L, e.what());
+	}
+
+	return 0;
+}
+
+// Rebuild the map's nodes, optionally with a given number of threads.
+static int udoommap_buildnodes(lua_State* L) {
+	auto ptr = *static_cast<std::shared_ptr<DoomMap>*>(luaL_checkudata(L, 1, WADmake::META_DOOMMAP));
+
+	NodeBuilder builder;
+	if (lua_type(L, 2) != LUA_TNONE && lua_type(L, 2) != LUA_TNIL) {
+		lua_Integer workers = luaL_checkinteger(L, 2);
+		if (workers < 0) {
+			luaL_argerror(L, 2, "must not be negative");
+		}
+		builder.setWorkers(static_cast<size_t>(workers));
+	}
+
+	try {
+		builder.build(*ptr);
+	} catch (const std::runtime_error& e) {
+		return luaL_error(L, e.what());
+	}
+
+	return 0;
+}
+
+// Rebuild the map's reject table.  The optional mode is either "sight",
+// the default, or "visible", followed by an optional number of threads.
+static int udoommap_buildreject(lua_State* L) {
+	static const char* const modes[] = { "visible", "sight", NULL };
+	auto ptr = *static_cast<std::shared_ptr<DoomMap>*>(luaL_checkudata(L, 1, WADmake::META_DOOMMAP));
+
+	RejectBuilder builder;
+	if (luaL_checkoption(L, 2, "sight", modes) == 0) {
+		builder.setMode(RejectBuilder::Mode::VISIBLE);
+	}
+	if (lua_type(L, 3) != LUA_TNONE && lua_type(L, 3) != LUA_TNIL) {
+		lua_Integer workers = luaL_checkinteger(L, 3);
+		if (workers < 0) {
+			luaL_argerror(L, 3, "must not be negative");
+		}
+		builder.setWorkers(static_cast<size_t>(workers));
+	}
+
+	try {
+		builder.build(*ptr);
+	} catch (const std::runtime_error& e) {
+		return luaL_error(L, e.what());
+	}
 
-	(*ptr)->setThings(std::move(things));
-	(*ptr)->setLinedefs(std::move(linedefs));
-	(*ptr)->setSidedefs(std::move(sidedefs));
-	(*ptr)->setVertexes(std::move(vertexes));
-	(*ptr)->setSegs(std::move(segs));
-	(*ptr)->setSsectors(std::move(ssectors));
-	(*ptr)->setNodes(std::move(nodes));
-	(*ptr)->setSectors(std::move(sectors));
-	(*ptr)->setReject(std::move(reject));
-	(*ptr)->setBlockmap(std::move(blockmap));
+	return 0;
+}
+
+// Weld vertexes, merge duplicate linedefs and drop anything left unused.
+// The optional parameter is how far apart vertexes can be and still be
+// welded.
+static int udoommap_optimize(lua_State* L) {
+	auto ptr = *static_cast<std::shared_ptr<DoomMap>*>(luaL_checkudata(L, 1, WADmake::META_DOOMMAP));
+
+	MapOptimizer optimizer;
+	if (lua_type(L, 2) != LUA_TNONE && lua_type(L, 2) != LUA_TNIL) {
+		lua_Integer tolerance = luaL_checkinteger(L, 2);
+		if (tolerance < 0) {
+			luaL_argerror(L, 2, "must not be negative");
+		}
+		optimizer.setTolerance(static_cast<int32_t>(tolerance));
+	}
+
+	try {
+		optimizer.optimize(*ptr);
+	} catch (const std::runtime_error& e) {
+		return luaL_error(L, e.what());
+	}
+
+	return 0;
+}
 
+// Index the map's vertexes, linedefs and things by where they are.  The
+// index doesn't see changes made to the map after it was created.
+static int udoommap_spatialindex(lua_State* L) {
+	auto ptr = *static_cast<std::shared_ptr<DoomMap>*>(luaL_checkudata(L, 1, WADmake::META_DOOMMAP));
+
+	std::shared_ptr<SpatialIndex> index;
+	try {
+		index.reset(new SpatialIndex(*ptr));
+	} catch (const std::runtime_error& e) {
+		return luaL_error(L, e.what());
+	}
+
+	auto udata = static_cast<std::shared_ptr<SpatialIndex>*>(lua_newuserdata(L, sizeof(std::shared_ptr<SpatialIndex>)));
+	new(udata) std::shared_ptr<SpatialIndex>(std::move(index));
+	luaL_setmetatable(L, WADmake::META_SPATIALINDEX);
 	return 1;
 }
 
@@ -109,10 +346,17 @@ static int udoommap_getlinedef(lua_State* L) {
 		return 1;
 	}
 
+	// References that didn't resolve when the lump was decoded are empty.
+	auto startvertex = linedef.startvertex.lock();
+	auto endvertex = linedef.endvertex.lock();
+	if (!startvertex || !endvertex) {
+		return luaL_error(L, "Linedef %d is missing a vertex", static_cast<int>(index));
+	}
+
 	lua_newtable(L);
-	lua_pushinteger(L, linedef.startvertex.lock()->id + 1);
+	lua_pushinteger(L, startvertex->id + 1);
 	lua_setfield(L, -2, "startvertex");
-	lua_pushinteger(L, linedef.endvertex.lock()->id + 1);
+	lua_pushinteger(L, endvertex->id + 1);
 	lua_setfield(L, -2, "endvertex");
 	lua_pushinteger(L, linedef.flags.to_ulong());
 	lua_setfield(L, -2, "flags");
@@ -134,8 +378,9 @@ static int udoommap_getlinedef(lua_State* L) {
 	return 1;
 }
 
-static int udoommap_getsector(lua_State* L) {
-	auto ptr = *static_cast<std::shared_ptr<DoomMap>*>(luaL_checkudata(L, 1, WADmake::META_DOOMMAP));
+template <class M>
+static int umap_getsector(lua_State* L) {
+	auto ptr = checkmap<M>(L, 1);
 
 	size_t index = luaL_checkinteger(L, 2);
 	Sector sector;
@@ -165,8 +410,9 @@ static int udoommap_getsector(lua_State* L) {
 	return 1;
 }
 
-static int udoommap_getsidedef(lua_State* L) {
-	auto ptr = *static_cast<std::shared_ptr<DoomMap>*>(luaL_checkudata(L, 1, WADmake::META_DOOMMAP));
+template <class M>
+static int umap_getsidedef(lua_State* L) {
+	auto ptr = checkmap<M>(L, 1);
 
 	size_t index = luaL_checkinteger(L, 2);
 	Sidedef sidedef;
@@ -188,7 +434,11 @@ static int udoommap_getsidedef(lua_State* L) {
 	lua_setfield(L, -2, "middletex");
 	lua_pushstring(L, sidedef.lowertex.c_str());
 	lua_setfield(L, -2, "lowertex");
-	lua_pushinteger(L, sidedef.sector.lock()->id + 1);
+	auto sector = sidedef.sector.lock();
+	if (!sector) {
+		return luaL_error(L, "Sidedef %d is missing its sector", static_cast<int>(index));
+	}
+	lua_pushinteger(L, sector->id + 1);
 	lua_setfield(L, -2, "sector");
 
 	return 1;
@@ -221,8 +471,9 @@ static int udoommap_getthing(lua_State* L) {
 	return 1;
 }
 
-static int udoommap_getvertex(lua_State* L) {
-	auto ptr = *static_cast<std::shared_ptr<DoomMap>*>(luaL_checkudata(L, 1, WADmake::META_DOOMMAP));
+template <class M>
+static int umap_getvertex(lua_State* L) {
+	auto ptr = checkmap<M>(L, 1);
 
 	size_t index = luaL_checkinteger(L, 2);
 	Vertex vertex;
@@ -242,12 +493,39 @@ static int udoommap_getvertex(lua_State* L) {
 	return 1;
 }
 
-static int udoommap_packmap(lua_State* L) {
-	auto ptr = *static_cast<std::shared_ptr<DoomMap>*>(luaL_checkudata(L, 1, WADmake::META_DOOMMAP));
+// Lumps that only some formats have, which go after the BLOCKMAP.
+static void packextralumps(Directory&, DoomMap&) { }
+
+static void packextralumps(Directory& dir, HexenMap& map) {
+	Lump behavior;
+	behavior.setName("BEHAVIOR");
+	std::string behaviorbuffer = map.getBehavior();
+	behavior.setData(std::move(behaviorbuffer));
+	dir.push_back(std::move(behavior));
+}
+
+template <class M>
+static int umap_packmap(lua_State* L) {
+	auto ptr = checkmap<M>(L, 1);
 
 	// Check for map name parameter
 	std::string name = Lua::checkstring(L, 2);
 
+	// IDs have to line up with record positions before anything is written.
+	// Lumps that were never decoded are checked here, so a dangling
+	// reference can still turn up.
+	LumpData thingsdata, linedefsdata, sidedefsdata, vertexesdata, sectorsdata;
+	try {
+		ptr->compact();
+		thingsdata = ptr->getThingsLump();
+		linedefsdata = ptr->getLinedefsLump();
+		sidedefsdata = ptr->getSidedefsLump();
+		vertexesdata = ptr->getVertexesLump();
+		sectorsdata = ptr->getSectorsLump();
+	} catch (const std::runtime_error& e) {
+		return luaL_error(L, e.what());
+	}
+
 	// Create Directory for map data
 	auto dir = static_cast<std::shared_ptr<Directory>*>(lua_newuserdata(L, sizeof(std::shared_ptr<Directory>)));
 	new(dir) std::shared_ptr<Directory>(new Directory());
@@ -261,33 +539,25 @@ static int udoommap_packmap(lua_State* L) {
 	// THINGS
 	Lump things;
 	things.setName("THINGS");
-	std::stringstream thingsbuffer;
-	ptr->getThings().write(thingsbuffer);
-	things.setData(thingsbuffer.str());
+	things.setData(std::move(thingsdata));
 	(*dir)->push_back(std::move(things));
 
 	// LINEDEFS
 	Lump linedefs;
 	linedefs.setName("LINEDEFS");
-	std::stringstream linedefsbuffer;
-	ptr->getLinedefs().write(linedefsbuffer);
-	linedefs.setData(linedefsbuffer.str());
+	linedefs.setData(std::move(linedefsdata));
 	(*dir)->push_back(std::move(linedefs));
 
 	// SIDEDEFS
 	Lump sidedefs;
 	sidedefs.setName("SIDEDEFS");
-	std::stringstream sidedefsbuffer;
-	ptr->getSidedefs().write(sidedefsbuffer);
-	sidedefs.setData(sidedefsbuffer.str());
+	sidedefs.setData(std::move(sidedefsdata));
 	(*dir)->push_back(std::move(sidedefs));
 
 	// VERTEXES
 	Lump vertexes;
 	vertexes.setName("VERTEXES");
-	std::stringstream vertexesbuffer;
-	ptr->getVertexes().write(vertexesbuffer);
-	vertexes.setData(vertexesbuffer.str());
+	vertexes.setData(std::move(vertexesdata));
 	(*dir)->push_back(std::move(vertexes));
 
 	// SEGS
@@ -314,9 +584,7 @@ static int udoommap_packmap(lua_State* L) {
 	// SECTORS
 	Lump sectors;
 	sectors.setName("SECTORS");
-	std::stringstream sectorsbuffer;
-	ptr->getSectors().write(sectorsbuffer);
-	sectors.setData(sectorsbuffer.str());
+	sectors.setData(std::move(sectorsdata));
 	(*dir)->push_back(std::move(sectors));
 
 	// REJECT
@@ -330,9 +598,44 @@ static int udoommap_packmap(lua_State* L) {
 	Lump blockmap;
 	blockmap.setName("BLOCKMAP");
 	std::string blockmapbuffer = ptr->getBlockmap();
-	reject.setData(std::move(blockmapbuffer));
+	blockmap.setData(std::move(blockmapbuffer));
 	(*dir)->push_back(std::move(blockmap));
 
+	packextralumps(**dir, *ptr);
+
+	return 1;
+}
+
+// Pack the map into UDMF lumps, given a map name.
+static int udoommap_packudmf(lua_State* L) {
+	auto ptr = *static_cast<std::shared_ptr<DoomMap>*>(luaL_checkudata(L, 1, WADmake::META_DOOMMAP));
+
+	std::string name = Lua::checkstring(L, 2);
+
+	std::string data;
+	try {
+		data = WriteTextmap(*ptr);
+	} catch (const std::runtime_error& e) {
+		return luaL_error(L, e.what());
+	}
+
+	auto dir = static_cast<std::shared_ptr<Directory>*>(lua_newuserdata(L, sizeof(std::shared_ptr<Directory>)));
+	new(dir) std::shared_ptr<Directory>(new Directory());
+	luaL_setmetatable(L, WADmake::META_LUMPS);
+
+	Lump header;
+	header.setName(std::move(name));
+	(*dir)->push_back(std::move(header));
+
+	Lump textmap;
+	textmap.setName("TEXTMAP");
+	textmap.setData(std::move(data));
+	(*dir)->push_back(std::move(textmap));
+
+	Lump endmap;
+	endmap.setName("ENDMAP");
+	(*dir)->push_back(std::move(endmap));
+
 	return 1;
 }
 
@@ -385,8 +688,9 @@ static int udoommap_setlinedef(lua_State* L) {
 	return 0;
 }
 
-static int udoommap_setsector(lua_State* L) {
-	auto ptr = *static_cast<std::shared_ptr<DoomMap>*>(luaL_checkudata(L, 1, WADmake::META_DOOMMAP));
+template <class M>
+static int umap_setsector(lua_State* L) {
+	auto ptr = checkmap<M>(L, 1);
 
 	size_t index = luaL_checkinteger(L, 2);
 	Sector& sector = ptr->getSectors()[index - 1];
@@ -436,8 +740,9 @@ static int udoommap_setsector(lua_State* L) {
 	return 0;
 }
 
-static int udoommap_setsidedef(lua_State* L) {
-	auto ptr = *static_cast<std::shared_ptr<DoomMap>*>(luaL_checkudata(L, 1, WADmake::META_DOOMMAP));
+template <class M>
+static int umap_setsidedef(lua_State* L) {
+	auto ptr = checkmap<M>(L, 1);
 
 	size_t index = luaL_checkinteger(L, 2);
 	Sidedef& sidedef = ptr->getSidedefs()[index - 1];
@@ -508,15 +813,16 @@ static int udoommap_setthing(lua_State* L) {
 
 	lua_getfield(L, 3, "type");
 	if (!lua_isnil(L, -1)) {
-		thing.angle = lua_tointeger(L, -1);
+		thing.type = lua_tointeger(L, -1);
 	}
 	lua_pop(L, 1);
 
 	return 0;
 }
 
-static int udoommap_setvertex(lua_State* L) {
-	auto ptr = *static_cast<std::shared_ptr<DoomMap>*>(luaL_checkudata(L, 1, WADmake::META_DOOMMAP));
+template <class M>
+static int umap_setvertex(lua_State* L) {
+	auto ptr = checkmap<M>(L, 1);
 
 	size_t index = luaL_checkinteger(L, 2);
 	Vertex& vertex = ptr->getVertexes()[index - 1];
@@ -536,34 +842,676 @@ static int udoommap_setvertex(lua_State* L) {
 	return 0;
 }
 
-// Garbage-collect Lumps
-static int udoommap_gc(lua_State* L) {
-	auto ptr = static_cast<std::shared_ptr<DoomMap>*>(luaL_checkudata(L, 1, WADmake::META_DOOMMAP));
+// Read an integer field value, without letting anything that isn't a number
+// quietly become 0.
+static lua_Integer tofieldinteger(lua_State* L, int index) {
+	int isnum;
+	lua_Integer value = lua_tointegerx(L, index, &isnum);
+	if (!isnum) {
+		luaL_error(L, "Expected an integer, got %s", luaL_typename(L, index));
+	}
+	return value;
+}
+
+static std::string tofieldstring(lua_State* L, int index) {
+	if (lua_type(L, index) != LUA_TSTRING) {
+		luaL_error(L, "Expected a string, got %s", luaL_typename(L, index));
+	}
+	size_t len;
+	const char* str = lua_tolstring(L, index, &len);
+	return std::string(str, len);
+}
+
+// Push a reference to another element as its 1-indexed ID, or 0 if there's
+// nothing there.
+template <class T>
+static void pushfieldref(lua_State* L, const std::weak_ptr<T>& ref) {
+	auto ptr = ref.lock();
+	lua_pushinteger(L, ptr ? ptr->id + 1 : 0);
+}
+
+template <class T>
+static void tofieldref(lua_State* L, int index, IndexedMap<T>& elements, std::weak_ptr<T>& ref) {
+	lua_Integer id = tofieldinteger(L, index);
+	if (id == 0) {
+		ref.reset();
+	} else if (id > 0 && elements.contains(id - 1)) {
+		ref = elements.lock(id - 1);
+	} else {
+		luaL_error(L, "Reference to missing element %d", static_cast<int>(id));
+	}
+}
+
+// A single field of a DoomMap element, for accessors that work on every
+// element at once.  References are 1-indexed, with 0 standing for none.
+template <class E>
+struct MapField {
+	const char* name;
+	void (*push)(lua_State* L, E& element);
+	void (*set)(lua_State* L, int index, DoomMap& map, E& element);
+};
+
+static const MapField<DoomLinedef> linedefFields[] = {
+	{ "startvertex",
+		[](lua_State* L, DoomLinedef& e) { pushfieldref(L, e.startvertex); },
+		[](lua_State* L, int i, DoomMap& map, DoomLinedef& e) { tofieldref(L, i, map.getVertexes(), e.startvertex); } },
+	{ "endvertex",
+		[](lua_State* L, DoomLinedef& e) { pushfieldref(L, e.endvertex); },
+		[](lua_State* L, int i, DoomMap& map, DoomLinedef& e) { tofieldref(L, i, map.getVertexes(), e.endvertex); } },
+	{ "flags",
+		[](lua_State* L, DoomLinedef& e) { lua_pushinteger(L, e.flags.to_ulong()); },
+		[](lua_State* L, int i, DoomMap&, DoomLinedef& e) { e.flags = tofieldinteger(L, i); } },
+	{ "special",
+		[](lua_State* L, DoomLinedef& e) { lua_pushinteger(L, e.special); },
+		[](lua_State* L, int i, DoomMap&, DoomLinedef& e) { e.special = tofieldinteger(L, i); } },
+	{ "tag",
+		[](lua_State* L, DoomLinedef& e) { lua_pushinteger(L, e.tag); },
+		[](lua_State* L, int i, DoomMap&, DoomLinedef& e) { e.tag = tofieldinteger(L, i); } },
+	{ "frontsidedef",
+		[](lua_State* L, DoomLinedef& e) { pushfieldref(L, e.frontsidedef); },
+		[](lua_State* L, int i, DoomMap& map, DoomLinedef& e) { tofieldref(L, i, map.getSidedefs(), e.frontsidedef); } },
+	{ "backsidedef",
+		[](lua_State* L, DoomLinedef& e) { pushfieldref(L, e.backsidedef); },
+		[](lua_State* L, int i, DoomMap& map, DoomLinedef& e) { tofieldref(L, i, map.getSidedefs(), e.backsidedef); } },
+	{ NULL, NULL, NULL }
+};
+
+static const MapField<Sector> sectorFields[] = {
+	{ "floor",
+		[](lua_State* L, Sector& e) { lua_pushinteger(L, e.floor); },
+		[](lua_State* L, int i, DoomMap&, Sector& e) { e.floor = tofieldinteger(L, i); } },
+	{ "ceiling",
+		[](lua_State* L, Sector& e) { lua_pushinteger(L, e.ceiling); },
+		[](lua_State* L, int i, DoomMap&, Sector& e) { e.ceiling = tofieldinteger(L, i); } },
+	{ "floortex",
+		[](lua_State* L, Sector& e) { lua_pushlstring(L, e.floortex.data(), e.floortex.size()); },
+		[](lua_State* L, int i, DoomMap&, Sector& e) { e.floortex = tofieldstring(L, i); } },
+	{ "ceilingtex",
+		[](lua_State* L, Sector& e) { lua_pushlstring(L, e.ceilingtex.data(), e.ceilingtex.size()); },
+		[](lua_State* L, int i, DoomMap&, Sector& e) { e.ceilingtex = tofieldstring(L, i); } },
+	{ "light",
+		[](lua_State* L, Sector& e) { lua_pushinteger(L, e.light); },
+		[](lua_State* L, int i, DoomMap&, Sector& e) { e.light = tofieldinteger(L, i); } },
+	{ "special",
+		[](lua_State* L, Sector& e) { lua_pushinteger(L, e.special); },
+		[](lua_State* L, int i, DoomMap&, Sector& e) { e.special = tofieldinteger(L, i); } },
+	{ "tag",
+		[](lua_State* L, Sector& e) { lua_pushinteger(L, e.tag); },
+		[](lua_State* L, int i, DoomMap&, Sector& e) { e.tag = tofieldinteger(L, i); } },
+	{ NULL, NULL, NULL }
+};
+
+static const MapField<Sidedef> sidedefFields[] = {
+	{ "xoffset",
+		[](lua_State* L, Sidedef& e) { lua_pushinteger(L, e.xoffset); },
+		[](lua_State* L, int i, DoomMap&, Sidedef& e) { e.xoffset = tofieldinteger(L, i); } },
+	{ "yoffset",
+		[](lua_State* L, Sidedef& e) { lua_pushinteger(L, e.yoffset); },
+		[](lua_State* L, int i, DoomMap&, Sidedef& e) { e.yoffset = tofieldinteger(L, i); } },
+	{ "uppertex",
+		[](lua_State* L, Sidedef& e) { lua_pushlstring(L, e.uppertex.data(), e.uppertex.size()); },
+		[](lua_State* L, int i, DoomMap&, Sidedef& e) { e.uppertex = tofieldstring(L, i); } },
+	{ "middletex",
+		[](lua_State* L, Sidedef& e) { lua_pushlstring(L, e.middletex.data(), e.middletex.size()); },
+		[](lua_State* L, int i, DoomMap&, Sidedef& e) { e.middletex = tofieldstring(L, i); } },
+	{ "lowertex",
+		[](lua_State* L, Sidedef& e) { lua_pushlstring(L, e.lowertex.data(), e.lowertex.size()); },
+		[](lua_State* L, int i, DoomMap&, Sidedef& e) { e.lowertex = tofieldstring(L, i); } },
+	{ "sector",
+		[](lua_State* L, Sidedef& e) { pushfieldref(L, e.sector); },
+		[](lua_State* L, int i, DoomMap& map, Sidedef& e) { tofieldref(L, i, map.getSectors(), e.sector); } },
+	{ NULL, NULL, NULL }
+};
+
+static const MapField<DoomThing> thingFields[] = {
+	{ "x",
+		[](lua_State* L, DoomThing& e) { lua_pushinteger(L, e.x); },
+		[](lua_State* L, int i, DoomMap&, DoomThing& e) { e.x = tofieldinteger(L, i); } },
+	{ "y",
+		[](lua_State* L, DoomThing& e) { lua_pushinteger(L, e.y); },
+		[](lua_State* L, int i, DoomMap&, DoomThing& e) { e.y = tofieldinteger(L, i); } },
+	{ "angle",
+		[](lua_State* L, DoomThing& e) { lua_pushinteger(L, e.angle); },
+		[](lua_State* L, int i, DoomMap&, DoomThing& e) { e.angle = tofieldinteger(L, i); } },
+	{ "type",
+		[](lua_State* L, DoomThing& e) { lua_pushinteger(L, e.type); },
+		[](lua_State* L, int i, DoomMap&, DoomThing& e) { e.type = tofieldinteger(L, i); } },
+	{ "flags",
+		[](lua_State* L, DoomThing& e) { lua_pushinteger(L, e.flags.to_ulong()); },
+		[](lua_State* L, int i, DoomMap&, DoomThing& e) { e.flags = tofieldinteger(L, i); } },
+	{ NULL, NULL, NULL }
+};
+
+static const MapField<Vertex> vertexFields[] = {
+	{ "x",
+		[](lua_State* L, Vertex& e) { lua_pushinteger(L, e.x); },
+		[](lua_State* L, int i, DoomMap&, Vertex& e) { e.x = tofieldinteger(L, i); } },
+	{ "y",
+		[](lua_State* L, Vertex& e) { lua_pushinteger(L, e.y); },
+		[](lua_State* L, int i, DoomMap&, Vertex& e) { e.y = tofieldinteger(L, i); } },
+	{ NULL, NULL, NULL }
+};
+
+// The kinds of element the bulk accessors take, in the order the switches
+// below expect them.
+static const char* const mapKinds[] = {
+	"linedefs", "sectors", "sidedefs", "things", "vertexes", NULL
+};
+
+template <class E>
+static const MapField<E>* checkfield(lua_State* L, int arg, const MapField<E>* fields) {
+	const char* name = luaL_checkstring(L, arg);
+	for (;fields->name != NULL;fields++) {
+		if (std::strcmp(fields->name, name) == 0) {
+			return fields;
+		}
+	}
+	luaL_argerror(L, arg, lua_pushfstring(L, "invalid field '%s'", name));
+	return NULL;
+}
+
+// Push one field of every element as a list.
+template <class C>
+static int pushcolumn(lua_State* L, C& elements, const MapField<typename C::value_type>* fields) {
+	auto field = checkfield(L, 3, fields);
+	lua_createtable(L, static_cast<int>(elements.size()), 0);
+	lua_Integer i = 1;
+	elements.each([&](typename C::value_type& element) {
+		field->push(L, element);
+		lua_rawseti(L, -2, i++);
+	});
+	return 1;
+}
+
+// Set one field of every element from a list.
+template <class C>
+static int tocolumn(lua_State* L, DoomMap& map, C& elements, const MapField<typename C::value_type>* fields) {
+	auto field = checkfield(L, 3, fields);
+	luaL_checktype(L, 4, LUA_TTABLE);
+	size_t count = lua_rawlen(L, 4);
+	if (count != elements.size()) {
+		return luaL_error(L, "Expected %d values, got %d", static_cast<int>(elements.size()), static_cast<int>(count));
+	}
+	lua_Integer i = 1;
+	elements.each([&](typename C::value_type& element) {
+		lua_rawgeti(L, 4, i++);
+		field->set(L, -1, map, element);
+		lua_pop(L, 1);
+	});
+	return 0;
+}
+
+// Call a function with the ID and fields of every element, reusing one
+// table for all of them.  If the function returns true, the fields in the
+// table are written back to the element.
+template <class C>
+static int eachelement(lua_State* L, DoomMap& map, C& elements, const MapField<typename C::value_type>* fields) {
+	typedef typename C::value_type E;
+	luaL_checktype(L, 3, LUA_TFUNCTION);
+	lua_settop(L, 3);
+
+	// Hold onto every element up front, in case the function adds or
+	// removes any.
+	std::vector<std::shared_ptr<E>> snapshot;
+	snapshot.reserve(elements.size());
+	elements.each([&](E& element) {
+		snapshot.push_back(elements.lock(element.id));
+	});
+
+	lua_newtable(L);
+	for (auto& element : snapshot) {
+		if (element->id == C::npos) {
+			continue;
+		}
+		for (auto field = fields;field->name != NULL;field++) {
+			field->push(L, *element);
+			lua_setfield(L, 4, field->name);
+		}
+		lua_pushvalue(L, 3);
+		lua_pushinteger(L, element->id + 1);
+		lua_pushvalue(L, 4);
+		lua_call(L, 2, 1);
+		if (lua_toboolean(L, -1) && element->id != C::npos) {
+			for (auto field = fields;field->name != NULL;field++) {
+				if (lua_getfield(L, 4, field->name) != LUA_TNIL) {
+					field->set(L, -1, map, *element);
+				}
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+	}
+	return 0;
+}
+
+// Call a function with every element of a kind, see eachelement.
+static int udoommap_each(lua_State* L) {
+	auto ptr = checkmap<DoomMap>(L, 1);
+
+	switch (luaL_checkoption(L, 2, NULL, mapKinds)) {
+	case 0:
+		return eachelement(L, *ptr, ptr->getLinedefs(), linedefFields);
+	case 1:
+		return eachelement(L, *ptr, ptr->getSectors(), sectorFields);
+	case 2:
+		return eachelement(L, *ptr, ptr->getSidedefs(), sidedefFields);
+	case 3:
+		return eachelement(L, *ptr, ptr->getThings(), thingFields);
+	default:
+		return eachelement(L, *ptr, ptr->getVertexes(), vertexFields);
+	}
+}
+
+// Get one field of every element of a kind as a list, so the nth entry
+// belongs to the element with ID n.  The map is compacted first.
+static int udoommap_getcolumn(lua_State* L) {
+	auto ptr = checkmap<DoomMap>(L, 1);
+
+	int kind = luaL_checkoption(L, 2, NULL, mapKinds);
+	try {
+		ptr->compact();
+	} catch (const std::runtime_error& e) {
+		return luaL_error(L, e.what());
+	}
+
+	switch (kind) {
+	case 0:
+		return pushcolumn(L, ptr->getLinedefs(), linedefFields);
+	case 1:
+		return pushcolumn(L, ptr->getSectors(), sectorFields);
+	case 2:
+		return pushcolumn(L, ptr->getSidedefs(), sidedefFields);
+	case 3:
+		return pushcolumn(L, ptr->getThings(), thingFields);
+	default:
+		return pushcolumn(L, ptr->getVertexes(), vertexFields);
+	}
+}
+
+// Set one field of every element of a kind from a list with an entry for
+// every element.  The map is compacted first.
+static int udoommap_setcolumn(lua_State* L) {
+	auto ptr = checkmap<DoomMap>(L, 1);
+
+	int kind = luaL_checkoption(L, 2, NULL, mapKinds);
+	try {
+		ptr->compact();
+	} catch (const std::runtime_error& e) {
+		return luaL_error(L, e.what());
+	}
+
+	switch (kind) {
+	case 0:
+		return tocolumn(L, *ptr, ptr->getLinedefs(), linedefFields);
+	case 1:
+		return tocolumn(L, *ptr, ptr->getSectors(), sectorFields);
+	case 2:
+		return tocolumn(L, *ptr, ptr->getSidedefs(), sidedefFields);
+	case 3:
+		return tocolumn(L, *ptr, ptr->getThings(), thingFields);
+	default:
+		return tocolumn(L, *ptr, ptr->getVertexes(), vertexFields);
+	}
+}
+
+// Push the arguments of a Hexen special as a list.
+static void pushargs(lua_State* L, const std::array<uint8_t, 5>& args) {
+	lua_createtable(L, static_cast<int>(args.size()), 0);
+	for (size_t i = 0;i < args.size();i++) {
+		lua_pushinteger(L, args[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+}
+
+// Read the arguments of a Hexen special from a list.  Missing arguments
+// are left alone.
+static void toargs(lua_State* L, int index, std::array<uint8_t, 5>& args) {
+	luaL_checktype(L, index, LUA_TTABLE);
+	for (size_t i = 0;i < args.size();i++) {
+		if (lua_rawgeti(L, index, i + 1) != LUA_TNIL) {
+			args[i] = lua_tointeger(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+}
+
+static int uhexenmap_getlinedef(lua_State* L) {
+	auto ptr = checkmap<HexenMap>(L, 1);
+
+	size_t index = luaL_checkinteger(L, 2);
+	HexenLinedef linedef;
+	try {
+		linedef = ptr->getLinedefs().at(index - 1);
+	} catch (const std::out_of_range& e) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	// References that didn't resolve when the lump was decoded are empty.
+	auto startvertex = linedef.startvertex.lock();
+	auto endvertex = linedef.endvertex.lock();
+	if (!startvertex || !endvertex) {
+		return luaL_error(L, "Linedef %d is missing a vertex", static_cast<int>(index));
+	}
+
+	lua_newtable(L);
+	lua_pushinteger(L, startvertex->id + 1);
+	lua_setfield(L, -2, "startvertex");
+	lua_pushinteger(L, endvertex->id + 1);
+	lua_setfield(L, -2, "endvertex");
+	lua_pushinteger(L, linedef.flags.to_ulong());
+	lua_setfield(L, -2, "flags");
+	lua_pushinteger(L, linedef.special);
+	lua_setfield(L, -2, "special");
+	pushargs(L, linedef.args);
+	lua_setfield(L, -2, "args");
+	auto frontsidedef = linedef.frontsidedef.lock();
+	if (frontsidedef) {
+		lua_pushinteger(L, frontsidedef->id + 1);
+		lua_setfield(L, -2, "frontsidedef");
+	}
+	auto backsidedef = linedef.backsidedef.lock();
+	if (backsidedef) {
+		lua_pushinteger(L, backsidedef->id + 1);
+		lua_setfield(L, -2, "backsidedef");
+	}
+
+	return 1;
+}
+
+static int uhexenmap_getthing(lua_State* L) {
+	auto ptr = checkmap<HexenMap>(L, 1);
+
+	size_t index = luaL_checkinteger(L, 2);
+	HexenThing thing;
+	try {
+		thing = ptr->getThings().at(index - 1);
+	} catch (const std::out_of_range& e) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	lua_newtable(L);
+	lua_pushinteger(L, thing.tid);
+	lua_setfield(L, -2, "tid");
+	lua_pushinteger(L, thing.x);
+	lua_setfield(L, -2, "x");
+	lua_pushinteger(L, thing.y);
+	lua_setfield(L, -2, "y");
+	lua_pushinteger(L, thing.z);
+	lua_setfield(L, -2, "z");
+	lua_pushinteger(L, thing.angle);
+	lua_setfield(L, -2, "angle");
+	lua_pushinteger(L, thing.type);
+	lua_setfield(L, -2, "type");
+	lua_pushinteger(L, thing.flags.to_ulong());
+	lua_setfield(L, -2, "flags");
+	lua_pushinteger(L, thing.special);
+	lua_setfield(L, -2, "special");
+	pushargs(L, thing.args);
+	lua_setfield(L, -2, "args");
+
+	return 1;
+}
+
+static int uhexenmap_setlinedef(lua_State* L) {
+	auto ptr = checkmap<HexenMap>(L, 1);
+
+	size_t index = luaL_checkinteger(L, 2);
+	HexenLinedef& linedef = ptr->getLinedefs()[index - 1];
+
+	lua_getfield(L, 3, "startvertex");
+	if (!lua_isnil(L, -1)) {
+		size_t vertexid = lua_tointeger(L, -1);
+		linedef.startvertex = ptr->getVertexes().lock(vertexid - 1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 3, "endvertex");
+	if (!lua_isnil(L, -1)) {
+		size_t vertexid = lua_tointeger(L, -1);
+		linedef.endvertex = ptr->getVertexes().lock(vertexid - 1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 3, "flags");
+	if (!lua_isnil(L, -1)) {
+		linedef.flags = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 3, "special");
+	if (!lua_isnil(L, -1)) {
+		linedef.special = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 3, "args");
+	if (!lua_isnil(L, -1)) {
+		toargs(L, -1, linedef.args);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 3, "frontsidedef");
+	if (!lua_isnil(L, -1)) {
+		size_t sidedefid = lua_tointeger(L, -1);
+		linedef.frontsidedef = ptr->getSidedefs().lock(sidedefid - 1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 3, "backsidedef");
+	if (!lua_isnil(L, -1)) {
+		size_t sidedefid = lua_tointeger(L, -1);
+		linedef.backsidedef = ptr->getSidedefs().lock(sidedefid - 1);
+	}
+	lua_pop(L, 1);
+
+	return 0;
+}
+
+static int uhexenmap_setthing(lua_State* L) {
+	auto ptr = checkmap<HexenMap>(L, 1);
+
+	size_t index = luaL_checkinteger(L, 2);
+	HexenThing& thing = ptr->getThings()[index - 1];
+
+	lua_getfield(L, 3, "tid");
+	if (!lua_isnil(L, -1)) {
+		thing.tid = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 3, "x");
+	if (!lua_isnil(L, -1)) {
+		thing.x = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 3, "y");
+	if (!lua_isnil(L, -1)) {
+		thing.y = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 3, "z");
+	if (!lua_isnil(L, -1)) {
+		thing.z = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 3, "angle");
+	if (!lua_isnil(L, -1)) {
+		thing.angle = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 3, "type");
+	if (!lua_isnil(L, -1)) {
+		thing.type = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 3, "flags");
+	if (!lua_isnil(L, -1)) {
+		thing.flags = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 3, "special");
+	if (!lua_isnil(L, -1)) {
+		thing.special = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 3, "args");
+	if (!lua_isnil(L, -1)) {
+		toargs(L, -1, thing.args);
+	}
+	lua_pop(L, 1);
+
+	return 0;
+}
+
+// Garbage-collect a map
+template <class M>
+static int umap_gc(lua_State* L) {
+	auto ptr = static_cast<std::shared_ptr<M>*>(luaL_checkudata(L, 1, MapMetatable<M>::name()));
 	ptr->~shared_ptr();
 	return 0;
 }
 
 // Functions attached to DoomMap userdata
 static const luaL_Reg udoommap_functions[] = {
+	{"buildblockmap", udoommap_buildblockmap},
+	{"buildnodes", udoommap_buildnodes},
+	{"buildreject", udoommap_buildreject},
+	{"each", udoommap_each},
+	{"getcolumn", udoommap_getcolumn},
 	{"getlinedef", udoommap_getlinedef},
-	{"getsector", udoommap_getsector},
-	{"getsidedef", udoommap_getsidedef},
+	{"getsector", umap_getsector<DoomMap>},
+	{"getsidedef", umap_getsidedef<DoomMap>},
 	{"getthing", udoommap_getthing},
-	{"packmap", udoommap_packmap},
-	{"getvertex", udoommap_getvertex},
+	{"optimize", udoommap_optimize},
+	{"packmap", umap_packmap<DoomMap>},
+	{"packudmf", udoommap_packudmf},
+	{"getvertex", umap_getvertex<DoomMap>},
+	{"setcolumn", udoommap_setcolumn},
 	{"setlinedef", udoommap_setlinedef},
-	{"setsector", udoommap_setsector},
-	{"setsidedef", udoommap_setsidedef},
+	{"setsector", umap_setsector<DoomMap>},
+	{"setsidedef", umap_setsidedef<DoomMap>},
 	{"setthing", udoommap_setthing},
-	{"setvertex", udoommap_setvertex},
-	{"__gc", udoommap_gc},
+	{"setvertex", umap_setvertex<DoomMap>},
+	{"spatialindex", udoommap_spatialindex},
+	{"__gc", umap_gc<DoomMap>},
+	{NULL, NULL}
+};
+
+// Functions attached to HexenMap userdata
+static const luaL_Reg uhexenmap_functions[] = {
+	{"getlinedef", uhexenmap_getlinedef},
+	{"getsector", umap_getsector<HexenMap>},
+	{"getsidedef", umap_getsidedef<HexenMap>},
+	{"getthing", uhexenmap_getthing},
+	{"getvertex", umap_getvertex<HexenMap>},
+	{"packmap", umap_packmap<HexenMap>},
+	{"setlinedef", uhexenmap_setlinedef},
+	{"setsector", umap_setsector<HexenMap>},
+	{"setsidedef", umap_setsidedef<HexenMap>},
+	{"setthing", uhexenmap_setthing},
+	{"setvertex", umap_setvertex<HexenMap>},
+	{"__gc", umap_gc<HexenMap>},
+	{NULL, NULL}
+};
+
+// Push a list of IDs as a table of 1-indexed positions.
+static void pushids(lua_State* L, const std::vector<size_t>& ids) {
+	lua_createtable(L, static_cast<int>(ids.size()), 0);
+	for (size_t i = 0;i < ids.size();i++) {
+		lua_pushinteger(L, ids[i] + 1);
+		lua_rawseti(L, -2, i + 1);
+	}
+}
+
+// Push an ID as a 1-indexed position, or nil if nothing was found.
+static void pushid(lua_State* L, size_t id) {
+	if (id == IndexedMap<Vertex>::npos) {
+		lua_pushnil(L);
+	} else {
+		lua_pushinteger(L, id + 1);
+	}
+}
+
+// Find linedefs that cross a box, given two opposite corners
+static int uspatialindex_linedefs(lua_State* L) {
+	auto ptr = *static_cast<std::shared_ptr<SpatialIndex>*>(luaL_checkudata(L, 1, WADmake::META_SPATIALINDEX));
+	pushids(L, ptr->linedefsInBox(luaL_checknumber(L, 2), luaL_checknumber(L, 3),
+	                              luaL_checknumber(L, 4), luaL_checknumber(L, 5)));
+	return 1;
+}
+
+// Find the linedef closest to a point
+static int uspatialindex_nearestlinedef(lua_State* L) {
+	auto ptr = *static_cast<std::shared_ptr<SpatialIndex>*>(luaL_checkudata(L, 1, WADmake::META_SPATIALINDEX));
+	pushid(L, ptr->nearestLinedef(luaL_checknumber(L, 2), luaL_checknumber(L, 3)));
+	return 1;
+}
+
+// Find the thing closest to a point
+static int uspatialindex_nearestthing(lua_State* L) {
+	auto ptr = *static_cast<std::shared_ptr<SpatialIndex>*>(luaL_checkudata(L, 1, WADmake::META_SPATIALINDEX));
+	pushid(L, ptr->nearestThing(luaL_checknumber(L, 2), luaL_checknumber(L, 3)));
+	return 1;
+}
+
+// Find the vertex closest to a point
+static int uspatialindex_nearestvertex(lua_State* L) {
+	auto ptr = *static_cast<std::shared_ptr<SpatialIndex>*>(luaL_checkudata(L, 1, WADmake::META_SPATIALINDEX));
+	pushid(L, ptr->nearestVertex(luaL_checknumber(L, 2), luaL_checknumber(L, 3)));
+	return 1;
+}
+
+// Find things inside a box, given two opposite corners
+static int uspatialindex_things(lua_State* L) {
+	auto ptr = *static_cast<std::shared_ptr<SpatialIndex>*>(luaL_checkudata(L, 1, WADmake::META_SPATIALINDEX));
+	pushids(L, ptr->thingsInBox(luaL_checknumber(L, 2), luaL_checknumber(L, 3),
+	                            luaL_checknumber(L, 4), luaL_checknumber(L, 5)));
+	return 1;
+}
+
+// Find vertexes inside a box, given two opposite corners
+static int uspatialindex_vertexes(lua_State* L) {
+	auto ptr = *static_cast<std::shared_ptr<SpatialIndex>*>(luaL_checkudata(L, 1, WADmake::META_SPATIALINDEX));
+	pushids(L, ptr->vertexesInBox(luaL_checknumber(L, 2), luaL_checknumber(L, 3),
+	                              luaL_checknumber(L, 4), luaL_checknumber(L, 5)));
+	return 1;
+}
+
+// Garbage-collect SpatialIndex
+static int uspatialindex_gc(lua_State* L) {
+	auto ptr = static_cast<std::shared_ptr<SpatialIndex>*>(luaL_checkudata(L, 1, WADmake::META_SPATIALINDEX));
+	ptr->~shared_ptr();
+	return 0;
+}
+
+// Functions attached to SpatialIndex userdata
+static const luaL_Reg uspatialindex_functions[] = {
+	{"linedefs", uspatialindex_linedefs},
+	{"nearestlinedef", uspatialindex_nearestlinedef},
+	{"nearestthing", uspatialindex_nearestthing},
+	{"nearestvertex", uspatialindex_nearestvertex},
+	{"things", uspatialindex_things},
+	{"vertexes", uspatialindex_vertexes},
+	{"__gc", uspatialindex_gc},
 	{NULL, NULL}
 };
 
 // Functions that go in the top-level wad package
 static const luaL_Reg wad_functions[] = {
+	{"buildblockmap", wad_buildblockmap},
 	{"createDoomMap", wad_createDoomMap},
+	{"createHexenMap", wad_createHexenMap},
 	{"unpackmap", wad_unpackmap},
+	{"unpackudmf", wad_unpackudmf},
 	{NULL, NULL}
 };
 
@@ -580,6 +1528,26 @@ void luaopen_map(lua_State* L) {
 	luaL_setfuncs(L, udoommap_functions, 0);
 	lua_pop(L, 1);
 	// [wadlib]
+	// Create "HexenMap" userdata
+	luaL_newmetatable(L, WADmake::META_HEXENMAP);
+	// [wadlib][HexenMapmeta]
+	lua_pushvalue(L, -1);
+	// [wadlib][HexenMapmeta][HexenMapmeta]
+	lua_setfield(L, -2, "__index");
+	// [wadlib][HexenMapmeta]
+	luaL_setfuncs(L, uhexenmap_functions, 0);
+	lua_pop(L, 1);
+	// [wadlib]
+	// Create "SpatialIndex" userdata
+	luaL_newmetatable(L, WADmake::META_SPATIALINDEX);
+	// [wadlib][SpatialIndexmeta]
+	lua_pushvalue(L, -1);
+	// [wadlib][SpatialIndexmeta][SpatialIndexmeta]
+	lua_setfield(L, -2, "__index");
+	// [wadlib][SpatialIndexmeta]
+	luaL_setfuncs(L, uspatialindex_functions, 0);
+	lua_pop(L, 1);
+	// [wadlib]
 	luaL_setfuncs(L, wad_functions, 0);
 }
 
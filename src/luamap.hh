@@ -22,6 +22,8 @@
 namespace WADmake {
 
 extern const char META_DOOMMAP[];
+extern const char META_HEXENMAP[];
+extern const char META_SPATIALINDEX[];
 
 void luaopen_map(lua_State* L);
 
@@ -16,433 +16,866 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
 #include "buffer.hh"
 #include "map.hh"
 
-#include <istream>
-#include <ostream>
-
 namespace WADmake {
 
-std::istream& Vertex::read(std::istream& buffer) {
+// Every record in a map lump has the same size, so the lump can be checked
+// once up front and then decoded as a single block.
+size_t RecordCount(BinaryReader& buffer, size_t size) {
+	if (buffer.remaining() % size != 0) {
+		throw std::runtime_error("Lump size is not a multiple of its record size");
+	}
+	return buffer.remaining() / size;
+}
+
+// Erased elements can still be locked when they share an allocation with
+// elements that haven't been erased, so check the ID as well.
+template <class T>
+static std::shared_ptr<T> LockLive(const std::weak_ptr<T>& ref) {
+	auto ptr = ref.lock();
+	if (ptr && ptr->id == IndexedMap<T>::npos) {
+		return nullptr;
+	}
+	return ptr;
+}
+
+// Look up the element a record refers to.  Raw lumps can be decoded long
+// after the map was loaded, by which time some of the elements they refer
+// to may have been erased, so anything that isn't there comes back as
+// nothing, just as compact would leave it.
+template <class T>
+static std::shared_ptr<T> LockRecord(IndexedMap<T>& map, size_t id) {
+	if (!map.contains(id)) {
+		return nullptr;
+	}
+	return map.lock(id);
+}
+
+// Decode a whole lump of records into one block, so every element of a
+// collection shares a single allocation.  Any extra arguments are handed
+// to each record's read, for resolving references.
+template <class T, class... Refs>
+static void ReadRecords(BinaryReader& buffer, IndexedMap<T>& map, Refs&... refs) {
+	size_t count = RecordCount(buffer, T::size);
+	const char* records = buffer.record(count * T::size);
+
+	std::vector<T> block(count);
+	for (size_t i = 0;i < count;i++) {
+		block[i].read(records + i * T::size, refs...);
+	}
+	map.append(std::move(block));
+}
+
+// Encode every element of a collection into a single run of records.
+template <class T>
+static void WriteRecords(BinaryWriter& buffer, IndexedMap<T>& map) {
+	char* records = buffer.record(map.size() * T::size);
+	map.each([&](T& element) {
+		element.write(records);
+		records += T::size;
+	});
+}
+
+void Vertex::read(const char* record) {
 	// X coordinate
-	this->x = ReadInt16LE(buffer);
+	this->x = LoadLE<int16_t>(record);
 
 	// Y coordinate
-	this->y = ReadInt16LE(buffer);
+	this->y = LoadLE<int16_t>(record + 2);
+}
 
+BinaryReader& Vertex::read(BinaryReader& buffer) {
+	this->read(buffer.record(Vertex::size));
 	return buffer;
 }
 
-std::ostream& Vertex::write(std::ostream& buffer) {
+void Vertex::write(char* record) {
 	// X coordinate
-	WriteInt16LE(buffer, this->x);
+	StoreLE<int16_t>(record, this->x);
 
 	// Y coordinate
-	WriteInt16LE(buffer, this->y);
+	StoreLE<int16_t>(record + 2, this->y);
+}
 
+BinaryWriter& Vertex::write(BinaryWriter& buffer) {
+	this->write(buffer.record(Vertex::size));
 	return buffer;
 }
 
-std::istream& Vertexes::read(std::istream& buffer) {
-	for (;;) {
-		buffer.peek(); // Trigger EOF if we're at the end
-		if (buffer.eof()) {
-			break;
-		}
-		Vertex vertex;
-		vertex.read(buffer);
-		this->push_back(std::move(vertex));
-	}
-
+BinaryReader& Vertexes::read(BinaryReader& buffer) {
+	ReadRecords(buffer, *this);
 	return buffer;
 }
 
-std::ostream& Vertexes::write(std::ostream& buffer) {
-	for (auto vertex : this->elements) {
-		vertex->write(buffer);
-	}
-
+BinaryWriter& Vertexes::write(BinaryWriter& buffer) {
+	WriteRecords(buffer, *this);
 	return buffer;
 }
 
-std::istream& Sector::read(std::istream& buffer) {
+void Sector::read(const char* record) {
 	// Floor height
-	this->floor = ReadInt16LE(buffer);
+	this->floor = LoadLE<int16_t>(record);
 
 	// Ceiling height
-	this->ceiling = ReadInt16LE(buffer);
+	this->ceiling = LoadLE<int16_t>(record + 2);
 
 	// Floor texture
-	this->floortex = ReadCString(buffer, 8);
+	this->floortex = LoadCString(record + 4, 8);
 
 	// Ceiling texture
-	this->ceilingtex = ReadCString(buffer, 8);
+	this->ceilingtex = LoadCString(record + 12, 8);
 
 	// Light level
-	this->light = ReadInt16LE(buffer);
+	this->light = LoadLE<int16_t>(record + 20);
 
 	// Sector special
-	this->special = ReadInt16LE(buffer);
+	this->special = LoadLE<int16_t>(record + 22);
 
 	// Sector Tag
-	this->tag = ReadInt16LE(buffer);
+	this->tag = LoadLE<int16_t>(record + 24);
+}
 
+BinaryReader& Sector::read(BinaryReader& buffer) {
+	this->read(buffer.record(Sector::size));
 	return buffer;
 }
 
-std::ostream& Sector::write(std::ostream& buffer) {
+void Sector::write(char* record) {
 	// Floor height
-	WriteInt16LE(buffer, this->floor);
+	StoreLE<int16_t>(record, this->floor);
 
 	// Ceiling height
-	WriteInt16LE(buffer, this->ceiling);
+	StoreLE<int16_t>(record + 2, this->ceiling);
 
 	// Floor texture
-	WriteCString(buffer, this->floortex, 8);
+	StoreCString(record + 4, this->floortex, 8);
 
 	// Ceiling texture
-	WriteCString(buffer, this->ceilingtex, 8);
+	StoreCString(record + 12, this->ceilingtex, 8);
 
 	// Light level
-	WriteInt16LE(buffer, this->light);
+	StoreLE<int16_t>(record + 20, this->light);
 
 	// Sector special
-	WriteInt16LE(buffer, this->special);
+	StoreLE<int16_t>(record + 22, this->special);
 
 	// Sector Tag
-	WriteInt16LE(buffer, this->tag);
+	StoreLE<int16_t>(record + 24, this->tag);
+}
 
+BinaryWriter& Sector::write(BinaryWriter& buffer) {
+	this->write(buffer.record(Sector::size));
 	return buffer;
 }
 
-std::istream& Sectors::read(std::istream& buffer) {
-	for (;;) {
-		buffer.peek(); // Trigger EOF if we're at the end
-		if (buffer.eof()) {
-			break;
-		}
-		Sector sector;
-		sector.read(buffer);
-		this->push_back(std::move(sector));
-	}
-
+BinaryReader& Sectors::read(BinaryReader& buffer) {
+	ReadRecords(buffer, *this);
 	return buffer;
 }
 
-std::ostream& Sectors::write(std::ostream& buffer) {
-	for (auto sector : this->elements) {
-		sector->write(buffer);
-	}
-
+BinaryWriter& Sectors::write(BinaryWriter& buffer) {
+	WriteRecords(buffer, *this);
 	return buffer;
 }
 
-std::istream& Sidedef::read(std::istream& buffer, Sectors& sectors) {
+void Sidedef::read(const char* record, Sectors& sectors) {
 	// X Texture Offset
-	this->xoffset = ReadInt16LE(buffer);
+	this->xoffset = LoadLE<int16_t>(record);
 
 	// Y Texture Offset
-	this->yoffset = ReadInt16LE(buffer);
+	this->yoffset = LoadLE<int16_t>(record + 2);
 
 	// Upper Texture
-	this->uppertex = ReadCString(buffer, 8);
+	this->uppertex = LoadCString(record + 4, 8);
 
 	// Middle Texture
-	this->middletex = ReadCString(buffer, 8);
+	this->middletex = LoadCString(record + 12, 8);
 
 	// Lower Texture
-	this->lowertex = ReadCString(buffer, 8);
+	this->lowertex = LoadCString(record + 20, 8);
 
 	// Sector
-	int16_t sectorid = ReadInt16LE(buffer);
-	this->sector = sectors.lock(sectorid);
+	int16_t sectorid = LoadLE<int16_t>(record + 28);
+	this->sector = LockRecord(sectors, sectorid);
+}
 
+BinaryReader& Sidedef::read(BinaryReader& buffer, Sectors& sectors) {
+	this->read(buffer.record(Sidedef::size), sectors);
 	return buffer;
 }
 
-std::ostream& Sidedef::write(std::ostream& buffer) {
+void Sidedef::write(char* record) {
 	// X Texture Offset
-	WriteInt16LE(buffer, this->xoffset);
+	StoreLE<int16_t>(record, this->xoffset);
 
 	// Y Texture Offset
-	WriteInt16LE(buffer, this->yoffset);
+	StoreLE<int16_t>(record + 2, this->yoffset);
 
 	// Upper Texture
-	WriteCString(buffer, this->uppertex, 8);
+	StoreCString(record + 4, this->uppertex, 8);
 
 	// Middle Texture
-	WriteCString(buffer, this->middletex, 8);
+	StoreCString(record + 12, this->middletex, 8);
 
 	// Lower Texture
-	WriteCString(buffer, this->lowertex, 8);
+	StoreCString(record + 20, this->lowertex, 8);
 
 	// Sector
-	WriteInt16LE(buffer, this->sector.lock()->id);
+	auto sector = LockLive(this->sector);
+	if (sector) {
+		StoreLE<int16_t>(record + 28, sector->id);
+	} else {
+		throw std::runtime_error("Sidedef is missing sector");
+	}
+}
 
+BinaryWriter& Sidedef::write(BinaryWriter& buffer) {
+	this->write(buffer.record(Sidedef::size));
 	return buffer;
 }
 
-std::istream& Sidedefs::read(std::istream& buffer, Sectors& sectors) {
-	for (;;) {
-		buffer.peek(); // Trigger EOF if we're at the end
-		if (buffer.eof()) {
-			break;
-		}
-		Sidedef sidedef;
-		sidedef.read(buffer, sectors);
-		this->push_back(std::move(sidedef));
-	}
-
+BinaryReader& Sidedefs::read(BinaryReader& buffer, Sectors& sectors) {
+	ReadRecords(buffer, *this, sectors);
 	return buffer;
 }
 
-std::ostream& Sidedefs::write(std::ostream& buffer) {
-	for (auto sidedef : this->elements) {
-		sidedef->write(buffer);
-	}
-
+BinaryWriter& Sidedefs::write(BinaryWriter& buffer) {
+	WriteRecords(buffer, *this);
 	return buffer;
 }
 
-std::istream& DoomLinedef::read(std::istream& buffer, Vertexes& vertexes, Sidedefs& sidedefs) {
+void DoomLinedef::read(const char* record, Vertexes& vertexes, Sidedefs& sidedefs) {
 	// Start vertex
-	int16_t startvertexid = ReadInt16LE(buffer);
-	this->startvertex = vertexes.lock(startvertexid);
+	int16_t startvertexid = LoadLE<int16_t>(record);
+	this->startvertex = LockRecord(vertexes, startvertexid);
 
 	// End vertex
-	int16_t endvertexid = ReadInt16LE(buffer);
-	this->endvertex = vertexes.lock(endvertexid);
+	int16_t endvertexid = LoadLE<int16_t>(record + 2);
+	this->endvertex = LockRecord(vertexes, endvertexid);
 
 	// Flags
-	this->flags = ReadUInt16LE(buffer);
+	this->flags = LoadLE<uint16_t>(record + 4);
 
 	// Line special
-	this->special = ReadInt16LE(buffer);
+	this->special = LoadLE<int16_t>(record + 6);
 
 	// Line tag
-	this->tag = ReadInt16LE(buffer);
+	this->tag = LoadLE<int16_t>(record + 8);
 
 	// Front sidedef
-	int16_t frontsidedefid = ReadInt16LE(buffer);
+	int16_t frontsidedefid = LoadLE<int16_t>(record + 10);
 	if (frontsidedefid != -1) {
-		this->frontsidedef = sidedefs.lock(frontsidedefid);
+		this->frontsidedef = LockRecord(sidedefs, frontsidedefid);
 	}
 
 	// Back sidedef
-	int16_t backsidedefid = ReadInt16LE(buffer);
+	int16_t backsidedefid = LoadLE<int16_t>(record + 12);
 	if (backsidedefid != -1) {
-		this->backsidedef = sidedefs.lock(backsidedefid);
+		this->backsidedef = LockRecord(sidedefs, backsidedefid);
 	}
+}
 
+BinaryReader& DoomLinedef::read(BinaryReader& buffer, Vertexes& vertexes, Sidedefs& sidedefs) {
+	this->read(buffer.record(DoomLinedef::size), vertexes, sidedefs);
 	return buffer;
 }
 
-std::ostream& DoomLinedef::write(std::ostream& buffer) {
+void DoomLinedef::write(char* record) {
 	// Start vertex
-	auto startvertex = this->startvertex.lock();
+	auto startvertex = LockLive(this->startvertex);
 	if (startvertex) {
-		WriteInt16LE(buffer, startvertex->id);
+		StoreLE<int16_t>(record, startvertex->id);
 	} else {
 		throw std::runtime_error("Linedef is missing start vertex");
 	}
 
 	// End vertex
-	auto endvertex = this->endvertex.lock();
+	auto endvertex = LockLive(this->endvertex);
 	if (endvertex) {
-		WriteInt16LE(buffer, endvertex->id);
+		StoreLE<int16_t>(record + 2, endvertex->id);
 	} else {
 		throw std::runtime_error("Linedef is missing end vertex");
 	}
 
 	// Flags
-	WriteUInt16LE(buffer, this->flags.to_ulong());
+	StoreLE<uint16_t>(record + 4, this->flags.to_ulong());
 
 	// Line special
-	WriteInt16LE(buffer, this->special);
+	StoreLE<int16_t>(record + 6, this->special);
 
 	// Line tag
-	WriteInt16LE(buffer, this->tag);
+	StoreLE<int16_t>(record + 8, this->tag);
 
 	// Front sidedef
-	auto frontsidedef = this->frontsidedef.lock();
+	auto frontsidedef = LockLive(this->frontsidedef);
 	if (frontsidedef) {
-		WriteInt16LE(buffer, frontsidedef->id);
+		StoreLE<int16_t>(record + 10, frontsidedef->id);
 	} else {
-		WriteInt16LE(buffer, -1);
+		StoreLE<int16_t>(record + 10, -1);
 	}
 
 	// Back sidedef
-	auto backsidedef = this->backsidedef.lock();
+	auto backsidedef = LockLive(this->backsidedef);
 	if (backsidedef) {
-		WriteInt16LE(buffer, backsidedef->id);
+		StoreLE<int16_t>(record + 12, backsidedef->id);
 	} else {
-		WriteInt16LE(buffer, -1);
+		StoreLE<int16_t>(record + 12, -1);
 	}
+}
 
+BinaryWriter& DoomLinedef::write(BinaryWriter& buffer) {
+	this->write(buffer.record(DoomLinedef::size));
 	return buffer;
 }
 
-std::istream& DoomLinedefs::read(std::istream& buffer, Vertexes& vertexes, Sidedefs& sidedefs) {
-	for (;;) {
-		buffer.peek(); // Trigger EOF if we're at the end
-		if (buffer.eof()) {
-			break;
-		}
-		DoomLinedef linedef;
-		linedef.read(buffer, vertexes, sidedefs);
-		this->push_back(std::move(linedef));
+BinaryReader& DoomLinedefs::read(BinaryReader& buffer, Vertexes& vertexes, Sidedefs& sidedefs) {
+	ReadRecords(buffer, *this, vertexes, sidedefs);
+	return buffer;
+}
+
+BinaryWriter& DoomLinedefs::write(BinaryWriter& buffer) {
+	WriteRecords(buffer, *this);
+	return buffer;
+}
+
+void DoomThing::read(const char* record) {
+	// X coordinate
+	this->x = LoadLE<int16_t>(record);
+
+	// Y coordinate
+	this->y = LoadLE<int16_t>(record + 2);
+
+	// Angle
+	this->angle = LoadLE<uint16_t>(record + 4);
+
+	// Type
+	this->type = LoadLE<uint16_t>(record + 6);
+
+	// Flags
+	this->flags = LoadLE<uint16_t>(record + 8);
+}
+
+BinaryReader& DoomThing::read(BinaryReader& buffer) {
+	this->read(buffer.record(DoomThing::size));
+	return buffer;
+}
+
+void DoomThing::write(char* record) {
+	// X coordinate
+	StoreLE<int16_t>(record, this->x);
+
+	// Y coordinate
+	StoreLE<int16_t>(record + 2, this->y);
+
+	// Angle
+	StoreLE<uint16_t>(record + 4, this->angle);
+
+	// Type
+	StoreLE<uint16_t>(record + 6, this->type);
+
+	// Flags
+	StoreLE<uint16_t>(record + 8, this->flags.to_ulong());
+}
+
+BinaryWriter& DoomThing::write(BinaryWriter& buffer) {
+	this->write(buffer.record(DoomThing::size));
+	return buffer;
+}
+
+BinaryReader& DoomThings::read(BinaryReader& buffer) {
+	ReadRecords(buffer, *this);
+	return buffer;
+}
+
+BinaryWriter& DoomThings::write(BinaryWriter& buffer) {
+	WriteRecords(buffer, *this);
+	return buffer;
+}
+
+void HexenLinedef::read(const char* record, Vertexes& vertexes, Sidedefs& sidedefs) {
+	// Start vertex
+	int16_t startvertexid = LoadLE<int16_t>(record);
+	this->startvertex = LockRecord(vertexes, startvertexid);
+
+	// End vertex
+	int16_t endvertexid = LoadLE<int16_t>(record + 2);
+	this->endvertex = LockRecord(vertexes, endvertexid);
+
+	// Flags
+	this->flags = LoadLE<uint16_t>(record + 4);
+
+	// Line special
+	this->special = LoadLE<uint8_t>(record + 6);
+
+	// Special arguments
+	for (size_t i = 0;i < this->args.size();i++) {
+		this->args[i] = LoadLE<uint8_t>(record + 7 + i);
+	}
+
+	// Front sidedef
+	int16_t frontsidedefid = LoadLE<int16_t>(record + 12);
+	if (frontsidedefid != -1) {
+		this->frontsidedef = LockRecord(sidedefs, frontsidedefid);
+	}
+
+	// Back sidedef
+	int16_t backsidedefid = LoadLE<int16_t>(record + 14);
+	if (backsidedefid != -1) {
+		this->backsidedef = LockRecord(sidedefs, backsidedefid);
 	}
+}
 
+BinaryReader& HexenLinedef::read(BinaryReader& buffer, Vertexes& vertexes, Sidedefs& sidedefs) {
+	this->read(buffer.record(HexenLinedef::size), vertexes, sidedefs);
 	return buffer;
 }
 
-std::ostream& DoomLinedefs::write(std::ostream& buffer) {
-	for (auto linedef : this->elements) {
-		linedef->write(buffer);
+void HexenLinedef::write(char* record) {
+	// Start vertex
+	auto startvertex = LockLive(this->startvertex);
+	if (startvertex) {
+		StoreLE<int16_t>(record, startvertex->id);
+	} else {
+		throw std::runtime_error("Linedef is missing start vertex");
+	}
+
+	// End vertex
+	auto endvertex = LockLive(this->endvertex);
+	if (endvertex) {
+		StoreLE<int16_t>(record + 2, endvertex->id);
+	} else {
+		throw std::runtime_error("Linedef is missing end vertex");
 	}
 
+	// Flags
+	StoreLE<uint16_t>(record + 4, this->flags.to_ulong());
+
+	// Line special
+	StoreLE<uint8_t>(record + 6, this->special);
+
+	// Special arguments
+	for (size_t i = 0;i < this->args.size();i++) {
+		StoreLE<uint8_t>(record + 7 + i, this->args[i]);
+	}
+
+	// Front sidedef
+	auto frontsidedef = LockLive(this->frontsidedef);
+	if (frontsidedef) {
+		StoreLE<int16_t>(record + 12, frontsidedef->id);
+	} else {
+		StoreLE<int16_t>(record + 12, -1);
+	}
+
+	// Back sidedef
+	auto backsidedef = LockLive(this->backsidedef);
+	if (backsidedef) {
+		StoreLE<int16_t>(record + 14, backsidedef->id);
+	} else {
+		StoreLE<int16_t>(record + 14, -1);
+	}
+}
+
+BinaryWriter& HexenLinedef::write(BinaryWriter& buffer) {
+	this->write(buffer.record(HexenLinedef::size));
+	return buffer;
+}
+
+BinaryReader& HexenLinedefs::read(BinaryReader& buffer, Vertexes& vertexes, Sidedefs& sidedefs) {
+	ReadRecords(buffer, *this, vertexes, sidedefs);
+	return buffer;
+}
+
+BinaryWriter& HexenLinedefs::write(BinaryWriter& buffer) {
+	WriteRecords(buffer, *this);
 	return buffer;
 }
 
-std::istream& DoomThing::read(std::istream& buffer) {
+void HexenThing::read(const char* record) {
+	// Thing ID
+	this->tid = LoadLE<int16_t>(record);
+
 	// X coordinate
-	this->x = ReadInt16LE(buffer);
+	this->x = LoadLE<int16_t>(record + 2);
 
 	// Y coordinate
-	this->y = ReadInt16LE(buffer);
+	this->y = LoadLE<int16_t>(record + 4);
+
+	// Starting height
+	this->z = LoadLE<int16_t>(record + 6);
 
 	// Angle
-	this->angle = ReadUInt16LE(buffer);
+	this->angle = LoadLE<uint16_t>(record + 8);
 
 	// Type
-	this->type = ReadUInt16LE(buffer);
+	this->type = LoadLE<uint16_t>(record + 10);
 
 	// Flags
-	this->flags = ReadUInt16LE(buffer);
+	this->flags = LoadLE<uint16_t>(record + 12);
+
+	// Special
+	this->special = LoadLE<uint8_t>(record + 14);
+
+	// Special arguments
+	for (size_t i = 0;i < this->args.size();i++) {
+		this->args[i] = LoadLE<uint8_t>(record + 15 + i);
+	}
+}
 
+BinaryReader& HexenThing::read(BinaryReader& buffer) {
+	this->read(buffer.record(HexenThing::size));
 	return buffer;
 }
 
-std::ostream& DoomThing::write(std::ostream& buffer) {
+void HexenThing::write(char* record) {
+	// Thing ID
+	StoreLE<int16_t>(record, this->tid);
+
 	// X coordinate
-	WriteInt16LE(buffer, this->x);
+	StoreLE<int16_t>(record + 2, this->x);
 
 	// Y coordinate
-	WriteInt16LE(buffer, this->y);
+	StoreLE<int16_t>(record + 4, this->y);
+
+	// Starting height
+	StoreLE<int16_t>(record + 6, this->z);
 
 	// Angle
-	WriteUInt16LE(buffer, this->angle);
+	StoreLE<uint16_t>(record + 8, this->angle);
 
 	// Type
-	WriteUInt16LE(buffer, this->type);
+	StoreLE<uint16_t>(record + 10, this->type);
 
 	// Flags
-	WriteUInt16LE(buffer, this->flags.to_ulong());
+	StoreLE<uint16_t>(record + 12, this->flags.to_ulong());
+
+	// Special
+	StoreLE<uint8_t>(record + 14, this->special);
+
+	// Special arguments
+	for (size_t i = 0;i < this->args.size();i++) {
+		StoreLE<uint8_t>(record + 15 + i, this->args[i]);
+	}
+}
 
+BinaryWriter& HexenThing::write(BinaryWriter& buffer) {
+	this->write(buffer.record(HexenThing::size));
 	return buffer;
 }
 
-std::istream& DoomThings::read(std::istream& buffer) {
-	for (;;) {
-		buffer.peek(); // Trigger EOF if we're at the end
-		if (buffer.eof()) {
-			break;
-		}
-		DoomThing thing;
-		thing.read(buffer);
-		this->push_back(std::move(thing));
-	}
+BinaryReader& HexenThings::read(BinaryReader& buffer) {
+	ReadRecords(buffer, *this);
+	return buffer;
+}
 
+BinaryWriter& HexenThings::write(BinaryWriter& buffer) {
+	WriteRecords(buffer, *this);
 	return buffer;
 }
 
-std::ostream& DoomThings::write(std::ostream& buffer) {
-	for (auto thing : this->elements) {
-		thing->write(buffer);
+// Check a raw lump before holding onto it, so a broken lump is caught when
+// the map is loaded instead of whenever it happens to be decoded.
+static void CheckLump(const LumpData& lump, size_t size) {
+	if (lump.size() % size != 0) {
+		throw std::runtime_error("Lump size is not a multiple of its record size");
 	}
+}
 
-	return buffer;
+// Decode a raw lump into its collection, then let go of the lump.
+template <class C, class... Refs>
+static void DecodeLump(C& collection, LumpData& lump, bool& raw, Refs&... refs) {
+	BinaryReader buffer(lump.data(), lump.size());
+	collection.read(buffer, refs...);
+	lump = LumpData();
+	raw = false;
+}
+
+// A lump that was never decoded is packed just as it came in.
+template <class C>
+static LumpData EncodeLump(C& collection, const LumpData& lump, bool raw) {
+	if (raw) {
+		return lump;
+	}
+	BinaryWriter buffer;
+	collection.write(buffer);
+	return LumpData(buffer.release());
+}
+
+// Nothing in a lump that was never decoded can have been erased, so every
+// ID stays where it is.
+template <class T>
+static std::vector<size_t> CompactLump(IndexedMap<T>& collection, const LumpData& lump, bool raw) {
+	if (raw) {
+		std::vector<size_t> remap(lump.size() / T::size);
+		std::iota(remap.begin(), remap.end(), 0);
+		return remap;
+	}
+	return collection.compact();
+}
+
+template <class L, class T>
+MapBase<L, T>::MapBase() :
+	linedefsraw(false), sectorsraw(false), sidedefsraw(false),
+	thingsraw(false), vertexesraw(false) { }
+
+// Clear out references to erased elements, then close up the holes the
+// erased elements left behind.  Everything that's left keeps referring to
+// the same elements, just under their new IDs.
+template <class L, class T>
+DoomMapRemap MapBase<L, T>::compact() {
+	// Raw lumps refer to elements by their position in the lumps they were
+	// loaded with, so they have to be decoded before whatever they refer to
+	// is renumbered.
+	if (this->sidedefsraw && !this->sectorsraw) {
+		this->getSidedefs();
+	}
+	if (this->linedefsraw && (!this->vertexesraw || !this->sidedefsraw)) {
+		this->getLinedefs();
+	}
+
+	this->sidedefs.each([](Sidedef& sidedef) {
+		if (!LockLive(sidedef.sector)) {
+			sidedef.sector.reset();
+		}
+	});
+	this->linedefs.each([](typename L::value_type& linedef) {
+		if (!LockLive(linedef.startvertex)) {
+			linedef.startvertex.reset();
+		}
+		if (!LockLive(linedef.endvertex)) {
+			linedef.endvertex.reset();
+		}
+		if (!LockLive(linedef.frontsidedef)) {
+			linedef.frontsidedef.reset();
+		}
+		if (!LockLive(linedef.backsidedef)) {
+			linedef.backsidedef.reset();
+		}
+	});
+
+	DoomMapRemap remap;
+	remap.linedefs = CompactLump(this->linedefs, this->linedefslump, this->linedefsraw);
+	remap.sectors = CompactLump(this->sectors, this->sectorslump, this->sectorsraw);
+	remap.sidedefs = CompactLump(this->sidedefs, this->sidedefslump, this->sidedefsraw);
+	remap.things = CompactLump(this->things, this->thingslump, this->thingsraw);
+	remap.vertexes = CompactLump(this->vertexes, this->vertexeslump, this->vertexesraw);
+	return remap;
 }
 
-std::string& DoomMap::getBlockmap() {
+template <class L, class T>
+std::string& MapBase<L, T>::getBlockmap() {
 	return this->blockmap;
 }
 
-DoomLinedefs& DoomMap::getLinedefs() {
+template <class L, class T>
+L& MapBase<L, T>::getLinedefs() {
+	if (this->linedefsraw) {
+		DecodeLump(this->linedefs, this->linedefslump, this->linedefsraw, this->getVertexes(), this->getSidedefs());
+	}
 	return this->linedefs;
 }
 
-std::string& DoomMap::getNodes() {
+// The LINEDEFS lump, as it came in if the linedefs were never asked for.
+template <class L, class T>
+LumpData MapBase<L, T>::getLinedefsLump() {
+	return EncodeLump(this->linedefs, this->linedefslump, this->linedefsraw);
+}
+
+template <class L, class T>
+std::string& MapBase<L, T>::getNodes() {
 	return this->nodes;
 }
 
-std::string& DoomMap::getReject() {
+template <class L, class T>
+std::string& MapBase<L, T>::getReject() {
 	return this->reject;
 }
 
-Sectors& DoomMap::getSectors() {
+template <class L, class T>
+Sectors& MapBase<L, T>::getSectors() {
+	if (this->sectorsraw) {
+		DecodeLump(this->sectors, this->sectorslump, this->sectorsraw);
+	}
 	return this->sectors;
 }
 
-std::string& DoomMap::getSegs() {
+// The SECTORS lump, as it came in if the sectors were never asked for.
+template <class L, class T>
+LumpData MapBase<L, T>::getSectorsLump() {
+	return EncodeLump(this->sectors, this->sectorslump, this->sectorsraw);
+}
+
+template <class L, class T>
+std::string& MapBase<L, T>::getSegs() {
 	return this->segs;
 }
 
-std::string& DoomMap::getSsectors() {
+template <class L, class T>
+std::string& MapBase<L, T>::getSsectors() {
 	return this->ssectors;
 }
 
-Sidedefs& DoomMap::getSidedefs() {
+template <class L, class T>
+Sidedefs& MapBase<L, T>::getSidedefs() {
+	if (this->sidedefsraw) {
+		DecodeLump(this->sidedefs, this->sidedefslump, this->sidedefsraw, this->getSectors());
+	}
 	return this->sidedefs;
 }
 
-DoomThings& DoomMap::getThings() {
+// The SIDEDEFS lump, as it came in if the sidedefs were never asked for.
+template <class L, class T>
+LumpData MapBase<L, T>::getSidedefsLump() {
+	return EncodeLump(this->sidedefs, this->sidedefslump, this->sidedefsraw);
+}
+
+template <class L, class T>
+T& MapBase<L, T>::getThings() {
+	if (this->thingsraw) {
+		DecodeLump(this->things, this->thingslump, this->thingsraw);
+	}
 	return this->things;
 }
 
-Vertexes& DoomMap::getVertexes() {
+// The THINGS lump, as it came in if the things were never asked for.
+template <class L, class T>
+LumpData MapBase<L, T>::getThingsLump() {
+	return EncodeLump(this->things, this->thingslump, this->thingsraw);
+}
+
+template <class L, class T>
+Vertexes& MapBase<L, T>::getVertexes() {
+	if (this->vertexesraw) {
+		DecodeLump(this->vertexes, this->vertexeslump, this->vertexesraw);
+	}
 	return this->vertexes;
 }
 
-void DoomMap::setBlockmap(std::string&& blockmap) {
+// The VERTEXES lump, as it came in if the vertexes were never asked for.
+template <class L, class T>
+LumpData MapBase<L, T>::getVertexesLump() {
+	return EncodeLump(this->vertexes, this->vertexeslump, this->vertexesraw);
+}
+
+template <class L, class T>
+void MapBase<L, T>::setBlockmap(std::string&& blockmap) {
 	this->blockmap = std::move(blockmap);
 }
 
-void DoomMap::setLinedefs(DoomLinedefs&& linedefs) {
+template <class L, class T>
+void MapBase<L, T>::setLinedefs(L&& linedefs) {
 	this->linedefs = std::move(linedefs);
+	this->linedefslump = LumpData();
+	this->linedefsraw = false;
 }
 
-void DoomMap::setNodes(std::string&& nodes) {
+// Hold onto a LINEDEFS lump, to be decoded once the linedefs are needed.
+template <class L, class T>
+void MapBase<L, T>::setLinedefsLump(const LumpData& lump) {
+	CheckLump(lump, L::value_type::size);
+	this->linedefs = L();
+	this->linedefslump = lump;
+	this->linedefsraw = true;
+}
+
+template <class L, class T>
+void MapBase<L, T>::setNodes(std::string&& nodes) {
 	this->nodes = std::move(nodes);
 }
 
-void DoomMap::setReject(std::string&& reject) {
+template <class L, class T>
+void MapBase<L, T>::setReject(std::string&& reject) {
 	this->reject = std::move(reject);
 }
 
-void DoomMap::setSegs(std::string&& segs) {
+template <class L, class T>
+void MapBase<L, T>::setSegs(std::string&& segs) {
 	this->segs = std::move(segs);
 }
 
-void DoomMap::setSectors(Sectors&& sectors) {
+template <class L, class T>
+void MapBase<L, T>::setSectors(Sectors&& sectors) {
 	this->sectors = std::move(sectors);
+	this->sectorslump = LumpData();
+	this->sectorsraw = false;
+}
+
+// Hold onto a SECTORS lump, to be decoded once the sectors are needed.
+template <class L, class T>
+void MapBase<L, T>::setSectorsLump(const LumpData& lump) {
+	CheckLump(lump, Sector::size);
+	this->sectors = Sectors();
+	this->sectorslump = lump;
+	this->sectorsraw = true;
 }
 
-void DoomMap::setSsectors(std::string&& ssectors) {
+template <class L, class T>
+void MapBase<L, T>::setSsectors(std::string&& ssectors) {
 	this->ssectors = std::move(ssectors);
 }
 
-void DoomMap::setSidedefs(Sidedefs&& sidedefs) {
+template <class L, class T>
+void MapBase<L, T>::setSidedefs(Sidedefs&& sidedefs) {
 	this->sidedefs = std::move(sidedefs);
+	this->sidedefslump = LumpData();
+	this->sidedefsraw = false;
+}
+
+// Hold onto a SIDEDEFS lump, to be decoded once the sidedefs are needed.
+template <class L, class T>
+void MapBase<L, T>::setSidedefsLump(const LumpData& lump) {
+	CheckLump(lump, Sidedef::size);
+	this->sidedefs = Sidedefs();
+	this->sidedefslump = lump;
+	this->sidedefsraw = true;
 }
 
-void DoomMap::setThings(DoomThings&& things) {
+template <class L, class T>
+void MapBase<L, T>::setThings(T&& things) {
 	this->things = std::move(things);
+	this->thingslump = LumpData();
+	this->thingsraw = false;
 }
 
-void DoomMap::setVertexes(Vertexes&& vertexes) {
+// Hold onto a THINGS lump, to be decoded once the things are needed.
+template <class L, class T>
+void MapBase<L, T>::setThingsLump(const LumpData& lump) {
+	CheckLump(lump, T::value_type::size);
+	this->things = T();
+	this->thingslump = lump;
+	this->thingsraw = true;
+}
+
+template <class L, class T>
+void MapBase<L, T>::setVertexes(Vertexes&& vertexes) {
 	this->vertexes = std::move(vertexes);
+	this->vertexeslump = LumpData();
+	this->vertexesraw = false;
+}
+
+// Hold onto a VERTEXES lump, to be decoded once the vertexes are needed.
+template <class L, class T>
+void MapBase<L, T>::setVertexesLump(const LumpData& lump) {
+	CheckLump(lump, Vertex::size);
+	this->vertexes = Vertexes();
+	this->vertexeslump = lump;
+	this->vertexesraw = true;
+}
+
+std::string& HexenMap::getBehavior() {
+	return this->behavior;
 }
 
+void HexenMap::setBehavior(std::string&& behavior) {
+	this->behavior = std::move(behavior);
+}
+
+template class MapBase<DoomLinedefs, DoomThings>;
+template class MapBase<HexenLinedefs, HexenThings>;
+
 }
@@ -19,29 +19,40 @@
 #ifndef MAP_HH
 #define MAP_HH
 
+#include <array>
 #include <bitset>
+#include <cstdint>
 #include <memory>
+#include <string>
 #include <vector>
 
+#include "buffer.hh"
+#include "directory.hh"
 #include "indexedmap.hh"
 
 namespace WADmake {
 
+size_t RecordCount(BinaryReader& buffer, size_t size);
+
 struct Vertex {
+	static const size_t size = 4;
 	size_t id;
 	int16_t x;
 	int16_t y;
-	std::istream& read(std::istream& buffer);
-	std::ostream& write(std::ostream& buffer);
+	void read(const char* record);
+	void write(char* record);
+	BinaryReader& read(BinaryReader& buffer);
+	BinaryWriter& write(BinaryWriter& buffer);
 };
 
 class Vertexes : public IndexedMap<Vertex> {
 public:
-	std::istream& read(std::istream& buffer);
-	std::ostream& write(std::ostream& buffer);
+	BinaryReader& read(BinaryReader& buffer);
+	BinaryWriter& write(BinaryWriter& buffer);
 };
 
 struct Sector {
+	static const size_t size = 26;
 	size_t id;
 	int16_t floor;
 	int16_t ceiling;
@@ -50,17 +61,20 @@ struct Sector {
 	int16_t light;
 	int16_t special;
 	int16_t tag;
-	std::istream& read(std::istream& buffer);
-	std::ostream& write(std::ostream& buffer);
+	void read(const char* record);
+	void write(char* record);
+	BinaryReader& read(BinaryReader& buffer);
+	BinaryWriter& write(BinaryWriter& buffer);
 };
 
 class Sectors : public IndexedMap<Sector> {
 public:
-	std::istream& read(std::istream& buffer);
-	std::ostream& write(std::ostream& buffer);
+	BinaryReader& read(BinaryReader& buffer);
+	BinaryWriter& write(BinaryWriter& buffer);
 };
 
 struct Sidedef {
+	static const size_t size = 30;
 	size_t id;
 	int16_t xoffset;
 	int16_t yoffset;
@@ -68,84 +82,190 @@ struct Sidedef {
 	std::string middletex;
 	std::string lowertex;
 	std::weak_ptr<Sector> sector;
-	std::istream& read(std::istream& buffer, Sectors& sectors);
-	std::ostream& write(std::ostream& buffer);
+	void read(const char* record, Sectors& sectors);
+	void write(char* record);
+	BinaryReader& read(BinaryReader& buffer, Sectors& sectors);
+	BinaryWriter& write(BinaryWriter& buffer);
 };
 
 class Sidedefs : public IndexedMap<Sidedef> {
 public:
-	std::istream& read(std::istream& buffer, Sectors& sectors);
-	std::ostream& write(std::ostream& buffer);
+	BinaryReader& read(BinaryReader& buffer, Sectors& sectors);
+	BinaryWriter& write(BinaryWriter& buffer);
 };
 
 struct DoomLinedef {
+	static const size_t size = 14;
 	size_t id;
 	std::weak_ptr<Vertex> startvertex;
 	std::weak_ptr<Vertex> endvertex;
-	std::bitset<sizeof(uint16_t)> flags;
+	std::bitset<16> flags;
 	int16_t special;
 	int16_t tag;
 	std::weak_ptr<Sidedef> frontsidedef;
 	std::weak_ptr<Sidedef> backsidedef;
-	std::istream& read(std::istream& buffer, Vertexes& vertexes, Sidedefs& sidedefs);
-	std::ostream& write(std::ostream& buffer);
+	void read(const char* record, Vertexes& vertexes, Sidedefs& sidedefs);
+	void write(char* record);
+	BinaryReader& read(BinaryReader& buffer, Vertexes& vertexes, Sidedefs& sidedefs);
+	BinaryWriter& write(BinaryWriter& buffer);
 };
 
 class DoomLinedefs : public IndexedMap<DoomLinedef> {
 public:
-	std::istream& read(std::istream& buffer, Vertexes& vertexes, Sidedefs& sidedefs);
-	std::ostream& write(std::ostream& buffer);
+	BinaryReader& read(BinaryReader& buffer, Vertexes& vertexes, Sidedefs& sidedefs);
+	BinaryWriter& write(BinaryWriter& buffer);
 };
 
 struct DoomThing {
+	static const size_t size = 10;
 	size_t id;
 	int16_t x;
 	int16_t y;
 	uint16_t angle;
 	uint16_t type;
 	std::bitset<16> flags;
-	std::istream& read(std::istream& buffer);
-	std::ostream& write(std::ostream& buffer);
+	void read(const char* record);
+	void write(char* record);
+	BinaryReader& read(BinaryReader& buffer);
+	BinaryWriter& write(BinaryWriter& buffer);
 };
 
 class DoomThings : public IndexedMap<DoomThing> {
 public:
-	std::istream& read(std::istream& buffer);
-	std::ostream& write(std::ostream& buffer);
+	BinaryReader& read(BinaryReader& buffer);
+	BinaryWriter& write(BinaryWriter& buffer);
+};
+
+struct HexenLinedef {
+	static const size_t size = 16;
+	size_t id;
+	std::weak_ptr<Vertex> startvertex;
+	std::weak_ptr<Vertex> endvertex;
+	std::bitset<16> flags;
+	uint8_t special;
+	std::array<uint8_t, 5> args;
+	std::weak_ptr<Sidedef> frontsidedef;
+	std::weak_ptr<Sidedef> backsidedef;
+	void read(const char* record, Vertexes& vertexes, Sidedefs& sidedefs);
+	void write(char* record);
+	BinaryReader& read(BinaryReader& buffer, Vertexes& vertexes, Sidedefs& sidedefs);
+	BinaryWriter& write(BinaryWriter& buffer);
+};
+
+class HexenLinedefs : public IndexedMap<HexenLinedef> {
+public:
+	BinaryReader& read(BinaryReader& buffer, Vertexes& vertexes, Sidedefs& sidedefs);
+	BinaryWriter& write(BinaryWriter& buffer);
+};
+
+struct HexenThing {
+	static const size_t size = 20;
+	size_t id;
+	int16_t tid;
+	int16_t x;
+	int16_t y;
+	int16_t z;
+	uint16_t angle;
+	uint16_t type;
+	std::bitset<16> flags;
+	uint8_t special;
+	std::array<uint8_t, 5> args;
+	void read(const char* record);
+	void write(char* record);
+	BinaryReader& read(BinaryReader& buffer);
+	BinaryWriter& write(BinaryWriter& buffer);
+};
+
+class HexenThings : public IndexedMap<HexenThing> {
+public:
+	BinaryReader& read(BinaryReader& buffer);
+	BinaryWriter& write(BinaryWriter& buffer);
+};
+
+// Old to new ID tables for everything compacted by MapBase::compact.
+struct DoomMapRemap {
+	std::vector<size_t> linedefs;
+	std::vector<size_t> sectors;
+	std::vector<size_t> sidedefs;
+	std::vector<size_t> things;
+	std::vector<size_t> vertexes;
 };
 
-class DoomMap {
+// The parts of a map every binary format shares.  Formats only differ in
+// the records their linedefs and things use.
+//
+// Maps can be handed their lumps raw, in which case each lump is only
+// decoded the first time its part of the map is asked for, along with
+// whatever that part refers to.  Parts that are never asked for are packed
+// straight from the lump they came from.
+template <class L, class T>
+class MapBase {
+protected:
 	std::string blockmap;
-	DoomLinedefs linedefs;
+	L linedefs;
+	LumpData linedefslump;
 	std::string nodes;
 	std::string reject;
 	std::string segs;
 	Sectors sectors;
+	LumpData sectorslump;
 	std::string ssectors;
 	Sidedefs sidedefs;
-	DoomThings things;
+	LumpData sidedefslump;
+	T things;
+	LumpData thingslump;
 	Vertexes vertexes;
+	LumpData vertexeslump;
+	bool linedefsraw;
+	bool sectorsraw;
+	bool sidedefsraw;
+	bool thingsraw;
+	bool vertexesraw;
 public:
+	typedef L Linedefs;
+	typedef T Things;
+	MapBase();
+	DoomMapRemap compact();
 	std::string& getBlockmap();
-	DoomLinedefs& getLinedefs();
+	L& getLinedefs();
+	LumpData getLinedefsLump();
 	std::string& getNodes();
 	std::string& getReject();
 	std::string& getSegs();
 	Sectors& getSectors();
+	LumpData getSectorsLump();
 	std::string& getSsectors();
 	Sidedefs& getSidedefs();
-	DoomThings& getThings();
+	LumpData getSidedefsLump();
+	T& getThings();
+	LumpData getThingsLump();
 	Vertexes& getVertexes();
+	LumpData getVertexesLump();
 	void setBlockmap(std::string&& blockmap);
-	void setLinedefs(DoomLinedefs&& linedefs);
+	void setLinedefs(L&& linedefs);
+	void setLinedefsLump(const LumpData& lump);
 	void setNodes(std::string&& nodes);
 	void setReject(std::string&& reject);
 	void setSegs(std::string&& segs);
 	void setSectors(Sectors&& sectors);
+	void setSectorsLump(const LumpData& lump);
 	void setSsectors(std::string&& ssectors);
 	void setSidedefs(Sidedefs&& sidedefs);
-	void setThings(DoomThings&& things);
+	void setSidedefsLump(const LumpData& lump);
+	void setThings(T&& things);
+	void setThingsLump(const LumpData& lump);
 	void setVertexes(Vertexes&& vertexes);
+	void setVertexesLump(const LumpData& lump);
+};
+
+class DoomMap : public MapBase<DoomLinedefs, DoomThings> { };
+
+// Hexen maps also carry their compiled ACS scripts.
+class HexenMap : public MapBase<HexenLinedefs, HexenThings> {
+	std::string behavior;
+public:
+	std::string& getBehavior();
+	void setBehavior(std::string&& behavior);
 };
 
 }
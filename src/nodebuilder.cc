@@ -0,0 +1,443 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <future>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "buffer.hh"
+#include "nodebuilder.hh"
+
+namespace WADmake {
+
+static const double pi = 3.14159265358979323846;
+
+// Points closer than this to a partition line count as being on it.
+static const double onLineEpsilon = 1.0 / 128;
+
+// Sets of segs smaller than this aren't worth handing to another thread.
+static const size_t parallelSegs = 512;
+
+// At most this many partition lines are scored for a set of segs.  Larger
+// sets have their candidates picked evenly from across the set.
+static const size_t maxCandidates = 256;
+
+// How much splitting a seg costs compared to one seg of imbalance.
+static const long long splitCost = 8;
+
+static const size_t segSize = 12;
+static const size_t ssectorSize = 4;
+static const size_t nodeSize = 28;
+
+// Child references with this bit set point at a subsector.
+static const uint16_t subsectorBit = 0x8000;
+
+struct BSPSeg {
+	double x1, y1, x2, y2;
+	// The line the seg lies on.  This comes from the seg's linedef, so
+	// it stays exact no matter how many times the seg is split.
+	int32_t px, py, pdx, pdy;
+	double plength;
+	size_t linedef;
+	size_t sector;
+	bool back;
+	double offset;
+};
+
+struct BSPBox {
+	double top, bottom, left, right;
+};
+
+// Nodes without children are subsectors.
+struct BSPNode {
+	std::vector<BSPSeg> segs;
+	int32_t x, y, dx, dy;
+	BSPBox box[2];
+	std::unique_ptr<BSPNode> child[2];
+};
+
+// Signed distance of a point from the line of a partition seg.  Negative
+// distances are in front of (to the right of) the partition.
+static double SideDistance(const BSPSeg& part, double x, double y) {
+	return (part.pdx * (y - part.py) - part.pdy * (x - part.px)) / part.plength;
+}
+
+// Returns 0 if the seg is in front of the partition, 1 if it's behind it,
+// or 2 if the partition splits it.  Segs that lie on the partition go in
+// front if they face the same way as it.
+static int ClassifySeg(const BSPSeg& part, const BSPSeg& seg, double& a, double& b) {
+	a = SideDistance(part, seg.x1, seg.y1);
+	b = SideDistance(part, seg.x2, seg.y2);
+	if (std::fabs(a) < onLineEpsilon && std::fabs(b) < onLineEpsilon) {
+		double dot = (seg.x2 - seg.x1) * part.pdx + (seg.y2 - seg.y1) * part.pdy;
+		return dot > 0 ? 0 : 1;
+	}
+	if (a < onLineEpsilon && b < onLineEpsilon) {
+		return 0;
+	}
+	if (a > -onLineEpsilon && b > -onLineEpsilon) {
+		return 1;
+	}
+	return 2;
+}
+
+// A set of segs can be a subsector if it all belongs to one sector and
+// none of the segs has another seg behind it.
+static bool IsSubsector(const std::vector<BSPSeg>& segs) {
+	for (auto& seg : segs) {
+		if (seg.sector != segs.front().sector) {
+			return false;
+		}
+	}
+	for (auto& part : segs) {
+		for (auto& seg : segs) {
+			if (SideDistance(part, seg.x1, seg.y1) > onLineEpsilon ||
+			    SideDistance(part, seg.x2, seg.y2) > onLineEpsilon) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Lower scores are better.  Partitions that leave one side empty score -1.
+static long long ScorePartition(const BSPSeg& part, const std::vector<BSPSeg>& segs) {
+	long long front = 0, back = 0, splits = 0;
+	for (auto& seg : segs) {
+		double a, b;
+		switch (ClassifySeg(part, seg, a, b)) {
+		case 0:
+			front += 1;
+			break;
+		case 1:
+			back += 1;
+			break;
+		default:
+			splits += 1;
+			break;
+		}
+	}
+	if (splits == 0 && (front == 0 || back == 0)) {
+		return -1;
+	}
+	return splits * splitCost + std::abs(front - back);
+}
+
+// Pick the seg whose line makes the best partition.  Ties go to the
+// earliest candidate, so the result doesn't depend on the thread count.
+static bool ChoosePartition(const std::vector<BSPSeg>& segs, size_t workers, size_t& best) {
+	// Segs from the same linedef all lie on the same line.
+	std::vector<size_t> candidates;
+	std::unordered_set<size_t> linedefs;
+	for (size_t i = 0;i < segs.size();i++) {
+		if (linedefs.insert(segs[i].linedef).second) {
+			candidates.push_back(i);
+		}
+	}
+	if (candidates.size() > maxCandidates) {
+		std::vector<size_t> picked(maxCandidates);
+		for (size_t i = 0;i < maxCandidates;i++) {
+			picked[i] = candidates[i * candidates.size() / maxCandidates];
+		}
+		candidates = std::move(picked);
+	}
+
+	std::vector<long long> scores(candidates.size());
+	auto score = [&](size_t begin, size_t end) {
+		for (size_t i = begin;i < end;i++) {
+			scores[i] = ScorePartition(segs[candidates[i]], segs);
+		}
+	};
+	if (workers > 1 && segs.size() >= parallelSegs) {
+		size_t chunk = (candidates.size() + workers - 1) / workers;
+		std::vector<std::future<void>> futures;
+		for (size_t begin = chunk;begin < candidates.size();begin += chunk) {
+			futures.push_back(std::async(std::launch::async, score, begin,
+			                             std::min(begin + chunk, candidates.size())));
+		}
+		score(0, std::min(chunk, candidates.size()));
+		for (auto& future : futures) {
+			future.get();
+		}
+	} else {
+		score(0, candidates.size());
+	}
+
+	bool found = false;
+	long long bestscore = 0;
+	for (size_t i = 0;i < candidates.size();i++) {
+		if (scores[i] >= 0 && (!found || scores[i] < bestscore)) {
+			found = true;
+			best = candidates[i];
+			bestscore = scores[i];
+		}
+	}
+	return found;
+}
+
+static void SplitSegs(const BSPSeg& part, const std::vector<BSPSeg>& segs,
+                      std::vector<BSPSeg>& front, std::vector<BSPSeg>& back) {
+	for (auto& seg : segs) {
+		double a, b;
+		switch (ClassifySeg(part, seg, a, b)) {
+		case 0:
+			front.push_back(seg);
+			break;
+		case 1:
+			back.push_back(seg);
+			break;
+		default: {
+			double t = a / (a - b);
+			double x = seg.x1 + t * (seg.x2 - seg.x1);
+			double y = seg.y1 + t * (seg.y2 - seg.y1);
+
+			BSPSeg first = seg;
+			first.x2 = x;
+			first.y2 = y;
+			BSPSeg second = seg;
+			second.x1 = x;
+			second.y1 = y;
+			second.offset = seg.offset + std::hypot(x - seg.x1, y - seg.y1);
+
+			(a < 0 ? front : back).push_back(first);
+			(a < 0 ? back : front).push_back(second);
+			break;
+		}
+		}
+	}
+}
+
+static BSPBox Bounds(const std::vector<BSPSeg>& segs) {
+	BSPBox box = { segs.front().y1, segs.front().y1, segs.front().x1, segs.front().x1 };
+	for (auto& seg : segs) {
+		box.top = std::max(box.top, std::max(seg.y1, seg.y2));
+		box.bottom = std::min(box.bottom, std::min(seg.y1, seg.y2));
+		box.left = std::min(box.left, std::min(seg.x1, seg.x2));
+		box.right = std::max(box.right, std::max(seg.x1, seg.x2));
+	}
+	return box;
+}
+
+static std::unique_ptr<BSPNode> BuildNode(std::vector<BSPSeg>&& segs, size_t workers) {
+	std::unique_ptr<BSPNode> node(new BSPNode);
+
+	size_t best;
+	if (IsSubsector(segs) || !ChoosePartition(segs, workers, best)) {
+		node->segs = std::move(segs);
+		return node;
+	}
+
+	BSPSeg part = segs[best];
+	node->x = part.px;
+	node->y = part.py;
+	node->dx = part.pdx;
+	node->dy = part.pdy;
+
+	std::vector<BSPSeg> front, back;
+	SplitSegs(part, segs, front, back);
+	std::vector<BSPSeg>().swap(segs);
+	node->box[0] = Bounds(front);
+	node->box[1] = Bounds(back);
+
+	// Both halves are independent of one another from here on.
+	if (workers > 1 && front.size() >= parallelSegs && back.size() >= parallelSegs) {
+		size_t frontworkers = workers / 2;
+		auto future = std::async(std::launch::async, BuildNode, std::move(front), frontworkers);
+		node->child[1] = BuildNode(std::move(back), workers - frontworkers);
+		node->child[0] = future.get();
+	} else {
+		node->child[0] = BuildNode(std::move(front), workers);
+		node->child[1] = BuildNode(std::move(back), workers);
+	}
+	return node;
+}
+
+// Serializes the finished tree.  Vertexes made by splitting segs are added
+// to the map as they're needed.
+class NodeWriter {
+	Vertexes& vertexes;
+	std::map<std::pair<long, long>, size_t> vertexids;
+	size_t numsegs;
+	size_t numssectors;
+	size_t numnodes;
+public:
+	BinaryWriter segs;
+	BinaryWriter ssectors;
+	BinaryWriter nodes;
+	NodeWriter(Vertexes& vertexes) : vertexes(vertexes), numsegs(0), numssectors(0), numnodes(0) {
+		vertexes.each([this](Vertex& vertex) {
+			this->vertexids.insert(std::make_pair(std::make_pair(long(vertex.x), long(vertex.y)), vertex.id));
+		});
+	}
+
+	size_t vertex(double x, double y) {
+		auto key = std::make_pair(std::lround(x), std::lround(y));
+		auto it = this->vertexids.find(key);
+		if (it != this->vertexids.end()) {
+			return it->second;
+		}
+
+		Vertex vertex;
+		vertex.x = static_cast<int16_t>(key.first);
+		vertex.y = static_cast<int16_t>(key.second);
+		this->vertexes.push_back(std::move(vertex));
+		size_t id = this->vertexes.size() - 1;
+		if (id > UINT16_MAX) {
+			throw std::runtime_error("Too many vertexes for vanilla nodes");
+		}
+		this->vertexids.insert(std::make_pair(key, id));
+		return id;
+	}
+
+	// Children are written before their parents, so the root node comes
+	// last.  Returns the child reference for the node.
+	uint16_t write(const BSPNode& node) {
+		if (!node.child[0]) {
+			if (this->numssectors >= subsectorBit || this->numsegs + node.segs.size() > UINT16_MAX) {
+				throw std::runtime_error("Too many subsectors for vanilla nodes");
+			}
+
+			char* record = this->segs.record(node.segs.size() * segSize);
+			for (auto& seg : node.segs) {
+				double angle = std::atan2(static_cast<double>(seg.pdy), static_cast<double>(seg.pdx));
+				StoreLE<uint16_t>(record, this->vertex(seg.x1, seg.y1));
+				StoreLE<uint16_t>(record + 2, this->vertex(seg.x2, seg.y2));
+				StoreLE<uint16_t>(record + 4, static_cast<uint16_t>(std::lround(angle * 32768 / pi)));
+				StoreLE<uint16_t>(record + 6, seg.linedef);
+				StoreLE<int16_t>(record + 8, seg.back ? 1 : 0);
+				StoreLE<int16_t>(record + 10, std::lround(seg.offset));
+				record += segSize;
+			}
+
+			record = this->ssectors.record(ssectorSize);
+			StoreLE<uint16_t>(record, node.segs.size());
+			StoreLE<uint16_t>(record + 2, this->numsegs);
+			this->numsegs += node.segs.size();
+			return subsectorBit | this->numssectors++;
+		}
+
+		uint16_t right = this->write(*node.child[0]);
+		uint16_t left = this->write(*node.child[1]);
+		if (this->numnodes >= subsectorBit) {
+			throw std::runtime_error("Too many nodes for vanilla nodes");
+		}
+
+		char* record = this->nodes.record(nodeSize);
+		StoreLE<int16_t>(record, node.x);
+		StoreLE<int16_t>(record + 2, node.y);
+		StoreLE<int16_t>(record + 4, node.dx);
+		StoreLE<int16_t>(record + 6, node.dy);
+		for (size_t i = 0;i < 2;i++) {
+			char* box = record + 8 + i * 8;
+			StoreLE<int16_t>(box, static_cast<int16_t>(std::ceil(node.box[i].top)));
+			StoreLE<int16_t>(box + 2, static_cast<int16_t>(std::floor(node.box[i].bottom)));
+			StoreLE<int16_t>(box + 4, static_cast<int16_t>(std::floor(node.box[i].left)));
+			StoreLE<int16_t>(box + 6, static_cast<int16_t>(std::ceil(node.box[i].right)));
+		}
+		StoreLE<uint16_t>(record + 24, right);
+		StoreLE<uint16_t>(record + 26, left);
+		return this->numnodes++;
+	}
+};
+
+NodeBuilder::NodeBuilder() : workers(0) { }
+
+// Replace the map's NODES, SEGS and SSECTORS.  The map is compacted first,
+// and any vertexes created by splitting segs are added to it.
+void NodeBuilder::build(DoomMap& map) {
+	map.compact();
+
+	size_t workers = this->workers;
+	if (workers == 0) {
+		workers = std::thread::hardware_concurrency();
+	}
+	if (workers == 0) {
+		workers = 1;
+	}
+
+	// Each side of each linedef starts out as one seg.
+	std::vector<BSPSeg> segs;
+	map.getLinedefs().each([&segs](DoomLinedef& linedef) {
+		auto startvertex = linedef.startvertex.lock();
+		auto endvertex = linedef.endvertex.lock();
+		if (!startvertex || !endvertex) {
+			throw std::runtime_error("Linedef is missing a vertex");
+		}
+
+		BSPSeg seg;
+		seg.linedef = linedef.id;
+		seg.offset = 0;
+		seg.pdx = endvertex->x - startvertex->x;
+		seg.pdy = endvertex->y - startvertex->y;
+		seg.plength = std::hypot(seg.pdx, seg.pdy);
+		if (seg.plength == 0) {
+			return;
+		}
+
+		auto frontsidedef = linedef.frontsidedef.lock();
+		if (frontsidedef) {
+			auto sector = frontsidedef->sector.lock();
+			seg.sector = sector ? sector->id : Sectors::npos;
+			seg.back = false;
+			seg.x1 = seg.px = startvertex->x;
+			seg.y1 = seg.py = startvertex->y;
+			seg.x2 = endvertex->x;
+			seg.y2 = endvertex->y;
+			segs.push_back(seg);
+		}
+
+		auto backsidedef = linedef.backsidedef.lock();
+		if (backsidedef) {
+			auto sector = backsidedef->sector.lock();
+			seg.sector = sector ? sector->id : Sectors::npos;
+			seg.back = true;
+			seg.x1 = seg.px = endvertex->x;
+			seg.y1 = seg.py = endvertex->y;
+			seg.x2 = startvertex->x;
+			seg.y2 = startvertex->y;
+			seg.pdx = -seg.pdx;
+			seg.pdy = -seg.pdy;
+			segs.push_back(seg);
+		}
+	});
+
+	NodeWriter writer(map.getVertexes());
+	if (!segs.empty()) {
+		writer.write(*BuildNode(std::move(segs), workers));
+	}
+
+	map.setSegs(writer.segs.release());
+	map.setSsectors(writer.ssectors.release());
+	map.setNodes(writer.nodes.release());
+}
+
+// Set the number of threads used to build nodes.  0 means one thread per
+// hardware thread.
+void NodeBuilder::setWorkers(size_t workers) {
+	this->workers = workers;
+}
+
+}
@@ -0,0 +1,45 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NODEBUILDER_HH
+#define NODEBUILDER_HH
+
+#include <cstddef>
+
+#include "map.hh"
+
+namespace WADmake {
+
+// Builds vanilla NODES, SEGS and SSECTORS lumps for a DoomMap.
+//
+// Partition lines are chosen by trying the lines of the segs in the
+// current set and keeping the one that splits the fewest segs while
+// keeping the two sides balanced.  Large sets have their candidates
+// scored across several threads, and once a set has been split the two
+// halves are built in parallel.
+class NodeBuilder {
+	size_t workers;
+public:
+	NodeBuilder();
+	void build(DoomMap& map);
+	void setWorkers(size_t workers);
+};
+
+}
+
+#endif
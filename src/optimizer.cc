@@ -0,0 +1,180 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "optimizer.hh"
+
+namespace WADmake {
+
+// Linedef flag for lines with a sector on both sides.
+static const size_t twoSidedFlag = 2;
+
+// Pack a pair of 32-bit numbers into a single hash key.
+static uint64_t PairKey(uint32_t a, uint32_t b) {
+	return (static_cast<uint64_t>(a) << 32) | b;
+}
+
+MapOptimizer::MapOptimizer() : tolerance(0) { }
+
+void MapOptimizer::optimize(DoomMap& map) {
+	// Start from dense IDs with no references to erased elements, so plain
+	// vectors can be indexed by ID.
+	map.compact();
+
+	// Weld vertexes.  Coordinates are quantized into cells a little larger
+	// than the tolerance, so a vertex can only be welded to one in its own
+	// cell or the eight around it.  Vertexes are visited in order, so every
+	// vertex is welded to the lowest ID in reach.
+	double cellsize = static_cast<double>(this->tolerance) + 1;
+	std::unordered_map<uint64_t, std::vector<std::shared_ptr<Vertex>>> cells;
+	std::vector<std::shared_ptr<Vertex>> welded(map.getVertexes().size());
+	map.getVertexes().each([&](Vertex& vertex) {
+		int32_t cellx = static_cast<int32_t>(std::floor(vertex.x / cellsize));
+		int32_t celly = static_cast<int32_t>(std::floor(vertex.y / cellsize));
+		std::shared_ptr<Vertex> best;
+		for (int32_t y = celly - 1;y <= celly + 1;y++) {
+			for (int32_t x = cellx - 1;x <= cellx + 1;x++) {
+				auto it = cells.find(PairKey(x, y));
+				if (it == cells.end()) {
+					continue;
+				}
+				for (auto& other : it->second) {
+					if (std::abs(other->x - vertex.x) <= this->tolerance &&
+					    std::abs(other->y - vertex.y) <= this->tolerance &&
+					    (!best || other->id < best->id)) {
+						best = other;
+					}
+				}
+			}
+		}
+		if (best) {
+			welded[vertex.id] = best;
+		} else {
+			welded[vertex.id] = map.getVertexes().lock(vertex.id);
+			cells[PairKey(cellx, celly)].push_back(welded[vertex.id]);
+		}
+	});
+
+	// Point linedefs at the welded vertexes, dropping any that collapse to
+	// nothing and merging any that run between the same two vertexes.
+	std::unordered_map<uint64_t, std::shared_ptr<DoomLinedef>> lines;
+	std::vector<size_t> drop;
+	map.getLinedefs().each([&](DoomLinedef& linedef) {
+		auto startvertex = linedef.startvertex.lock();
+		auto endvertex = linedef.endvertex.lock();
+		if (!startvertex || !endvertex) {
+			throw std::runtime_error("Linedef is missing a vertex");
+		}
+		startvertex = welded[startvertex->id];
+		endvertex = welded[endvertex->id];
+		linedef.startvertex = startvertex;
+		linedef.endvertex = endvertex;
+		if (startvertex == endvertex) {
+			drop.push_back(linedef.id);
+			return;
+		}
+
+		uint64_t key = PairKey(std::min(startvertex->id, endvertex->id), std::max(startvertex->id, endvertex->id));
+		auto it = lines.find(key);
+		if (it == lines.end()) {
+			lines.insert(std::make_pair(key, map.getLinedefs().lock(linedef.id)));
+			return;
+		}
+
+		// The duplicate can fill in the back of a one-sided line, with
+		// whichever of its sides faces the same way.
+		DoomLinedef& kept = *it->second;
+		bool reversed = kept.startvertex.lock() != startvertex;
+		auto backsidedef = reversed ? linedef.frontsidedef.lock() : linedef.backsidedef.lock();
+		if (!kept.backsidedef.lock() && backsidedef) {
+			kept.backsidedef = backsidedef;
+			kept.flags.set(twoSidedFlag);
+		}
+		if (kept.special == 0 && linedef.special != 0) {
+			kept.special = linedef.special;
+			kept.tag = linedef.tag;
+		}
+		drop.push_back(linedef.id);
+	});
+	map.getLinedefs().erase(drop);
+
+	// Sweep away whatever is no longer referred to.
+	std::vector<bool> usedsidedefs(map.getSidedefs().size(), false);
+	std::vector<bool> usedvertexes(map.getVertexes().size(), false);
+	map.getLinedefs().each([&](DoomLinedef& linedef) {
+		usedvertexes[linedef.startvertex.lock()->id] = true;
+		usedvertexes[linedef.endvertex.lock()->id] = true;
+		auto frontsidedef = linedef.frontsidedef.lock();
+		if (frontsidedef) {
+			usedsidedefs[frontsidedef->id] = true;
+		}
+		auto backsidedef = linedef.backsidedef.lock();
+		if (backsidedef) {
+			usedsidedefs[backsidedef->id] = true;
+		}
+	});
+
+	drop.clear();
+	std::vector<bool> usedsectors(map.getSectors().size(), false);
+	map.getSidedefs().each([&](Sidedef& sidedef) {
+		if (!usedsidedefs[sidedef.id]) {
+			drop.push_back(sidedef.id);
+			return;
+		}
+		auto sector = sidedef.sector.lock();
+		if (sector) {
+			usedsectors[sector->id] = true;
+		}
+	});
+	map.getSidedefs().erase(drop);
+
+	drop.clear();
+	map.getSectors().each([&](Sector& sector) {
+		if (!usedsectors[sector.id]) {
+			drop.push_back(sector.id);
+		}
+	});
+	map.getSectors().erase(drop);
+
+	drop.clear();
+	map.getVertexes().each([&](Vertex& vertex) {
+		if (!usedvertexes[vertex.id]) {
+			drop.push_back(vertex.id);
+		}
+	});
+	map.getVertexes().erase(drop);
+
+	map.compact();
+}
+
+// Set how far apart, on either axis, two vertexes can be and still be
+// welded together.  0 only welds vertexes in exactly the same place.
+void MapOptimizer::setTolerance(int32_t tolerance) {
+	if (tolerance < 0) {
+		throw std::out_of_range("Tolerance must not be negative");
+	}
+	this->tolerance = tolerance;
+}
+
+}
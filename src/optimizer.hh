@@ -0,0 +1,45 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OPTIMIZER_HH
+#define OPTIMIZER_HH
+
+#include <cstdint>
+
+#include "map.hh"
+
+namespace WADmake {
+
+// Cleans up the geometry editors tend to leave behind in a DoomMap.
+//
+// Vertexes within the tolerance of one another are welded together,
+// linedefs that end up with no length are dropped and linedefs between the
+// same two vertexes are merged into one.  Sidedefs, sectors and vertexes
+// that nothing refers to any more are then removed and the map compacted.
+// Nodes, blockmap and reject are left alone and need to be rebuilt.
+class MapOptimizer {
+	int32_t tolerance;
+public:
+	MapOptimizer();
+	void optimize(DoomMap& map);
+	void setTolerance(int32_t tolerance);
+};
+
+}
+
+#endif
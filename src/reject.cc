@@ -0,0 +1,422 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "reject.hh"
+
+namespace WADmake {
+
+// Slack given to every side test, in map units.  Lines of sight have to
+// cross a two-sided linedef at least this far from where it was entered,
+// and gaps any narrower than this are closed, so sight lines that only
+// graze a vertex don't count.  That matches the engine's own sight checks,
+// which treat touching the end of a one-sided linedef as blocked.
+static const double sightEpsilon = 1.0 / 1024;
+
+// Portal steps followed from each exit.  Past that, any exit that is still
+// in sight counts as seeing everything it might see.
+static const size_t sightBudget = 1 << 12;
+
+// Exits followed between each update of mightsee.
+static const size_t sightBatch = 64;
+
+struct SightPoint {
+	double x, y;
+};
+
+struct SightSegment {
+	SightPoint p1, p2;
+};
+
+// A two-sided linedef.
+struct SightPortal {
+	SightSegment segment;
+	size_t front, back;
+};
+
+// A way out of a sector, along with the side of the portal it leads to.
+// Each portal has two of them, numbered portal * 2 and portal * 2 + 1.
+struct SightExit {
+	size_t index;
+	size_t portal;
+	size_t sector;
+	double side;
+};
+
+// Everything the sight checks need, shared read-only between threads.
+// mightsee has a row of sector bits for each exit, covering every sector
+// that a line of sight could reach after taking it.
+struct SightMap {
+	std::vector<SightPortal> portals;
+	std::vector<std::vector<SightExit>> exits;
+	size_t words;
+	std::vector<uint64_t> mightsee;
+};
+
+// Per-thread state for following sight lines out of one exit.
+struct SightFlow {
+	const SightMap& sight;
+	uint64_t* row;
+	std::vector<bool> passed;
+	std::deque<std::vector<uint64_t>> might;
+	size_t steps;
+
+	SightFlow(const SightMap& sight) : sight(sight), row(nullptr),
+		passed(sight.portals.size(), false), steps(0) { }
+};
+
+static size_t Popcount(uint64_t bits) {
+	size_t count = 0;
+	for (;bits;bits &= bits - 1) {
+		count++;
+	}
+	return count;
+}
+
+// Distance of c from the line through a and b, positive on its left.
+static double Side(const SightPoint& a, const SightPoint& b, const SightPoint& c) {
+	double length = std::hypot(b.x - a.x, b.y - a.y);
+	return ((b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x)) / length;
+}
+
+// Cut away the part of a segment that is less than margin onto the given
+// side of the line through a and b.  Returns false if nothing is left.  A
+// line too short to have a direction doesn't cut anything.
+static bool ClipSegment(SightSegment& segment, const SightPoint& a, const SightPoint& b,
+                        double side, double margin) {
+	if (std::hypot(b.x - a.x, b.y - a.y) < sightEpsilon) {
+		return true;
+	}
+	double d1 = side * Side(a, b, segment.p1) - margin;
+	double d2 = side * Side(a, b, segment.p2) - margin;
+	if (d1 >= 0 && d2 >= 0) {
+		return true;
+	}
+	if (d1 < 0 && d2 < 0) {
+		return false;
+	}
+
+	double t = d1 / (d1 - d2);
+	SightPoint cut = { segment.p1.x + t * (segment.p2.x - segment.p1.x),
+	                   segment.p1.y + t * (segment.p2.y - segment.p1.y) };
+	if (d1 < 0) {
+		segment.p1 = cut;
+	} else {
+		segment.p2 = cut;
+	}
+	return true;
+}
+
+// Any line of sight that crosses both source and pass has to stay between
+// the lines that run from an end of one to an end of the other with the
+// two segments on opposite sides.  Cut target down to that area.
+static bool ClipToSeparators(const SightSegment& source, const SightSegment& pass, SightSegment& target) {
+	const SightPoint s[2] = { source.p1, source.p2 };
+	const SightPoint q[2] = { pass.p1, pass.p2 };
+	for (int i = 0;i < 2;i++) {
+		for (int j = 0;j < 2;j++) {
+			if (std::hypot(q[j].x - s[i].x, q[j].y - s[i].y) < sightEpsilon) {
+				continue;
+			}
+			double ds = Side(s[i], q[j], s[1 - i]);
+			double dq = Side(s[i], q[j], q[1 - j]);
+			if (std::abs(ds) < sightEpsilon) {
+				continue;
+			}
+			double side = ds > 0 ? -1 : 1;
+			if (side * dq < -sightEpsilon) {
+				continue;
+			}
+			if (!ClipSegment(target, s[i], q[j], side, -sightEpsilon)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Follow every line of sight that came from source and entered sector
+// through pass, marking each sector it reaches.  Walls inside sectors are
+// never checked, so this only ever errs on the side of visible.
+// flow.might[depth] holds the sectors these lines could still reach.
+static void FlowSight(SightFlow& flow, size_t sector, const SightSegment& source,
+                      const SightSegment& pass, double passside, size_t depth) {
+	const SightMap& sight = flow.sight;
+	while (flow.might.size() <= depth + 1) {
+		flow.might.emplace_back(sight.words);
+	}
+	const std::vector<uint64_t>& might = flow.might[depth];
+	std::vector<uint64_t>& next = flow.might[depth + 1];
+
+	for (const SightExit& exit : sight.exits[sector]) {
+		if (flow.passed[exit.portal]) {
+			continue;
+		}
+
+		// Don't bother if everything past this exit is already visible.
+		const uint64_t* mightsee = &sight.mightsee[exit.index * sight.words];
+		bool more = false;
+		for (size_t i = 0;i < sight.words;i++) {
+			next[i] = might[i] & mightsee[i];
+			if (next[i] & ~flow.row[i]) {
+				more = true;
+			}
+		}
+		if (!more) {
+			continue;
+		}
+
+		SightSegment target = sight.portals[exit.portal].segment;
+		if (!ClipSegment(target, pass.p1, pass.p2, passside, sightEpsilon)) {
+			continue;
+		}
+		if (!ClipToSeparators(source, pass, target)) {
+			continue;
+		}
+		if (std::hypot(target.p2.x - target.p1.x, target.p2.y - target.p1.y) < sightEpsilon) {
+			continue;
+		}
+
+		// Looking back the other way, only part of the source might be
+		// able to see what is left of the target.
+		SightSegment nextsource = source;
+		if (!ClipToSeparators(target, pass, nextsource)) {
+			continue;
+		}
+
+		flow.row[exit.sector / 64] |= uint64_t(1) << (exit.sector % 64);
+		if (++flow.steps > sightBudget) {
+			for (size_t i = 0;i < sight.words;i++) {
+				flow.row[i] |= next[i];
+			}
+			continue;
+		}
+		flow.passed[exit.portal] = true;
+		FlowSight(flow, exit.sector, nextsource, target, exit.side, depth + 1);
+		flow.passed[exit.portal] = false;
+	}
+}
+
+// Any line of sight between two sectors has to leave the first one and
+// enter the second one through a chain of two-sided linedefs, so those
+// are all the sight checks look at.
+static SightMap BuildSightMap(DoomMap& map) {
+	SightMap sight;
+	size_t numsectors = map.getSectors().size();
+	sight.exits.resize(numsectors);
+
+	map.getLinedefs().each([&](DoomLinedef& linedef) {
+		auto startvertex = linedef.startvertex.lock();
+		auto endvertex = linedef.endvertex.lock();
+		if (!startvertex || !endvertex) {
+			throw std::runtime_error("Linedef is missing a vertex");
+		}
+
+		auto frontsidedef = linedef.frontsidedef.lock();
+		auto backsidedef = linedef.backsidedef.lock();
+		auto frontsector = frontsidedef ? frontsidedef->sector.lock() : nullptr;
+		auto backsector = backsidedef ? backsidedef->sector.lock() : nullptr;
+		if (!frontsector || !backsector) {
+			return;
+		}
+
+		SightPortal portal;
+		portal.segment.p1.x = startvertex->x;
+		portal.segment.p1.y = startvertex->y;
+		portal.segment.p2.x = endvertex->x;
+		portal.segment.p2.y = endvertex->y;
+		portal.front = frontsector->id;
+		portal.back = backsector->id;
+		if (std::hypot(portal.segment.p2.x - portal.segment.p1.x,
+		               portal.segment.p2.y - portal.segment.p1.y) < sightEpsilon) {
+			return;
+		}
+
+		// The front side is on the right of a linedef, so crossing it
+		// from the front leads to its left.
+		size_t index = sight.portals.size();
+		sight.portals.push_back(portal);
+		SightExit forward = { index * 2, index, portal.back, 1 };
+		SightExit backward = { index * 2 + 1, index, portal.front, -1 };
+		sight.exits[portal.front].push_back(forward);
+		sight.exits[portal.back].push_back(backward);
+	});
+	// A line of sight can never come back across an exit it took, so
+	// flood out from each exit through every portal that is at least
+	// partly on its far side.
+	sight.words = (numsectors + 63) / 64;
+	sight.mightsee.resize(sight.portals.size() * 2 * sight.words);
+	std::vector<size_t> queue;
+	for (size_t sector = 0;sector < numsectors;sector++) {
+		for (const SightExit& exit : sight.exits[sector]) {
+			const SightSegment& segment = sight.portals[exit.portal].segment;
+			uint64_t* mightsee = &sight.mightsee[exit.index * sight.words];
+			mightsee[exit.sector / 64] |= uint64_t(1) << (exit.sector % 64);
+			queue.assign(1, exit.sector);
+			while (!queue.empty()) {
+				size_t from = queue.back();
+				queue.pop_back();
+				for (const SightExit& next : sight.exits[from]) {
+					if (next.portal == exit.portal ||
+					    mightsee[next.sector / 64] & (uint64_t(1) << (next.sector % 64))) {
+						continue;
+					}
+					SightSegment target = sight.portals[next.portal].segment;
+					if (ClipSegment(target, segment.p1, segment.p2, exit.side, sightEpsilon)) {
+						mightsee[next.sector / 64] |= uint64_t(1) << (next.sector % 64);
+						queue.push_back(next.sector);
+					}
+				}
+			}
+		}
+	}
+
+	return sight;
+}
+
+RejectBuilder::RejectBuilder() : mode(RejectBuilder::Mode::SIGHT), workers(0) { }
+
+// Replace the map's REJECT.  The map is compacted first, so sector IDs
+// match the sectors that will be written.
+void RejectBuilder::build(DoomMap& map) {
+	map.compact();
+
+	size_t numsectors = map.getSectors().size();
+	std::string reject((numsectors * numsectors + 7) / 8, '\0');
+	if (this->mode == RejectBuilder::Mode::VISIBLE) {
+		map.setReject(std::move(reject));
+		return;
+	}
+
+	SightMap sight = BuildSightMap(map);
+	size_t words = sight.words;
+	size_t numexits = sight.portals.size() * 2;
+
+	// Follow sight out of each exit on its own.  The exits that might see
+	// the least go first, and once a batch of them is done what they really
+	// see replaces their mightsee, so later exits can stop at them sooner.
+	// Batches don't depend on the number of threads, so neither does the
+	// output.
+	std::vector<size_t> counts(numexits, 0);
+	for (size_t e = 0;e < numexits;e++) {
+		for (size_t i = 0;i < words;i++) {
+			counts[e] += Popcount(sight.mightsee[e * words + i]);
+		}
+	}
+	std::vector<size_t> order(numexits);
+	for (size_t e = 0;e < numexits;e++) {
+		order[e] = e;
+	}
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return counts[a] < counts[b];
+	});
+
+	size_t workers = this->workers;
+	if (workers == 0) {
+		workers = std::thread::hardware_concurrency();
+	}
+	if (workers == 0) {
+		workers = 1;
+	}
+
+	std::vector<uint64_t> sees(numexits * words, 0);
+	for (size_t batch = 0;batch < numexits;batch += sightBatch) {
+		size_t end = std::min(batch + sightBatch, numexits);
+		std::atomic<size_t> nextexit(batch);
+		auto work = [&]() {
+			SightFlow flow(sight);
+			flow.might.emplace_back(words);
+			for (size_t i = nextexit++;i < end;i = nextexit++) {
+				size_t e = order[i];
+				const SightPortal& portal = sight.portals[e / 2];
+				size_t sector = e % 2 ? portal.front : portal.back;
+				double side = e % 2 ? -1 : 1;
+
+				flow.row = &sees[e * words];
+				flow.row[sector / 64] |= uint64_t(1) << (sector % 64);
+				flow.steps = 0;
+				std::copy(&sight.mightsee[e * words], &sight.mightsee[(e + 1) * words],
+				          flow.might[0].begin());
+				flow.passed[e / 2] = true;
+				FlowSight(flow, sector, portal.segment, portal.segment, side, 0);
+				flow.passed[e / 2] = false;
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for (size_t i = 1;i < workers && batch + i < end;i++) {
+			threads.push_back(std::thread(work));
+		}
+		work();
+		for (auto& thread : threads) {
+			thread.join();
+		}
+
+		for (size_t i = batch;i < end;i++) {
+			size_t e = order[i];
+			std::copy(&sees[e * words], &sees[(e + 1) * words], &sight.mightsee[e * words]);
+		}
+	}
+
+	// A sector sees itself and whatever its exits see.  Sight goes both
+	// ways, so a pair only needs to be found from one end.
+	std::vector<uint64_t> visible(numsectors * words, 0);
+	for (size_t a = 0;a < numsectors;a++) {
+		uint64_t* row = &visible[a * words];
+		row[a / 64] |= uint64_t(1) << (a % 64);
+		for (const SightExit& exit : sight.exits[a]) {
+			for (size_t i = 0;i < words;i++) {
+				row[i] |= sees[exit.index * words + i];
+			}
+		}
+	}
+
+	// Sectors that can't see one another get their bit set.
+	for (size_t a = 0;a < numsectors;a++) {
+		for (size_t b = 0;b < numsectors;b++) {
+			bool ab = visible[a * words + b / 64] & (uint64_t(1) << (b % 64));
+			bool ba = visible[b * words + a / 64] & (uint64_t(1) << (a % 64));
+			if (!ab && !ba) {
+				size_t bit = a * numsectors + b;
+				reject[bit / 8] |= static_cast<char>(1 << (bit % 8));
+			}
+		}
+	}
+
+	map.setReject(std::move(reject));
+}
+
+void RejectBuilder::setMode(RejectBuilder::Mode mode) {
+	this->mode = mode;
+}
+
+// Set the number of threads used to check sight lines.  0 means one thread
+// per hardware thread.
+void RejectBuilder::setWorkers(size_t workers) {
+	this->workers = workers;
+}
+
+}
@@ -0,0 +1,50 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REJECT_HH
+#define REJECT_HH
+
+#include <cstddef>
+
+#include "map.hh"
+
+namespace WADmake {
+
+// Builds a vanilla REJECT lump for a DoomMap.
+//
+// VISIBLE marks every sector as able to see every other sector, which is
+// always safe.  SIGHT follows lines of sight out of each sector through
+// chains of two-sided linedefs, narrowing them down at each step, and only
+// rejects sectors that none of them can reach.  It never looks at walls
+// inside a sector, so it can miss some rejections but never rejects a pair
+// that can see each other.  The work is split up between threads.
+class RejectBuilder {
+public:
+	enum class Mode { VISIBLE, SIGHT };
+	RejectBuilder();
+	void build(DoomMap& map);
+	void setMode(RejectBuilder::Mode mode);
+	void setWorkers(size_t workers);
+private:
+	Mode mode;
+	size_t workers;
+};
+
+}
+
+#endif
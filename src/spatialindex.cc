@@ -0,0 +1,344 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+#include "blockmap.hh"
+#include "spatialindex.hh"
+
+namespace WADmake {
+
+// Counting sort element slots into the cells they were found in.
+template<class G>
+static void FillGrid(G& grid, size_t numcells, const std::vector<uint32_t>& cells,
+                     const std::vector<uint32_t>& slots) {
+	grid.starts.assign(numcells + 1, 0);
+	for (uint32_t cell : cells) {
+		grid.starts[cell + 1] += 1;
+	}
+	for (size_t i = 0;i < numcells;i++) {
+		grid.starts[i + 1] += grid.starts[i];
+	}
+	grid.slots.resize(cells.size());
+	std::vector<uint32_t> next(grid.starts.begin(), grid.starts.end() - 1);
+	for (size_t i = 0;i < cells.size();i++) {
+		grid.slots[next[cells[i]]++] = slots[i];
+	}
+}
+
+// Clip a line to a box, returning true if any of it is left.
+static bool LineInBox(double x1, double y1, double x2, double y2,
+                      double left, double bottom, double right, double top) {
+	double dx = x2 - x1, dy = y2 - y1;
+	double p[4] = { -dx, dx, -dy, dy };
+	double q[4] = { x1 - left, right - x1, y1 - bottom, top - y1 };
+	double t0 = 0, t1 = 1;
+	for (int i = 0;i < 4;i++) {
+		if (p[i] == 0) {
+			if (q[i] < 0) {
+				return false;
+			}
+			continue;
+		}
+		double t = q[i] / p[i];
+		if (p[i] < 0) {
+			t0 = std::max(t0, t);
+		} else {
+			t1 = std::min(t1, t);
+		}
+		if (t0 > t1) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Squared distance from a point to a line.
+static double LineDistance(double x, double y, double x1, double y1, double x2, double y2) {
+	double dx = x2 - x1, dy = y2 - y1;
+	double length = dx * dx + dy * dy;
+	double t = 0;
+	if (length > 0) {
+		t = std::max(0.0, std::min(1.0, ((x - x1) * dx + (y - y1) * dy) / length));
+	}
+	double px = x1 + t * dx - x, py = y1 + t * dy - y;
+	return px * px + py * py;
+}
+
+SpatialIndex::SpatialIndex(DoomMap& map) : originx(0), originy(0), columns(0), rows(0) {
+	map.getVertexes().each([&](Vertex& vertex) {
+		Point point = { vertex.id, static_cast<double>(vertex.x), static_cast<double>(vertex.y) };
+		this->vertexes.push_back(point);
+	});
+	map.getLinedefs().each([&](DoomLinedef& linedef) {
+		auto startvertex = linedef.startvertex.lock();
+		auto endvertex = linedef.endvertex.lock();
+		if (!startvertex || !endvertex) {
+			throw std::runtime_error("Linedef is missing a vertex");
+		}
+		Line line = { linedef.id, static_cast<double>(startvertex->x), static_cast<double>(startvertex->y),
+		              static_cast<double>(endvertex->x), static_cast<double>(endvertex->y) };
+		this->linedefs.push_back(line);
+	});
+	map.getThings().each([&](DoomThing& thing) {
+		Point point = { thing.id, static_cast<double>(thing.x), static_cast<double>(thing.y) };
+		this->things.push_back(point);
+	});
+
+	// The grid covers every vertex and thing, which covers every linedef.
+	bool first = true;
+	double maxx = 0, maxy = 0;
+	auto grow = [&](double x, double y) {
+		if (first) {
+			this->originx = maxx = x;
+			this->originy = maxy = y;
+			first = false;
+		}
+		this->originx = std::min(this->originx, x);
+		this->originy = std::min(this->originy, y);
+		maxx = std::max(maxx, x);
+		maxy = std::max(maxy, y);
+	};
+	for (auto& point : this->vertexes) {
+		grow(point.x, point.y);
+	}
+	for (auto& point : this->things) {
+		grow(point.x, point.y);
+	}
+	if (first) {
+		return;
+	}
+	this->columns = static_cast<int32_t>(maxx - this->originx) / blockSize + 1;
+	this->rows = static_cast<int32_t>(maxy - this->originy) / blockSize + 1;
+	size_t numcells = static_cast<size_t>(this->columns) * this->rows;
+
+	std::vector<uint32_t> cells, slots;
+	auto fillpoints = [&](Grid& grid, const std::vector<Point>& points) {
+		cells.clear();
+		slots.clear();
+		for (uint32_t i = 0;i < points.size();i++) {
+			int32_t column = static_cast<int32_t>(points[i].x - this->originx) / blockSize;
+			int32_t row = static_cast<int32_t>(points[i].y - this->originy) / blockSize;
+			cells.push_back(row * this->columns + column);
+			slots.push_back(i);
+		}
+		FillGrid(grid, numcells, cells, slots);
+	};
+	fillpoints(this->vertexgrid, this->vertexes);
+	fillpoints(this->thinggrid, this->things);
+
+	cells.clear();
+	slots.clear();
+	for (uint32_t i = 0;i < this->linedefs.size();i++) {
+		const Line& line = this->linedefs[i];
+		WalkBlocks(line.x1 - this->originx, line.y1 - this->originy,
+		           line.x2 - this->originx, line.y2 - this->originy, this->columns, cells);
+		slots.resize(cells.size(), i);
+	}
+	FillGrid(this->linedefgrid, numcells, cells, slots);
+}
+
+// Call func on the slot of every element in the cells overlapping a box.
+// The box's edges are inclusive.
+template<class T, class F>
+void SpatialIndex::search(const Grid& grid, const std::vector<T>& elements,
+                          double x1, double y1, double x2, double y2, F func) const {
+	if (x1 > x2) {
+		std::swap(x1, x2);
+	}
+	if (y1 > y2) {
+		std::swap(y1, y2);
+	}
+
+	double column1 = std::floor((x1 - this->originx) / blockSize);
+	double column2 = std::floor((x2 - this->originx) / blockSize);
+	double row1 = std::floor((y1 - this->originy) / blockSize);
+	double row2 = std::floor((y2 - this->originy) / blockSize);
+	if (column2 < 0 || row2 < 0 || column1 >= this->columns || row1 >= this->rows) {
+		return;
+	}
+	int32_t left = static_cast<int32_t>(std::max<double>(column1, 0));
+	int32_t right = static_cast<int32_t>(std::min<double>(column2, this->columns - 1));
+	int32_t bottom = static_cast<int32_t>(std::max<double>(row1, 0));
+	int32_t top = static_cast<int32_t>(std::min<double>(row2, this->rows - 1));
+
+	for (int32_t row = bottom;row <= top;row++) {
+		for (int32_t column = left;column <= right;column++) {
+			size_t cell = static_cast<size_t>(row) * this->columns + column;
+			for (size_t i = grid.starts[cell];i < grid.starts[cell + 1];i++) {
+				func(grid.slots[i], elements[grid.slots[i]]);
+			}
+		}
+	}
+}
+
+// Find the slot of the element closest to a point, searching outwards one
+// ring of cells at a time until nothing further out could be any closer.
+template<class T, class F>
+size_t SpatialIndex::nearest(const Grid& grid, const std::vector<T>& elements,
+                             double x, double y, F distance) const {
+	if (elements.empty()) {
+		return IndexedMap<T>::npos;
+	}
+
+	// Points off the edge of the grid start from the closest cell on it.
+	double maxcolumn = this->columns - 1, maxrow = this->rows - 1;
+	double cellx = std::floor((x - this->originx) / blockSize);
+	double celly = std::floor((y - this->originy) / blockSize);
+	int32_t column = static_cast<int32_t>(std::max(0.0, std::min(cellx, maxcolumn)));
+	int32_t row = static_cast<int32_t>(std::max(0.0, std::min(celly, maxrow)));
+
+	size_t best = IndexedMap<T>::npos;
+	double bestdistance = std::numeric_limits<double>::infinity();
+	auto visit = [&](int32_t c, int32_t r) {
+		if (c < 0 || r < 0 || c >= this->columns || r >= this->rows) {
+			return;
+		}
+		size_t cell = static_cast<size_t>(r) * this->columns + c;
+		for (size_t i = grid.starts[cell];i < grid.starts[cell + 1];i++) {
+			uint32_t slot = grid.slots[i];
+			double d = distance(elements[slot]);
+			if (d < bestdistance || (d == bestdistance && slot < best)) {
+				best = slot;
+				bestdistance = d;
+			}
+		}
+	};
+
+	const double inf = std::numeric_limits<double>::infinity();
+	for (int32_t ring = 0;;ring++) {
+		for (int32_t r = row - ring;r <= row + ring;r++) {
+			if (r == row - ring || r == row + ring) {
+				for (int32_t c = column - ring;c <= column + ring;c++) {
+					visit(c, r);
+				}
+			} else {
+				visit(column - ring, r);
+				if (ring > 0) {
+					visit(column + ring, r);
+				}
+			}
+		}
+
+		// Everything not visited yet lies past one of the edges of the
+		// square of rings so far that hasn't reached the edge of the grid.
+		double left = column - ring > 0 ? x - (this->originx + static_cast<double>(column - ring) * blockSize) : inf;
+		double right = column + ring < maxcolumn ? this->originx + static_cast<double>(column + ring + 1) * blockSize - x : inf;
+		double bottom = row - ring > 0 ? y - (this->originy + static_cast<double>(row - ring) * blockSize) : inf;
+		double top = row + ring < maxrow ? this->originy + static_cast<double>(row + ring + 1) * blockSize - y : inf;
+		double bound = std::min(std::min(left, right), std::min(bottom, top));
+		if (bound == inf || (bound > 0 && bestdistance <= bound * bound)) {
+			break;
+		}
+	}
+
+	return best;
+}
+
+// Find every linedef that crosses or touches a box.
+std::vector<size_t> SpatialIndex::linedefsInBox(double x1, double y1, double x2, double y2) const {
+	double left = std::min(x1, x2), right = std::max(x1, x2);
+	double bottom = std::min(y1, y2), top = std::max(y1, y2);
+	std::vector<uint32_t> slots;
+	this->search(this->linedefgrid, this->linedefs, x1, y1, x2, y2, [&](uint32_t slot, const Line& line) {
+		if (LineInBox(line.x1, line.y1, line.x2, line.y2, left, bottom, right, top)) {
+			slots.push_back(slot);
+		}
+	});
+
+	// Linedefs show up once for every cell they cross.
+	std::sort(slots.begin(), slots.end());
+	slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+	std::vector<size_t> ids;
+	ids.reserve(slots.size());
+	for (uint32_t slot : slots) {
+		ids.push_back(this->linedefs[slot].id);
+	}
+	return ids;
+}
+
+// Find every thing inside a box.
+std::vector<size_t> SpatialIndex::thingsInBox(double x1, double y1, double x2, double y2) const {
+	double left = std::min(x1, x2), right = std::max(x1, x2);
+	double bottom = std::min(y1, y2), top = std::max(y1, y2);
+	std::vector<uint32_t> slots;
+	this->search(this->thinggrid, this->things, x1, y1, x2, y2, [&](uint32_t slot, const Point& point) {
+		if (point.x >= left && point.x <= right && point.y >= bottom && point.y <= top) {
+			slots.push_back(slot);
+		}
+	});
+
+	std::sort(slots.begin(), slots.end());
+	std::vector<size_t> ids;
+	ids.reserve(slots.size());
+	for (uint32_t slot : slots) {
+		ids.push_back(this->things[slot].id);
+	}
+	return ids;
+}
+
+// Find every vertex inside a box.
+std::vector<size_t> SpatialIndex::vertexesInBox(double x1, double y1, double x2, double y2) const {
+	double left = std::min(x1, x2), right = std::max(x1, x2);
+	double bottom = std::min(y1, y2), top = std::max(y1, y2);
+	std::vector<uint32_t> slots;
+	this->search(this->vertexgrid, this->vertexes, x1, y1, x2, y2, [&](uint32_t slot, const Point& point) {
+		if (point.x >= left && point.x <= right && point.y >= bottom && point.y <= top) {
+			slots.push_back(slot);
+		}
+	});
+
+	std::sort(slots.begin(), slots.end());
+	std::vector<size_t> ids;
+	ids.reserve(slots.size());
+	for (uint32_t slot : slots) {
+		ids.push_back(this->vertexes[slot].id);
+	}
+	return ids;
+}
+
+// Find the linedef closest to a point, or npos if there are none.  Ties go
+// to the lowest ID.
+size_t SpatialIndex::nearestLinedef(double x, double y) const {
+	size_t slot = this->nearest(this->linedefgrid, this->linedefs, x, y, [&](const Line& line) {
+		return LineDistance(x, y, line.x1, line.y1, line.x2, line.y2);
+	});
+	return slot == IndexedMap<Line>::npos ? slot : this->linedefs[slot].id;
+}
+
+// Find the thing closest to a point, or npos if there are none.
+size_t SpatialIndex::nearestThing(double x, double y) const {
+	size_t slot = this->nearest(this->thinggrid, this->things, x, y, [&](const Point& point) {
+		return (point.x - x) * (point.x - x) + (point.y - y) * (point.y - y);
+	});
+	return slot == IndexedMap<Point>::npos ? slot : this->things[slot].id;
+}
+
+// Find the vertex closest to a point, or npos if there are none.
+size_t SpatialIndex::nearestVertex(double x, double y) const {
+	size_t slot = this->nearest(this->vertexgrid, this->vertexes, x, y, [&](const Point& point) {
+		return (point.x - x) * (point.x - x) + (point.y - y) * (point.y - y);
+	});
+	return slot == IndexedMap<Point>::npos ? slot : this->vertexes[slot].id;
+}
+
+}
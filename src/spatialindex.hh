@@ -0,0 +1,76 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPATIALINDEX_HH
+#define SPATIALINDEX_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "map.hh"
+
+namespace WADmake {
+
+// A uniform grid of 128x128 cells over the vertexes, linedefs and things of
+// a DoomMap, for finding what lies inside a box or closest to a point.
+//
+// The grid is built in bulk from a snapshot of the map, so it has to be
+// rebuilt after the map is edited.  Queries return the IDs the elements
+// had in the map, in ascending order, and are safe to run from several
+// threads at once.
+class SpatialIndex {
+	// Each kind of element keeps its cells as a list of offsets into one
+	// array of element slots.
+	struct Grid {
+		std::vector<uint32_t> starts;
+		std::vector<uint32_t> slots;
+	};
+	struct Point {
+		size_t id;
+		double x, y;
+	};
+	struct Line {
+		size_t id;
+		double x1, y1, x2, y2;
+	};
+
+	double originx, originy;
+	int32_t columns, rows;
+	std::vector<Point> vertexes;
+	std::vector<Line> linedefs;
+	std::vector<Point> things;
+	Grid vertexgrid, linedefgrid, thinggrid;
+
+	template<class T, class F> void search(const Grid& grid, const std::vector<T>& elements,
+	                                       double x1, double y1, double x2, double y2, F func) const;
+	template<class T, class F> size_t nearest(const Grid& grid, const std::vector<T>& elements,
+	                                          double x, double y, F distance) const;
+public:
+	SpatialIndex(DoomMap& map);
+	std::vector<size_t> linedefsInBox(double x1, double y1, double x2, double y2) const;
+	std::vector<size_t> thingsInBox(double x1, double y1, double x2, double y2) const;
+	std::vector<size_t> vertexesInBox(double x1, double y1, double x2, double y2) const;
+	size_t nearestLinedef(double x, double y) const;
+	size_t nearestThing(double x, double y) const;
+	size_t nearestVertex(double x, double y) const;
+};
+
+}
+
+#endif
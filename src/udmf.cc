@@ -0,0 +1,810 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "udmf.hh"
+
+namespace WADmake {
+
+// Every block name and field name the reader knows about.
+enum class TextmapKey {
+	UNKNOWN,
+	NAMESPACE, VERTEX, LINEDEF, SIDEDEF, SECTOR, THING,
+	X, Y, V1, V2, SIDEFRONT, SIDEBACK, SPECIAL, ID,
+	BLOCKING, BLOCKMONSTERS, TWOSIDED, DONTPEGTOP, DONTPEGBOTTOM, SECRET,
+	BLOCKSOUND, DONTDRAW, MAPPED, PASSUSE,
+	OFFSETX, OFFSETY, TEXTURETOP, TEXTUREBOTTOM, TEXTUREMIDDLE,
+	HEIGHTFLOOR, HEIGHTCEILING, TEXTUREFLOOR, TEXTURECEILING, LIGHTLEVEL,
+	ANGLE, TYPE, SKILL1, SKILL2, SKILL3, SKILL4, SKILL5,
+	AMBUSH, SINGLE, DM, COOP, FRIEND
+};
+
+struct TextmapKeyName {
+	const char* name;
+	TextmapKey key;
+};
+
+static const TextmapKeyName textmapKeys[] = {
+	{ "namespace", TextmapKey::NAMESPACE }, { "vertex", TextmapKey::VERTEX },
+	{ "linedef", TextmapKey::LINEDEF }, { "sidedef", TextmapKey::SIDEDEF },
+	{ "sector", TextmapKey::SECTOR }, { "thing", TextmapKey::THING },
+	{ "x", TextmapKey::X }, { "y", TextmapKey::Y },
+	{ "v1", TextmapKey::V1 }, { "v2", TextmapKey::V2 },
+	{ "sidefront", TextmapKey::SIDEFRONT }, { "sideback", TextmapKey::SIDEBACK },
+	{ "special", TextmapKey::SPECIAL }, { "id", TextmapKey::ID },
+	{ "blocking", TextmapKey::BLOCKING }, { "blockmonsters", TextmapKey::BLOCKMONSTERS },
+	{ "twosided", TextmapKey::TWOSIDED }, { "dontpegtop", TextmapKey::DONTPEGTOP },
+	{ "dontpegbottom", TextmapKey::DONTPEGBOTTOM }, { "secret", TextmapKey::SECRET },
+	{ "blocksound", TextmapKey::BLOCKSOUND }, { "dontdraw", TextmapKey::DONTDRAW },
+	{ "mapped", TextmapKey::MAPPED }, { "passuse", TextmapKey::PASSUSE },
+	{ "offsetx", TextmapKey::OFFSETX }, { "offsety", TextmapKey::OFFSETY },
+	{ "texturetop", TextmapKey::TEXTURETOP }, { "texturebottom", TextmapKey::TEXTUREBOTTOM },
+	{ "texturemiddle", TextmapKey::TEXTUREMIDDLE },
+	{ "heightfloor", TextmapKey::HEIGHTFLOOR }, { "heightceiling", TextmapKey::HEIGHTCEILING },
+	{ "texturefloor", TextmapKey::TEXTUREFLOOR }, { "textureceiling", TextmapKey::TEXTURECEILING },
+	{ "lightlevel", TextmapKey::LIGHTLEVEL },
+	{ "angle", TextmapKey::ANGLE }, { "type", TextmapKey::TYPE },
+	{ "skill1", TextmapKey::SKILL1 }, { "skill2", TextmapKey::SKILL2 },
+	{ "skill3", TextmapKey::SKILL3 }, { "skill4", TextmapKey::SKILL4 },
+	{ "skill5", TextmapKey::SKILL5 }, { "ambush", TextmapKey::AMBUSH },
+	{ "single", TextmapKey::SINGLE }, { "dm", TextmapKey::DM },
+	{ "coop", TextmapKey::COOP }, { "friend", TextmapKey::FRIEND }
+};
+
+// Linedef flags, in the order of their bits in the binary format.
+static const TextmapKeyName linedefFlags[] = {
+	{ "blocking", TextmapKey::BLOCKING }, { "blockmonsters", TextmapKey::BLOCKMONSTERS },
+	{ "twosided", TextmapKey::TWOSIDED }, { "dontpegtop", TextmapKey::DONTPEGTOP },
+	{ "dontpegbottom", TextmapKey::DONTPEGBOTTOM }, { "secret", TextmapKey::SECRET },
+	{ "blocksound", TextmapKey::BLOCKSOUND }, { "dontdraw", TextmapKey::DONTDRAW },
+	{ "mapped", TextmapKey::MAPPED }, { "passuse", TextmapKey::PASSUSE }
+};
+
+// Thing flag bits.  Things are in single player, deathmatch and co-op
+// unless the matching "not in" bit is set.
+static const size_t thingEasy = 0, thingMedium = 1, thingHard = 2, thingAmbush = 3;
+static const size_t thingNotSingle = 4, thingNotDM = 5, thingNotCoop = 6, thingFriend = 7;
+
+static char LowerASCII(char c) {
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+// Keys are case insensitive, so they're hashed and compared in lowercase.
+static uint32_t HashKey(const char* str, size_t length) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0;i < length;i++) {
+		hash = (hash ^ static_cast<unsigned char>(LowerASCII(str[i]))) * 16777619u;
+	}
+	return hash;
+}
+
+static bool EqualKey(const char* str, size_t length, const char* name) {
+	for (size_t i = 0;i < length;i++) {
+		if (name[i] == '\0' || LowerASCII(str[i]) != name[i]) {
+			return false;
+		}
+	}
+	return name[length] == '\0';
+}
+
+// Open-addressed table of every known key, built once.
+class TextmapKeyTable {
+	static const size_t tableSize = 256;
+	std::array<const TextmapKeyName*, tableSize> slots;
+public:
+	TextmapKeyTable() {
+		this->slots.fill(nullptr);
+		for (auto& key : textmapKeys) {
+			size_t slot = HashKey(key.name, std::char_traits<char>::length(key.name)) % tableSize;
+			while (this->slots[slot]) {
+				slot = (slot + 1) % tableSize;
+			}
+			this->slots[slot] = &key;
+		}
+	}
+	TextmapKey find(const char* str, size_t length) const {
+		size_t slot = HashKey(str, length) % tableSize;
+		while (this->slots[slot]) {
+			if (EqualKey(str, length, this->slots[slot]->name)) {
+				return this->slots[slot]->key;
+			}
+			slot = (slot + 1) % tableSize;
+		}
+		return TextmapKey::UNKNOWN;
+	}
+};
+
+static const TextmapKeyTable& TextmapKeys() {
+	static const TextmapKeyTable table;
+	return table;
+}
+
+enum class TokenType { END, IDENTIFIER, NUMBER, STRING, SYMBOL };
+
+// A token is just a view into the lump.  String tokens leave out their
+// quotes but keep their escapes.
+struct Token {
+	TokenType type;
+	const char* begin;
+	size_t length;
+	bool is(char symbol) const {
+		return this->type == TokenType::SYMBOL && *this->begin == symbol;
+	}
+};
+
+class TextmapTokenizer {
+	const char* pos;
+	const char* end;
+	size_t line;
+public:
+	TextmapTokenizer(const char* data, size_t length) : pos(data), end(data + length), line(1) { }
+
+	[[noreturn]] void error(const char* message) const {
+		throw std::runtime_error("TEXTMAP line " + std::to_string(this->line) + ": " + message);
+	}
+
+	Token next() {
+		// Skip whitespace and comments.
+		for (;;) {
+			while (this->pos < this->end && (*this->pos == ' ' || *this->pos == '\t' ||
+			       *this->pos == '\r' || *this->pos == '\n')) {
+				if (*this->pos == '\n') {
+					this->line += 1;
+				}
+				this->pos += 1;
+			}
+			if (this->end - this->pos >= 2 && this->pos[0] == '/' && this->pos[1] == '/') {
+				while (this->pos < this->end && *this->pos != '\n') {
+					this->pos += 1;
+				}
+			} else if (this->end - this->pos >= 2 && this->pos[0] == '/' && this->pos[1] == '*') {
+				this->pos += 2;
+				while (this->end - this->pos >= 2 && !(this->pos[0] == '*' && this->pos[1] == '/')) {
+					if (*this->pos == '\n') {
+						this->line += 1;
+					}
+					this->pos += 1;
+				}
+				if (this->end - this->pos < 2) {
+					this->error("Unterminated comment");
+				}
+				this->pos += 2;
+			} else {
+				break;
+			}
+		}
+
+		Token token = { TokenType::END, this->pos, 0 };
+		if (this->pos == this->end) {
+			return token;
+		}
+
+		char c = *this->pos;
+		const char* start = this->pos;
+		if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_') {
+			token.type = TokenType::IDENTIFIER;
+			while (this->pos < this->end && ((*this->pos >= 'A' && *this->pos <= 'Z') ||
+			       (*this->pos >= 'a' && *this->pos <= 'z') ||
+			       (*this->pos >= '0' && *this->pos <= '9') || *this->pos == '_')) {
+				this->pos += 1;
+			}
+		} else if ((c >= '0' && c <= '9') || c == '+' || c == '-' || c == '.') {
+			// Signs only show up again in an exponent.
+			token.type = TokenType::NUMBER;
+			this->pos += 1;
+			while (this->pos < this->end) {
+				char n = *this->pos;
+				if ((n >= '0' && n <= '9') || (n >= 'A' && n <= 'Z') || (n >= 'a' && n <= 'z') || n == '.' ||
+				    ((n == '+' || n == '-') && (this->pos[-1] == 'e' || this->pos[-1] == 'E'))) {
+					this->pos += 1;
+				} else {
+					break;
+				}
+			}
+		} else if (c == '"') {
+			token.type = TokenType::STRING;
+			this->pos += 1;
+			start = this->pos;
+			while (this->pos < this->end && *this->pos != '"') {
+				if (*this->pos == '\\' && this->end - this->pos >= 2) {
+					this->pos += 1;
+				}
+				if (*this->pos == '\n') {
+					this->line += 1;
+				}
+				this->pos += 1;
+			}
+			if (this->pos == this->end) {
+				this->error("Unterminated string");
+			}
+			token.begin = start;
+			token.length = this->pos - start;
+			this->pos += 1;
+			return token;
+		} else {
+			token.type = TokenType::SYMBOL;
+			this->pos += 1;
+		}
+
+		token.begin = start;
+		token.length = this->pos - start;
+		return token;
+	}
+
+	void expect(char symbol) {
+		if (!this->next().is(symbol)) {
+			char message[] = "Expected ' '";
+			message[10] = symbol;
+			this->error(message);
+		}
+	}
+
+	int64_t toInteger(const Token& token) const {
+		const char* p = token.begin;
+		const char* e = token.begin + token.length;
+		if (token.type != TokenType::NUMBER) {
+			this->error("Expected an integer");
+		}
+
+		bool negative = false;
+		if (p < e && (*p == '+' || *p == '-')) {
+			negative = *p == '-';
+			p += 1;
+		}
+		int base = 10;
+		if (e - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+			base = 16;
+			p += 2;
+		}
+		if (p == e) {
+			this->error("Expected an integer");
+		}
+
+		int64_t value = 0;
+		for (;p < e;p++) {
+			int digit;
+			if (*p >= '0' && *p <= '9') {
+				digit = *p - '0';
+			} else if (base == 16 && LowerASCII(*p) >= 'a' && LowerASCII(*p) <= 'f') {
+				digit = LowerASCII(*p) - 'a' + 10;
+			} else {
+				this->error("Expected an integer");
+			}
+			value = value * base + digit;
+			if (value > INT32_MAX) {
+				this->error("Integer is too large");
+			}
+		}
+		return negative ? -value : value;
+	}
+
+	double toFloat(const Token& token) const {
+		const char* p = token.begin;
+		const char* e = token.begin + token.length;
+		if (token.type != TokenType::NUMBER) {
+			this->error("Expected a number");
+		}
+
+		bool negative = false;
+		if (p < e && (*p == '+' || *p == '-')) {
+			negative = *p == '-';
+			p += 1;
+		}
+		if (e - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+			return static_cast<double>(this->toInteger(token));
+		}
+		double value = 0;
+		bool digits = false;
+		for (;p < e && *p >= '0' && *p <= '9';p++) {
+			value = value * 10 + (*p - '0');
+			digits = true;
+		}
+		if (p < e && *p == '.') {
+			double scale = 0.1;
+			for (p++;p < e && *p >= '0' && *p <= '9';p++) {
+				value += (*p - '0') * scale;
+				scale /= 10;
+				digits = true;
+			}
+		}
+		if (digits && p < e && (*p == 'e' || *p == 'E')) {
+			Token exponent = { TokenType::NUMBER, p + 1, static_cast<size_t>(e - p - 1) };
+			value *= std::pow(10.0, static_cast<double>(this->toInteger(exponent)));
+			p = e;
+		}
+		if (!digits || p != e) {
+			this->error("Expected a number");
+		}
+		return negative ? -value : value;
+	}
+
+	int16_t toInt16(const Token& token) const {
+		int64_t value = this->toInteger(token);
+		if (value < INT16_MIN || value > INT16_MAX) {
+			this->error("Integer is out of range");
+		}
+		return static_cast<int16_t>(value);
+	}
+
+	uint16_t toUInt16(const Token& token) const {
+		int64_t value = this->toInteger(token);
+		if (value < 0 || value > UINT16_MAX) {
+			this->error("Integer is out of range");
+		}
+		return static_cast<uint16_t>(value);
+	}
+
+	// Coordinates are rounded to the map units the binary format uses.
+	int16_t toCoordinate(const Token& token) const {
+		double value = std::floor(this->toFloat(token) + 0.5);
+		if (value < INT16_MIN || value > INT16_MAX) {
+			this->error("Coordinate is out of range");
+		}
+		return static_cast<int16_t>(value);
+	}
+
+	bool toBool(const Token& token) const {
+		if (token.type == TokenType::IDENTIFIER) {
+			if (EqualKey(token.begin, token.length, "true")) {
+				return true;
+			}
+			if (EqualKey(token.begin, token.length, "false")) {
+				return false;
+			}
+		}
+		this->error("Expected true or false");
+	}
+
+	std::string toString(const Token& token) const {
+		if (token.type != TokenType::STRING) {
+			this->error("Expected a string");
+		}
+		std::string str;
+		str.reserve(token.length);
+		for (size_t i = 0;i < token.length;i++) {
+			if (token.begin[i] == '\\' && i + 1 < token.length) {
+				i += 1;
+			}
+			str.push_back(token.begin[i]);
+		}
+		return str;
+	}
+};
+
+// Everything read so far.  Linedefs and sidedefs refer to other elements
+// by index, which are only resolved once every block has been read.
+struct TextmapBlocks {
+	std::vector<Vertex> vertexes;
+	std::vector<Sector> sectors;
+	std::vector<Sidedef> sidedefs;
+	std::vector<int64_t> sidedefsectors;
+	std::vector<DoomLinedef> linedefs;
+	std::vector<std::array<int64_t, 4>> linedefrefs;
+	std::vector<DoomThing> things;
+};
+
+static void ReadBlock(TextmapTokenizer& tokenizer, TextmapKey kind, TextmapBlocks& blocks) {
+	const TextmapKeyTable& keys = TextmapKeys();
+
+	Vertex vertex = Vertex();
+	Sector sector = Sector();
+	sector.light = 160;
+	Sidedef sidedef = Sidedef();
+	sidedef.uppertex = sidedef.middletex = sidedef.lowertex = "-";
+	int64_t sidedefsector = -1;
+	DoomLinedef linedef = DoomLinedef();
+	std::array<int64_t, 4> linedefrefs = {{ -1, -1, -1, -1 }};
+	DoomThing thing = DoomThing();
+	thing.flags.set(thingNotSingle).set(thingNotDM).set(thingNotCoop);
+
+	// Required fields, as bits in the order they're listed.
+	unsigned required = 0;
+
+	for (;;) {
+		Token name = tokenizer.next();
+		if (name.is('}')) {
+			break;
+		}
+		if (name.type != TokenType::IDENTIFIER) {
+			tokenizer.error("Expected a field name");
+		}
+		tokenizer.expect('=');
+		Token value = tokenizer.next();
+		tokenizer.expect(';');
+
+		TextmapKey key = keys.find(name.begin, name.length);
+		switch (kind) {
+		case TextmapKey::VERTEX:
+			if (key == TextmapKey::X) {
+				vertex.x = tokenizer.toCoordinate(value);
+				required |= 1;
+			} else if (key == TextmapKey::Y) {
+				vertex.y = tokenizer.toCoordinate(value);
+				required |= 2;
+			}
+			break;
+		case TextmapKey::LINEDEF:
+			switch (key) {
+			case TextmapKey::V1: linedefrefs[0] = tokenizer.toInteger(value); required |= 1; break;
+			case TextmapKey::V2: linedefrefs[1] = tokenizer.toInteger(value); required |= 2; break;
+			case TextmapKey::SIDEFRONT: linedefrefs[2] = tokenizer.toInteger(value); required |= 4; break;
+			case TextmapKey::SIDEBACK: linedefrefs[3] = tokenizer.toInteger(value); break;
+			case TextmapKey::SPECIAL: linedef.special = tokenizer.toInt16(value); break;
+			case TextmapKey::ID: linedef.tag = std::max<int16_t>(tokenizer.toInt16(value), 0); break;
+			default:
+				for (size_t bit = 0;bit < sizeof(linedefFlags) / sizeof(linedefFlags[0]);bit++) {
+					if (linedefFlags[bit].key == key) {
+						linedef.flags.set(bit, tokenizer.toBool(value));
+					}
+				}
+				break;
+			}
+			break;
+		case TextmapKey::SIDEDEF:
+			switch (key) {
+			case TextmapKey::OFFSETX: sidedef.xoffset = tokenizer.toInt16(value); break;
+			case TextmapKey::OFFSETY: sidedef.yoffset = tokenizer.toInt16(value); break;
+			case TextmapKey::TEXTURETOP: sidedef.uppertex = tokenizer.toString(value); break;
+			case TextmapKey::TEXTUREBOTTOM: sidedef.lowertex = tokenizer.toString(value); break;
+			case TextmapKey::TEXTUREMIDDLE: sidedef.middletex = tokenizer.toString(value); break;
+			case TextmapKey::SECTOR: sidedefsector = tokenizer.toInteger(value); required |= 1; break;
+			default: break;
+			}
+			break;
+		case TextmapKey::SECTOR:
+			switch (key) {
+			case TextmapKey::HEIGHTFLOOR: sector.floor = tokenizer.toInt16(value); break;
+			case TextmapKey::HEIGHTCEILING: sector.ceiling = tokenizer.toInt16(value); break;
+			case TextmapKey::TEXTUREFLOOR: sector.floortex = tokenizer.toString(value); required |= 1; break;
+			case TextmapKey::TEXTURECEILING: sector.ceilingtex = tokenizer.toString(value); required |= 2; break;
+			case TextmapKey::LIGHTLEVEL: sector.light = tokenizer.toInt16(value); break;
+			case TextmapKey::SPECIAL: sector.special = tokenizer.toInt16(value); break;
+			case TextmapKey::ID: sector.tag = tokenizer.toInt16(value); break;
+			default: break;
+			}
+			break;
+		case TextmapKey::THING:
+			switch (key) {
+			case TextmapKey::X: thing.x = tokenizer.toCoordinate(value); required |= 1; break;
+			case TextmapKey::Y: thing.y = tokenizer.toCoordinate(value); required |= 2; break;
+			case TextmapKey::TYPE: thing.type = tokenizer.toUInt16(value); required |= 4; break;
+			case TextmapKey::ANGLE: thing.angle = static_cast<uint16_t>((tokenizer.toInteger(value) % 360 + 360) % 360); break;
+			case TextmapKey::SKILL1: case TextmapKey::SKILL2:
+				thing.flags.set(thingEasy, thing.flags.test(thingEasy) || tokenizer.toBool(value));
+				break;
+			case TextmapKey::SKILL3: thing.flags.set(thingMedium, tokenizer.toBool(value)); break;
+			case TextmapKey::SKILL4: case TextmapKey::SKILL5:
+				thing.flags.set(thingHard, thing.flags.test(thingHard) || tokenizer.toBool(value));
+				break;
+			case TextmapKey::AMBUSH: thing.flags.set(thingAmbush, tokenizer.toBool(value)); break;
+			case TextmapKey::SINGLE: thing.flags.set(thingNotSingle, !tokenizer.toBool(value)); break;
+			case TextmapKey::DM: thing.flags.set(thingNotDM, !tokenizer.toBool(value)); break;
+			case TextmapKey::COOP: thing.flags.set(thingNotCoop, !tokenizer.toBool(value)); break;
+			case TextmapKey::FRIEND: thing.flags.set(thingFriend, tokenizer.toBool(value)); break;
+			default: break;
+			}
+			break;
+		default:
+			// Blocks we don't know about are skipped.
+			break;
+		}
+	}
+
+	switch (kind) {
+	case TextmapKey::VERTEX:
+		if (required != 3) {
+			tokenizer.error("Vertex is missing x or y");
+		}
+		blocks.vertexes.push_back(std::move(vertex));
+		break;
+	case TextmapKey::LINEDEF:
+		if (required != 7) {
+			tokenizer.error("Linedef is missing v1, v2 or sidefront");
+		}
+		blocks.linedefs.push_back(std::move(linedef));
+		blocks.linedefrefs.push_back(linedefrefs);
+		break;
+	case TextmapKey::SIDEDEF:
+		if (required != 1) {
+			tokenizer.error("Sidedef is missing sector");
+		}
+		blocks.sidedefs.push_back(std::move(sidedef));
+		blocks.sidedefsectors.push_back(sidedefsector);
+		break;
+	case TextmapKey::SECTOR:
+		if (required != 3) {
+			tokenizer.error("Sector is missing texturefloor or textureceiling");
+		}
+		blocks.sectors.push_back(std::move(sector));
+		break;
+	case TextmapKey::THING:
+		if (required != 7) {
+			tokenizer.error("Thing is missing x, y or type");
+		}
+		blocks.things.push_back(std::move(thing));
+		break;
+	default:
+		break;
+	}
+}
+
+// Look up an element by its index in the TEXTMAP.
+template <class T>
+static std::shared_ptr<T> LockIndex(IndexedMap<T>& map, int64_t index, const char* message) {
+	if (index < 0 || static_cast<uint64_t>(index) >= map.size()) {
+		throw std::runtime_error(message);
+	}
+	return map.lock(static_cast<size_t>(index));
+}
+
+// Read a TEXTMAP lump into an empty map.
+void ReadTextmap(const char* data, size_t length, DoomMap& map) {
+	const TextmapKeyTable& keys = TextmapKeys();
+	TextmapTokenizer tokenizer(data, length);
+	TextmapBlocks blocks;
+	bool named = false;
+
+	for (;;) {
+		Token name = tokenizer.next();
+		if (name.type == TokenType::END) {
+			break;
+		}
+		if (name.type != TokenType::IDENTIFIER) {
+			tokenizer.error("Expected a block or field name");
+		}
+
+		Token next = tokenizer.next();
+		if (next.is('=')) {
+			// Other namespaces have fields and meanings a DoomMap has no
+			// place for, so they can't be read as one.  Any other global
+			// field doesn't affect the map.
+			Token value = tokenizer.next();
+			if (keys.find(name.begin, name.length) == TextmapKey::NAMESPACE) {
+				std::string space = tokenizer.toString(value);
+				if (!EqualKey(space.data(), space.size(), "doom")) {
+					tokenizer.error(("Namespace \"" + space + "\" can't be read as a Doom map").c_str());
+				}
+				named = true;
+			}
+			tokenizer.expect(';');
+		} else if (next.is('{')) {
+			ReadBlock(tokenizer, keys.find(name.begin, name.length), blocks);
+		} else {
+			tokenizer.error("Expected '=' or '{'");
+		}
+	}
+	if (!named) {
+		throw std::runtime_error("TEXTMAP has no namespace");
+	}
+
+	Vertexes vertexes;
+	vertexes.append(std::move(blocks.vertexes));
+	Sectors sectors;
+	sectors.append(std::move(blocks.sectors));
+	Sidedefs sidedefs;
+	sidedefs.append(std::move(blocks.sidedefs));
+	for (size_t i = 0;i < sidedefs.size();i++) {
+		sidedefs.at(i).sector = LockIndex(sectors, blocks.sidedefsectors[i], "Sidedef refers to a missing sector");
+	}
+	DoomLinedefs linedefs;
+	linedefs.append(std::move(blocks.linedefs));
+	for (size_t i = 0;i < linedefs.size();i++) {
+		DoomLinedef& linedef = linedefs.at(i);
+		const std::array<int64_t, 4>& refs = blocks.linedefrefs[i];
+		linedef.startvertex = LockIndex(vertexes, refs[0], "Linedef refers to a missing vertex");
+		linedef.endvertex = LockIndex(vertexes, refs[1], "Linedef refers to a missing vertex");
+		linedef.frontsidedef = LockIndex(sidedefs, refs[2], "Linedef refers to a missing sidedef");
+		if (refs[3] != -1) {
+			linedef.backsidedef = LockIndex(sidedefs, refs[3], "Linedef refers to a missing sidedef");
+		}
+	}
+	DoomThings things;
+	things.append(std::move(blocks.things));
+
+	map.setVertexes(std::move(vertexes));
+	map.setSectors(std::move(sectors));
+	map.setSidedefs(std::move(sidedefs));
+	map.setLinedefs(std::move(linedefs));
+	map.setThings(std::move(things));
+}
+
+static void WriteBlock(std::string& out, const char* name) {
+	out += "\n";
+	out += name;
+	out += "\n{\n";
+}
+
+static void WriteInteger(std::string& out, const char* key, int64_t value) {
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), " = %lld;\n", static_cast<long long>(value));
+	out += key;
+	out += buffer;
+}
+
+static void WriteFloat(std::string& out, const char* key, int64_t value) {
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), " = %lld.0;\n", static_cast<long long>(value));
+	out += key;
+	out += buffer;
+}
+
+static void WriteTrue(std::string& out, const char* key) {
+	out += key;
+	out += " = true;\n";
+}
+
+static void WriteString(std::string& out, const char* key, const std::string& value) {
+	out += key;
+	out += " = \"";
+	for (char c : value) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+		}
+		out += c;
+	}
+	out += "\";\n";
+}
+
+// Write a map out as a TEXTMAP lump.  The map is compacted first, so
+// element IDs match their positions in the lump.  Fields that match the
+// UDMF defaults are left out.
+std::string WriteTextmap(DoomMap& map) {
+	map.compact();
+
+	std::string out;
+	out.reserve(64 * (map.getVertexes().size() + map.getLinedefs().size() + map.getSidedefs().size() +
+	                  map.getSectors().size() + map.getThings().size()));
+	out += "namespace = \"doom\";\n";
+
+	map.getVertexes().each([&](Vertex& vertex) {
+		WriteBlock(out, "vertex");
+		WriteFloat(out, "x", vertex.x);
+		WriteFloat(out, "y", vertex.y);
+		out += "}\n";
+	});
+
+	map.getLinedefs().each([&](DoomLinedef& linedef) {
+		auto startvertex = linedef.startvertex.lock();
+		auto endvertex = linedef.endvertex.lock();
+		if (!startvertex || !endvertex) {
+			throw std::runtime_error("Linedef is missing a vertex");
+		}
+		auto frontsidedef = linedef.frontsidedef.lock();
+		if (!frontsidedef) {
+			throw std::runtime_error("Linedef is missing front sidedef");
+		}
+		auto backsidedef = linedef.backsidedef.lock();
+
+		WriteBlock(out, "linedef");
+		WriteInteger(out, "v1", startvertex->id);
+		WriteInteger(out, "v2", endvertex->id);
+		WriteInteger(out, "sidefront", frontsidedef->id);
+		if (backsidedef) {
+			WriteInteger(out, "sideback", backsidedef->id);
+		}
+		if (linedef.special != 0) {
+			WriteInteger(out, "special", linedef.special);
+		}
+		if (linedef.tag != 0) {
+			WriteInteger(out, "id", linedef.tag);
+		}
+		for (size_t bit = 0;bit < sizeof(linedefFlags) / sizeof(linedefFlags[0]);bit++) {
+			if (linedef.flags.test(bit)) {
+				WriteTrue(out, linedefFlags[bit].name);
+			}
+		}
+		out += "}\n";
+	});
+
+	map.getSidedefs().each([&](Sidedef& sidedef) {
+		auto sector = sidedef.sector.lock();
+		if (!sector) {
+			throw std::runtime_error("Sidedef is missing sector");
+		}
+
+		WriteBlock(out, "sidedef");
+		WriteInteger(out, "sector", sector->id);
+		if (sidedef.xoffset != 0) {
+			WriteInteger(out, "offsetx", sidedef.xoffset);
+		}
+		if (sidedef.yoffset != 0) {
+			WriteInteger(out, "offsety", sidedef.yoffset);
+		}
+		if (sidedef.uppertex != "-") {
+			WriteString(out, "texturetop", sidedef.uppertex);
+		}
+		if (sidedef.lowertex != "-") {
+			WriteString(out, "texturebottom", sidedef.lowertex);
+		}
+		if (sidedef.middletex != "-") {
+			WriteString(out, "texturemiddle", sidedef.middletex);
+		}
+		out += "}\n";
+	});
+
+	map.getSectors().each([&](Sector& sector) {
+		WriteBlock(out, "sector");
+		WriteString(out, "texturefloor", sector.floortex);
+		WriteString(out, "textureceiling", sector.ceilingtex);
+		if (sector.floor != 0) {
+			WriteInteger(out, "heightfloor", sector.floor);
+		}
+		if (sector.ceiling != 0) {
+			WriteInteger(out, "heightceiling", sector.ceiling);
+		}
+		if (sector.light != 160) {
+			WriteInteger(out, "lightlevel", sector.light);
+		}
+		if (sector.special != 0) {
+			WriteInteger(out, "special", sector.special);
+		}
+		if (sector.tag != 0) {
+			WriteInteger(out, "id", sector.tag);
+		}
+		out += "}\n";
+	});
+
+	map.getThings().each([&](DoomThing& thing) {
+		WriteBlock(out, "thing");
+		WriteFloat(out, "x", thing.x);
+		WriteFloat(out, "y", thing.y);
+		WriteInteger(out, "type", thing.type);
+		if (thing.angle != 0) {
+			WriteInteger(out, "angle", thing.angle);
+		}
+		if (thing.flags.test(thingEasy)) {
+			WriteTrue(out, "skill1");
+			WriteTrue(out, "skill2");
+		}
+		if (thing.flags.test(thingMedium)) {
+			WriteTrue(out, "skill3");
+		}
+		if (thing.flags.test(thingHard)) {
+			WriteTrue(out, "skill4");
+			WriteTrue(out, "skill5");
+		}
+		if (thing.flags.test(thingAmbush)) {
+			WriteTrue(out, "ambush");
+		}
+		if (!thing.flags.test(thingNotSingle)) {
+			WriteTrue(out, "single");
+		}
+		if (!thing.flags.test(thingNotDM)) {
+			WriteTrue(out, "dm");
+		}
+		if (!thing.flags.test(thingNotCoop)) {
+			WriteTrue(out, "coop");
+		}
+		if (thing.flags.test(thingFriend)) {
+			WriteTrue(out, "friend");
+		}
+		out += "}\n";
+	});
+
+	return out;
+}
+
+}
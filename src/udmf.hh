@@ -0,0 +1,41 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UDMF_HH
+#define UDMF_HH
+
+#include <cstddef>
+#include <string>
+
+#include "map.hh"
+
+namespace WADmake {
+
+// Read and write the TEXTMAP lump of a UDMF map in the "doom" namespace.
+//
+// The reader makes a single pass over the lump without copying it.
+// Tokens point straight into the lump, and keys are matched against a
+// fixed table, so only string values that end up in the map allocate.
+// Fields the map has no place for are skipped, but a TEXTMAP in any other
+// namespace is refused.
+void ReadTextmap(const char* data, size_t length, DoomMap& map);
+std::string WriteTextmap(DoomMap& map);
+
+}
+
+#endif
@@ -21,10 +21,67 @@
 #include <sstream>
 
 #include "buffer.hh"
+#include "file.hh"
 #include "wad.hh"
 
 namespace WADmake {
 
+// Parse the WAD header into the WAD type, number of lumps and position of
+// the infotable.
+static void ReadHeader(BinaryReader& reader, Wad::Type& type, int32_t& numlumps, int32_t& infotablefs) {
+	const char* header = reader.record(12);
+
+	// WAD identifier
+	if (std::memcmp(header, "IWAD", 4) == 0) {
+		type = Wad::Type::IWAD;
+	}
+	else if (std::memcmp(header, "PWAD", 4) == 0) {
+		type = Wad::Type::PWAD;
+	}
+	else {
+		throw std::runtime_error("Invalid WAD identifier");
+	}
+
+	// Number of lumps
+	numlumps = LoadLE<int32_t>(header + 4);
+	if (numlumps < 0) {
+		std::stringstream error;
+		error << "Too many lumps in WAD (found " << numlumps << ", max " << INT32_MAX << ")";
+		throw std::out_of_range(error.str());
+	}
+
+	// Infotable pointer
+	infotablefs = LoadLE<int32_t>(header + 8);
+	if (infotablefs < 0) {
+		throw std::out_of_range("Position of infotable is out of range");
+	}
+}
+
+// Parse an infotable entry, checking that the position and size make
+// sense.  Lumps with a size of 0 can have a nonsense position, so the
+// position is only checked if the size isn't 0.
+static void ReadInfotableEntry(BinaryReader& reader, int32_t i, int32_t& filepos, int32_t& size, std::string& name) {
+	const char* entry = reader.record(16);
+
+	// Read a directory entry
+	filepos = LoadLE<int32_t>(entry);
+	size = LoadLE<int32_t>(entry + 4);
+
+	// Read name
+	name = LoadCString(entry + 8, 8);
+
+	if (size > 0 && filepos < 0) {
+		std::stringstream error;
+		error << "Position of lump " << i << " is out of range";
+		throw std::out_of_range(error.str());
+	}
+	else if (size < 0) {
+		std::stringstream error;
+		error << "Size of lump " << i << " is out of range";
+		throw std::out_of_range(error.str());
+	}
+}
+
 Wad::Wad() : type(Wad::Type::NONE), lumps(new Directory) { }
 
 Wad::Wad(Wad::Type type) : type(type), lumps(new Directory) { }
@@ -45,71 +102,86 @@ Wad::Type Wad::getType() {
 	return this->type;
 }
 
-std::istream& operator>>(std::istream& buffer, Wad& wad) {
-	// WAD identifier
-	std::vector<char> identifier = ReadBuffer(buffer, 4);
-	if (std::memcmp(identifier.data(), "IWAD", identifier.size()) == 0) {
-		wad.type = Wad::Type::IWAD;
-	}
-	else if (std::memcmp(identifier.data(), "PWAD", identifier.size()) == 0) {
-		wad.type = Wad::Type::PWAD;
-	}
-	else {
+// Open a WAD file on disk.  Only the header and infotable are parsed, and
+// every lump is a view into the mapped file, so no lump data is read until
+// somebody asks for it.
+void Wad::open(const std::string& filename) {
+	auto mapping = std::make_shared<const MappedFile>(filename);
+	BinaryReader reader(mapping->getData(), mapping->size());
+
+	if (reader.size() < 12) {
 		throw std::runtime_error("Invalid WAD identifier");
 	}
 
-	// Number of lumps
-	int32_t numlumps = ReadInt32LE(buffer);
-	if (numlumps < 0) {
-		std::stringstream error;
-		error << "Too many lumps in WAD (found " << numlumps << ", max " << INT32_MAX << ")";
-		throw std::out_of_range(error.str());
+	Wad::Type type;
+	int32_t numlumps, infotablefs;
+	ReadHeader(reader, type, numlumps, infotablefs);
+
+	if (static_cast<size_t>(infotablefs) > reader.size() ||
+	    static_cast<size_t>(numlumps) > (reader.size() - infotablefs) / 16) {
+		throw std::out_of_range("Couldn't find infotable");
 	}
+	reader.seek(infotablefs);
 
-	// Infotable pointer
-	int32_t infotablefs = ReadInt32LE(buffer);
-	if (infotablefs < 0) {
-		throw std::out_of_range("Position of infotable is out of range");
+	auto lumps = std::make_shared<Directory>();
+	for (int32_t i = 0; i < numlumps; i++) {
+		int32_t filepos, size;
+		std::string name;
+		ReadInfotableEntry(reader, i, filepos, size, name);
+
+		// Create lump
+		Lump lump;
+		lump.setName(std::move(name));
+		if (size > 0) {
+			lump.setData(LumpData(mapping, filepos, size));
+		}
+
+		lumps->push_back(std::move(lump));
 	}
 
+	this->type = type;
+	this->lumps = lumps;
+}
+
+std::istream& operator>>(std::istream& buffer, Wad& wad) {
+	// Header
+	std::string headerstr = ReadString(buffer, 12);
+	BinaryReader header(headerstr.data(), headerstr.size());
+	int32_t numlumps, infotablefs;
+	ReadHeader(header, wad.type, numlumps, infotablefs);
+
+	// The whole infotable is read in one go, so make sure the stream is
+	// long enough before allocating room for it.
+	if (!buffer.seekg(0, std::ios::end)) {
+		throw std::runtime_error("Couldn't find end of WAD");
+	}
+	uint64_t length = static_cast<uint64_t>(buffer.tellg());
+	if (static_cast<uint64_t>(infotablefs) > length ||
+	    static_cast<uint64_t>(numlumps) > (length - infotablefs) / 16) {
+		throw std::out_of_range("Couldn't find infotable");
+	}
 	if (!buffer.seekg(infotablefs)) {
 		throw std::out_of_range("Couldn't find infotable");
 	}
+	std::string infotablestr = ReadString(buffer, static_cast<size_t>(numlumps) * 16);
+	BinaryReader infotable(infotablestr.data(), infotablestr.size());
 
 	for (int32_t i = 0; i < numlumps; i++) {
-		// Read a directory entry
-		int32_t filepos = ReadInt32LE(buffer);
-		int32_t size = ReadInt32LE(buffer);
-
-		// Read name
-		std::vector<char> name = ReadBuffer(buffer, 8);
-		name.push_back(0);
-		std::string namestring(name.data());
+		int32_t filepos, size;
+		std::string name;
+		ReadInfotableEntry(infotable, i, filepos, size, name);
 
 		// Create lump
 		Lump lump;
-		lump.setName(std::move(namestring));
-
-		// If the size is 0, the file position could be complete
-		// nonsense, so only attempt to read data if size is not 0.
+		lump.setName(std::move(name));
 		if (size > 0) {
-			if (filepos < 0) {
+			if (static_cast<uint64_t>(filepos) + size > length) {
 				std::stringstream error;
-				error << "Position of lump " << i << " is out of range";
+				error << "Lump " << i << " is past the end of the WAD";
 				throw std::out_of_range(error.str());
 			}
-
-			auto info = buffer.tellg();
 			buffer.seekg(filepos);
-			std::vector<char> data = ReadBuffer(buffer, size);
-			buffer.seekg(info);
-
-			lump.setData(std::move(data));
-		}
-		else if (size < 0) {
-			std::stringstream error;
-			error << "Size of lump " << i << " is out of range";
-			throw std::out_of_range(error.str());
+			lump.setData(ReadString(buffer, size));
 		}
 
 		wad.lumps->push_back(std::move(lump));
@@ -118,68 +190,118 @@ std::istream& operator>>(std::istream& buffer, Wad& wad) {
 	return buffer;
 }
 
-std::ostream& operator<<(std::ostream& buffer, Wad& wad) {
+// Write the infotable entry of a lump whose data starts at filepos.
+static void WriteInfotableEntry(BinaryWriter& infotable, const Lump& lump, uint64_t filepos) {
+	char* entry = infotable.record(16);
+
+	// Write lump position
+	if (filepos > static_cast<uint64_t>(std::numeric_limits<int32_t>::max())) {
+		throw std::runtime_error("Couldn't write lump position");
+	}
+	StoreLE<int32_t>(entry, static_cast<int32_t>(filepos));
+
+	// Write lump size
+	const std::string& name = lump.getName();
+	if (lump.getSize() > static_cast<size_t>(std::numeric_limits<int32_t>::max())) {
+		throw std::runtime_error("Lump " + name + " is too large");
+	}
+	StoreLE<int32_t>(entry + 4, static_cast<int32_t>(lump.getSize()));
+
+	// Write lump name.  If the name is 8 characters, there is no null terminator.
+	if (name.size() > 8) {
+		throw std::runtime_error("Lump name " + name + " is longer than 8 characters");
+	}
+	StoreCString(entry + 8, name, 8);
+}
+
+// Write the WAD header, consisting of the WAD type, number of lumps and
+// position of the infotable.
+static void WriteHeader(BinaryWriter& buffer, Wad::Type type, size_t numlumps, uint64_t infotablepos) {
 	// Write WAD type to buffer
-	if (wad.type == Wad::Type::IWAD) {
-		buffer << "IWAD";
-	} else if (wad.type == Wad::Type::PWAD) {
-		buffer << "PWAD";
+	if (type == Wad::Type::IWAD) {
+		buffer.writeData("IWAD", 4);
+	} else if (type == Wad::Type::PWAD) {
+		buffer.writeData("PWAD", 4);
 	} else {
 		throw std::runtime_error("Can't write Wad of type NONE");
 	}
 
-	std::stringstream alldata;
-	std::stringstream infotable;
+	// Write number of lumps
+	if (numlumps > static_cast<size_t>(std::numeric_limits<int32_t>::max())) {
+		throw std::runtime_error("Too many lumps");
+	}
+	buffer.write<int32_t>(static_cast<int32_t>(numlumps));
 
-	for (Lump lump : *(wad.lumps)) {
-		std::string data = lump.getData();
+	// Write offset of infotable
+	if (infotablepos > static_cast<uint64_t>(std::numeric_limits<int32_t>::max())) {
+		throw std::runtime_error("Couldn't write infotable position");
+	}
+	buffer.write<int32_t>(static_cast<int32_t>(infotablepos));
+}
 
-		// Write lump position
-		auto alldatapos = alldata.tellp() + static_cast<std::char_traits<char>::pos_type>(12);
-		if (alldatapos > std::numeric_limits<int32_t>::max()) {
-			throw std::runtime_error("Couldn't write lump position");
-		}
-		WriteInt32LE(infotable, static_cast<int32_t>(alldatapos));
+// Write the WAD straight to a file on disk.  The header is written with a
+// placeholder and patched once we know where the infotable ended up, so
+// lump data never has to be buffered in memory.
+void Wad::save(const std::string& filename) {
+	if (this->type == Wad::Type::NONE) {
+		throw std::runtime_error("Can't write Wad of type NONE");
+	}
 
-		// Write lump data
-		alldata.write(data.data(), data.size());
+	OutputFile file(filename);
 
-		// Write lump size
-		std::string name = lump.getName();
-		if (data.size() > std::numeric_limits<int32_t>::max()) {
-			throw std::runtime_error("Lump " + name + " is too large");
-		}
-		WriteInt32LE(infotable, static_cast<int32_t>(data.size()));
+	// Header placeholder
+	char placeholder[12] = { 0 };
+	file.write(placeholder, sizeof(placeholder));
 
-		// Write lump name.  If the name is 8 characters, there is no null terminator.
-		if (name.size() > 8) {
-			throw std::runtime_error("Lump name " + name + " is longer than 8 characters");
-		}
-		char namebuffer[8] = { 0 };
-		std::memmove(namebuffer, name.c_str(), name.size());
-		infotable.write(namebuffer, sizeof(namebuffer));
+	// Lump data, noting where each lump ends up in the infotable
+	BinaryWriter infotable;
+	infotable.reserve(this->lumps->size() * 16);
+	for (const Lump& lump : *(this->lumps)) {
+		WriteInfotableEntry(infotable, lump, file.tell());
+		const LumpData& data = lump.getData();
+		file.write(data.data(), data.size());
 	}
 
-	// Write number of lumps
-	if (wad.lumps->size() > std::numeric_limits<int32_t>::max()) {
-		throw std::runtime_error("Too many lumps");
+	// Infotable
+	uint64_t infotablepos = file.tell();
+	file.write(infotable.data(), infotable.size());
+
+	// Patch the real header over the placeholder
+	BinaryWriter header;
+	WriteHeader(header, this->type, this->lumps->size(), infotablepos);
+	file.writeAt(0, header.data(), header.size());
+
+	file.close();
+}
+
+// Since we know the size of every lump up front, the infotable can be
+// built before any data is written, and lump data can be streamed
+// directly to the buffer.
+std::ostream& operator<<(std::ostream& buffer, Wad& wad) {
+	BinaryWriter infotable;
+	infotable.reserve(wad.lumps->size() * 16);
+	uint64_t filepos = 12;
+	for (const Lump& lump : *(wad.lumps)) {
+		WriteInfotableEntry(infotable, lump, filepos);
+		filepos += lump.getSize();
 	}
-	WriteInt32LE(buffer, static_cast<int32_t>(wad.lumps->size()));
 
-	// Write offset of infotable
-	auto alldatapos = alldata.tellp() + static_cast<std::char_traits<char>::pos_type>(12);
-	if (alldatapos > std::numeric_limits<int32_t>::max()) {
-		throw std::runtime_error("Couldn't write infotable position");
+	BinaryWriter header;
+	WriteHeader(header, wad.type, wad.lumps->size(), filepos);
+	if (!buffer.write(header.data(), header.size())) {
+		throw std::runtime_error("Couldn't write WAD header");
 	}
-	WriteInt32LE(buffer, static_cast<int32_t>(alldatapos));
 
 	// Write data
-	if (!(buffer << alldata.rdbuf())) {
-		throw std::runtime_error("Couldn't write WAD data");
+	for (const Lump& lump : *(wad.lumps)) {
+		const LumpData& data = lump.getData();
+		if (!buffer.write(data.data(), data.size())) {
+			throw std::runtime_error("Couldn't write WAD data");
+		}
 	}
 
 	// Write infotable
-	if (!(buffer << infotable.rdbuf())) {
+	if (!buffer.write(infotable.data(), infotable.size())) {
 		throw std::runtime_error("Couldn't write infotable");
 	}
 
@@ -21,6 +21,7 @@
 
 #include <iosfwd>
 #include <memory>
+#include <string>
 
 #include "directory.hh"
 
@@ -33,6 +34,8 @@ public:
 	Wad(Wad::Type type);
 	std::shared_ptr<Directory> getLumps();
 	Wad::Type getType();
+	void open(const std::string& filename);
+	void save(const std::string& filename);
 	void setLumps(const std::shared_ptr<Directory>& lumps);
 	void setLumps(Directory&& lumps);
 	friend std::istream& operator>>(std::istream& buffer, Wad& wad);
@@ -16,14 +16,21 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <exception>
 #include <limits>
-#include <sstream>
+#include <mutex>
+#include <thread>
 
 #include <zlib.h>
 
 #include "buffer.hh"
+#include "crc32.hh"
 #include "directory.hh"
+#include "file.hh"
 #include "zip.hh"
 
 namespace WADmake {
@@ -62,34 +69,40 @@ public:
 	}
 };
 
-static std::string zlibInflate(std::istream& buffer, size_t in_len, size_t out_len) {
+// zlib counts its buffers in uInt, which can be smaller than size_t, so
+// anything bigger is handed over a piece at a time.
+static uInt zlibPiece(size_t len) {
+	return static_cast<uInt>(std::min<size_t>(len, std::numeric_limits<uInt>::max()));
+}
+
+static std::string zlibInflate(const char* data_in, size_t in_len, size_t out_len) {
 	inflateStream is;
-	z_stream strm = is.getStream();
+	z_stream& strm = is.getStream();
 
 	// Input buffer
-	std::vector<char> data_in(in_len);
-	if (!buffer.read(data_in.data(), data_in.size())) {
-		throw std::out_of_range("Couldn't read buffer to infliate");
-	}
-	if (data_in.size() > std::numeric_limits<uInt>::max()) {
-		throw std::out_of_range("Input buffer too large");
-	}
-	strm.avail_in = static_cast<uInt>(data_in.size());
-	strm.next_in = reinterpret_cast<Bytef*>(data_in.data());
+	const char* in_end = data_in + in_len;
+	strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data_in));
+	strm.avail_in = 0;
 
 	// Output buffer
-	std::vector<char> data_out(out_len);
-	if (data_in.size() > std::numeric_limits<uInt>::max()) {
-		throw std::out_of_range("Output buffer too large");
-	}
-	strm.avail_out = static_cast<uInt>(data_out.size());
-	strm.next_out = reinterpret_cast<Bytef*>(data_out.data());
+	std::string output(out_len, '\0');
+	char* out_end = &output[0] + output.size();
+	strm.next_out = reinterpret_cast<Bytef*>(&output[0]);
+	strm.avail_out = 0;
 
 	// Uncompress the entire buffer
-	int success = inflate(&strm, Z_FINISH);
+	int success;
+	do {
+		if (strm.avail_in == 0) {
+			strm.avail_in = zlibPiece(in_end - reinterpret_cast<char*>(strm.next_in));
+		}
+		if (strm.avail_out == 0) {
+			strm.avail_out = zlibPiece(out_end - reinterpret_cast<char*>(strm.next_out));
+		}
+		success = inflate(&strm, Z_NO_FLUSH);
+	} while (success == Z_OK);
+
 	switch (success) {
-		case Z_OK:
-			throw std::runtime_error("Incomplete inflation");
 		case Z_STREAM_END:
 			break;
 		case Z_NEED_DICT:
@@ -101,13 +114,14 @@ static std::string zlibInflate(std::istream& buffer, size_t in_len, size_t out_l
 		case Z_MEM_ERROR:
 			throw std::bad_alloc();
 		case Z_BUF_ERROR:
+			if (reinterpret_cast<char*>(strm.next_out) == out_end) {
+				throw std::runtime_error("Incomplete inflation");
+			}
 			throw std::runtime_error("Inflation progress impossible");
 		default:
 			throw std::runtime_error(strm.msg);
 	}
 
-	std::string output(data_out.begin(), data_out.end());
-
 	return output;
 }
 
@@ -146,38 +160,72 @@ public:
 	}
 };
 
-static void zlibDeflate(std::ostream& buffer, const std::string& str) {
-	deflateStream ds;
-	z_stream strm = ds.getStream();
-
-	// Input buffer
-	if (str.size() > std::numeric_limits<uInt>::max()) {
-		throw std::out_of_range("Input buffer too large");
-	}
-	strm.avail_in = static_cast<uInt>(str.size());
-	strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(str.data()));
+// If crc is given, the CRC32 of the input is calculated along the way, a
+// chunk at a time so each chunk is still in cache when deflate gets to it.
+static std::string zlibDeflate(const LumpData& str, uint32_t* crc) {
+	static const size_t chunkSize = 64 * 1024;
 
-	// Output buffer
-	std::vector<char> data_out(deflateBound(&strm, static_cast<uInt>(str.size())));
-	strm.avail_out = static_cast<uInt>(data_out.size());
-	strm.next_out = reinterpret_cast<Bytef*>(data_out.data());
+	deflateStream ds;
+	z_stream& strm = ds.getStream();
+
+	// Output buffer, which only has to grow if the bound didn't fit in a
+	// uLong.
+	uLong bound = deflateBound(&strm, static_cast<uLong>(
+		std::min<size_t>(str.size(), std::numeric_limits<uLong>::max())));
+	std::string data_out(bound, '\0');
+	auto moreOutput = [&]() {
+		size_t out_pos = reinterpret_cast<char*>(strm.next_out) - &data_out[0];
+		if (out_pos == data_out.size()) {
+			data_out.resize(out_pos + out_pos / 2 + chunkSize);
+		}
+		strm.next_out = reinterpret_cast<Bytef*>(&data_out[out_pos]);
+		strm.avail_out = zlibPiece(data_out.size() - out_pos);
+	};
+	strm.next_out = reinterpret_cast<Bytef*>(&data_out[0]);
+	strm.avail_out = 0;
 
 	// Compress the entire buffer
-	int success = deflate(&strm, Z_FINISH);
-	switch (success) {
-	case Z_OK:
-		throw std::runtime_error("Incomplete deflation");
-	case Z_STREAM_END:
-		break;
-	case Z_STREAM_ERROR:
-		throw std::runtime_error("Stream state corrupted");
-	case Z_BUF_ERROR:
-		throw std::runtime_error("Deflation progress impossible");
-	default:
-		throw std::runtime_error(strm.msg);
+	if (crc) {
+		*crc = 0;
 	}
+	size_t pos = 0;
+	int success;
+	do {
+		size_t len = std::min(chunkSize, str.size() - pos);
+		if (crc) {
+			*crc = CRC32(*crc, str.data() + pos, len);
+		}
+		strm.avail_in = static_cast<uInt>(len);
+		strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(str.data() + pos));
+		pos += len;
+
+		// Keep going until the chunk is used up, or the stream is done.
+		int flush = pos == str.size() ? Z_FINISH : Z_NO_FLUSH;
+		do {
+			if (strm.avail_out == 0) {
+				moreOutput();
+			}
+			success = deflate(&strm, flush);
+			switch (success) {
+			case Z_OK:
+			case Z_STREAM_END:
+				break;
+			case Z_STREAM_ERROR:
+				throw std::runtime_error("Stream state corrupted");
+			case Z_BUF_ERROR:
+				// Only a problem once there is nothing left to wait for.
+				if (flush == Z_FINISH) {
+					throw std::runtime_error("Deflation progress impossible");
+				}
+				break;
+			default:
+				throw std::runtime_error(strm.msg);
+			}
+		} while (flush == Z_FINISH ? success != Z_STREAM_END : strm.avail_out == 0);
+	} while (pos < str.size());
 
-	buffer.write(reinterpret_cast<char*>(data_out.data()), strm.total_out);
+	data_out.resize(reinterpret_cast<char*>(strm.next_out) - &data_out[0]);
+	return data_out;
 }
 
 // Header for Local File
@@ -189,26 +237,160 @@ const char Zip::centralDirectoryHeader[] = { 'P', 'K', 0x01, 0x02 };
 // Header for End of Central Directory
 const char Zip::endOfCentralDirectoryHeader[] = { 'P', 'K', 0x05, 0x06 };
 
+// Header for ZIP64 End of Central Directory
+const char Zip::zip64EndOfCentralDirectoryHeader[] = { 'P', 'K', 0x06, 0x06 };
+
+// Header for ZIP64 End of Central Directory Locator
+const char Zip::zip64EndOfCentralDirectoryLocator[] = { 'P', 'K', 0x06, 0x07 };
+
 // Version of ZIP standards that Zip obeys
 const uint16_t Zip::version = 8;
 
-// Parse a local file entry.  Assumes the buffer is set to the location
-// of the local file entry's magic number.
-void Zip::parseLocalFile(std::istream& buffer) {
-	// Identifier
-	std::vector<char> identifier = ReadBuffer(buffer, 4);
-	if (std::memcmp(identifier.data(), Zip::localFileHeader, identifier.size()) != 0) {
+// Version of ZIP standards needed to extract ZIP64 files
+const uint16_t Zip::zip64Version = 45;
+
+// Header ID of the ZIP64 extended information extra field
+static const uint16_t zip64ExtraID = 0x0001;
+
+// Fields that are too small for ZIP64 values are set to this, and the
+// real value is stored elsewhere.
+static const uint32_t zip64Marker = std::numeric_limits<uint32_t>::max();
+static const uint16_t zip64Marker16 = std::numeric_limits<uint16_t>::max();
+
+// Replace any size, offset or disk number that was too big for its usual
+// field with the real value from the ZIP64 extended information extra
+// field.  Values that are present are always stored in this order.
+static void ReadZip64Extra(const char* extra, size_t len, uint64_t& uncompressed_size,
+                           uint64_t& compressed_size, uint64_t& offset, uint32_t& disk) {
+	BinaryReader reader(extra, len);
+	while (reader.remaining() >= 4) {
+		uint16_t id = reader.read<uint16_t>();
+		uint16_t field_len = reader.read<uint16_t>();
+		if (field_len > reader.remaining()) {
+			throw std::runtime_error("Invalid extra field");
+		}
+
+		if (id == zip64ExtraID) {
+			BinaryReader field(reader.record(field_len), field_len);
+			if (uncompressed_size == zip64Marker) {
+				uncompressed_size = field.read<uint64_t>();
+			}
+			if (compressed_size == zip64Marker) {
+				compressed_size = field.read<uint64_t>();
+			}
+			if (offset == zip64Marker) {
+				offset = field.read<uint64_t>();
+			}
+			if (disk == zip64Marker16) {
+				disk = field.read<uint32_t>();
+			}
+			return;
+		}
+
+		reader.record(field_len);
+	}
+}
+
+// Build a ZIP64 extended information extra field holding the passed
+// values, or nothing if there aren't any.
+static std::string WriteZip64Extra(const std::vector<uint64_t>& values) {
+	BinaryWriter extra;
+	if (values.empty()) {
+		return extra.release();
+	}
+	extra.write<uint16_t>(zip64ExtraID);
+	extra.write<uint16_t>(static_cast<uint16_t>(values.size() * sizeof(uint64_t)));
+	for (auto value : values) {
+		extra.write<uint64_t>(value);
+	}
+	return extra.release();
+}
+
+// A file as it was stored in a ZIP.  The compressed data is found in the
+// ZIP when it is needed, and is only inflated once somebody needs the lump
+// data.  Lumps that still have one of these as their source are written
+// back out verbatim.
+class Zip::Source : public LumpSource {
+public:
+	LumpData archive;
+	uint64_t offset;
+	Zip::compression compression;
+	uint32_t crc;
+	uint64_t compressed_size;
+	uint64_t uncompressed_size;
+	bool verify;
+	Source() : offset(0), compression(Zip::compression::STORE), crc(0),
+	           compressed_size(0), uncompressed_size(0), verify(true) { }
+	LumpData getCompressed() const;
+	LumpData load() const override;
+	size_t size() const override;
+};
+
+LumpData Zip::Source::getCompressed() const {
+	// The local file header might have different filename and extra field
+	// lengths than the central directory, so we have to look at it to find
+	// where the file data actually starts.
+	if (this->offset > this->archive.size()) {
+		throw std::runtime_error("Invalid local file header offset");
+	}
+	BinaryReader reader(this->archive.data(), this->archive.size());
+	reader.seek(static_cast<size_t>(this->offset));
+	const char* header = reader.record(30);
+	if (std::memcmp(header, Zip::localFileHeader, sizeof(Zip::localFileHeader)) != 0) {
 		throw std::runtime_error("Not a valid local file entry");
 	}
 
-	// Version needed to extract
-	ReadUInt16LE(buffer);
+	// Skip past the filename and extra field
+	uint16_t filename_len = LoadLE<uint16_t>(header + 26);
+	uint16_t extra_len = LoadLE<uint16_t>(header + 28);
+	reader.record(filename_len + extra_len);
+
+	if (this->compressed_size > reader.remaining()) {
+		throw std::runtime_error("Invalid compressed size");
+	}
+	return this->archive.slice(reader.tell(), static_cast<size_t>(this->compressed_size));
+}
+
+LumpData Zip::Source::load() const {
+	LumpData compressed = this->getCompressed();
+
+	// Stored files don't need to be copied at all.
+	LumpData data;
+	if (this->compression == Zip::compression::DEFLATE && compressed.size() > 0) {
+		data = LumpData(zlibInflate(compressed.data(), compressed.size(), static_cast<size_t>(this->uncompressed_size)));
+	} else {
+		data = compressed;
+	}
 
-	// General purpose bitflag
-	ReadUInt16LE(buffer);
+	// Check the CRC32 sum.
+	if (this->verify) {
+		uint32_t crc_actual = CRC32(0, data.data(), data.size());
+		if (this->crc != crc_actual) {
+			throw std::runtime_error("CRC check failed");
+		}
+	}
+
+	return data;
+}
+
+size_t Zip::Source::size() const {
+	return static_cast<size_t>(this->uncompressed_size);
+}
+
+// Parse a Central Directory entry at the reader's position.
+void Zip::parseCentralDirectory(const LumpData& archive, BinaryReader& reader, bool lazy) {
+	const char* entry = reader.record(46);
+
+	// Identifier
+	if (std::memcmp(entry, Zip::centralDirectoryHeader, sizeof(Zip::centralDirectoryHeader)) != 0) {
+		throw std::runtime_error("Not a valid central directory entry");
+	}
+
+	// Version made by, version needed to extract and general purpose
+	// bitflag are at 4, 6 and 8.
 
 	// Compression method
-	Zip::compression compression = static_cast<Zip::compression>(ReadUInt16LE(buffer));
+	uint16_t compression = LoadLE<uint16_t>(entry + 10);
 	switch (compression) {
 	case Zip::compression::STORE:
 	case Zip::compression::DEFLATE:
@@ -217,181 +399,258 @@ void Zip::parseLocalFile(std::istream& buffer) {
 		throw std::runtime_error("Unsupported compression");
 	}
 
-	// Last modified file time
-	ReadUInt16LE(buffer);
-
-	// Last modified file date
-	ReadUInt16LE(buffer);
+	// Last modified file time and date are at 12 and 14.
 
 	// CRC32
-	uint32_t crc_expected = ReadUInt32LE(buffer);
+	uint32_t crc = LoadLE<uint32_t>(entry + 16);
 
 	// Compressed size
-	uint32_t compressed_size = ReadUInt32LE(buffer);
+	uint64_t compressed_size = LoadLE<uint32_t>(entry + 20);
 
 	// Uncompressed size
-	uint32_t uncompressed_size = ReadUInt32LE(buffer);
+	uint64_t uncompressed_size = LoadLE<uint32_t>(entry + 24);
 
 	// Filename length
-	uint16_t filename_len = ReadUInt16LE(buffer);
+	uint16_t filename_len = LoadLE<uint16_t>(entry + 28);
 
 	// Extra field length
-	uint16_t extra_len = ReadUInt16LE(buffer);
+	uint16_t extra_len = LoadLE<uint16_t>(entry + 30);
+
+	// File comment length
+	uint16_t comment_len = LoadLE<uint16_t>(entry + 32);
+
+	// Disk number start
+	uint32_t disk = LoadLE<uint16_t>(entry + 34);
+
+	// Internal and external file attributes are at 36 and 38.
+
+	// Relative offset of local file header
+	uint64_t offset = LoadLE<uint32_t>(entry + 42);
 
 	// Filename
-	std::string filename = ReadString(buffer, filename_len);
+	std::string filename = reader.readString(filename_len);
 
 	// Extra field
-	ReadBuffer(buffer, extra_len);
+	const char* extra = reader.record(extra_len);
+	ReadZip64Extra(extra, extra_len, uncompressed_size, compressed_size, offset, disk);
+	if (disk != 0) {
+		throw std::runtime_error("Multi-part ZIP files are not supported");
+	}
+	if (offset > archive.size()) {
+		throw std::runtime_error("Invalid local file header offset");
+	}
+	if (compressed_size > std::numeric_limits<size_t>::max() ||
+	    uncompressed_size > std::numeric_limits<size_t>::max()) {
+		throw std::runtime_error("File " + filename + " is too large");
+	}
+
+	// Comment
+	reader.record(comment_len);
+
+	// The directory entry has all we need to find the file later.
+	auto source = std::make_shared<Zip::Source>();
+	source->archive = archive;
+	source->offset = offset;
+	source->compression = static_cast<Zip::compression>(compression);
+	source->crc = crc;
+	source->compressed_size = compressed_size;
+	source->uncompressed_size = uncompressed_size;
+	source->verify = this->verify;
 
-	// File data
 	Lump lump;
 	lump.setName(std::move(filename));
+	lump.setSource(source);
 
-	if (compressed_size > 0) {
-		switch (compression) {
-		case Zip::compression::STORE:
-			lump.setData(ReadBuffer(buffer, compressed_size));
-			break;
-		case Zip::compression::DEFLATE:
-			lump.setData(zlibInflate(buffer, compressed_size, uncompressed_size));
-			break;
-		default:
-			throw std::runtime_error("Unsupported compression");
-		}
-	}
-
-	// Check the CRC32 sum.
-	std::string data = lump.getData();
-	if (data.size() > std::numeric_limits<uInt>::max()) {
-		throw std::runtime_error("File is too big for CRC check");
-	}
-	uint32_t crc_actual = crc32(0, reinterpret_cast<const Bytef*>(data.data()), static_cast<uInt>(data.size()));
-	if (crc_expected != crc_actual) {
-		throw std::runtime_error("CRC check failed");
+	// Unless we were asked to be lazy, inflate (and check) the data right
+	// away.
+	if (!lazy) {
+		lump.getData();
 	}
 
 	this->lumps->push_back(std::move(lump));
 }
 
-// Parse a Central Directory entry.  Assumes the buffer is set to the
-// location of the Central Directory entry's magic number.
-void Zip::parseCentralDirectory(std::istream& buffer) {
-	// Identifier
-	std::vector<char> identifier = ReadBuffer(buffer, 4);
-	if (std::memcmp(identifier.data(), Zip::centralDirectoryHeader, identifier.size()) != 0) {
-		throw std::runtime_error("Not a valid central directory entry");
+// Check that an End of Central Directory header found at the given
+// position actually describes the central directory, so a stray header
+// in a comment or in file data isn't mistaken for the real thing.
+bool Zip::checkEndCentralDirectory(const LumpData& archive, size_t eocdpos) {
+	const char* data = archive.data();
+	const char* record = data + eocdpos;
+	uint16_t disk = LoadLE<uint16_t>(record + 4);
+	uint16_t cddisk = LoadLE<uint16_t>(record + 6);
+	uint16_t cdentries = LoadLE<uint16_t>(record + 8);
+	uint16_t total_cdentries = LoadLE<uint16_t>(record + 10);
+	uint32_t cdsize = LoadLE<uint32_t>(record + 12);
+	uint32_t cdoffset = LoadLE<uint32_t>(record + 16);
+	uint16_t comment_len = LoadLE<uint16_t>(record + 20);
+
+	// The comment has to fit in the file.
+	if (comment_len > archive.size() - eocdpos - 22) {
+		return false;
 	}
 
-	// Version made by
-	ReadUInt16LE(buffer);
-
-	// Version needed to extract
-	ReadUInt16LE(buffer);
+	// ZIP64 archives have a locator right in front of this header.
+	if (disk == zip64Marker16 || cddisk == zip64Marker16 ||
+	    cdentries == zip64Marker16 || total_cdentries == zip64Marker16 ||
+	    cdsize == zip64Marker || cdoffset == zip64Marker) {
+		if (eocdpos >= 20 && std::memcmp(record - 20, Zip::zip64EndOfCentralDirectoryLocator,
+		                                 sizeof(Zip::zip64EndOfCentralDirectoryLocator)) == 0) {
+			return true;
+		}
+	}
 
-	// General purpose bitflag
-	ReadUInt16LE(buffer);
+	// The central directory has to come before this header, and has to
+	// start with a central directory entry unless it's empty.
+	if (static_cast<uint64_t>(cdoffset) + cdsize > eocdpos) {
+		return false;
+	}
+	if (cdentries == 0) {
+		return true;
+	}
+	return eocdpos - cdoffset >= sizeof(Zip::centralDirectoryHeader) &&
+	       std::memcmp(data + cdoffset, Zip::centralDirectoryHeader, sizeof(Zip::centralDirectoryHeader)) == 0;
+}
 
-	// Compression method
-	ReadUInt16LE(buffer);
+// Parse the End of Central Directory header at the given position, and
+// then every entry in the central directory.
+void Zip::parseEndCentralDirectory(const LumpData& archive, size_t eocdpos, bool lazy) {
+	BinaryReader reader(archive.data(), archive.size());
+	reader.seek(eocdpos + sizeof(Zip::endOfCentralDirectoryHeader));
+	const char* record = reader.record(18);
 
-	// Last modified file time
-	ReadUInt16LE(buffer);
+	// Disk number
+	uint32_t disk = LoadLE<uint16_t>(record);
 
-	// Last modified file date
-	ReadUInt16LE(buffer);
+	// Disk number of central directory
+	uint32_t cddisk = LoadLE<uint16_t>(record + 2);
 
-	// CRC32
-	ReadUInt32LE(buffer);
+	// Central directory entries
+	uint64_t cdentries = LoadLE<uint16_t>(record + 4);
 
-	// Compressed size
-	ReadUInt32LE(buffer);
+	// Total number of central directory entries
+	uint64_t total_cdentries = LoadLE<uint16_t>(record + 6);
 
-	// Uncompressed size
-	ReadUInt32LE(buffer);
+	// Size of the central directory is at 8.
 
-	// Filename length
-	uint16_t filename_len = ReadUInt16LE(buffer);
+	// Offset of central directory
+	uint64_t cdoffset = LoadLE<uint32_t>(record + 12);
+
+	// If anything didn't fit, the real values are in the ZIP64 End of
+	// Central Directory record, which is found through a locator that
+	// sits right before this record.
+	bool saturated = disk == zip64Marker16 || cddisk == zip64Marker16 ||
+	                 cdentries == zip64Marker16 || total_cdentries == zip64Marker16 ||
+	                 cdoffset == zip64Marker;
+	if (saturated && eocdpos >= 20) {
+		reader.seek(eocdpos - 20);
+		const char* locator = reader.record(20);
+		if (std::memcmp(locator, Zip::zip64EndOfCentralDirectoryLocator, sizeof(Zip::zip64EndOfCentralDirectoryLocator)) == 0) {
+			// Disk number of ZIP64 End of Central Directory
+			if (LoadLE<uint32_t>(locator + 4) != 0) {
+				throw std::runtime_error("Multi-part ZIP files are not supported");
+			}
 
-	// Extra field length
-	uint16_t extra_len = ReadUInt16LE(buffer);
+			// Offset of ZIP64 End of Central Directory
+			uint64_t eocd64offset = LoadLE<uint64_t>(locator + 8);
+			if (eocd64offset > archive.size()) {
+				throw std::runtime_error("Invalid ZIP64 end of central directory offset");
+			}
 
-	// File comment length
-	uint16_t comment_len = ReadUInt16LE(buffer);
+			// Total number of disks is at 16.
 
-	// Disk number start
-	if (ReadUInt16LE(buffer) != 0) {
-		throw std::runtime_error("Multi-part ZIP files are not supported");
-	}
+			reader.seek(static_cast<size_t>(eocd64offset));
+			const char* eocd64 = reader.record(56);
+			if (std::memcmp(eocd64, Zip::zip64EndOfCentralDirectoryHeader, sizeof(Zip::zip64EndOfCentralDirectoryHeader)) != 0) {
+				throw std::runtime_error("Not a valid ZIP64 end of central directory");
+			}
 
-	// Internal file attibutes
-	ReadUInt16LE(buffer);
+			// Size of the rest of the record, version made by and
+			// version needed to extract are at 4, 12 and 14.
 
-	// External file attibutes
-	ReadUInt32LE(buffer);
+			// Disk number
+			disk = LoadLE<uint32_t>(eocd64 + 16);
 
-	// Relative offset of local file header
-	uint32_t offset = ReadUInt32LE(buffer);
-	if (offset > this->filesize) {
-		throw std::runtime_error("Invalid local file header offset");
-	}
+			// Disk number of central directory
+			cddisk = LoadLE<uint32_t>(eocd64 + 20);
 
-	// Filename
-	ReadString(buffer, filename_len);
+			// Central directory entries
+			cdentries = LoadLE<uint64_t>(eocd64 + 24);
 
-	// Extra field
-	ReadBuffer(buffer, extra_len);
+			// Total number of central directory entries
+			total_cdentries = LoadLE<uint64_t>(eocd64 + 32);
 
-	// Comment
-	ReadBuffer(buffer, comment_len);
-
-	// We've parsed a directory entry, but we still need to parse the
-	// actual file itself.
-	auto save = buffer.tellg();
-	buffer.seekg(offset);
-	this->parseLocalFile(buffer);
-	buffer.seekg(save);
-}
+			// Size of the central directory is at 40.
 
-// Parse the End of Central Directory header in a ZIP file, assuming we
-// have already parsed the magic number.
-void Zip::parseEndCentralDirectory(std::istream& buffer) {
-	// Disk number
-	if (ReadUInt16LE(buffer) != 0) {
-		throw std::runtime_error("Multi-part ZIP files are not supported");
+			// Offset of central directory
+			cdoffset = LoadLE<uint64_t>(eocd64 + 48);
+		}
 	}
 
-	// Disk number of central directory
-	if (ReadUInt16LE(buffer) != 0) {
+	if (disk != 0 || cddisk != 0) {
 		throw std::runtime_error("Multi-part ZIP files are not supported");
 	}
-
-	// Central directory entries
-	uint16_t cdentries = ReadUInt16LE(buffer);
-
-	// Total number of central directory entries
-	uint16_t total_cdentries = ReadUInt16LE(buffer);
 	if (cdentries != total_cdentries) {
 		throw std::runtime_error("Central directory entry count does not equal total");
 	}
-
-	// Size of the central directory
-	ReadUInt32LE(buffer);
-
-	// Offset of central directory
-	uint32_t cdoffset = ReadUInt32LE(buffer);
-	if (cdoffset > this->filesize) {
+	if (cdoffset > archive.size()) {
 		throw std::runtime_error("Invalid central directory offset");
 	}
 
 	// Read every entry in the central directory
-	buffer.seekg(cdoffset);
-	for (size_t index = 0;index < cdentries;index++) {
-		this->parseCentralDirectory(buffer);
+	reader.seek(static_cast<size_t>(cdoffset));
+	for (uint64_t index = 0;index < cdentries;index++) {
+		this->parseCentralDirectory(archive, reader, lazy);
 	}
 }
 
-Zip::Zip() : filesize(0), lumps(new Directory) { }
+// Parse a whole ZIP file in memory.  Lumps refer back to the archive for
+// their compressed data, and if lazy is set, aren't inflated until they
+// are used.
+void Zip::parse(const LumpData& archive, bool lazy) {
+	// Ensure our buffer is big enough to be a ZIP file
+	if (archive.size() < 22) {
+		throw std::runtime_error("Buffer is not ZIP file - too small");
+	}
+
+	// The End of Central Directory record is 22 bytes followed by a
+	// comment of up to 65535 bytes, so it has to be somewhere in the tail
+	// of the file.
+	size_t tail_len = std::min<size_t>(archive.size(), 22 + std::numeric_limits<uint16_t>::max());
+	size_t tail_pos = archive.size() - tail_len;
+
+	// Every place the header shows up is a candidate, and the real one is
+	// most likely the last one that passes inspection.
+	std::vector<size_t> candidates;
+	const char* start = archive.data() + tail_pos;
+	const char* end = archive.data() + archive.size() - 22 + 1;
+	for (const char* p = start;p < end;p++) {
+		p = static_cast<const char*>(std::memchr(p, Zip::endOfCentralDirectoryHeader[0], end - p));
+		if (p == nullptr) {
+			break;
+		}
+		if (std::memcmp(p, Zip::endOfCentralDirectoryHeader, sizeof(Zip::endOfCentralDirectoryHeader)) == 0) {
+			candidates.push_back(p - archive.data());
+		}
+	}
+
+	for (auto it = candidates.rbegin();it != candidates.rend();++it) {
+		if (Zip::checkEndCentralDirectory(archive, *it)) {
+			this->parseEndCentralDirectory(archive, *it, lazy);
+			return;
+		}
+	}
+
+	throw std::runtime_error("Buffer is not ZIP file - can't find identifier");
+}
+
+Zip::Zip() : verify(true), workers(0), lumps(new Directory) { }
+
+// Open a ZIP file on disk.  Only the central directory is read, and each
+// file is inflated from the mapped ZIP the first time its data is used.
+void Zip::open(const std::string& filename) {
+	auto mapping = std::make_shared<const MappedFile>(filename);
+	this->parse(LumpData(mapping, 0, mapping->size()), true);
+}
 
 std::shared_ptr<Directory> Zip::getLumps() {
 	return this->lumps;
@@ -405,199 +664,518 @@ void Zip::setLumps(Directory&& lumps) {
 	this->lumps = std::make_shared<Directory>(std::move(lumps));
 }
 
+// Set whether lumps read from a ZIP have their CRC32 checked when they
+// are first loaded.
+void Zip::setVerify(bool verify) {
+	this->verify = verify;
+}
+
+// Set the number of threads used to compress lumps.  0 means one thread
+// per hardware thread.
+void Zip::setWorkers(size_t workers) {
+	this->workers = workers;
+}
+
+// The whole stream is read into memory and parsed from there, and every
+// file is inflated right away.
 std::istream& operator>>(std::istream& buffer, Zip& zip) {
-	// Ensure our buffer is big enough to be a ZIP file
 	buffer.seekg(0, buffer.end);
-	zip.filesize = buffer.tellg();
-	if (zip.filesize < 22) {
-		throw std::runtime_error("Buffer is not ZIP file - too small");
+	std::streamoff filesize = buffer.tellg();
+	if (filesize < 0) {
+		throw std::runtime_error("Couldn't find size of ZIP file");
 	}
+	buffer.seekg(0, buffer.beg);
+	zip.parse(LumpData(ReadString(buffer, static_cast<size_t>(filesize))), false);
+	return buffer;
+}
 
-	// Start at the end and work backwards until we find an end of
-	// central directory record.  22 is the closest the End of Central
-	// Directory header could possibly be to the end.
-	buffer.seekg(-22, buffer.end);
+// A lump that has been compressed ahead of time and is ready to be
+// written out.
+struct Zip::PackedLump {
+	Zip::compression compression;
+	uint32_t crc;
+	LumpData data;
+	bool ready;
+	PackedLump() : compression(Zip::compression::STORE), crc(0), ready(false) { }
+};
 
-	for (;;) {
-		std::vector<char> identifier = ReadBuffer(buffer, 4);
-		if (std::memcmp(identifier.data(), Zip::endOfCentralDirectoryHeader, identifier.size()) == 0) {
-			zip.parseEndCentralDirectory(buffer);
-			break;
+// Lumps at least this large have their CRC32 worked out in pieces of
+// crcPieceSize bytes by whichever workers are free.
+static const size_t crcSplitSize = 4 * 1024 * 1024;
+static const size_t crcPieceSize = 1024 * 1024;
+
+// Compresses lumps on a pool of worker threads.  Workers never run too
+// far ahead of the lump that is being written, so only a handful of
+// compressed lumps are held in memory at any one time.
+class Zip::PackPool {
+	const Directory& lumps;
+	std::vector<Zip::PackedLump> packed;
+	std::vector<std::thread> threads;
+	size_t workers;
+	std::mutex mutex;
+	std::condition_variable cv;
+	size_t window;
+	size_t next;
+	size_t written;
+	bool stop;
+	std::exception_ptr error;
+
+	// A piece of the CRC32 of a large lump, which any waiting worker can
+	// pick up while the lump itself is being deflated.
+	struct CRCPiece {
+		const char* data;
+		size_t len;
+		uint32_t crc;
+		bool done;
+	};
+	std::deque<CRCPiece*> pieces;
+
+	// Work out the next waiting piece.  The lock is held on the way in and
+	// on the way out.
+	void crcPiece(std::unique_lock<std::mutex>& lock) {
+		CRCPiece* piece = this->pieces.front();
+		this->pieces.pop_front();
+		lock.unlock();
+		piece->crc = CRC32(0, piece->data, piece->len);
+		lock.lock();
+		piece->done = true;
+		this->cv.notify_all();
+	}
+
+	void work() {
+		for (;;) {
+			std::unique_lock<std::mutex> lock(this->mutex);
+			this->cv.wait(lock, [this]() {
+				return this->stop || !this->pieces.empty() ||
+				       (this->next < this->packed.size() && this->next < this->written + this->window);
+			});
+
+			// Somebody is waiting on these, so they come first.
+			if (!this->pieces.empty()) {
+				this->crcPiece(lock);
+				continue;
+			}
+			if (this->stop) {
+				return;
+			}
+			size_t index = this->next++;
+			lock.unlock();
+
+			try {
+				Zip::packLump(this->lumps.at(index), this->packed[index], *this);
+			} catch (...) {
+				lock.lock();
+				if (!this->error) {
+					this->error = std::current_exception();
+				}
+				this->stop = true;
+				this->cv.notify_all();
+				return;
+			}
+
+			lock.lock();
+			this->packed[index].ready = true;
+			this->cv.notify_all();
+		}
+	}
+public:
+	PackPool(const Directory& lumps, size_t workers) :
+		lumps(lumps), packed(lumps.size()), workers(workers), window(workers * 4),
+		next(0), written(0), stop(false) {
+		for (size_t i = 0;i < workers;i++) {
+			this->threads.push_back(std::thread(&Zip::PackPool::work, this));
 		}
+	}
+	~PackPool() {
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->stop = true;
+		}
+		this->cv.notify_all();
+		for (auto& thread : this->threads) {
+			thread.join();
+		}
+	}
 
-		if (buffer.tellg() == static_cast<std::char_traits<char>::pos_type>(0)) {
-			throw std::runtime_error("Buffer is not ZIP file - can't find identifier");
+	// Deflate a lump and calculate its CRC32.  With other workers around,
+	// the CRC32 of a large lump is split into pieces for them to pick up,
+	// and the pieces are combined once deflate is done.
+	std::string deflate(const LumpData& data, uint32_t& crc) {
+		if (this->workers < 2 || data.size() < crcSplitSize) {
+			return zlibDeflate(data, &crc);
 		}
 
-		buffer.seekg(-1, buffer.cur);
+		std::vector<CRCPiece> pieces;
+		for (size_t pos = 0;pos < data.size();pos += crcPieceSize) {
+			CRCPiece piece = { data.data() + pos, std::min(crcPieceSize, data.size() - pos), 0, false };
+			pieces.push_back(piece);
+		}
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			for (auto& piece : pieces) {
+				this->pieces.push_back(&piece);
+			}
+		}
+		this->cv.notify_all();
+
+		// Whatever happens to deflate, the pieces have to be finished
+		// before they go out of scope.  Help out with waiting pieces
+		// instead of just sitting there.
+		auto finish = [&]() {
+			std::unique_lock<std::mutex> lock(this->mutex);
+			for (auto& piece : pieces) {
+				while (!piece.done) {
+					if (!this->pieces.empty()) {
+						this->crcPiece(lock);
+					} else {
+						this->cv.wait(lock);
+					}
+				}
+			}
+		};
+		std::string compressed;
+		try {
+			compressed = zlibDeflate(data, nullptr);
+		} catch (...) {
+			finish();
+			throw;
+		}
+		finish();
+
+		crc = pieces[0].crc;
+		for (size_t i = 1;i < pieces.size();i++) {
+			crc = CRC32Combine(crc, pieces[i].crc, pieces[i].len);
+		}
+		return compressed;
 	}
 
-	return buffer;
-}
+	// Wait for the lump at the given index to be compressed.
+	Zip::PackedLump& get(size_t index) {
+		std::unique_lock<std::mutex> lock(this->mutex);
+		this->cv.wait(lock, [this, index]() {
+			return this->packed[index].ready || this->error;
+		});
+		if (this->error) {
+			std::rethrow_exception(this->error);
+		}
+		return this->packed[index];
+	}
 
-std::ostream& operator<<(std::ostream& buffer, Zip& zip) {
-	std::stringstream centralDirectory;
+	// Let go of a lump once it has been written.
+	void release(size_t index) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->packed[index].data = LumpData();
+		this->written = index + 1;
+		this->cv.notify_all();
+	}
+};
 
-	// Write every lump out as a local file (with header) and the
-	// central directory header
-	for (Lump lump : *(zip.lumps)) {
-		std::string name = lump.getName();
-		std::string data = lump.getData();
+// Compress a lump and calculate its CRC32 in the same pass.
+void Zip::packLump(const Lump& lump, Zip::PackedLump& packed, Zip::PackPool& pool) {
+	// Lumps that haven't changed since they were read from a ZIP already
+	// have everything we need.
+	auto source = std::dynamic_pointer_cast<const Zip::Source>(lump.getSource());
+	if (source) {
+		packed.compression = source->compression;
+		packed.crc = source->crc;
+		packed.data = source->getCompressed();
+		return;
+	}
+
+	const LumpData& data = lump.getData();
+
+	// Empty lumps can't get any smaller.
+	if (data.empty()) {
+		packed.compression = Zip::compression::STORE;
+		packed.crc = 0;
+		packed.data = data;
+		return;
+	}
 
-		// Compress ahead of time
-		std::stringstream compressed;
-		zlibDeflate(compressed, data);
+	// Did we actually save any space?
+	std::string compressed = pool.deflate(data, packed.crc);
+	if (compressed.size() <= data.size()) {
+		packed.compression = Zip::compression::DEFLATE;
+		packed.data = LumpData(std::move(compressed));
+	} else {
+		packed.compression = Zip::compression::STORE;
+		packed.data = data;
+	}
+}
 
-		// Did we actually save any space?
-		Zip::compression compression = Zip::compression::STORE;
-		if (static_cast<size_t>(compressed.tellp()) <= data.size()) {
-			compression = Zip::compression::DEFLATE;
+// Hands ZIP data to a stream, turning failed writes into exceptions.
+class ZipStreamOutput {
+	std::ostream& stream;
+public:
+	ZipStreamOutput(std::ostream& stream) : stream(stream) { }
+	void write(const char* data, size_t len) {
+		if (!this->stream.write(data, len)) {
+			throw std::runtime_error("Couldn't write ZIP data");
 		}
+	}
+};
 
-		// Store local file position so we can write it later
-		auto filepos = buffer.tellp();
+// Write the whole ZIP to anything with a write(data, len), starting at the
+// given position in the file.
+template <class O>
+void Zip::pack(O& output, uint64_t filepos) {
+	BinaryWriter centralDirectory;
+	centralDirectory.reserve(this->lumps->size() * 64);
+
+	// Figure out how many threads we're compressing with.
+	size_t workers = this->workers;
+	if (workers == 0) {
+		workers = std::thread::hardware_concurrency();
+	}
+	if (workers == 0) {
+		workers = 1;
+	}
+	if (workers > this->lumps->size()) {
+		workers = this->lumps->size();
+	}
+	Zip::PackPool pool(*(this->lumps), workers);
+
+	// Write every lump out as a local file (with header) and the
+	// central directory header
+	for (size_t index = 0;index < this->lumps->size();index++) {
+		const Lump& lump = this->lumps->at(index);
+		const std::string& name = lump.getName();
+
+		// Wait for the lump to be compressed.  Only the compressed data
+		// is touched here, so unchanged lumps from another ZIP are never
+		// inflated at all.
+		Zip::PackedLump& packed = pool.get(index);
+		Zip::compression compression = packed.compression;
+		const LumpData& data = packed.data;
+		size_t size = lump.getSize();
+
+		// Sizes and offsets that don't fit in their usual fields go in a
+		// ZIP64 extra field instead.  The local header has to have both
+		// sizes if it has either.
+		std::vector<uint64_t> local64;
+		if (size >= zip64Marker || data.size() >= zip64Marker) {
+			local64.push_back(size);
+			local64.push_back(data.size());
+		}
+		std::vector<uint64_t> cd64;
+		if (size >= zip64Marker) {
+			cd64.push_back(size);
+		}
+		if (data.size() >= zip64Marker) {
+			cd64.push_back(data.size());
+		}
+		if (filepos >= zip64Marker) {
+			cd64.push_back(filepos);
+		}
+		std::string localExtra = WriteZip64Extra(local64);
+		std::string cdExtra = WriteZip64Extra(cd64);
+		uint16_t needed = cd64.empty() ? Zip::version : Zip::zip64Version;
 
 		// Headers
-		buffer.write(Zip::localFileHeader, sizeof(Zip::localFileHeader));
-		centralDirectory.write(Zip::centralDirectoryHeader, sizeof(Zip::centralDirectoryHeader));
+		BinaryWriter header;
+		header.writeData(Zip::localFileHeader, sizeof(Zip::localFileHeader));
+		centralDirectory.writeData(Zip::centralDirectoryHeader, sizeof(Zip::centralDirectoryHeader));
 
 		// Version made by (only in Central Directory)
-		WriteUInt16LE(centralDirectory, Zip::version);
+		centralDirectory.write<uint16_t>(needed);
 
 		// Version needed to extract
-		WriteUInt16LE(buffer, Zip::version);
-		WriteUInt16LE(centralDirectory, Zip::version);
+		header.write<uint16_t>(local64.empty() ? Zip::version : Zip::zip64Version);
+		centralDirectory.write<uint16_t>(needed);
 
 		// General purpose bitflag
-		WriteUInt16LE(buffer, 0);
-		WriteUInt16LE(centralDirectory, 0);
+		header.write<uint16_t>(0);
+		centralDirectory.write<uint16_t>(0);
 
 		// Compression method
-		WriteUInt16LE(buffer, compression);
-		WriteUInt16LE(centralDirectory, compression);
+		header.write<uint16_t>(compression);
+		centralDirectory.write<uint16_t>(compression);
 
 		// Last modified file time
-		WriteUInt16LE(buffer, 0);
-		WriteUInt16LE(centralDirectory, 0);
+		header.write<uint16_t>(0);
+		centralDirectory.write<uint16_t>(0);
 
 		// Last modified file date
-		WriteUInt16LE(buffer, 0);
-		WriteUInt16LE(centralDirectory, 0);
+		header.write<uint16_t>(0);
+		centralDirectory.write<uint16_t>(0);
 
 		// CRC32
-		if (data.size() > std::numeric_limits<uInt>::max()) {
-			throw std::runtime_error("Lump is too big for CRC check");
-		}
-		uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(data.data()), static_cast<uInt>(data.size()));
-		WriteUInt32LE(buffer, crc);
-		WriteUInt32LE(centralDirectory, crc);
+		header.write<uint32_t>(packed.crc);
+		centralDirectory.write<uint32_t>(packed.crc);
 
 		// Compressed size
-		if (compression == Zip::compression::DEFLATE) {
-			if (compressed.tellp() > std::numeric_limits<uint32_t>::max()) {
-				throw std::runtime_error("Lump " + name + " is too large");
-			}
-			WriteUInt32LE(buffer, static_cast<uint32_t>(compressed.tellp()));
-			WriteUInt32LE(centralDirectory, static_cast<uint32_t>(compressed.tellp()));
+		if (data.size() >= zip64Marker) {
+			centralDirectory.write<uint32_t>(zip64Marker);
 		} else {
-			if (data.size() > std::numeric_limits<uint32_t>::max()) {
-				throw std::runtime_error("Lump " + name + " is too large");
-			}
-			WriteUInt32LE(buffer, static_cast<uint32_t>(data.size()));
-			WriteUInt32LE(centralDirectory, static_cast<uint32_t>(data.size()));
+			centralDirectory.write<uint32_t>(static_cast<uint32_t>(data.size()));
+		}
+		if (!local64.empty()) {
+			header.write<uint32_t>(zip64Marker);
+		} else {
+			header.write<uint32_t>(static_cast<uint32_t>(data.size()));
 		}
 
 		// Uncompressed size
-		if (data.size() > std::numeric_limits<uint32_t>::max()) {
-			throw std::runtime_error("Lump " + name + " is too large");
+		if (size >= zip64Marker) {
+			centralDirectory.write<uint32_t>(zip64Marker);
+		} else {
+			centralDirectory.write<uint32_t>(static_cast<uint32_t>(size));
+		}
+		if (!local64.empty()) {
+			header.write<uint32_t>(zip64Marker);
+		} else {
+			header.write<uint32_t>(static_cast<uint32_t>(size));
 		}
-		WriteUInt32LE(buffer, static_cast<uint32_t>(data.size()));
-		WriteUInt32LE(centralDirectory, static_cast<uint32_t>(data.size()));
 
 		// Filename length
 		if (name.size() > std::numeric_limits<uint16_t>::max()) {
 			throw std::runtime_error("Lump name " + name + " is too large");
 		}
-		WriteUInt16LE(buffer, static_cast<uint16_t>(name.size()));
-		WriteUInt16LE(centralDirectory, static_cast<uint16_t>(name.size()));
+		header.write<uint16_t>(static_cast<uint16_t>(name.size()));
+		centralDirectory.write<uint16_t>(static_cast<uint16_t>(name.size()));
 
 		// Extra field length
-		WriteUInt16LE(buffer, 0);
-		WriteUInt16LE(centralDirectory, 0);
+		header.write<uint16_t>(static_cast<uint16_t>(localExtra.size()));
+		centralDirectory.write<uint16_t>(static_cast<uint16_t>(cdExtra.size()));
 
 		// File comment length (only in Central Directory)
-		WriteUInt16LE(centralDirectory, 0);
+		centralDirectory.write<uint16_t>(0);
 
 		// Disk number (only in Central Directory)
-		WriteUInt16LE(centralDirectory, 0);
+		centralDirectory.write<uint16_t>(0);
 
 		// Internal file attibutes (only in Central Directory)
-		WriteUInt16LE(centralDirectory, 0);
+		centralDirectory.write<uint16_t>(0);
 
 		// External file attibutes (only in Central Directory)
-		WriteUInt32LE(centralDirectory, 0);
+		centralDirectory.write<uint32_t>(0);
 
 		// Local header location (only in Central Directory)
-		if (filepos > std::numeric_limits<uint32_t>::max()) {
-			throw std::runtime_error("Cannot write local header location of lump " + name);
+		if (filepos >= zip64Marker) {
+			centralDirectory.write<uint32_t>(zip64Marker);
+		} else {
+			centralDirectory.write<uint32_t>(static_cast<uint32_t>(filepos));
 		}
-		WriteUInt32LE(centralDirectory, static_cast<uint32_t>(filepos));
 
 		// Filename
-		WriteString(buffer, name);
-		WriteString(centralDirectory, name);
+		header.writeString(name);
+		centralDirectory.writeString(name);
 
-		// Extra field & File comment (skipped)
+		// Extra field
+		header.writeString(localExtra);
+		centralDirectory.writeString(cdExtra);
 
-		// Write actual file data
-		if (compression == Zip::compression::DEFLATE) {
-			buffer << compressed.rdbuf();
-		} else {
-			buffer.write(data.data(), data.size());
-		}
+		// File comment (skipped)
+
+		// Write the local header and actual file data
+		output.write(header.data(), header.size());
+		output.write(data.data(), data.size());
+		filepos += header.size() + data.size();
+
+		pool.release(index);
 	}
 
 	// Keep track of the start of central directory position
-	auto cdoffset = buffer.tellp();
+	uint64_t cdoffset = filepos;
+	uint64_t cdsize = centralDirectory.size();
+	uint64_t cdentries = this->lumps->size();
+
+	// The end of central directory headers are written after the central
+	// directory itself
+	BinaryWriter end;
+
+	// If anything is too big for the end of central directory header, write
+	// the ZIP64 end of central directory header and its locator first.
+	bool zip64 = cdentries >= zip64Marker16 || cdsize >= zip64Marker || cdoffset >= zip64Marker;
+	if (zip64) {
+		uint64_t eocd64offset = cdoffset + cdsize;
+
+		// Header
+		end.writeData(Zip::zip64EndOfCentralDirectoryHeader, sizeof(Zip::zip64EndOfCentralDirectoryHeader));
+
+		// Size of the rest of the record
+		end.write<uint64_t>(44);
+
+		// Version made by
+		end.write<uint16_t>(Zip::zip64Version);
+
+		// Version needed to extract
+		end.write<uint16_t>(Zip::zip64Version);
+
+		// Disk number
+		end.write<uint32_t>(0);
+
+		// Disk number of central directory
+		end.write<uint32_t>(0);
+
+		// Central directory entries
+		end.write<uint64_t>(cdentries);
 
-	// Concatinate the central directory to the file
-	buffer << centralDirectory.rdbuf();
+		// Total number of central directory entries
+		end.write<uint64_t>(cdentries);
+
+		// Size of the central directory
+		end.write<uint64_t>(cdsize);
+
+		// Offset of central directory
+		end.write<uint64_t>(cdoffset);
+
+		// Locator header
+		end.writeData(Zip::zip64EndOfCentralDirectoryLocator, sizeof(Zip::zip64EndOfCentralDirectoryLocator));
+
+		// Disk number of ZIP64 end of central directory
+		end.write<uint32_t>(0);
+
+		// Offset of ZIP64 end of central directory
+		end.write<uint64_t>(eocd64offset);
+
+		// Total number of disks
+		end.write<uint32_t>(1);
+	}
 
 	// Write the end of central directory header
 
 	// Header
-	buffer.write(Zip::endOfCentralDirectoryHeader, sizeof(Zip::endOfCentralDirectoryHeader));
+	end.writeData(Zip::endOfCentralDirectoryHeader, sizeof(Zip::endOfCentralDirectoryHeader));
 
 	// Disk number
-	WriteUInt16LE(buffer, 0);
+	end.write<uint16_t>(0);
 
 	// Disk number of central directory
-	WriteUInt16LE(buffer, 0);
+	end.write<uint16_t>(0);
 
 	// Central directory entries
-	if (zip.lumps->size() > std::numeric_limits<uint16_t>::max()) {
-		throw std::runtime_error("Too many lumps");
-	}
-	WriteUInt16LE(buffer, static_cast<uint16_t>(zip.lumps->size()));
+	uint16_t entries16 = zip64 ? zip64Marker16 : static_cast<uint16_t>(cdentries);
+	end.write<uint16_t>(entries16);
 
 	// Total number of central directory entries
-	WriteUInt16LE(buffer, static_cast<uint16_t>(zip.lumps->size()));
+	end.write<uint16_t>(entries16);
 
 	// Size of the central directory
-	if (centralDirectory.tellp() > std::numeric_limits<uint32_t>::max()) {
-		throw std::runtime_error("Central directory is too large");
-	}
-	WriteUInt32LE(buffer, static_cast<uint32_t>(centralDirectory.tellp()));
+	end.write<uint32_t>(cdsize >= zip64Marker ? zip64Marker : static_cast<uint32_t>(cdsize));
 
 	// Offset of central directory
-	if (cdoffset > std::numeric_limits<uint32_t>::max()) {
-		throw std::runtime_error("Can't write central directory offset");
-	}
-	WriteUInt32LE(buffer, static_cast<uint32_t>(cdoffset));
+	end.write<uint32_t>(zip64 ? zip64Marker : static_cast<uint32_t>(cdoffset));
 
 	// Comment length
-	WriteUInt16LE(buffer, 0);
+	end.write<uint16_t>(0);
+
+	// Concatinate the central directory and end headers to the file
+	output.write(centralDirectory.data(), centralDirectory.size());
+	output.write(end.data(), end.size());
+}
 
+// Write the ZIP straight to a file on disk.  Compressed lumps go out as
+// soon as they're ready, so the whole archive is never held in memory.
+void Zip::save(const std::string& filename) {
+	OutputFile file(filename);
+	this->pack(file, 0);
+	file.close();
+}
+
+std::ostream& operator<<(std::ostream& buffer, Zip& zip) {
+	ZipStreamOutput output(buffer);
+	zip.pack(output, static_cast<uint64_t>(buffer.tellp()));
 	return buffer;
 }
 
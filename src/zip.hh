@@ -22,28 +22,46 @@
 #include <cstdint>
 #include <iosfwd>
 #include <memory>
+#include <string>
 
 #include "wad.hh"
 
 namespace WADmake {
 
+class BinaryReader;
+
 class Zip {
 	static const char localFileHeader[];
 	static const char centralDirectoryHeader[];
 	static const char endOfCentralDirectoryHeader[];
+	static const char zip64EndOfCentralDirectoryHeader[];
+	static const char zip64EndOfCentralDirectoryLocator[];
 	static const uint16_t version;
+	static const uint16_t zip64Version;
 	enum compression : uint16_t { STORE = 0, DEFLATE = 8 };
 
-	size_t filesize;
+	struct PackedLump;
+	class PackPool;
+	class Source;
+
+	bool verify;
+	size_t workers;
 	std::shared_ptr<Directory> lumps;
-	void parseLocalFile(std::istream& buffer);
-	void parseCentralDirectory(std::istream& buffer);
-	void parseEndCentralDirectory(std::istream& buffer);
+	static void packLump(const Lump& lump, PackedLump& packed, PackPool& pool);
+	static bool checkEndCentralDirectory(const LumpData& archive, size_t eocdpos);
+	void parse(const LumpData& archive, bool lazy);
+	void parseCentralDirectory(const LumpData& archive, BinaryReader& reader, bool lazy);
+	void parseEndCentralDirectory(const LumpData& archive, size_t eocdpos, bool lazy);
+	template <class O> void pack(O& output, uint64_t filepos);
 public:
 	Zip();
 	std::shared_ptr<Directory> getLumps();
+	void open(const std::string& filename);
+	void save(const std::string& filename);
 	void setLumps(const std::shared_ptr<Directory>& lumps);
 	void setLumps(Directory&& lumps);
+	void setVerify(bool verify);
+	void setWorkers(size_t workers);
 	friend std::istream& operator>>(std::istream& buffer, Zip& zip);
 	friend std::ostream& operator<<(std::ostream& buffer, Zip& zip);
 };
@@ -0,0 +1,71 @@
+/*
+ *  wadmake: a WAD manipulation utility.
+ *  Copyright (C) 2015  Alex Mayfield
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compares the speed of our CRC32 against the one in zlib.
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "crc32.hh"
+
+using namespace WADmake;
+
+static void Bench(const char* name, size_t size, size_t total,
+                  const std::function<uint32_t(const char*, size_t)>& func) {
+	std::vector<char> data(size);
+	std::mt19937 rng(size);
+	for (auto& c : data) {
+		c = static_cast<char>(rng());
+	}
+
+	size_t rounds = total / size;
+	uint32_t result = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0;i < rounds;i++) {
+		result += func(data.data(), data.size());
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	double mbps = (static_cast<double>(rounds) * size) / (1024 * 1024) / elapsed.count();
+	std::printf("%-10s %10zu bytes %10.1f MiB/s  (%08x)\n", name, size, mbps, result);
+}
+
+int main() {
+	const size_t total = 512 * 1024 * 1024;
+	const size_t sizes[] = { 64, 1024, 16 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+
+	for (auto size : sizes) {
+		Bench("zlib", size, total, [](const char* data, size_t len) {
+			return static_cast<uint32_t>(crc32(0, reinterpret_cast<const Bytef*>(data), static_cast<uInt>(len)));
+		});
+		Bench("portable", size, total, [](const char* data, size_t len) {
+			return CRC32Portable(0, data, len);
+		});
+		Bench("wadmake", size, total, [](const char* data, size_t len) {
+			return CRC32(0, data, len);
+		});
+	}
+
+	return 0;
+}
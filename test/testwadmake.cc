@@ -19,9 +19,23 @@
 #define CATCH_CONFIG_MAIN
 #include "catch.hh"
 
+#include <zlib.h>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+#include "blockmap.hh"
 #include "buffer.hh"
+#include "crc32.hh"
+#include "densemap.hh"
 #include "lua.hh"
 #include "map.hh"
+#include "nodebuilder.hh"
+#include "optimizer.hh"
+#include "reject.hh"
+#include "spatialindex.hh"
+#include "udmf.hh"
 #include "wad.hh"
 #include "zip.hh"
 
@@ -89,6 +103,175 @@ TEST_CASE("WriteUInt64LE can write 64-bit Little Endian integers", "[bit]") {
 	REQUIRE(buffer.str()[7] == '\xFF');
 }
 
+TEST_CASE("MemoryStream can read and seek without copying", "[bit]") {
+	const char data[] = "\xFE\xFF\xFC\xFD\xFE\xFF";
+	MemoryStream buffer(data, 6);
+	REQUIRE(ReadUInt16LE(buffer) == 0xFFFE);
+	REQUIRE(ReadUInt32LE(buffer) == 0xFFFEFDFC);
+	buffer.seekg(0);
+	REQUIRE(ReadUInt16LE(buffer) == 0xFFFE);
+	buffer.seekg(-2, buffer.end);
+	REQUIRE(buffer.tellg() == 4);
+}
+
+TEST_CASE("BinaryReader can read Little Endian integers and strings", "[bit]") {
+	const char data[] = "\xFE\xFF\xFC\xFD\xFE\xFFHISSY\0\0\0\xFF";
+	BinaryReader reader(data, 15);
+	REQUIRE(reader.read<int16_t>() == -2);
+	REQUIRE(reader.read<uint32_t>() == 0xFFFEFDFC);
+	REQUIRE(reader.readCString(8) == "HISSY");
+	REQUIRE(reader.remaining() == 1);
+	REQUIRE_THROWS(reader.read<uint16_t>());
+	REQUIRE(reader.read<uint8_t>() == 0xFF);
+	REQUIRE(reader.eof());
+
+	reader.seek(2);
+	const char* record = reader.record(4);
+	REQUIRE(LoadLE<uint16_t>(record) == 0xFDFC);
+	REQUIRE(LoadLE<int16_t>(record + 2) == -2);
+	REQUIRE_THROWS(reader.seek(16));
+}
+
+TEST_CASE("BinaryWriter can write Little Endian integers and strings", "[bit]") {
+	BinaryWriter writer;
+	writer.write<int16_t>(-2);
+	writer.write<uint64_t>(0xFFFEFDFCFBFAF9F8);
+	writer.writeCString("HISSY", 8);
+	writer.writeCString("TOOLONGNAME", 8);
+	writer.writeAt<uint16_t>(0, 0x1234);
+	REQUIRE_THROWS(writer.writeAt<uint32_t>(24, 0));
+
+	std::string result = writer.release();
+	REQUIRE(writer.size() == 0);
+	REQUIRE(result == std::string("\x34\x12\xF8\xF9\xFA\xFB\xFC\xFD\xFE\xFFHISSY\0\0\0TOOLONGN", 26));
+}
+
+TEST_CASE("Lump data is shared and copied on write", "[directory]") {
+	Lump lump;
+	lump.setData(std::string("hissy"));
+
+	Lump copy = lump;
+	REQUIRE(copy.getData().data() == lump.getData().data());
+
+	copy.mutableData()[0] = 'k';
+	REQUIRE(copy.getData().str() == "kissy");
+	REQUIRE(lump.getData().str() == "hissy");
+
+	// No longer shared, so no need to copy again
+	const char* before = copy.getData().data();
+	copy.mutableData()[1] = 'a';
+	REQUIRE(copy.getData().data() == before);
+	REQUIRE(copy.getData().str() == "kassy");
+
+	REQUIRE(lump.getData().slice(1, 3).str() == "iss");
+}
+
+TEST_CASE("Directory keeps its name index up to date", "[directory]") {
+	Directory dir;
+	const char* names[] = { "MAP01", "THINGS", "MAP02", "THINGS", "MAP03", "THINGS" };
+	for (const char* name : names) {
+		Lump lump;
+		lump.setName(name);
+		dir.push_back(std::move(lump));
+	}
+
+	bool success;
+	size_t index;
+	std::tie(success, index) = dir.find_index("THINGS", 2);
+	REQUIRE(success);
+	REQUIRE(index == 3);
+
+	SECTION("Inserting shifts later positions") {
+		Lump lump;
+		lump.setName("THINGS");
+		dir.insert_at(2, std::move(lump));
+		std::tie(success, index) = dir.find_index("THINGS", 2);
+		REQUIRE(success);
+		REQUIRE(index == 2);
+		std::tie(success, index) = dir.find_index("MAP02", 0);
+		REQUIRE(index == 3);
+		std::tie(success, index) = dir.find_index("THINGS", 3);
+		REQUIRE(index == 4);
+	}
+
+	SECTION("Erasing shifts later positions") {
+		dir.erase_at(1);
+		std::tie(success, index) = dir.find_index("THINGS", 0);
+		REQUIRE(success);
+		REQUIRE(index == 2);
+		std::tie(success, index) = dir.find_index("MAP03", 0);
+		REQUIRE(index == 3);
+	}
+
+	SECTION("Replacing a lump renames it in the index") {
+		Lump lump;
+		lump.setName("LINEDEFS");
+		dir.set_at(3, std::move(lump));
+		std::tie(success, index) = dir.find_index("THINGS", 2);
+		REQUIRE(index == 5);
+		std::tie(success, index) = dir.find_index("LINEDEFS", 0);
+		REQUIRE(index == 3);
+	}
+
+	SECTION("Missing lumps aren't found") {
+		std::tie(success, index) = dir.find_index("THINGS", 6);
+		REQUIRE_FALSE(success);
+		std::tie(success, index) = dir.find_index("SIDEDEFS", 0);
+		REQUIRE_FALSE(success);
+	}
+}
+
+TEST_CASE("Directory finds maps by their lumps", "[directory]") {
+	Directory dir;
+	const char* names[] = {
+		"PLAYPAL", "MAP01", "THINGS", "LINEDEFS", "SIDEDEFS", "VERTEXES",
+		"SECTORS", "BEHAVIOR", "GL_MAP01", "GL_VERT", "MAP02", "TEXTMAP",
+		"ZNODES", "EXTRA", "ENDMAP", "MAP03", "SECTORS", "THINGS", "ENDOOM"
+	};
+	for (const char* name : names) {
+		Lump lump;
+		lump.setName(name);
+		dir.push_back(std::move(lump));
+	}
+
+	const std::vector<MapLocation>& maps = dir.maps();
+	REQUIRE(maps.size() == 3);
+	REQUIRE(maps[0].name == "MAP01");
+	REQUIRE(maps[0].lumps.size() == 8);
+	REQUIRE(maps[1].lumps.size() == 4);
+	REQUIRE(maps[2].header == 15);
+
+	bool success;
+	size_t index;
+	std::tie(success, index) = maps[0].find("BEHAVIOR");
+	REQUIRE(success);
+	REQUIRE(index == 7);
+	std::tie(success, index) = maps[1].find("EXTRA");
+	REQUIRE(index == 13);
+	std::tie(success, index) = maps[2].find("THINGS");
+	REQUIRE(index == 17);
+	std::tie(success, index) = maps[2].find("LINEDEFS");
+	REQUIRE_FALSE(success);
+
+	std::tie(success, index) = dir.find_map("MAP02");
+	REQUIRE(success);
+	REQUIRE(index == 1);
+	std::tie(success, index) = dir.find_map_at(15);
+	REQUIRE(success);
+	REQUIRE(index == 2);
+	std::tie(success, index) = dir.find_map_at(2);
+	REQUIRE_FALSE(success);
+
+	SECTION("Changing the directory finds the maps again") {
+		dir.erase_at(10);
+		REQUIRE(dir.maps().size() == 2);
+		std::tie(success, index) = dir.find_map("MAP02");
+		REQUIRE_FALSE(success);
+		std::tie(success, index) = dir.find_map("MAP03");
+		REQUIRE(index == 1);
+	}
+}
+
 TEST_CASE("Wad can construct from istream, output to ostream, and read itself again", "[wad]") {
 	std::stringstream buffer;
 	std::ifstream moo2d_wad("moo2d.wad", std::fstream::in | std::fstream::binary);
@@ -109,6 +292,149 @@ TEST_CASE("Wad can construct from istream, output to ostream, and read itself ag
 	REQUIRE(dir_again->size() == 11);
 }
 
+TEST_CASE("Wad refuses an infotable longer than the stream", "[wad]") {
+	// 28 bytes that claim to hold 0x7fffffff lumps.
+	std::string data("PWAD\xff\xff\xff\x7f\x0c\0\0\0", 12);
+	data.append(16, '\0');
+	std::stringstream buffer(data);
+	Wad wad(Wad::Type::NONE);
+	REQUIRE_THROWS(buffer >> wad);
+
+	SECTION("Lumps past the end of the stream are refused too") {
+		std::string entry("\x1c\0\0\0\0\0\0\x7fHUGE\0\0\0\0", 16);
+		std::string small("PWAD\x01\0\0\0\x0c\0\0\0", 12);
+		std::stringstream smallbuffer(small + entry);
+		REQUIRE_THROWS(smallbuffer >> wad);
+	}
+}
+
+TEST_CASE("Wad can be opened from a mapped file", "[wad]") {
+	std::ifstream moo2d_wad("moo2d.wad", std::fstream::in | std::fstream::binary);
+	Wad moo2d_stream(Wad::Type::NONE);
+	moo2d_wad >> moo2d_stream;
+
+	Wad moo2d(Wad::Type::NONE);
+	moo2d.open("moo2d.wad");
+	REQUIRE(moo2d.getType() == moo2d_stream.getType());
+
+	auto dir = moo2d.getLumps();
+	auto dir_stream = moo2d_stream.getLumps();
+	REQUIRE(dir->size() == 11);
+	for (size_t i = 0;i < dir->size();i++) {
+		REQUIRE(dir->at(i).getName() == dir_stream->at(i).getName());
+		REQUIRE(dir->at(i).getSize() == dir_stream->at(i).getData().size());
+		REQUIRE(dir->at(i).getData() == dir_stream->at(i).getData());
+	}
+
+	SECTION("Modified lumps no longer refer to the mapping") {
+		Lump lump = dir->at(1);
+		lump.setData(std::string("hissy"));
+		dir->set_at(1, std::move(lump));
+		REQUIRE(dir->at(1).getData().str() == "hissy");
+		REQUIRE(dir->at(2).getData() == dir_stream->at(2).getData());
+	}
+}
+
+TEST_CASE("Wad can be saved directly to a file", "[wad]") {
+	Wad moo2d(Wad::Type::NONE);
+	moo2d.open("moo2d.wad");
+	moo2d.save("moo2d_saved.wad");
+
+	std::stringstream buffer;
+	buffer << moo2d;
+
+	std::ifstream saved_wad("moo2d_saved.wad", std::fstream::in | std::fstream::binary);
+	std::stringstream saved;
+	saved << saved_wad.rdbuf();
+	REQUIRE(saved.str() == buffer.str());
+
+	Wad moo2d_again(Wad::Type::NONE);
+	moo2d_again.open("moo2d_saved.wad");
+	REQUIRE(moo2d_again.getType() == Wad::Type::PWAD);
+	REQUIRE(moo2d_again.getLumps()->size() == 11);
+}
+
+TEST_CASE("Wad can be saved over the file it was opened from", "[wad]") {
+	Wad moo2d(Wad::Type::NONE);
+	moo2d.open("moo2d.wad");
+	moo2d.save("moo2d_resaved.wad");
+
+	std::stringstream buffer;
+	buffer << moo2d;
+
+	// Lumps still point into the mapped file while it's being replaced.
+	Wad resaved(Wad::Type::NONE);
+	resaved.open("moo2d_resaved.wad");
+	resaved.save("moo2d_resaved.wad");
+
+	std::stringstream resaved_buffer;
+	resaved_buffer << resaved;
+	REQUIRE(resaved_buffer.str() == buffer.str());
+
+	std::ifstream resaved_wad("moo2d_resaved.wad", std::fstream::in | std::fstream::binary);
+	std::stringstream saved;
+	saved << resaved_wad.rdbuf();
+	REQUIRE(saved.str() == buffer.str());
+}
+
+TEST_CASE("Saving a Wad leaves other files alone", "[wad]") {
+	{
+		std::ofstream other("moo2d_kept.wad.tmp", std::fstream::out | std::fstream::binary);
+		other << "keep";
+	}
+
+	Wad moo2d(Wad::Type::NONE);
+	moo2d.open("moo2d.wad");
+	moo2d.save("moo2d_kept.wad");
+
+	std::ifstream other("moo2d_kept.wad.tmp", std::fstream::in | std::fstream::binary);
+	std::stringstream kept;
+	kept << other.rdbuf();
+	REQUIRE(kept.str() == "keep");
+}
+
+#ifndef _WIN32
+TEST_CASE("Saving a Wad over a file keeps its permissions", "[wad]") {
+	Wad moo2d(Wad::Type::NONE);
+	moo2d.open("moo2d.wad");
+	moo2d.save("moo2d_mode.wad");
+	REQUIRE(chmod("moo2d_mode.wad", 0640) == 0);
+	moo2d.save("moo2d_mode.wad");
+
+	struct stat st;
+	REQUIRE(stat("moo2d_mode.wad", &st) == 0);
+	REQUIRE((st.st_mode & 07777) == 0640);
+}
+#endif
+
+TEST_CASE("CRC32 matches zlib", "[crc32]") {
+	std::string data;
+	for (size_t i = 0;i < 5000;i++) {
+		data.push_back(static_cast<char>((i * 7919) >> 3));
+	}
+
+	// Every length up to a few folding blocks, and from odd alignments.
+	for (size_t offset = 0;offset < 4;offset++) {
+		for (size_t len = 0;len < 300;len++) {
+			uint32_t expected = crc32(0, reinterpret_cast<const Bytef*>(data.data() + offset), static_cast<uInt>(len));
+			REQUIRE(CRC32(0, data.data() + offset, len) == expected);
+			REQUIRE(CRC32Portable(0, data.data() + offset, len) == expected);
+		}
+	}
+
+	uint32_t expected = crc32(0, reinterpret_cast<const Bytef*>(data.data()), static_cast<uInt>(data.size()));
+	REQUIRE(CRC32(0, data.data(), data.size()) == expected);
+	REQUIRE(CRC32(CRC32(0, data.data(), 1234), data.data() + 1234, data.size() - 1234) == expected);
+
+	SECTION("CRCs of pieces can be combined") {
+		for (size_t split : { 0, 1, 63, 1000, 4096, 5000 }) {
+			uint32_t crc1 = CRC32(0, data.data(), split);
+			uint32_t crc2 = CRC32(0, data.data() + split, data.size() - split);
+			REQUIRE(CRC32Combine(crc1, crc2, data.size() - split) == expected);
+		}
+	}
+}
+
 TEST_CASE("Zip can construct from istream, output to ostream, and read itself again", "[zip]") {
 	std::stringstream buffer;
 	std::ifstream duel32f_pk3("duel32f.pk3", std::fstream::in | std::fstream::binary);
@@ -129,6 +455,960 @@ TEST_CASE("Zip can construct from istream, output to ostream, and read itself ag
 	REQUIRE(dir->size() == 369);
 }
 
+TEST_CASE("Zip can be opened from a mapped file", "[zip]") {
+	std::ifstream duel32f_pk3("duel32f.pk3", std::fstream::in | std::fstream::binary);
+	Zip duel32_stream;
+	duel32f_pk3 >> duel32_stream;
+
+	Zip duel32;
+	duel32.open("duel32f.pk3");
+
+	auto dir = duel32.getLumps();
+	auto dir_stream = duel32_stream.getLumps();
+	REQUIRE(dir->size() == 369);
+	for (size_t i = 0;i < dir->size();i++) {
+		REQUIRE(dir->at(i).getName() == dir_stream->at(i).getName());
+		REQUIRE(dir->at(i).getSize() == dir_stream->at(i).getData().size());
+		REQUIRE(dir->at(i).getData() == dir_stream->at(i).getData());
+	}
+
+	SECTION("Opened Zip writes the same output as a streamed one") {
+		std::stringstream buffer;
+		buffer << duel32;
+		std::stringstream buffer_stream;
+		buffer_stream << duel32_stream;
+		REQUIRE(buffer.str() == buffer_stream.str());
+	}
+}
+
+TEST_CASE("Zip can be saved directly to a file", "[zip]") {
+	Zip duel32;
+	duel32.open("duel32f.pk3");
+	duel32.save("duel32f_saved.pk3");
+
+	std::stringstream buffer;
+	buffer << duel32;
+
+	std::ifstream saved_pk3("duel32f_saved.pk3", std::fstream::in | std::fstream::binary);
+	std::stringstream saved;
+	saved << saved_pk3.rdbuf();
+	REQUIRE(saved.str() == buffer.str());
+}
+
+TEST_CASE("Unchanged Zip lumps are written back out verbatim", "[zip]") {
+	Zip duel32;
+	duel32.open("duel32f.pk3");
+	auto dir = duel32.getLumps();
+
+	Lump lump = dir->at(0);
+	lump.setData(std::string("hissy"));
+	dir->set_at(0, std::move(lump));
+	REQUIRE(dir->at(0).getSource() == nullptr);
+	REQUIRE(dir->at(1).getSource() != nullptr);
+
+	std::stringstream buffer;
+	buffer << duel32;
+	buffer.seekg(0);
+
+	Zip duel32_again;
+	buffer >> duel32_again;
+
+	std::ifstream duel32f_pk3("duel32f.pk3", std::fstream::in | std::fstream::binary);
+	Zip duel32_stream;
+	duel32f_pk3 >> duel32_stream;
+
+	auto dir_again = duel32_again.getLumps();
+	auto dir_stream = duel32_stream.getLumps();
+	REQUIRE(dir_again->size() == dir_stream->size());
+	REQUIRE(dir_again->at(0).getData().str() == "hissy");
+	for (size_t i = 1;i < dir_again->size();i++) {
+		REQUIRE(dir_again->at(i).getName() == dir_stream->at(i).getName());
+		REQUIRE(dir_again->at(i).getData() == dir_stream->at(i).getData());
+	}
+}
+
+TEST_CASE("Zip can find its end of central directory behind a comment", "[zip]") {
+	std::ifstream duel32f_pk3("duel32f.pk3", std::fstream::in | std::fstream::binary);
+	std::stringstream original;
+	original << duel32f_pk3.rdbuf();
+	std::string data = original.str();
+
+	// Give the ZIP a comment that has a bogus end of central directory
+	// header of its own inside it.
+	std::string comment(1000, 'x');
+	comment.replace(500, 4, "PK\x05\x06");
+	data[data.size() - 2] = static_cast<char>(comment.size() & 0xFF);
+	data[data.size() - 1] = static_cast<char>(comment.size() >> 8);
+	data += comment;
+
+	std::stringstream buffer(data);
+	Zip duel32;
+	buffer >> duel32;
+	REQUIRE(duel32.getLumps()->size() == 369);
+}
+
+TEST_CASE("Zip with more than 65535 lumps uses ZIP64", "[zip]") {
+	Directory lumps;
+	for (size_t i = 0;i < 70000;i++) {
+		Lump lump;
+		lump.setName(std::to_string(i));
+		lumps.push_back(std::move(lump));
+	}
+
+	Zip big;
+	big.setLumps(std::move(lumps));
+
+	std::stringstream buffer;
+	buffer << big;
+	buffer.seekg(0);
+
+	Zip big_again;
+	buffer >> big_again;
+
+	auto dir = big_again.getLumps();
+	REQUIRE(dir->size() == 70000);
+	REQUIRE(dir->at(0).getName() == "0");
+	REQUIRE(dir->at(69999).getName() == "69999");
+}
+
+TEST_CASE("Zip output doesn't depend on the number of compression threads", "[zip]") {
+	std::ifstream duel32f_pk3("duel32f.pk3", std::fstream::in | std::fstream::binary);
+
+	Zip duel32;
+	duel32f_pk3 >> duel32;
+
+	// Make sure every lump actually gets compressed again.
+	auto lumps = duel32.getLumps();
+	for (size_t i = 0;i < lumps->size();i++) {
+		Lump lump = lumps->at(i);
+		lump.setData(lumps->at(i).getData());
+		lumps->set_at(i, std::move(lump));
+	}
+
+	std::stringstream single;
+	duel32.setWorkers(1);
+	single << duel32;
+
+	std::stringstream multiple;
+	duel32.setWorkers(8);
+	multiple << duel32;
+
+	REQUIRE(single.str() == multiple.str());
+
+	Zip duel32_again;
+	multiple.seekg(0);
+	multiple >> duel32_again;
+
+	auto dir = duel32.getLumps();
+	auto dir_again = duel32_again.getLumps();
+	REQUIRE(dir_again->size() == dir->size());
+	for (size_t i = 0;i < dir->size();i++) {
+		REQUIRE(dir_again->at(i).getName() == dir->at(i).getName());
+		REQUIRE(dir_again->at(i).getData() == dir->at(i).getData());
+	}
+}
+
+TEST_CASE("Zip splits the CRC32 of large lumps between threads", "[zip]") {
+	// Big enough to be split into a few pieces, with a ragged last piece.
+	std::string data(9 * 1024 * 1024 + 123, '\0');
+	for (size_t i = 0;i < data.size();i++) {
+		data[i] = static_cast<char>((i * 2654435761u) >> 13);
+	}
+
+	Directory lumps;
+	for (size_t i = 0;i < 3;i++) {
+		Lump lump;
+		lump.setName("LUMP" + std::to_string(i));
+		lump.setData(i == 1 ? std::string(data) : std::string("small"));
+		lumps.push_back(std::move(lump));
+	}
+	Zip zip;
+	zip.setLumps(std::move(lumps));
+
+	std::stringstream single;
+	zip.setWorkers(1);
+	single << zip;
+
+	std::stringstream multiple;
+	zip.setWorkers(3);
+	multiple << zip;
+
+	REQUIRE(single.str() == multiple.str());
+
+	// Reading the lump back checks its CRC32.
+	Zip zip_again;
+	multiple.seekg(0);
+	multiple >> zip_again;
+	REQUIRE(zip_again.getLumps()->at(1).getData().str() == data);
+}
+
+TEST_CASE("Map lumps are decoded a whole lump at a time", "[map]") {
+	std::string data("\x01\x00\x02\x00\xFF\xFF\x00\x80", 8);
+	BinaryReader reader(data.data(), data.size());
+	Vertexes vertexes;
+	vertexes.read(reader);
+	REQUIRE(reader.eof());
+	REQUIRE(vertexes.at(0).x == 1);
+	REQUIRE(vertexes.at(0).y == 2);
+	REQUIRE(vertexes.at(1).x == -1);
+	REQUIRE(vertexes.at(1).y == -32768);
+	REQUIRE(vertexes.lock(1)->id == 1);
+
+	BinaryWriter writer;
+	vertexes.write(writer);
+	REQUIRE(writer.release() == data);
+
+	SECTION("Lumps with a partial record are rejected") {
+		BinaryReader partial(data.data(), data.size() - 1);
+		Vertexes more;
+		REQUIRE_THROWS(more.read(partial));
+	}
+}
+
+TEST_CASE("Hexen linedefs and things can be read and written", "[map]") {
+	Vertexes vertexes;
+	for (int i = 0;i < 2;i++) {
+		Vertex vertex;
+		vertex.x = i;
+		vertex.y = i;
+		vertexes.push_back(std::move(vertex));
+	}
+	Sectors sectors;
+	sectors.push_back(Sector());
+	Sidedefs sidedefs;
+	Sidedef sidedef;
+	sidedef.sector = sectors.lock(0);
+	sidedefs.push_back(std::move(sidedef));
+
+	std::string linedefdata("\x00\x00\x01\x00\x01\x00\x50\x01\x02\x03\x04\x05\x00\x00\xFF\xFF", 16);
+	BinaryReader linedefreader(linedefdata.data(), linedefdata.size());
+	HexenLinedefs linedefs;
+	linedefs.read(linedefreader, vertexes, sidedefs);
+	REQUIRE(linedefs.size() == 1);
+	HexenLinedef& linedef = linedefs.at(0);
+	REQUIRE(linedef.endvertex.lock()->id == 1);
+	REQUIRE(linedef.flags.to_ulong() == 1);
+	REQUIRE(linedef.special == 80);
+	REQUIRE(linedef.args[0] == 1);
+	REQUIRE(linedef.args[4] == 5);
+	REQUIRE(linedef.frontsidedef.lock()->id == 0);
+	REQUIRE(!linedef.backsidedef.lock());
+
+	std::string thingdata("\x07\x00\x40\x00\xC0\xFF\x08\x00\x5A\x00\x01\x00\x07\x00\x50\x0A\x0B\x0C\x0D\x0E", 20);
+	BinaryReader thingreader(thingdata.data(), thingdata.size());
+	HexenThings things;
+	things.read(thingreader);
+	REQUIRE(things.size() == 1);
+	HexenThing& thing = things.at(0);
+	REQUIRE(thing.tid == 7);
+	REQUIRE(thing.x == 64);
+	REQUIRE(thing.y == -64);
+	REQUIRE(thing.z == 8);
+	REQUIRE(thing.angle == 90);
+	REQUIRE(thing.type == 1);
+	REQUIRE(thing.flags.to_ulong() == 7);
+	REQUIRE(thing.special == 80);
+	REQUIRE(thing.args[4] == 14);
+
+	BinaryWriter writer;
+	linedefs.write(writer);
+	REQUIRE(writer.release() == linedefdata);
+	things.write(writer);
+	REQUIRE(writer.release() == thingdata);
+}
+
+TEST_CASE("IndexedMap can erase elements and compact itself", "[map]") {
+	Vertexes vertexes;
+	for (int16_t i = 0;i < 5;i++) {
+		Vertex vertex;
+		vertex.x = i;
+		vertex.y = i;
+		vertexes.push_back(std::move(vertex));
+	}
+	std::weak_ptr<Vertex> third = vertexes.lock(3);
+
+	vertexes.erase(1);
+	vertexes.erase(std::vector<size_t>{ 2, 4 });
+	REQUIRE(vertexes.size() == 2);
+	REQUIRE(!vertexes.contains(1));
+	REQUIRE(vertexes.at(3).x == 3);
+	REQUIRE_THROWS(vertexes.erase(1));
+
+	auto remap = vertexes.compact();
+	REQUIRE(remap == (std::vector<size_t>{ 0, Vertexes::npos, Vertexes::npos, 1, Vertexes::npos }));
+	REQUIRE(vertexes.at(1).x == 3);
+	REQUIRE(third.lock()->id == 1);
+	REQUIRE(!vertexes.contains(3));
+
+	Vertex vertex;
+	vertexes.push_back(std::move(vertex));
+	REQUIRE(vertexes.lock(2)->id == 2);
+}
+
+// Read the geometry and things of MAP01 in moo2d.wad.
+static void ReadMoo2dMap(DoomMap& map) {
+	Wad moo2d(Wad::Type::NONE);
+	moo2d.open("moo2d.wad");
+	auto dir = moo2d.getLumps();
+
+	LumpData data = dir->at(4).getData();
+	BinaryReader vertexesbuffer(data.data(), data.size());
+	map.getVertexes().read(vertexesbuffer);
+	data = dir->at(8).getData();
+	BinaryReader sectorsbuffer(data.data(), data.size());
+	map.getSectors().read(sectorsbuffer);
+	data = dir->at(3).getData();
+	BinaryReader sidedefsbuffer(data.data(), data.size());
+	map.getSidedefs().read(sidedefsbuffer, map.getSectors());
+	data = dir->at(2).getData();
+	BinaryReader linedefsbuffer(data.data(), data.size());
+	map.getLinedefs().read(linedefsbuffer, map.getVertexes(), map.getSidedefs());
+	data = dir->at(1).getData();
+	BinaryReader thingsbuffer(data.data(), data.size());
+	map.getThings().read(thingsbuffer);
+}
+
+TEST_CASE("DoomMap compaction drops references to erased elements", "[map]") {
+	DoomMap map;
+	ReadMoo2dMap(map);
+
+	size_t sidedefs = map.getSidedefs().size();
+	map.getSidedefs().erase(0);
+	auto remap = map.compact();
+	REQUIRE(remap.sidedefs[0] == Sidedefs::npos);
+	REQUIRE(remap.sidedefs[1] == 0);
+	REQUIRE(map.getSidedefs().size() == sidedefs - 1);
+
+	BinaryWriter writer;
+	map.getLinedefs().write(writer);
+	std::string linedefs = writer.release();
+	REQUIRE(linedefs.size() == 8 * DoomLinedef::size);
+	map.getLinedefs().each([&](DoomLinedef& linedef) {
+		const char* record = linedefs.data() + linedef.id * DoomLinedef::size;
+		auto front = linedef.frontsidedef.lock();
+		REQUIRE(LoadLE<int16_t>(record + 10) == (front ? static_cast<int16_t>(front->id) : -1));
+	});
+	REQUIRE(LoadLE<int16_t>(linedefs.data() + 10) == -1);
+}
+
+TEST_CASE("DoomMap only decodes the lumps it needs", "[map]") {
+	Wad moo2d(Wad::Type::NONE);
+	moo2d.open("moo2d.wad");
+	auto dir = moo2d.getLumps();
+
+	DoomMap map;
+	map.setThingsLump(dir->at(1).getData());
+	map.setLinedefsLump(dir->at(2).getData());
+	map.setSidedefsLump(dir->at(3).getData());
+	map.setVertexesLump(dir->at(4).getData());
+	map.setSectorsLump(dir->at(8).getData());
+
+	SECTION("Untouched lumps are packed as they came in") {
+		REQUIRE(map.getThings().size() == dir->at(1).getSize() / DoomThing::size);
+		map.compact();
+		REQUIRE(map.getLinedefsLump().data() == dir->at(2).getData().data());
+		REQUIRE(map.getSectorsLump().data() == dir->at(8).getData().data());
+		REQUIRE(map.getThingsLump() == dir->at(1).getData());
+	}
+
+	SECTION("Lumps are decoded before what they refer to is renumbered") {
+		size_t startvertex = LoadLE<int16_t>(dir->at(2).getData().data());
+		map.getVertexes().erase(0);
+		auto remap = map.compact();
+
+		auto vertex = map.getLinedefs().at(0).startvertex.lock();
+		if (remap.vertexes[startvertex] == Vertexes::npos) {
+			REQUIRE(!vertex);
+		} else {
+			REQUIRE(vertex->id == remap.vertexes[startvertex]);
+		}
+		REQUIRE(map.getSidedefsLump() == dir->at(3).getData());
+	}
+
+	SECTION("Broken lumps are caught before they are decoded") {
+		REQUIRE_THROWS(map.setSectorsLump(dir->at(8).getData().slice(0, 5)));
+	}
+}
+
+TEST_CASE("DenseMap can read and write Doom map lumps", "[map]") {
+	Wad moo2d(Wad::Type::NONE);
+	moo2d.open("moo2d.wad");
+	auto dir = moo2d.getLumps();
+
+	DenseMap map;
+	const size_t order[] = { 4, 8, 3, 2, 1 };
+	std::string written[5];
+	for (size_t i = 0;i < 5;i++) {
+		LumpData data = dir->at(order[i]).getData();
+		BinaryReader reader(data.data(), data.size());
+		BinaryWriter writer;
+		switch (i) {
+		case 0: map.readVertexes(reader); map.writeVertexes(writer); break;
+		case 1: map.readSectors(reader); map.writeSectors(writer); break;
+		case 2: map.readSidedefs(reader); map.writeSidedefs(writer); break;
+		case 3: map.readLinedefs(reader); map.writeLinedefs(writer); break;
+		case 4: map.readThings(reader); map.writeThings(writer); break;
+		}
+		written[i] = writer.release();
+		REQUIRE(written[i] == data.str());
+	}
+
+	SECTION("Erasing keeps indexes stable and renumbers references on write") {
+		uint32_t generation = map.vertexes.generation();
+		size_t vertexes = map.vertexes.size();
+
+		// Move every linedef off of the first vertex, then erase it.
+		for (DenseIndex i = 0;i < map.linedefs.slots();i++) {
+			if (map.linedefs.startvertex[i] == 0) {
+				map.linedefs.startvertex[i] = 1;
+			}
+			if (map.linedefs.endvertex[i] == 0) {
+				map.linedefs.endvertex[i] = 1;
+			}
+		}
+		map.vertexes.erase(0);
+		REQUIRE(!map.vertexes.contains(0));
+		REQUIRE(map.vertexes.contains(1));
+		REQUIRE(map.vertexes.size() == vertexes - 1);
+		REQUIRE(map.vertexes.generation() != generation);
+		REQUIRE_THROWS(map.vertexes.erase(0));
+
+		BinaryWriter writer;
+		map.writeVertexes(writer);
+		REQUIRE(writer.release() == written[0].substr(Vertex::size));
+
+		map.writeLinedefs(writer);
+		std::string linedefs = writer.release();
+		REQUIRE(LoadLE<uint16_t>(linedefs.data()) == map.linedefs.startvertex[0] - 1);
+	}
+
+	SECTION("References to erased elements can't be written") {
+		map.sectors.erase(0);
+		BinaryWriter writer;
+		REQUIRE_THROWS(map.writeSidedefs(writer));
+	}
+}
+
+TEST_CASE("DenseMap can't write a reference that reads back as missing", "[map]") {
+	DenseMap map;
+	DenseName name = ToDenseName("-");
+	DenseIndex sector = map.sectors.push_back(0, 128, name, name, 160, 0, 0);
+	for (size_t i = 0;i <= UINT16_MAX;i++) {
+		map.sidedefs.push_back(0, 0, name, name, name, sector);
+	}
+	DenseIndex v1 = map.vertexes.push_back(0, 0);
+	DenseIndex v2 = map.vertexes.push_back(64, 0);
+
+	// Sidedef 65535 would be written as 0xFFFF, which means no sidedef.
+	map.linedefs.push_back(v1, v2, 0, 0, 0, UINT16_MAX - 1, NoIndex);
+	BinaryWriter writer;
+	map.writeLinedefs(writer);
+	std::string linedefs = writer.release();
+	REQUIRE(LoadLE<uint16_t>(linedefs.data() + 10) == UINT16_MAX - 1);
+
+	map.linedefs.frontsidedef[0] = UINT16_MAX;
+	REQUIRE_THROWS(map.writeLinedefs(writer));
+}
+
+// Build a map out of a size by size grid of square sectors.
+static void BuildGridMap(DoomMap& map, int size) {
+	for (int y = 0;y <= size;y++) {
+		for (int x = 0;x <= size;x++) {
+			Vertex vertex;
+			vertex.x = x * 64;
+			vertex.y = y * 64;
+			map.getVertexes().push_back(std::move(vertex));
+		}
+	}
+	for (int i = 0;i < size * size;i++) {
+		Sector sector;
+		map.getSectors().push_back(std::move(sector));
+	}
+
+	// Lines run between two vertexes, with cell a to their right and cell
+	// b to their left.  Cells outside of the grid are -1.
+	auto addline = [&](int v1, int v2, int a, int b) {
+		if (a == -1) {
+			std::swap(v1, v2);
+			std::swap(a, b);
+		}
+		DoomLinedef linedef;
+		linedef.startvertex = map.getVertexes().lock(v1);
+		linedef.endvertex = map.getVertexes().lock(v2);
+		for (int side = 0;side < 2;side++) {
+			int cell = side == 0 ? a : b;
+			if (cell == -1) {
+				continue;
+			}
+			Sidedef sidedef;
+			sidedef.sector = map.getSectors().lock(cell);
+			map.getSidedefs().push_back(std::move(sidedef));
+			auto ptr = map.getSidedefs().lock(map.getSidedefs().size() - 1);
+			(side == 0 ? linedef.frontsidedef : linedef.backsidedef) = ptr;
+		}
+		map.getLinedefs().push_back(std::move(linedef));
+	};
+	auto cell = [size](int x, int y) {
+		return (x < 0 || y < 0 || x >= size || y >= size) ? -1 : y * size + x;
+	};
+	for (int y = 0;y <= size;y++) {
+		for (int x = 0;x < size;x++) {
+			addline(y * (size + 1) + x, y * (size + 1) + x + 1, cell(x, y - 1), cell(x, y));
+		}
+	}
+	for (int x = 0;x <= size;x++) {
+		for (int y = 0;y < size;y++) {
+			addline(y * (size + 1) + x, (y + 1) * (size + 1) + x, cell(x, y), cell(x - 1, y));
+		}
+	}
+}
+
+// Walk the nodes of a map down to the sector a point is in.
+static size_t PointInSector(DoomMap& map, int x, int y) {
+	const std::string& nodes = map.getNodes();
+	uint16_t child = static_cast<uint16_t>(nodes.size() / 28 - 1);
+	if (nodes.empty()) {
+		child = 0x8000;
+	}
+	while (!(child & 0x8000)) {
+		const char* node = nodes.data() + child * 28;
+		int64_t dx = x - LoadLE<int16_t>(node);
+		int64_t dy = y - LoadLE<int16_t>(node + 2);
+		int64_t left = LoadLE<int16_t>(node + 6) * dx;
+		int64_t right = dy * LoadLE<int16_t>(node + 4);
+		child = LoadLE<uint16_t>(node + (right < left ? 24 : 26));
+	}
+
+	const char* ssector = map.getSsectors().data() + (child & 0x7FFF) * 4;
+	const char* seg = map.getSegs().data() + LoadLE<uint16_t>(ssector + 2) * 12;
+	DoomLinedef& linedef = map.getLinedefs().at(LoadLE<uint16_t>(seg + 6));
+	auto sidedef = LoadLE<int16_t>(seg + 8) ? linedef.backsidedef.lock() : linedef.frontsidedef.lock();
+	return sidedef->sector.lock()->id;
+}
+
+TEST_CASE("NodeBuilder builds nodes that find the right sectors", "[nodes]") {
+	DoomMap map;
+	BuildGridMap(map, 16);
+	NodeBuilder builder;
+	builder.setWorkers(1);
+	builder.build(map);
+
+	REQUIRE((map.getSegs().size() % 12) == 0);
+	REQUIRE((map.getSsectors().size() % 4) == 0);
+	REQUIRE((map.getNodes().size() % 28) == 0);
+	for (int y = 0;y < 16;y++) {
+		for (int x = 0;x < 16;x++) {
+			REQUIRE(PointInSector(map, x * 64 + 32, y * 64 + 32) == static_cast<size_t>(y * 16 + x));
+		}
+	}
+
+	SECTION("Points in moo2d end up in the right sectors") {
+		DoomMap moo2d;
+		ReadMoo2dMap(moo2d);
+		builder.build(moo2d);
+
+		// The map is one square room inside of another.
+		for (int y = 16;y < 512;y += 32) {
+			for (int x = 16;x < 512;x += 32) {
+				bool inner = x > 128 && x < 384 && y > 128 && y < 384;
+				REQUIRE(PointInSector(moo2d, x, y) == (inner ? 1u : 0u));
+			}
+		}
+	}
+
+	SECTION("Output doesn't depend on the number of threads") {
+		DoomMap threaded;
+		BuildGridMap(threaded, 16);
+		NodeBuilder threadedbuilder;
+		threadedbuilder.setWorkers(4);
+		threadedbuilder.build(threaded);
+		REQUIRE(threaded.getNodes() == map.getNodes());
+		REQUIRE(threaded.getSegs() == map.getSegs());
+		REQUIRE(threaded.getSsectors() == map.getSsectors());
+	}
+}
+
+// Find the linedefs listed in the block that a point is in.
+static std::vector<uint16_t> BlockLines(DoomMap& map, int x, int y) {
+	const std::string& blockmap = map.getBlockmap();
+	int column = (x - LoadLE<int16_t>(blockmap.data())) / 128;
+	int row = (y - LoadLE<int16_t>(blockmap.data() + 2)) / 128;
+	int columns = LoadLE<int16_t>(blockmap.data() + 4);
+	size_t offset = LoadLE<uint16_t>(blockmap.data() + 8 + (row * columns + column) * 2) * 2;
+
+	std::vector<uint16_t> lines;
+	REQUIRE(LoadLE<uint16_t>(blockmap.data() + offset) == 0);
+	for (offset += 2;LoadLE<uint16_t>(blockmap.data() + offset) != 0xFFFF;offset += 2) {
+		lines.push_back(LoadLE<uint16_t>(blockmap.data() + offset));
+	}
+	return lines;
+}
+
+TEST_CASE("BlockmapBuilder puts linedefs in the blocks they cross", "[blockmap]") {
+	DoomMap map;
+	ReadMoo2dMap(map);
+	BlockmapBuilder builder;
+	builder.build(map);
+
+	const std::string& blockmap = map.getBlockmap();
+	REQUIRE(LoadLE<int16_t>(blockmap.data()) == -8);
+	REQUIRE(LoadLE<int16_t>(blockmap.data() + 2) == -8);
+	REQUIRE(LoadLE<int16_t>(blockmap.data() + 4) == 5);
+	REQUIRE(LoadLE<int16_t>(blockmap.data() + 6) == 5);
+
+	// The outer room's left wall, and the inner room's bottom left corner.
+	REQUIRE(BlockLines(map, 0, 200) == (std::vector<uint16_t>{ 0 }));
+	REQUIRE(BlockLines(map, 128, 200) == (std::vector<uint16_t>{ 4, 7 }));
+	REQUIRE(BlockLines(map, 256, 256).empty());
+
+	SECTION("Identical block lists are only written once") {
+		size_t compressed = blockmap.size();
+		builder.setCompress(false);
+		builder.build(map);
+		REQUIRE(map.getBlockmap().size() > compressed);
+		REQUIRE(BlockLines(map, 128, 200) == (std::vector<uint16_t>{ 4, 7 }));
+	}
+
+	SECTION("A DenseMap of the same map gets the same blockmap") {
+		Wad moo2d(Wad::Type::NONE);
+		moo2d.open("moo2d.wad");
+		auto dir = moo2d.getLumps();
+
+		DenseMap dense;
+		LumpData data = dir->at(4).getData();
+		BinaryReader vertexesbuffer(data.data(), data.size());
+		dense.readVertexes(vertexesbuffer);
+		data = dir->at(8).getData();
+		BinaryReader sectorsbuffer(data.data(), data.size());
+		dense.readSectors(sectorsbuffer);
+		data = dir->at(3).getData();
+		BinaryReader sidedefsbuffer(data.data(), data.size());
+		dense.readSidedefs(sidedefsbuffer);
+		data = dir->at(2).getData();
+		BinaryReader linedefsbuffer(data.data(), data.size());
+		dense.readLinedefs(linedefsbuffer);
+		REQUIRE(builder.build(dense) == blockmap);
+
+		// Erased linedefs are skipped, and the rest are renumbered.
+		dense.linedefs.erase(0);
+		map.getLinedefs().erase(0);
+		builder.build(map);
+		REQUIRE(builder.build(dense) == map.getBlockmap());
+
+		dense.vertexes.erase(0);
+		REQUIRE_THROWS(builder.build(dense));
+	}
+}
+
+// Check the reject table to see if one sector can see another.
+static bool CanSee(DoomMap& map, size_t a, size_t b) {
+	size_t bit = a * map.getSectors().size() + b;
+	return !(map.getReject()[bit / 8] & (1 << (bit % 8)));
+}
+
+TEST_CASE("RejectBuilder finds which sectors can see each other", "[reject]") {
+	// Wall off a 3x3 grid into a snake, so the two ends can't see each
+	// other:
+	//
+	// 6 7 8
+	// -----
+	// 3 4 5
+	// -----
+	// 0 1 2
+	DoomMap map;
+	BuildGridMap(map, 3);
+	size_t walls[] = { 3, 4, 7, 8 };
+	for (size_t wall : walls) {
+		map.getLinedefs().at(wall).backsidedef.reset();
+	}
+
+	RejectBuilder builder;
+	builder.setWorkers(1);
+	builder.build(map);
+	REQUIRE(map.getReject().size() == 11);
+	REQUIRE(CanSee(map, 0, 0));
+	REQUIRE(CanSee(map, 0, 1));
+	REQUIRE(CanSee(map, 0, 2));
+	REQUIRE(CanSee(map, 2, 0));
+	REQUIRE(!CanSee(map, 0, 8));
+	REQUIRE(!CanSee(map, 8, 0));
+
+	SECTION("Output doesn't depend on the number of threads") {
+		std::string reject = map.getReject();
+		builder.setWorkers(3);
+		builder.build(map);
+		REQUIRE(map.getReject() == reject);
+	}
+
+	SECTION("Everything can see everything in visible mode") {
+		builder.setMode(RejectBuilder::Mode::VISIBLE);
+		builder.build(map);
+		REQUIRE(map.getReject() == std::string(11, '\0'));
+	}
+}
+
+TEST_CASE("RejectBuilder never rejects a narrow sight line", "[reject]") {
+	// Sector 0 sees sector 2 down a corridor (sector 1) that is almost
+	// entirely blocked by a pillar, through 8 unit gaps on either side:
+	//
+	//        +------------+-+------------+
+	//  0     |     1      |#|            |     2
+	//        +------------+-+------------+
+	DoomMap map;
+	int16_t coords[][2] = {
+		{ -128, 0 }, { 0, 0 }, { 512, 0 }, { 640, 0 },
+		{ -128, 64 }, { 0, 64 }, { 512, 64 }, { 640, 64 },
+		{ 240, 8 }, { 272, 8 }, { 272, 56 }, { 240, 56 },
+	};
+	for (auto& coord : coords) {
+		Vertex vertex;
+		vertex.x = coord[0];
+		vertex.y = coord[1];
+		map.getVertexes().push_back(std::move(vertex));
+	}
+	for (int i = 0;i < 3;i++) {
+		Sector sector;
+		map.getSectors().push_back(std::move(sector));
+	}
+	auto addline = [&](size_t v1, size_t v2, int front, int back) {
+		DoomLinedef linedef;
+		linedef.startvertex = map.getVertexes().lock(v1);
+		linedef.endvertex = map.getVertexes().lock(v2);
+		for (int side = 0;side < 2;side++) {
+			int sector = side == 0 ? front : back;
+			if (sector == -1) {
+				continue;
+			}
+			Sidedef sidedef;
+			sidedef.sector = map.getSectors().lock(sector);
+			map.getSidedefs().push_back(std::move(sidedef));
+			auto ptr = map.getSidedefs().lock(map.getSidedefs().size() - 1);
+			(side == 0 ? linedef.frontsidedef : linedef.backsidedef) = ptr;
+		}
+		map.getLinedefs().push_back(std::move(linedef));
+	};
+	addline(0, 1, 0, -1);
+	addline(1, 2, 1, -1);
+	addline(2, 3, 2, -1);
+	addline(7, 6, 2, -1);
+	addline(6, 5, 1, -1);
+	addline(5, 4, 0, -1);
+	addline(4, 0, 0, -1);
+	addline(3, 7, 2, -1);
+	addline(1, 5, 1, 0);
+	addline(2, 6, 2, 1);
+	addline(8, 11, 1, -1);
+	addline(11, 10, 1, -1);
+	addline(10, 9, 1, -1);
+	addline(9, 8, 1, -1);
+
+	RejectBuilder builder;
+	builder.setWorkers(1);
+	builder.build(map);
+	REQUIRE(CanSee(map, 0, 1));
+	REQUIRE(CanSee(map, 0, 2));
+	REQUIRE(CanSee(map, 2, 0));
+}
+
+TEST_CASE("MapOptimizer welds vertexes and drops what is left unused", "[optimizer]") {
+	DoomMap map;
+	BuildGridMap(map, 2);
+
+	// Vertex 9 is close to vertex 0, vertex 10 sits on top of vertex 4 and
+	// vertex 11 isn't used at all.
+	int16_t coords[][2] = { { 1, 0 }, { 64, 64 }, { 500, 500 } };
+	for (auto& coord : coords) {
+		Vertex vertex;
+		vertex.x = coord[0];
+		vertex.y = coord[1];
+		map.getVertexes().push_back(std::move(vertex));
+	}
+
+	// Sectors 4 and 5 are only used by the extra linedefs, sector 6 by
+	// nothing.
+	for (int i = 0;i < 3;i++) {
+		Sector sector;
+		map.getSectors().push_back(std::move(sector));
+	}
+	auto addline = [&](size_t v1, size_t v2, size_t sector) {
+		Sidedef sidedef;
+		sidedef.sector = map.getSectors().lock(sector);
+		map.getSidedefs().push_back(std::move(sidedef));
+		DoomLinedef linedef;
+		linedef.startvertex = map.getVertexes().lock(v1);
+		linedef.endvertex = map.getVertexes().lock(v2);
+		linedef.frontsidedef = map.getSidedefs().lock(map.getSidedefs().size() - 1);
+		map.getLinedefs().push_back(std::move(linedef));
+	};
+
+	// Linedef 12 runs the other way along linedef 0 once vertex 9 is
+	// welded, and linedef 13 has no length at all.
+	addline(9, 1, 4);
+	addline(10, 4, 5);
+
+	MapOptimizer optimizer;
+	SECTION("Vertexes in the same place are welded") {
+		optimizer.optimize(map);
+		REQUIRE(map.getVertexes().size() == 10);
+		REQUIRE(map.getLinedefs().size() == 13);
+		REQUIRE(map.getSidedefs().size() == 17);
+		REQUIRE(map.getSectors().size() == 5);
+	}
+
+	SECTION("Vertexes within the tolerance are welded") {
+		optimizer.setTolerance(1);
+		optimizer.optimize(map);
+		REQUIRE(map.getVertexes().size() == 9);
+		REQUIRE(map.getLinedefs().size() == 12);
+		REQUIRE(map.getSidedefs().size() == 17);
+		REQUIRE(map.getSectors().size() == 5);
+
+		// The linedefs were merged into one two-sided linedef.
+		DoomLinedef& linedef = map.getLinedefs().at(0);
+		REQUIRE(linedef.flags.test(2));
+		REQUIRE(linedef.frontsidedef.lock()->sector.lock()->id == 0);
+		REQUIRE(linedef.backsidedef.lock()->sector.lock()->id == 4);
+	}
+}
+
+TEST_CASE("SpatialIndex finds what is in a box or near a point", "[spatialindex]") {
+	DoomMap map;
+	BuildGridMap(map, 8);
+	uint32_t seed = 1;
+	for (int i = 0;i < 200;i++) {
+		DoomThing thing;
+		seed = seed * 1103515245 + 12345;
+		thing.x = static_cast<int16_t>((seed >> 16) % 600) - 40;
+		seed = seed * 1103515245 + 12345;
+		thing.y = static_cast<int16_t>((seed >> 16) % 600) - 40;
+		map.getThings().push_back(std::move(thing));
+	}
+	SpatialIndex index(map);
+
+	// Horizontal lines come first, then vertical lines starting at 72.
+	REQUIRE(index.linedefsInBox(10, 10, 20, 20).empty());
+	REQUIRE(index.linedefsInBox(70, 20, 60, 10) == std::vector<size_t>({ 80 }));
+	REQUIRE(index.linedefsInBox(64, 64, 64, 64) == std::vector<size_t>({ 8, 9, 80, 81 }));
+	REQUIRE(index.vertexesInBox(0, 0, 64, 64) == std::vector<size_t>({ 0, 1, 9, 10 }));
+	REQUIRE(index.vertexesInBox(1000, 1000, 2000, 2000).empty());
+	REQUIRE(index.nearestLinedef(30, 3) == 0);
+	REQUIRE(index.nearestVertex(-500, 1000) == 72);
+
+	SECTION("Nearest things match a brute force search") {
+		for (int i = 0;i < 100;i++) {
+			seed = seed * 1103515245 + 12345;
+			double x = static_cast<double>((seed >> 16) % 1200) - 300;
+			seed = seed * 1103515245 + 12345;
+			double y = static_cast<double>((seed >> 16) % 1200) - 300;
+
+			double best = -1;
+			map.getThings().each([&](DoomThing& thing) {
+				double d = (thing.x - x) * (thing.x - x) + (thing.y - y) * (thing.y - y);
+				if (best < 0 || d < best) {
+					best = d;
+				}
+			});
+			DoomThing& thing = map.getThings().at(index.nearestThing(x, y));
+			double d = (thing.x - x) * (thing.x - x) + (thing.y - y) * (thing.y - y);
+			REQUIRE(d == best);
+		}
+	}
+
+	SECTION("Things in a box match a brute force search") {
+		std::vector<size_t> expected;
+		map.getThings().each([&](DoomThing& thing) {
+			if (thing.x >= 100 && thing.x <= 300 && thing.y >= -20 && thing.y <= 150) {
+				expected.push_back(thing.id);
+			}
+		});
+		REQUIRE(!expected.empty());
+		REQUIRE(index.thingsInBox(100, -20, 300, 150) == expected);
+	}
+}
+
+TEST_CASE("UDMF TEXTMAP can be read and written", "[udmf]") {
+	std::string textmap =
+		"// A room with a door\n"
+		"namespace = \"doom\";\n"
+		"Vertex { x = 0.0; y = 0.0; }\n"
+		"vertex { x = 64.4; y = -0x10; }\n"
+		"vertex { x = 6.4e1; y = 63.6; comment = \"skipped\"; }\n"
+		"/* Linedefs can come before\n   what they refer to */\n"
+		"linedef { v1 = 0; v2 = 1; sidefront = 0; sideback = 1; TwoSided = true; special = 1; id = 7; }\n"
+		"linedef { v1 = 1; v2 = 2; sidefront = 0; blocking = true; blocking = false; mapped = true; }\n"
+		"sidedef { sector = 0; texturemiddle = \"STARTAN3\"; offsetx = -8; }\n"
+		"sidedef { sector = 1; }\n"
+		"sector { texturefloor = \"FLOOR4_8\"; textureceiling = \"CEIL3_5\"; heightceiling = 128; }\n"
+		"sector { texturefloor = \"FLAT\\\"1\"; textureceiling = \"F_SKY1\"; lightlevel = 255; id = 7; }\n"
+		"thing { x = 32.0; y = 32.0; type = 1; angle = 450; skill2 = true; single = true; dm = true; }\n"
+		"mystery { x = 1; }\n";
+
+	DoomMap map;
+	ReadTextmap(textmap.data(), textmap.size(), map);
+	REQUIRE(map.getVertexes().size() == 3);
+	REQUIRE(map.getVertexes().at(1).x == 64);
+	REQUIRE(map.getVertexes().at(1).y == -16);
+	REQUIRE(map.getVertexes().at(2).x == 64);
+	REQUIRE(map.getVertexes().at(2).y == 64);
+
+	REQUIRE(map.getLinedefs().size() == 2);
+	DoomLinedef& door = map.getLinedefs().at(0);
+	REQUIRE(door.flags.to_ulong() == 4);
+	REQUIRE(door.special == 1);
+	REQUIRE(door.tag == 7);
+	REQUIRE(door.endvertex.lock()->id == 1);
+	REQUIRE(door.backsidedef.lock()->sector.lock()->id == 1);
+	REQUIRE(map.getLinedefs().at(1).flags.to_ulong() == 256);
+	REQUIRE(!map.getLinedefs().at(1).backsidedef.lock());
+
+	REQUIRE(map.getSidedefs().at(0).middletex == "STARTAN3");
+	REQUIRE(map.getSidedefs().at(0).uppertex == "-");
+	REQUIRE(map.getSidedefs().at(0).xoffset == -8);
+	REQUIRE(map.getSectors().at(0).ceiling == 128);
+	REQUIRE(map.getSectors().at(0).light == 160);
+	REQUIRE(map.getSectors().at(1).floortex == "FLAT\"1");
+	REQUIRE(map.getSectors().at(1).tag == 7);
+
+	DoomThing& thing = map.getThings().at(0);
+	REQUIRE(thing.angle == 90);
+	REQUIRE(thing.flags.to_ulong() == (1 | 64));
+
+	SECTION("Written maps read back the same") {
+		std::string written = WriteTextmap(map);
+		DoomMap copy;
+		ReadTextmap(written.data(), written.size(), copy);
+		REQUIRE(WriteTextmap(copy) == written);
+
+		BinaryWriter original, reread;
+		map.getLinedefs().write(original);
+		copy.getLinedefs().write(reread);
+		REQUIRE(original.release() == reread.release());
+		map.getThings().write(original);
+		copy.getThings().write(reread);
+		REQUIRE(original.release() == reread.release());
+		map.getSectors().write(original);
+		copy.getSectors().write(reread);
+		REQUIRE(original.release() == reread.release());
+	}
+
+	SECTION("Errors point at the line they were found on") {
+		auto error = [](const std::string& broken) {
+			DoomMap copy;
+			try {
+				ReadTextmap(broken.data(), broken.size(), copy);
+			} catch (const std::runtime_error& e) {
+				return std::string(e.what());
+			}
+			return std::string();
+		};
+		REQUIRE(error("namespace = \"doom\";\n\nvertex { x = 1; }\n") == "TEXTMAP line 3: Vertex is missing x or y");
+		REQUIRE(error("thing {\nx = 1.5.5;\n") == "TEXTMAP line 2: Expected a number");
+		REQUIRE(error("namespace = \"doom\";\nlinedef { v1 = 0; v2 = 0; sidefront = 0; }") == "Linedef refers to a missing vertex");
+		REQUIRE(error("namespace = \"zdoom\";\n") == "TEXTMAP line 1: Namespace \"zdoom\" can't be read as a Doom map");
+		REQUIRE(error("vertex { x = 0; y = 0; }\n") == "TEXTMAP has no namespace");
+	}
+}
+
 TEST_CASE("Environment should be created correctly", "[lua]") {
 	LuaEnvironment lua;
 	lua_State* L = lua.getState();
@@ -338,6 +1618,13 @@ TEST_CASE("Test Lumps:packwad()", "[lualumps]") {
 		REQUIRE(Lua::checkstring(L, -2) == "MAP01");
 		REQUIRE(Lua::checkstring(L, -1) == "");
 	}
+
+	SECTION("A truncated infotable is an error, not the input back") {
+		luaL_dostring(L, "return pcall(wad.unpackwad, 'PWAD\\255\\255\\255\\127\\12\\0\\0\\0' .. string.rep('\\0', 16))");
+
+		REQUIRE(!lua_toboolean(L, -2));
+		REQUIRE(Lua::checkstring(L, -1) == "Couldn't find infotable");
+	}
 }
 
 TEST_CASE("Test Lumps:packzip()", "[lualumps]") {
@@ -354,6 +1641,38 @@ TEST_CASE("Test Lumps:packzip()", "[lualumps]") {
 	}
 }
 
+TEST_CASE("Test wad.openwad() and Lumps:writewad()", "[lualumps]") {
+	LuaEnvironment lua;
+	lua.doString("x, t = wad.openwad('moo2d.wad');x:writewad('moo2d_lua.wad');y, u = wad.openwad('moo2d_lua.wad')", "test");
+
+	lua_State* L = lua.getState();
+
+	lua.doString("return #y, t, u, y:get(2), select(2, x:get(2)) == select(2, y:get(2))", "test");
+	REQUIRE(lua_tointeger(L, -5) == 11);
+	REQUIRE(std::string(lua_tostring(L, -4)) == "pwad");
+	REQUIRE(std::string(lua_tostring(L, -3)) == "pwad");
+	REQUIRE(std::string(lua_tostring(L, -2)) == "THINGS");
+	REQUIRE(lua_toboolean(L, -1) == true);
+	lua_pop(L, 5);
+
+	REQUIRE_THROWS(lua.doString("wad.openwad('missing.wad')", "test"));
+}
+
+TEST_CASE("Test wad.openzip() and Lumps:writezip()", "[lualumps]") {
+	LuaEnvironment lua;
+	lua.doString("x = wad.openzip('duel32f.pk3');x:writezip('duel32f_lua.pk3', 1);y = wad.openzip('duel32f_lua.pk3')", "test");
+
+	lua_State* L = lua.getState();
+
+	lua.doString("return #x == #y, y:get(1), select(2, x:get(1)) == select(2, y:get(1))", "test");
+	REQUIRE(lua_toboolean(L, -3) == true);
+	REQUIRE(std::string(lua_tostring(L, -2)) == "ANIMDEFS");
+	REQUIRE(lua_toboolean(L, -1) == true);
+	lua_pop(L, 3);
+
+	REQUIRE_THROWS(lua.doString("wad.openzip('missing.pk3')", "test"));
+}
+
 TEST_CASE("DoomMap can be created from scratch", "[luamap]") {
 	LuaEnvironment lua;
 	lua.doString("return wad.createDoomMap()", "test");
@@ -401,6 +1720,220 @@ TEST_CASE("Test DoomMap:packmap()", "[luamap]") {
 	lua_pop(L, 1);
 }
 
+TEST_CASE("Test DoomMap:buildblockmap()", "[luamap]") {
+	LuaEnvironment lua;
+	lua.doString("x = wad.createDoomMap();x:buildblockmap();z = x:packmap('MAP01')", "test");
+
+	lua_State* L = lua.getState();
+
+	// BLOCKMAP should end up in its own lump
+	lua.doString("return select(2, z:get(11)) ~= '' and select(2, z:get(10)) == ''", "test");
+	REQUIRE(lua_isboolean(L, -1) == true);
+	REQUIRE(lua_toboolean(L, -1) == true);
+	lua_pop(L, 1);
+}
+
+TEST_CASE("Test wad.buildblockmap()", "[luamap]") {
+	LuaEnvironment lua;
+	lua.doString("x = wad.openwad('moo2d.wad');y = wad.unpackmap(x);y:buildblockmap()", "test");
+
+	lua_State* L = lua.getState();
+
+	// Building straight from the lumps matches unpacking the map first
+	lua.doString("local z = y:packmap('MAP01');return wad.buildblockmap(x) == select(2, z:get(z:find('BLOCKMAP')))", "test");
+	REQUIRE(lua_isboolean(L, -1) == true);
+	REQUIRE(lua_toboolean(L, -1) == true);
+	lua_pop(L, 1);
+
+	lua.doString("return #wad.buildblockmap(x, 'MAP01', false) > #wad.buildblockmap(x, 'MAP01')", "test");
+	REQUIRE(lua_toboolean(L, -1) == true);
+	lua_pop(L, 1);
+
+	REQUIRE_THROWS(lua.doString("wad.buildblockmap(x, 'MAP02')", "test"));
+}
+
+TEST_CASE("Test DoomMap:spatialindex()", "[luamap]") {
+	LuaEnvironment lua;
+	lua.doString("x = wad.createDoomMap();"
+		"x:setvertex(1, {x = 0, y = 0});x:setvertex(2, {x = 256, y = 0});"
+		"x:setthing(1, {x = 32, y = 32});x:setthing(2, {x = 200, y = -10});"
+		"i = x:spatialindex()", "test");
+
+	lua_State* L = lua.getState();
+
+	lua.doString("return i:nearestthing(190, 0), i:nearestvertex(190, 0), i:nearestlinedef(0, 0)", "test");
+	REQUIRE(lua_tointeger(L, -3) == 2);
+	REQUIRE(lua_tointeger(L, -2) == 2);
+	REQUIRE(lua_isnil(L, -1));
+	lua_pop(L, 3);
+
+	lua.doString("local t = i:things(0, 0, 64, 64);return #t, t[1]", "test");
+	REQUIRE(lua_tointeger(L, -2) == 1);
+	REQUIRE(lua_tointeger(L, -1) == 1);
+	lua_pop(L, 2);
+}
+
+TEST_CASE("Test DoomMap:packudmf() and wad.unpackudmf()", "[luamap]") {
+	LuaEnvironment lua;
+	lua.doString("x = wad.createDoomMap();"
+		"x:setvertex(1, {x = 0, y = 0});x:setvertex(2, {x = 64, y = 0});"
+		"x:setsector(1, {floortex = 'FLOOR4_8', ceilingtex = 'CEIL3_5', ceiling = 128});"
+		"x:setsidedef(1, {sector = 1, middletex = 'STARTAN3'});"
+		"x:setlinedef(1, {startvertex = 1, endvertex = 2, frontsidedef = 1});"
+		"z = x:packudmf('MAP01');y = wad.unpackudmf(z)", "test");
+
+	lua_State* L = lua.getState();
+
+	lua.doString("return z:get(2), z:get(3), y:getsector(1).ceiling, y:getlinedef(1).endvertex", "test");
+	REQUIRE(std::string(lua_tostring(L, -4)) == "TEXTMAP");
+	REQUIRE(std::string(lua_tostring(L, -3)) == "ENDMAP");
+	REQUIRE(lua_tointeger(L, -2) == 128);
+	REQUIRE(lua_tointeger(L, -1) == 2);
+	lua_pop(L, 4);
+
+	lua.doString("z:set(2, 'TEXTMAP', 'namespace = \"hexen\";');return pcall(wad.unpackudmf, z)", "test");
+	REQUIRE(!lua_toboolean(L, -2));
+	std::string message = lua_tostring(L, -1);
+	REQUIRE(message.find("Namespace \"hexen\"") != std::string::npos);
+	lua_pop(L, 2);
+}
+
+TEST_CASE("Dangling references in map lumps are Lua errors", "[luamap]") {
+	LuaEnvironment lua;
+	lua.doString("x = wad.createDoomMap();"
+		"x:setvertex(1, {x = 0, y = 0});x:setvertex(2, {x = 64, y = 0});"
+		"x:setsector(1, {floortex = 'FLOOR4_8', ceilingtex = 'CEIL3_5'});"
+		"x:setsidedef(1, {sector = 1});"
+		"x:setlinedef(1, {startvertex = 1, endvertex = 2, frontsidedef = 1});"
+		"z = x:packmap('MAP01')", "test");
+
+	lua_State* L = lua.getState();
+	auto message = [&]() {
+		REQUIRE(!lua_toboolean(L, -2));
+		REQUIRE(lua_type(L, -1) == LUA_TSTRING);
+		std::string str = lua_tostring(L, -1);
+		lua_pop(L, 2);
+		return str;
+	};
+
+	SECTION("Linedef with a missing vertex") {
+		lua.doString("z:set(3, nil, string.pack('<I2I2i2i2i2I2I2', 0, 39999, 0, 0, 0, 0, 65535));"
+			"y = wad.unpackmap(z)", "test");
+		lua.doString("return pcall(y.getlinedef, y, 1)", "test");
+		REQUIRE(message().find("Linedef 1 is missing a vertex") != std::string::npos);
+		lua.doString("return pcall(y.packmap, y, 'MAP01')", "test");
+		REQUIRE(message().find("missing") != std::string::npos);
+	}
+
+	SECTION("Sidedef with a missing sector") {
+		lua.doString("local t = '-' .. string.rep('\\0', 7);"
+			"z:set(4, nil, string.pack('<i2i2c8c8c8i2', 0, 0, t, t, t, 5));"
+			"y = wad.unpackmap(z)", "test");
+		lua.doString("return pcall(y.getsidedef, y, 1)", "test");
+		REQUIRE(message().find("Sidedef 1 is missing its sector") != std::string::npos);
+		lua.doString("return pcall(y.packmap, y, 'MAP01')", "test");
+		REQUIRE(message().find("missing") != std::string::npos);
+	}
+}
+
+TEST_CASE("Hexen maps are unpacked as HexenMap", "[luamap]") {
+	LuaEnvironment lua;
+	lua.doString("x = wad.createHexenMap();"
+		"x:setvertex(1, {x = 0, y = 0});x:setvertex(2, {x = 64, y = 0});"
+		"x:setsector(1, {floortex = 'FLOOR4_8', ceilingtex = 'CEIL3_5'});"
+		"x:setsidedef(1, {sector = 1});"
+		"x:setlinedef(1, {startvertex = 1, endvertex = 2, frontsidedef = 1, special = 80, args = {1, 2, 3}});"
+		"x:setthing(1, {tid = 5, x = 32, y = 16, z = 8, type = 1, args = {0, 0, 0, 0, 9}});"
+		"z = x:packmap('MAP01');y = wad.unpackmap(z)", "test");
+
+	lua_State* L = lua.getState();
+
+	lua.doString("return z:get(12), getmetatable(y) == getmetatable(x), y:getlinedef(1).args[3], y:getthing(1).tid, y:getthing(1).args[5]", "test");
+	REQUIRE(std::string(lua_tostring(L, -5)) == "BEHAVIOR");
+	REQUIRE(lua_toboolean(L, -4) == true);
+	REQUIRE(lua_tointeger(L, -3) == 3);
+	REQUIRE(lua_tointeger(L, -2) == 5);
+	REQUIRE(lua_tointeger(L, -1) == 9);
+	lua_pop(L, 5);
+}
+
+TEST_CASE("Maps are unpacked by name", "[luamap]") {
+	LuaEnvironment lua;
+	lua.doString("x = wad.createDoomMap();"
+		"x:setvertex(1, {x = 0, y = 0});x:setvertex(2, {x = 64, y = 0});"
+		"x:setsector(1, {floortex = 'FLOOR4_8', ceilingtex = 'CEIL3_5'});"
+		"x:setsidedef(1, {sector = 1});"
+		"x:setlinedef(1, {startvertex = 1, endvertex = 2, frontsidedef = 1});"
+		"z = x:packmap('MAP01');"
+		"x:setvertex(2, {x = 128, y = 0});"
+		"y = x:packmap('MAP02');"
+		"for i = 1, #z do y:insert(z:get(i)) end;"
+		"y:insert(1, 'PLAYPAL', '');"
+		"y:remove(y:find('SEGS'));"
+		"local i = y:find('THINGS');local _, things = y:get(i);y:remove(i);"
+		"y:insert(y:find('SECTORS') + 1, 'THINGS', things)", "test");
+
+	lua_State* L = lua.getState();
+
+	lua.doString("local maps = y:maps();return #maps, maps[1], maps[2]", "test");
+	REQUIRE(lua_tointeger(L, -3) == 2);
+	REQUIRE(std::string(lua_tostring(L, -2)) == "MAP02");
+	REQUIRE(std::string(lua_tostring(L, -1)) == "MAP01");
+	lua_pop(L, 3);
+
+	lua.doString("return wad.unpackmap(y, 'MAP01'):getvertex(2).x, wad.unpackmap(y):getvertex(2).x, wad.unpackmap(y, y:find('MAP01')):getvertex(2).x", "test");
+	REQUIRE(lua_tointeger(L, -3) == 64);
+	REQUIRE(lua_tointeger(L, -2) == 128);
+	REQUIRE(lua_tointeger(L, -1) == 64);
+	lua_pop(L, 3);
+
+	REQUIRE_THROWS(lua.doString("wad.unpackmap(y, 'MAP03')", "test"));
+	REQUIRE_THROWS(lua.doString("wad.unpackmap(y, 1)", "test"));
+}
+
+TEST_CASE("Test DoomMap column accessors and DoomMap:each()", "[luamap]") {
+	LuaEnvironment lua;
+	lua.doString("x = wad.createDoomMap();"
+		"x:setvertex(1, {x = 0, y = 0});x:setvertex(2, {x = 64, y = 0});x:setvertex(3, {x = 64, y = 64});"
+		"x:setsector(1, {floortex = 'FLOOR4_8', ceilingtex = 'CEIL3_5'});"
+		"x:setsidedef(1, {sector = 1});"
+		"x:setlinedef(1, {startvertex = 1, endvertex = 2, frontsidedef = 1});"
+		"x:setlinedef(2, {startvertex = 2, endvertex = 3, frontsidedef = 1, special = 11});"
+		"x:setthing(1, {x = 32, y = 16, type = 1});x:setthing(2, {x = 48, y = 16, type = 3004})", "test");
+
+	lua_State* L = lua.getState();
+
+	lua.doString("local xs = x:getcolumn('vertexes', 'x');local backs = x:getcolumn('linedefs', 'backsidedef');"
+		"return #xs, xs[3], backs[2], x:getcolumn('sectors', 'floortex')[1]", "test");
+	REQUIRE(lua_tointeger(L, -4) == 3);
+	REQUIRE(lua_tointeger(L, -3) == 64);
+	REQUIRE(lua_tointeger(L, -2) == 0);
+	REQUIRE(std::string(lua_tostring(L, -1)) == "FLOOR4_8");
+	lua_pop(L, 4);
+
+	lua.doString("x:setcolumn('things', 'type', {2001, 2002});x:setcolumn('linedefs', 'backsidedef', {1, 0});"
+		"return x:getthing(2).type, x:getlinedef(1).backsidedef, x:getlinedef(2).backsidedef", "test");
+	REQUIRE(lua_tointeger(L, -3) == 2002);
+	REQUIRE(lua_tointeger(L, -2) == 1);
+	REQUIRE(lua_isnil(L, -1));
+	lua_pop(L, 3);
+
+	lua.doString("local tables = {};local count = 0;"
+		"x:each('linedefs', function(id, line) tables[line] = true;count = count + 1;"
+		"if line.special == 11 then line.tag = 7;return true end end);"
+		"local distinct = 0;for _ in pairs(tables) do distinct = distinct + 1 end;"
+		"return count, distinct, x:getlinedef(2).tag, x:getlinedef(1).tag", "test");
+	REQUIRE(lua_tointeger(L, -4) == 2);
+	REQUIRE(lua_tointeger(L, -3) == 1);
+	REQUIRE(lua_tointeger(L, -2) == 7);
+	REQUIRE(lua_tointeger(L, -1) == 0);
+	lua_pop(L, 4);
+
+	REQUIRE_THROWS(lua.doString("x:setcolumn('things', 'x', {1})", "test"));
+	REQUIRE_THROWS(lua.doString("x:setcolumn('linedefs', 'startvertex', {1, 9})", "test"));
+	REQUIRE_THROWS(lua.doString("x:getcolumn('things', 'height')", "test"));
+}
+
 TEST_CASE("Thing setter and getter works", "[luamap]") {
 	LuaEnvironment lua;
 	lua.doString("x = wad.createDoomMap();x:setthing(1, {x = 32, y = 32});return x:getthing(1)", "test");